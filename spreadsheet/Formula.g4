@@ -9,10 +9,19 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | expr (EQ | NE | LT | LE | GT | GE) expr  # BinaryOp
+    | NAME '(' (arg (',' arg)*)? ')'  # Call
+    | LOGICAL  # Logical
     | CELL  # Cell
+    | SHEET_CELL  # SheetCell
     | NUMBER  # Literal
     ;
 
+arg
+    : CELL ':' CELL  # Range
+    | expr  # Argument
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -26,5 +35,18 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+EQ: '=' ;
+NE: '<>' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
 CELL: [A-Z]+[0-9]+ ;
+// ячейка другого листа книги: Sheet2!A1
+SHEET_CELL: SHEET_NAME '!' [A-Z]+[0-9]+ ;
+fragment SHEET_NAME: [A-Za-z_][A-Za-z0-9_]* ;
+// логическая константа - до NAME, чтобы не стать именем функции
+LOGICAL: 'TRUE' | 'FALSE' ;
+// имя функции (SUM, AVERAGE, ...)
+NAME: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
@@ -7,16 +7,22 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
 #include <string>
+#include <vector>
 
 namespace ASTImpl {
 
     using namespace std::literals;
 
 enum ExprPrecedence {
+    EP_COMPARE,
     EP_ADD,
     EP_SUB,
     EP_MUL,
@@ -62,25 +68,147 @@ enum PrecedenceRule {
 //     (currently in the table we're always putting in the parentheses)
 // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
 // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+// Comparisons have the lowest precedence and are left-associative:
+// A = (B < C) needs the parentheses, (A = B) < C doesn't; a comparison inside
+// any other operation always needs them.
 constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_COMPARE */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// коды узлов в бинарном (постфиксном) представлении формулы
+enum class OpCode : char {
+    Number = 'n',   // далее double
+    Cell = 'c',     // далее int32 строка и int32 столбец
+    Unary = 'u',    // далее символ операции
+    Binary = 'b',   // далее символ операции
+    SheetCell = 's',// далее uint32 длина и имя листа, int32 строка и int32 столбец
+    Range = 'r',    // далее int32 строка и столбец левого верхнего и правого нижнего углов
+    Call = 'f',     // далее код функции и uint32 число аргументов
+    Logical = 'l',  // далее uint8: 1 - TRUE, 0 - FALSE
+};
+
+// функции формул; значение - код функции в бинарном представлении
+enum class Function : char {
+    Sum = 'S',
+    Count = 'C',
+    Average = 'A',
+    Min = 'm',
+    Max = 'M',
+    SumProduct = 'P',
+    Match = 'X',
+    VLookup = 'V',
+    Index = 'I',
+    If = '?',
+    And = '&',
+    Or = '|',
+    Choose = 'H',
+};
+
+// неограниченное число аргументов
+constexpr std::uint32_t ANY_ARGS = std::numeric_limits<std::uint32_t>::max();
+
+struct FunctionInfo {
+    Function function;
+    std::string_view name;
+    std::uint32_t min_args;
+    std::uint32_t max_args;
+};
+
+constexpr FunctionInfo FUNCTIONS[] = {
+    { Function::Sum, "SUM"sv, 1, ANY_ARGS },
+    { Function::Count, "COUNT"sv, 1, ANY_ARGS },
+    { Function::Average, "AVERAGE"sv, 1, ANY_ARGS },
+    { Function::Min, "MIN"sv, 1, ANY_ARGS },
+    { Function::Max, "MAX"sv, 1, ANY_ARGS },
+    { Function::SumProduct, "SUMPRODUCT"sv, 1, ANY_ARGS },
+    { Function::Match, "MATCH"sv, 2, 3 },
+    { Function::VLookup, "VLOOKUP"sv, 3, 4 },
+    { Function::Index, "INDEX"sv, 2, 3 },
+    { Function::If, "IF"sv, 2, 3 },
+    { Function::And, "AND"sv, 1, ANY_ARGS },
+    { Function::Or, "OR"sv, 1, ANY_ARGS },
+    { Function::Choose, "CHOOSE"sv, 2, ANY_ARGS },
+};
+
+std::optional<Function> FunctionFromName(std::string_view name) {
+    for (const FunctionInfo& info : FUNCTIONS) {
+        if (info.name == name) {
+            return info.function;
+        }
+    }
+    return std::nullopt;
+}
+
+const FunctionInfo* FindFunction(Function function) {
+    for (const FunctionInfo& info : FUNCTIONS) {
+        if (info.function == function) {
+            return &info;
+        }
+    }
+    return nullptr;
+}
+
+std::string_view FunctionName(Function function) {
+    const FunctionInfo* info = FindFunction(function);
+    return info ? info->name : std::string_view{};
+}
+
+// подходит ли число аргументов функции
+bool IsValidArgCount(Function function, std::size_t count) {
+    const FunctionInfo* info = FindFunction(function);
+    return info != nullptr && count >= info->min_args && count <= info->max_args;
+}
+
+template <typename T>
+void WriteRaw(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T ReadRaw(std::string_view& in) {
+    if (in.size() < sizeof(T)) {
+        throw ParsingError("Unexpected end of formula bytecode");
+    }
+    T value;
+    std::memcpy(&value, in.data(), sizeof(T));
+    in.remove_prefix(sizeof(T));
+    return value;
+}
+
+// Трасса формулы, вычисляемой в этом потоке (nullptr - не записывается).
+// Execute() подменяет её на время вычисления, в том числе вложенного: формула
+// другой ячейки, вычисляемая при чтении её значения, пишет в свою трассу.
+thread_local EvaluationTrace* current_trace = nullptr;
+
 class Expr {
 public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
     virtual double Evaluate(const SheetInterface& sheet) const = 0;
+    // значение с производными по входам (FormulaAST::ExecuteDual())
+    virtual Dual EvaluateDual(const SheetInterface& sheet, const DualValues& values) const = 0;
+    // дописывает в out постфиксную запись поддерева (см. DeserializeFormulaAST)
+    virtual void Serialize(std::string& out) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
+    // значение узла логическое (единица или ноль)
+    virtual bool IsLogical() const {
+        return false;
+    }
+    // в поддереве есть условные функции
+    virtual bool IsConditional() const {
+        return false;
+    }
+
     void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
@@ -99,6 +227,13 @@ public:
 };
 
 namespace {
+// target += factor * source по всем направлениям
+void AddTangent(Dual& target, const Dual& source, double factor = 1.) {
+    for (std::size_t lane = 0; lane < DUAL_LANES; ++lane) {
+        target.tangent[lane] += factor * source.tangent[lane];
+    }
+}
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -106,8 +241,24 @@ public:
         Subtract = '-',
         Multiply = '*',
         Divide = '/',
+        Equal = '=',
+        NotEqual = '#',
+        Less = '<',
+        LessOrEqual = 'l',
+        Greater = '>',
+        GreaterOrEqual = 'g',
     };
 
+    static bool IsValidType(Type type) {
+        switch (type) {
+        case Add: case Subtract: case Multiply: case Divide:
+        case Equal: case NotEqual: case Less: case LessOrEqual: case Greater: case GreaterOrEqual:
+            return true;
+        default:
+            return false;
+        }
+    }
+
 public:
     explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
         : type_(type)
@@ -116,7 +267,7 @@ public:
     }
 
     void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
+        out << '(' << GetSymbol() << ' ';
         lhs_->Print(out);
         out << ' ';
         rhs_->Print(out);
@@ -125,10 +276,17 @@ public:
 
     void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
         lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
+        out << GetSymbol();
         rhs_->PrintFormula(out, precedence, /* right_child = */ true);
     }
 
+    void Serialize(std::string& out) const override {
+        lhs_->Serialize(out);
+        rhs_->Serialize(out);
+        out.push_back(static_cast<char>(OpCode::Binary));
+        out.push_back(static_cast<char>(type_));
+    }
+
     ExprPrecedence GetPrecedence() const override {
         switch (type_) {
             case Add:
@@ -139,6 +297,13 @@ public:
                 return EP_MUL;
             case Divide:
                 return EP_DIV;
+            case Equal:
+            case NotEqual:
+            case Less:
+            case LessOrEqual:
+            case Greater:
+            case GreaterOrEqual:
+                return EP_COMPARE;
             default:
                 // have to do this because VC++ has a buggy warning
                 assert(false);
@@ -149,8 +314,51 @@ public:
 // Реализуйте метод Evaluate() для бинарных операций.
 // При делении на 0 выбрасывайте ошибку вычисления FormulaError
     double Evaluate(const SheetInterface& sheet) const override {
-        double left = lhs_->Evaluate(sheet);
-        double right = rhs_->Evaluate(sheet);
+        return Apply(lhs_->Evaluate(sheet), rhs_->Evaluate(sheet));
+    }
+
+    Dual EvaluateDual(const SheetInterface& sheet, const DualValues& values) const override {
+        const Dual left = lhs_->EvaluateDual(sheet, values);
+        const Dual right = rhs_->EvaluateDual(sheet, values);
+        Dual result{ Apply(left.value, right.value) };
+        switch (type_) {
+        case Add:
+            AddTangent(result, left);
+            AddTangent(result, right);
+            break;
+        case Subtract:
+            AddTangent(result, left);
+            AddTangent(result, right, -1.);
+            break;
+        case Multiply:
+            AddTangent(result, left, right.value);
+            AddTangent(result, right, left.value);
+            break;
+        case Divide:
+            AddTangent(result, left, 1. / right.value);
+            AddTangent(result, right, -result.value / right.value);
+            break;
+        default:
+            // сравнение кусочно-постоянно
+            break;
+        }
+        return result;
+    }
+
+    bool IsLogical() const override {
+        return GetPrecedence() == EP_COMPARE;
+    }
+
+    bool IsConditional() const override {
+        return lhs_->IsConditional() || rhs_->IsConditional();
+    }
+
+private:
+    Type type_;
+    std::unique_ptr<Expr> lhs_;
+    std::unique_ptr<Expr> rhs_;
+
+    double Apply(double left, double right) const {
         double result = 0;
         switch (type_) {
         case Add:
@@ -168,6 +376,18 @@ public:
             }
             result = left / right;
             break;
+        case Equal:
+            return left == right;
+        case NotEqual:
+            return left != right;
+        case Less:
+            return left < right;
+        case LessOrEqual:
+            return left <= right;
+        case Greater:
+            return left > right;
+        case GreaterOrEqual:
+            return left >= right;
         }
         if (std::isfinite(result)) {
             return result;
@@ -175,10 +395,18 @@ public:
         throw FormulaError(FormulaError::Category::Div0);
     }
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    std::string GetSymbol() const {
+        switch (type_) {
+        case NotEqual:
+            return "<>"s;
+        case LessOrEqual:
+            return "<="s;
+        case GreaterOrEqual:
+            return ">="s;
+        default:
+            return std::string(1, static_cast<char>(type_));
+        }
+    }
 };
 
 class UnaryOpExpr final : public Expr {
@@ -205,6 +433,12 @@ public:
         operand_->PrintFormula(out, precedence);
     }
 
+    void Serialize(std::string& out) const override {
+        operand_->Serialize(out);
+        out.push_back(static_cast<char>(OpCode::Unary));
+        out.push_back(static_cast<char>(type_));
+    }
+
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
@@ -222,6 +456,20 @@ public:
         }
     }
 
+    Dual EvaluateDual(const SheetInterface& sheet, const DualValues& values) const override {
+        Dual operand = operand_->EvaluateDual(sheet, values);
+        if (type_ == UnaryMinus) {
+            Dual result{ -operand.value };
+            AddTangent(result, operand, -1.);
+            return result;
+        }
+        return operand;
+    }
+
+    bool IsConditional() const override {
+        return operand_->IsConditional();
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> operand_;
@@ -241,6 +489,11 @@ public:
         out << value_;
     }
 
+    void Serialize(std::string& out) const override {
+        out.push_back(static_cast<char>(OpCode::Number));
+        WriteRaw(out, value_);
+    }
+
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
@@ -250,10 +503,92 @@ public:
         return value_;
     }
 
+    Dual EvaluateDual(const SheetInterface& sheet, const DualValues& values) const override {
+        return Dual{ value_ };
+    }
+
 private:
     double value_;
 };
 
+// Логическая константа TRUE или FALSE
+class LogicalExpr final : public Expr {
+public:
+    explicit LogicalExpr(bool value)
+        : value_(value) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << LogicalToString(value_);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    void Serialize(std::string& out) const override {
+        out.push_back(static_cast<char>(OpCode::Logical));
+        WriteRaw<std::uint8_t>(out, value_ ? 1 : 0);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        return value_ ? 1. : 0.;
+    }
+
+    Dual EvaluateDual(const SheetInterface& sheet, const DualValues& values) const override {
+        return Dual{ Evaluate(sheet) };
+    }
+
+    bool IsLogical() const override {
+        return true;
+    }
+
+private:
+    bool value_;
+};
+
+// Значение ячейки pos листа sheet как число (пустая ячейка - ноль, логическое
+// значение - единица или ноль)
+double EvaluateCell(const SheetInterface& sheet, Position pos) {
+    if (sheet.GetCell(pos) == nullptr) {
+        return 0.0;
+    }
+    CellInterface::Value result = sheet.GetCell(pos)->GetValue();
+    if (std::holds_alternative<double>(result)) {
+        return std::get<double>(result);
+    }
+    if (std::holds_alternative<bool>(result)) {
+        return std::get<bool>(result) ? 1. : 0.;
+    }
+    if (std::holds_alternative<std::string>(result)) {
+        const std::string& str = std::get<std::string>(result);
+        if (str == "") {
+            return 0.0;
+        }
+        if (auto number = TextToNumber(str)) {
+            return *number;
+        }
+        throw FormulaError(FormulaError::Category::Value);
+    }
+    if (std::holds_alternative<FormulaError>(result)) {
+        throw std::get<FormulaError>(result);
+    }
+    assert(false);
+    return 0.;
+}
+
+// Значение ячейки с производными; ячейка, не зависящая от входов, - константа
+Dual EvaluateCellDual(const SheetInterface& sheet, Position pos, const DualValues& values) {
+    if (const Dual* dual = values.Find(sheet, pos)) {
+        return *dual;
+    }
+    return Dual{ EvaluateCell(sheet, pos) };
+}
+
 class CellExpr final : public Expr {
 public:
     explicit CellExpr(const Position* cell) :
@@ -273,6 +608,12 @@ public:
         Print(out);
     }
 
+    void Serialize(std::string& out) const override {
+        out.push_back(static_cast<char>(OpCode::Cell));
+        WriteRaw<std::int32_t>(out, cell_->row);
+        WriteRaw<std::int32_t>(out, cell_->col);
+    }
+
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
@@ -282,48 +623,543 @@ public:
         if (!cell_->IsValid()) {
             throw FormulaError(FormulaError::Category::Ref);
         }
+        if (current_trace != nullptr) {
+            current_trace->cells.push_back(*cell_);
+        }
+        return EvaluateCell(sheet, *cell_);
+    }
 
-        if (sheet.GetCell(*cell_) == nullptr) {
-            return 0.0;
+    Dual EvaluateDual(const SheetInterface& sheet, const DualValues& values) const override {
+        if (!cell_->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
         }
-        CellInterface::Value result = sheet.GetCell(*cell_)->GetValue();
-        if (std::holds_alternative<double>(result)) {
-            return std::get<double>(result);
+        return EvaluateCellDual(sheet, *cell_, values);
+    }
+
+private:
+    const Position* cell_;
+
+};
+
+// Ссылка на ячейку другого листа книги: Sheet2!A1
+class SheetCellExpr final : public Expr {
+public:
+    explicit SheetCellExpr(const SheetCellRef* ref) :
+        ref_(ref) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << ref_->sheet << '!';
+        if (!ref_->pos.IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << ref_->pos.ToString();
         }
-        if (std::holds_alternative<std::string>(result)) {
-            std::string str = std::get<std::string>(result);
-            if (str == "") {
-                return 0.0;
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        Print(out);
+    }
+
+    void Serialize(std::string& out) const override {
+        out.push_back(static_cast<char>(OpCode::SheetCell));
+        WriteRaw<std::uint32_t>(out, static_cast<std::uint32_t>(ref_->sheet.size()));
+        out += ref_->sheet;
+        WriteRaw<std::int32_t>(out, ref_->pos.row);
+        WriteRaw<std::int32_t>(out, ref_->pos.col);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        return EvaluateCell(GetTarget(sheet), ref_->pos);
+    }
+
+    Dual EvaluateDual(const SheetInterface& sheet, const DualValues& values) const override {
+        return EvaluateCellDual(GetTarget(sheet), ref_->pos, values);
+    }
+
+private:
+    const SheetCellRef* ref_;
+
+    const SheetInterface& GetTarget(const SheetInterface& sheet) const {
+        const SheetInterface* target = sheet.FindSheet(ref_->sheet);
+        if (target == nullptr || !ref_->pos.IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return *target;
+    }
+};
+
+// Диапазон A1:B10 - допустим только как аргумент функции
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const Range* range) :
+        range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        if (!range_->IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << range_->ToString();
+        }
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        Print(out);
+    }
+
+    void Serialize(std::string& out) const override {
+        out.push_back(static_cast<char>(OpCode::Range));
+        WriteRaw<std::int32_t>(out, range_->from.row);
+        WriteRaw<std::int32_t>(out, range_->from.col);
+        WriteRaw<std::int32_t>(out, range_->to.row);
+        WriteRaw<std::int32_t>(out, range_->to.col);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        // диапазон не имеет числового значения
+        throw FormulaError(FormulaError::Category::Value);
+    }
+
+    Dual EvaluateDual(const SheetInterface& sheet, const DualValues& values) const override {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+
+    // диапазон, удалённый вместе со строками или столбцами, даёт #REF!
+    const Range& GetRange() const {
+        if (!range_->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return *range_;
+    }
+
+private:
+    const Range* range_;
+};
+
+// Вызов функции: SUM(A1:A10,B1)
+class FunctionExpr final : public Expr {
+public:
+    FunctionExpr(Function function, std::vector<std::unique_ptr<Expr>> args) :
+        function_(function), args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << FunctionName(function_) << '(';
+        bool first = true;
+        for (const auto& arg : args_) {
+            if (!first) {
+                out << ',';
             }
-            for (char ch : str)
-            {
-                // если не цифра и не точка
-                if (!(std::isdigit(ch) || ch == '.')) {
-                    throw FormulaError(FormulaError::Category::Value);
+            first = false;
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        out << FunctionName(function_) << '(';
+        bool first = true;
+        for (const auto& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            // аргументы разделены запятыми, скобки вокруг них не нужны
+            arg->PrintFormula(out, EP_COMPARE);
+        }
+        out << ')';
+    }
+
+    void Serialize(std::string& out) const override {
+        for (const auto& arg : args_) {
+            arg->Serialize(out);
+        }
+        out.push_back(static_cast<char>(OpCode::Call));
+        out.push_back(static_cast<char>(function_));
+        WriteRaw<std::uint32_t>(out, static_cast<std::uint32_t>(args_.size()));
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        switch (function_) {
+        case Function::If:
+            return EvaluateIf(sheet);
+        case Function::And:
+        case Function::Or:
+            return EvaluateAndOr(sheet);
+        case Function::Choose:
+            return EvaluateChoose(sheet);
+        default:
+            break;
+        }
+
+        // функции диапазонов читают их целиком
+        if (current_trace != nullptr) {
+            for (const auto& arg : args_) {
+                if (auto range = dynamic_cast<const RangeExpr*>(arg.get())) {
+                    current_trace->ranges.push_back(range->GetRange());
                 }
             }
-            // если несколько точек
-            if (std::count(str.begin(), str.end(), '.') > 1) {
+        }
+        switch (function_) {
+        case Function::Min:
+        case Function::Max:
+            return EvaluateExtrema(sheet);
+        case Function::SumProduct:
+            return EvaluateProduct(sheet);
+        case Function::Match:
+            return EvaluateMatch(sheet);
+        case Function::VLookup:
+            return EvaluateVLookup(sheet);
+        case Function::Index:
+            return EvaluateIndex(sheet);
+        default:
+            return EvaluateTotals(sheet);
+        }
+    }
+
+    Dual EvaluateDual(const SheetInterface& sheet, const DualValues& values) const override {
+        switch (function_) {
+        case Function::If:
+            if (args_[0]->EvaluateDual(sheet, values).value != 0.) {
+                return args_[1]->EvaluateDual(sheet, values);
+            }
+            return args_.size() > 2 ? args_[2]->EvaluateDual(sheet, values) : Dual{};
+        case Function::Choose:
+            return GetChosenArg(args_[0]->EvaluateDual(sheet, values).value).EvaluateDual(sheet, values);
+        case Function::Sum:
+        case Function::Average:
+            return EvaluateTotalsDual(sheet, values);
+        case Function::Min:
+        case Function::Max:
+            return EvaluateExtremaDual(sheet, values);
+        case Function::SumProduct:
+            return EvaluateProductDual(sheet, values);
+        case Function::VLookup:
+            return EvaluateCellDual(sheet, FindVLookupCell(sheet), values);
+        case Function::Index:
+            return EvaluateCellDual(sheet, FindIndexCell(sheet), values);
+        default:
+            // COUNT, MATCH, AND, OR кусочно-постоянны
+            return Dual{ Evaluate(sheet) };
+        }
+    }
+
+    bool IsLogical() const override {
+        switch (function_) {
+        case Function::And:
+        case Function::Or:
+            return true;
+        case Function::If:
+            // без третьего аргумента невыбранная ветвь - FALSE
+            return args_[1]->IsLogical() && (args_.size() < 3 || args_[2]->IsLogical());
+        case Function::Choose:
+            return std::all_of(args_.begin() + 1, args_.end(), [](const auto& arg) {
+                return arg->IsLogical();
+            });
+        default:
+            return false;
+        }
+    }
+
+    bool IsConditional() const override {
+        if (function_ == Function::If || function_ == Function::And ||
+            function_ == Function::Or || function_ == Function::Choose) {
+            return true;
+        }
+        return std::any_of(args_.begin(), args_.end(), [](const auto& arg) {
+            return arg->IsConditional();
+        });
+    }
+
+private:
+    Function function_;
+    std::vector<std::unique_ptr<Expr>> args_;
+
+    // IF(условие, значение, [иначе]): вычисляется только выбранная ветвь
+    double EvaluateIf(const SheetInterface& sheet) const {
+        if (args_[0]->Evaluate(sheet) != 0.) {
+            return args_[1]->Evaluate(sheet);
+        }
+        return args_.size() > 2 ? args_[2]->Evaluate(sheet) : 0.;
+    }
+
+    // AND, OR: аргументы вычисляются по порядку до первого, определяющего
+    // результат (ложного для AND, истинного для OR)
+    double EvaluateAndOr(const SheetInterface& sheet) const {
+        const bool stop_value = function_ == Function::Or;
+        for (const auto& arg : args_) {
+            if ((arg->Evaluate(sheet) != 0.) == stop_value) {
+                return stop_value ? 1. : 0.;
+            }
+        }
+        return stop_value ? 0. : 1.;
+    }
+
+    // CHOOSE(номер, значение1, ...): вычисляется только выбранное значение
+    double EvaluateChoose(const SheetInterface& sheet) const {
+        return GetChosenArg(args_[0]->Evaluate(sheet)).Evaluate(sheet);
+    }
+
+    const Expr& GetChosenArg(double number) const {
+        double index = std::trunc(number);
+        if (index < 1. || index >= static_cast<double>(args_.size())) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return *args_[static_cast<std::size_t>(index)];
+    }
+
+    // SUM, COUNT, AVERAGE
+    double EvaluateTotals(const SheetInterface& sheet) const {
+        RangeTotals totals;
+        for (const auto& arg : args_) {
+            if (auto range = dynamic_cast<const RangeExpr*>(arg.get())) {
+                RangeTotals range_totals = sheet.GetRangeTotals(range->GetRange());
+                totals.sum += range_totals.sum;
+                totals.count += range_totals.count;
+            } else {
+                totals.sum += arg->Evaluate(sheet);
+                ++totals.count;
+            }
+        }
+
+        if (function_ == Function::Count) {
+            return static_cast<double>(totals.count);
+        }
+        if (function_ == Function::Average) {
+            if (totals.count == 0) {
+                throw FormulaError(FormulaError::Category::Div0);
+            }
+            return totals.sum / static_cast<double>(totals.count);
+        }
+        return totals.sum;
+    }
+
+    // SUM, AVERAGE с производными: производные ячеек диапазонов складываются
+    Dual EvaluateTotalsDual(const SheetInterface& sheet, const DualValues& values) const {
+        Dual result;
+        std::size_t count = 0;
+        for (const auto& arg : args_) {
+            if (auto range = dynamic_cast<const RangeExpr*>(arg.get())) {
+                RangeTotals range_totals = sheet.GetRangeTotals(range->GetRange());
+                result.value += range_totals.sum;
+                count += range_totals.count;
+                values.ForEachInRange(sheet, range->GetRange(), [&result](Position, const Dual& cell) {
+                    AddTangent(result, cell);
+                });
+            } else {
+                Dual value = arg->EvaluateDual(sheet, values);
+                result.value += value.value;
+                AddTangent(result, value);
+                ++count;
+            }
+        }
+        if (function_ == Function::Average) {
+            if (count == 0) {
+                throw FormulaError(FormulaError::Category::Div0);
+            }
+            Dual average{ result.value / static_cast<double>(count) };
+            AddTangent(average, result, 1. / static_cast<double>(count));
+            return average;
+        }
+        return result;
+    }
+
+    // MIN, MAX; без числовых значений результат - ноль
+    double EvaluateExtrema(const SheetInterface& sheet) const {
+        RangeExtrema extrema;
+        for (const auto& arg : args_) {
+            if (auto range = dynamic_cast<const RangeExpr*>(arg.get())) {
+                extrema.Merge(sheet.GetRangeExtrema(range->GetRange()));
+            } else {
+                double value = arg->Evaluate(sheet);
+                extrema.Merge(RangeExtrema{ value, value, 1 });
+            }
+        }
+        if (extrema.count == 0) {
+            return 0.;
+        }
+        return function_ == Function::Min ? extrema.min : extrema.max;
+    }
+
+    // MIN, MAX с производными аргумента, на котором достигается экстремум
+    Dual EvaluateExtremaDual(const SheetInterface& sheet, const DualValues& values) const {
+        Dual result{ EvaluateExtrema(sheet) };
+        bool found = false;
+        auto check = [&result, &found](const Dual& value) {
+            if (!found && value.value == result.value) {
+                result.tangent = value.tangent;
+                found = true;
+            }
+        };
+        for (const auto& arg : args_) {
+            if (auto range = dynamic_cast<const RangeExpr*>(arg.get())) {
+                values.ForEachInRange(sheet, range->GetRange(), [&check](Position, const Dual& cell) {
+                    check(cell);
+                });
+            } else {
+                check(arg->EvaluateDual(sheet, values));
+            }
+        }
+        return result;
+    }
+
+    // SUMPRODUCT: аргументы - диапазоны одного размера
+    double EvaluateProduct(const SheetInterface& sheet) const {
+        std::vector<Range> ranges = GetProductRanges();
+
+        if (ranges.size() == 1) {
+            return sheet.GetRangeTotals(ranges.front()).sum;
+        }
+        if (ranges.size() == 2) {
+            return sheet.GetRangeProduct(ranges[0], ranges[1]);
+        }
+        double result = 0.;
+        for (int row = 0; row <= ranges.front().to.row - ranges.front().from.row; ++row) {
+            for (int col = 0; col <= ranges.front().to.col - ranges.front().from.col; ++col) {
+                double product = 1.;
+                for (const Range& range : ranges) {
+                    Position pos{ range.from.row + row, range.from.col + col };
+                    product *= GetRangeNumber(sheet, pos).value_or(0.);
+                }
+                result += product;
+            }
+        }
+        return result;
+    }
+
+    // SUMPRODUCT с производными: производная ячейки диапазона умножается на
+    // значения ячеек с тем же смещением в остальных диапазонах
+    Dual EvaluateProductDual(const SheetInterface& sheet, const DualValues& values) const {
+        Dual result{ EvaluateProduct(sheet) };
+        std::vector<Range> ranges = GetProductRanges();
+        for (std::size_t i = 0; i < ranges.size(); ++i) {
+            values.ForEachInRange(sheet, ranges[i], [&](Position pos, const Dual& cell) {
+                const int row = pos.row - ranges[i].from.row;
+                const int col = pos.col - ranges[i].from.col;
+                double factor = 1.;
+                for (std::size_t j = 0; j < ranges.size(); ++j) {
+                    if (j != i) {
+                        Position other{ ranges[j].from.row + row, ranges[j].from.col + col };
+                        factor *= GetRangeNumber(sheet, other).value_or(0.);
+                    }
+                }
+                AddTangent(result, cell, factor);
+            });
+        }
+        return result;
+    }
+
+    std::vector<Range> GetProductRanges() const {
+        std::vector<Range> ranges;
+        for (const auto& arg : args_) {
+            auto range = dynamic_cast<const RangeExpr*>(arg.get());
+            if (range == nullptr) {
                 throw FormulaError(FormulaError::Category::Value);
-            }       
-            try { 
-                // преобразуем строку в число
-                return std::stod(std::get<std::string>(result));
             }
-            catch (const std::exception& /*ext*/) {
+            const Range& first = ranges.empty() ? range->GetRange() : ranges.front();
+            if (range->GetRange().to.row - range->GetRange().from.row != first.to.row - first.from.row ||
+                range->GetRange().to.col - range->GetRange().from.col != first.to.col - first.from.col) {
                 throw FormulaError(FormulaError::Category::Value);
             }
+            ranges.push_back(range->GetRange());
         }
-        if (std::holds_alternative<FormulaError>(result)) {
-            throw std::get<FormulaError>(result);
+        return ranges;
+    }
+
+    // аргумент index, который должен быть диапазоном
+    const Range& GetRangeArg(std::size_t index) const {
+        auto range = dynamic_cast<const RangeExpr*>(args_[index].get());
+        if (range == nullptr) {
+            throw FormulaError(FormulaError::Category::Value);
         }
-        assert(false);
-        return 0.;
+        return range->GetRange();
     }
 
-private:
-    const Position* cell_;
+    // MATCH(значение, строка или столбец, [тип]): номер найденной ячейки с
+    // единицы. Тип 1 (по умолчанию) - ближайшее меньшее, 0 - точное
+    // совпадение; поиск в убывающих данных (-1) не поддерживается.
+    double EvaluateMatch(const SheetInterface& sheet) const {
+        double value = args_[0]->Evaluate(sheet);
+        const Range& range = GetRangeArg(1);
+        LookupMode mode = LookupMode::LessOrEqual;
+        if (args_.size() > 2) {
+            double type = args_[2]->Evaluate(sheet);
+            if (type == 0.) {
+                mode = LookupMode::Exact;
+            } else if (type < 0.) {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+        }
+        if (range.from.row != range.to.row && range.from.col != range.to.col) {
+            throw FormulaError(FormulaError::Category::NA);
+        }
+        std::optional<int> offset = sheet.LookupValue(range, value, mode);
+        if (!offset) {
+            throw FormulaError(FormulaError::Category::NA);
+        }
+        return *offset + 1;
+    }
+
+    // VLOOKUP(значение, таблица, номер столбца, [приближённо]): значение из
+    // столбца таблицы в строке, найденной по её первому столбцу; 0 в
+    // последнем аргументе - точное совпадение, иначе - ближайшее меньшее
+    double EvaluateVLookup(const SheetInterface& sheet) const {
+        return EvaluateCell(sheet, FindVLookupCell(sheet));
+    }
+
+    Position FindVLookupCell(const SheetInterface& sheet) const {
+        double value = args_[0]->Evaluate(sheet);
+        const Range& table = GetRangeArg(1);
+        double col = std::trunc(args_[2]->Evaluate(sheet));
+        LookupMode mode = args_.size() > 3 && args_[3]->Evaluate(sheet) == 0. ? LookupMode::Exact
+                                                                              : LookupMode::LessOrEqual;
+        if (col < 1.) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        if (col > table.to.col - table.from.col + 1) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        Range keys{ table.from, Position{ table.to.row, table.from.col } };
+        std::optional<int> offset = sheet.LookupValue(keys, value, mode);
+        if (!offset) {
+            throw FormulaError(FormulaError::Category::NA);
+        }
+        return Position{ table.from.row + *offset, table.from.col + static_cast<int>(col) - 1 };
+    }
+
+    // INDEX(диапазон, строка, [столбец]): значение ячейки диапазона по номерам
+    // с единицы; для диапазона из одной строки единственный номер - столбец
+    double EvaluateIndex(const SheetInterface& sheet) const {
+        return EvaluateCell(sheet, FindIndexCell(sheet));
+    }
 
+    Position FindIndexCell(const SheetInterface& sheet) const {
+        const Range& range = GetRangeArg(0);
+        double row = std::trunc(args_[1]->Evaluate(sheet));
+        double col = args_.size() > 2 ? std::trunc(args_[2]->Evaluate(sheet)) : 1.;
+        if (args_.size() == 2 && range.from.row == range.to.row) {
+            std::swap(row, col);
+        }
+        if (row < 1. || col < 1. || row > range.to.row - range.from.row + 1 ||
+            col > range.to.col - range.from.col + 1) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return Position{ range.from.row + static_cast<int>(row) - 1,
+                         range.from.col + static_cast<int>(col) - 1 };
+    }
 };
 
 class ParseASTListener final : public FormulaBaseListener {
@@ -340,6 +1176,14 @@ public:
         return std::move(cells_);
     }
 
+    std::forward_list<SheetCellRef> MoveSheetCells() {
+        return std::move(sheet_cells_);
+    }
+
+    std::forward_list<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -386,15 +1230,32 @@ public:
             type = BinaryOpExpr::Subtract;
         } else if (ctx->MUL()) {
             type = BinaryOpExpr::Multiply;
-        } else {
-            assert(ctx->DIV() != nullptr);
+        } else if (ctx->DIV()) {
             type = BinaryOpExpr::Divide;
+        } else if (ctx->EQ()) {
+            type = BinaryOpExpr::Equal;
+        } else if (ctx->NE()) {
+            type = BinaryOpExpr::NotEqual;
+        } else if (ctx->LT()) {
+            type = BinaryOpExpr::Less;
+        } else if (ctx->LE()) {
+            type = BinaryOpExpr::LessOrEqual;
+        } else if (ctx->GT()) {
+            type = BinaryOpExpr::Greater;
+        } else {
+            assert(ctx->GE() != nullptr);
+            type = BinaryOpExpr::GreaterOrEqual;
         }
 
         auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
         args_.back() = std::move(node);
     }
 
+    void exitLogical(FormulaParser::LogicalContext* ctx) override {
+        bool value = ctx->LOGICAL()->getSymbol()->getText() == "TRUE";
+        args_.push_back(std::make_unique<LogicalExpr>(value));
+    }
+
     void exitCell(FormulaParser::CellContext* ctx) override {
         auto value_str = ctx->CELL()->getSymbol()->getText();
         auto value = Position::FromString(value_str);
@@ -407,6 +1268,58 @@ public:
         args_.push_back(std::move(node));
     }
 
+    void exitSheetCell(FormulaParser::SheetCellContext* ctx) override {
+        auto value_str = ctx->SHEET_CELL()->getSymbol()->getText();
+        auto separator = value_str.find('!');
+        auto pos = Position::FromString(std::string_view(value_str).substr(separator + 1));
+        if (!pos.IsValid()) {
+            throw FormulaException("Invalid position: " + value_str);
+        }
+
+        sheet_cells_.push_front(SheetCellRef{ value_str.substr(0, separator), pos });
+        auto node = std::make_unique<SheetCellExpr>(&sheet_cells_.front());
+        args_.push_back(std::move(node));
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        auto from_str = ctx->CELL(0)->getSymbol()->getText();
+        auto to_str = ctx->CELL(1)->getSymbol()->getText();
+        auto from = Position::FromString(from_str);
+        auto to = Position::FromString(to_str);
+        if (!from.IsValid() || !to.IsValid()) {
+            throw FormulaException("Invalid range: " + from_str + ':' + to_str);
+        }
+
+        ranges_.push_front(Range::FromCorners(from, to));
+        auto node = std::make_unique<RangeExpr>(&ranges_.front());
+        args_.push_back(std::move(node));
+    }
+
+    void enterCall(FormulaParser::CallContext* /*ctx*/) override {
+        // аргументы вызова - всё, что окажется в args_ выше этой отметки
+        call_args_begin_.push_back(args_.size());
+    }
+
+    void exitCall(FormulaParser::CallContext* ctx) override {
+        auto name = ctx->NAME()->getSymbol()->getText();
+        auto function = FunctionFromName(name);
+        if (!function) {
+            throw FormulaException("Unknown function: " + name);
+        }
+
+        std::size_t begin = call_args_begin_.back();
+        call_args_begin_.pop_back();
+        std::vector<std::unique_ptr<Expr>> call_args(std::make_move_iterator(args_.begin() + begin),
+                                                     std::make_move_iterator(args_.end()));
+        args_.resize(begin);
+        if (!IsValidArgCount(*function, call_args.size())) {
+            throw FormulaException("Wrong number of arguments for function " + name);
+        }
+
+        auto node = std::make_unique<FunctionExpr>(*function, std::move(call_args));
+        args_.push_back(std::move(node));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
@@ -414,6 +1327,9 @@ public:
 private:
     std::vector<std::unique_ptr<Expr>> args_;
     std::forward_list<Position> cells_;
+    std::forward_list<SheetCellRef> sheet_cells_;
+    std::forward_list<Range> ranges_;
+    std::vector<std::size_t> call_args_begin_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -450,7 +1366,8 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveSheetCells(),
+                      listener.MoveRanges());
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -462,6 +1379,111 @@ FormulaAST ParseFormulaAST(const std::string& in_str) {
     }
 }
 
+FormulaAST DeserializeFormulaAST(std::string_view bytecode) {
+    using namespace ASTImpl;
+
+    std::vector<std::unique_ptr<Expr>> args;
+    std::forward_list<Position> cells;
+    std::forward_list<SheetCellRef> sheet_cells;
+    std::forward_list<Range> ranges;
+
+    while (!bytecode.empty()) {
+        switch (static_cast<OpCode>(ReadRaw<char>(bytecode))) {
+        case OpCode::Number:
+            args.push_back(std::make_unique<NumberExpr>(ReadRaw<double>(bytecode)));
+            break;
+        case OpCode::Cell: {
+            Position pos;
+            pos.row = ReadRaw<std::int32_t>(bytecode);
+            pos.col = ReadRaw<std::int32_t>(bytecode);
+            cells.push_front(pos);
+            args.push_back(std::make_unique<CellExpr>(&cells.front()));
+            break;
+        }
+        case OpCode::SheetCell: {
+            auto length = ReadRaw<std::uint32_t>(bytecode);
+            if (length > bytecode.size()) {
+                throw ParsingError("Unexpected end of formula bytecode");
+            }
+            SheetCellRef ref{ std::string(bytecode.substr(0, length)), Position{} };
+            bytecode.remove_prefix(length);
+            ref.pos.row = ReadRaw<std::int32_t>(bytecode);
+            ref.pos.col = ReadRaw<std::int32_t>(bytecode);
+            sheet_cells.push_front(std::move(ref));
+            args.push_back(std::make_unique<SheetCellExpr>(&sheet_cells.front()));
+            break;
+        }
+        case OpCode::Range: {
+            Position from, to;
+            from.row = ReadRaw<std::int32_t>(bytecode);
+            from.col = ReadRaw<std::int32_t>(bytecode);
+            to.row = ReadRaw<std::int32_t>(bytecode);
+            to.col = ReadRaw<std::int32_t>(bytecode);
+            // удалённый диапазон (#REF!) записан двумя Position::NONE
+            bool deleted = from == Position::NONE && to == Position::NONE;
+            if (!deleted && (!from.IsValid() || !to.IsValid())) {
+                throw ParsingError("Invalid range in formula bytecode");
+            }
+            ranges.push_front(deleted ? Range{ from, to } : Range::FromCorners(from, to));
+            args.push_back(std::make_unique<RangeExpr>(&ranges.front()));
+            break;
+        }
+        case OpCode::Call: {
+            auto function = static_cast<Function>(ReadRaw<char>(bytecode));
+            auto count = ReadRaw<std::uint32_t>(bytecode);
+            if (!IsValidArgCount(function, count) || count > args.size()) {
+                throw ParsingError("Invalid function call in formula bytecode");
+            }
+            auto first = args.end() - count;
+            std::vector<std::unique_ptr<Expr>> call_args(std::make_move_iterator(first),
+                                                         std::make_move_iterator(args.end()));
+            args.erase(first, args.end());
+            args.push_back(std::make_unique<FunctionExpr>(function, std::move(call_args)));
+            break;
+        }
+        case OpCode::Logical: {
+            auto value = ReadRaw<std::uint8_t>(bytecode);
+            if (value > 1) {
+                throw ParsingError("Invalid logical value in formula bytecode");
+            }
+            args.push_back(std::make_unique<LogicalExpr>(value == 1));
+            break;
+        }
+        case OpCode::Unary: {
+            auto type = static_cast<UnaryOpExpr::Type>(ReadRaw<char>(bytecode));
+            if (args.empty() ||
+                (type != UnaryOpExpr::UnaryPlus && type != UnaryOpExpr::UnaryMinus)) {
+                throw ParsingError("Invalid unary operation in formula bytecode");
+            }
+            args.back() = std::make_unique<UnaryOpExpr>(type, std::move(args.back()));
+            break;
+        }
+        case OpCode::Binary: {
+            auto type = static_cast<BinaryOpExpr::Type>(ReadRaw<char>(bytecode));
+            if (args.size() < 2 || !BinaryOpExpr::IsValidType(type)) {
+                throw ParsingError("Invalid binary operation in formula bytecode");
+            }
+            std::unique_ptr<Expr> rhs = std::move(args.back());
+            args.pop_back();
+            args.back() = std::make_unique<BinaryOpExpr>(type, std::move(args.back()), std::move(rhs));
+            break;
+        }
+        default:
+            throw ParsingError("Invalid formula bytecode");
+        }
+    }
+
+    if (args.size() != 1) {
+        throw ParsingError("Invalid formula bytecode");
+    }
+    return FormulaAST(std::move(args.front()), std::move(cells), std::move(sheet_cells),
+                      std::move(ranges));
+}
+
+void FormulaAST::Serialize(std::string& out) const {
+    root_expr_->Serialize(out);
+}
+
 void FormulaAST::Print(std::ostream& out) const {
     root_expr_->Print(out);
 }
@@ -470,18 +1492,95 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
+double FormulaAST::Execute(const SheetInterface& sheet, EvaluationTrace* trace) const {
+    struct TraceScope {
+        EvaluationTrace* saved = ASTImpl::current_trace;
+        ~TraceScope() {
+            ASTImpl::current_trace = saved;
+        }
+    } scope;
+    ASTImpl::current_trace = trace;
     return root_expr_->Evaluate(sheet);
 }
 
+Dual FormulaAST::ExecuteDual(const SheetInterface& sheet, const DualValues& values) const {
+    // производные не зависят от трассы: ветви выбираются по значениям
+    struct TraceScope {
+        EvaluationTrace* saved = ASTImpl::current_trace;
+        ~TraceScope() {
+            ASTImpl::current_trace = saved;
+        }
+    } scope;
+    ASTImpl::current_trace = nullptr;
+    return root_expr_->EvaluateDual(sheet, values);
+}
+
+bool FormulaAST::IsLogical() const {
+    return root_expr_->IsLogical();
+}
+
+bool FormulaAST::IsConditional() const {
+    return root_expr_->IsConditional();
+}
+
 FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-    std::forward_list<Position> cells) :
-    root_expr_(std::move(root_expr)), cells_(std::move(cells)) {
+    std::forward_list<Position> cells,
+    std::forward_list<SheetCellRef> sheet_cells,
+    std::forward_list<Range> ranges) :
+    root_expr_(std::move(root_expr)), cells_(std::move(cells)), sheet_cells_(std::move(sheet_cells)),
+    ranges_(std::move(ranges)) {
 
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
 
 const std::forward_list<Position>& FormulaAST::GetCells() const {
     return cells_;
 }
+
+const std::forward_list<SheetCellRef>& FormulaAST::GetSheetCells() const {
+    return sheet_cells_;
+}
+
+const std::forward_list<Range>& FormulaAST::GetRanges() const {
+    return ranges_;
+}
+
+bool FormulaAST::IsAffectedBy(const ReferenceMapping& mapping, bool local, std::string_view sheet) const {
+    if (local) {
+        if (std::any_of(cells_.begin(), cells_.end(), [&mapping](Position pos) {
+                return !(mapping.Apply(pos) == pos);
+            }) ||
+            std::any_of(ranges_.begin(), ranges_.end(), [&mapping](const Range& range) {
+                return !(mapping.Apply(range) == range);
+            })) {
+            return true;
+        }
+    }
+    return !sheet.empty() &&
+           std::any_of(sheet_cells_.begin(), sheet_cells_.end(), [&](const SheetCellRef& ref) {
+               return ref.sheet == sheet && !(mapping.Apply(ref.pos) == ref.pos);
+           });
+}
+
+void FormulaAST::MapReferences(const ReferenceMapping& mapping, bool local, std::string_view sheet) {
+    // выражения ссылаются на элементы списков, поэтому правка списков
+    // переносит и ссылки в дереве
+    if (local) {
+        for (Position& pos : cells_) {
+            pos = mapping.Apply(pos);
+        }
+        for (Range& range : ranges_) {
+            range = mapping.Apply(range);
+        }
+    }
+    if (!sheet.empty()) {
+        for (SheetCellRef& ref : sheet_cells_) {
+            if (ref.sheet == sheet) {
+                ref.pos = mapping.Apply(ref.pos);
+            }
+        }
+    }
+}
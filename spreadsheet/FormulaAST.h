@@ -18,21 +18,50 @@ class ParsingError : public std::runtime_error {
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+        std::forward_list<Position> cells,
+        std::forward_list<SheetCellRef> sheet_cells = {},
+        std::forward_list<Range> ranges = {});
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    // Вычисляет формулу; логическое значение - единица или ноль. В trace
+    // записываются прочитанные ячейки и диапазоны листа sheet.
+    double Execute(const SheetInterface& sheet, EvaluationTrace* trace = nullptr) const;
+    // Вычисляет формулу с производными (FormulaInterface::EvaluateDual());
+    // ошибка бросается как FormulaError
+    Dual ExecuteDual(const SheetInterface& sheet, const DualValues& values) const;
+    // Значение формулы логическое (сравнение, TRUE, AND, ...)
+    bool IsLogical() const;
+    // В формуле есть условные функции (IF, AND, OR, CHOOSE)
+    bool IsConditional() const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
+    // Дописывает в out формулу в бинарном (постфиксном) виде
+    void Serialize(std::string& out) const;
 
     const std::forward_list<Position>& GetCells() const;                               
+    // ссылки на ячейки других листов книги
+    const std::forward_list<SheetCellRef>& GetSheetCells() const;
+    // диапазоны - аргументы функций
+    const std::forward_list<Range>& GetRanges() const;
+
+    // Перенос mapping меняет ссылки формулы: на свой лист (local) или на лист
+    // с именем sheet (Sheet2!A1; пустое имя - такие ссылки не проверяются)
+    bool IsAffectedBy(const ReferenceMapping& mapping, bool local, std::string_view sheet) const;
+    // Переносит ссылки на месте; потерянные ссылки на ячейки и диапазоны
+    // становятся #REF!
+    void MapReferences(const ReferenceMapping& mapping, bool local, std::string_view sheet);
 
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
     std::forward_list<Position> cells_;
+    std::forward_list<SheetCellRef> sheet_cells_;
+    std::forward_list<Range> ranges_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+FormulaAST ParseFormulaAST(const std::string& in_str);
+// Восстанавливает AST из бинарного вида, полученного FormulaAST::Serialize(),
+// без разбора текста. Бросает ParsingError для некорректных данных.
+FormulaAST DeserializeFormulaAST(std::string_view bytecode);
\ No newline at end of file
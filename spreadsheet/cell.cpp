@@ -1,5 +1,6 @@
 #include "cell.h"
 #include "formula.h"
+#include "sheet.h"
 
 #include <cassert>
 #include <iostream>
@@ -35,9 +36,14 @@ bool Cell::EmptyImpl::IsCached() const
     return true;
 }
 
+std::unique_ptr<Cell::Impl> Cell::EmptyImpl::Clone(SheetInterface& /*sheet*/) const
+{
+    return std::make_unique<EmptyImpl>();
+}
+
 // текстовая ячейка ----------------------------------------------------------------
 
-Cell::TextImpl::TextImpl(const std::string &text) : text_{text} { }
+Cell::TextImpl::TextImpl(std::string text) : text_{std::move(text)} { }
 
 CellInterface::Value Cell::TextImpl::GetValue() 
 {
@@ -68,6 +74,11 @@ bool Cell::TextImpl::IsCached() const
     return true;
 }
 
+std::unique_ptr<Cell::Impl> Cell::TextImpl::Clone(SheetInterface& /*sheet*/) const
+{
+    return std::make_unique<TextImpl>(text_);
+}
+
 // формульная ячейка ---------------------------------------------------------------
 
 Cell::FormulaImpl::FormulaImpl(const std::string &text, SheetInterface& sheet) :
@@ -75,28 +86,68 @@ Cell::FormulaImpl::FormulaImpl(const std::string &text, SheetInterface& sheet) :
     sheet_(&sheet) {
 }
 
+Cell::FormulaImpl::FormulaImpl(std::shared_ptr<const FormulaInterface> formula, SheetInterface& sheet,
+                               std::optional<CellInterface::Value> cache_value) :
+    formula_(std::move(formula)),
+    sheet_(&sheet) {
+    if (cache_value) {
+        cache_value_ = std::move(*cache_value);
+        cache_state_.store(Valid, std::memory_order_relaxed);
+    }
+}
+
 void Cell::FormulaImpl::Set(std::string text) {
     formula_ = ParseFormula(std::move(text.substr(1)));
+    InvalidateCache();
+}
+
+CellInterface::Value Cell::FormulaImpl::Calculate(const FormulaInterface& formula,
+                                                  const SheetInterface& sheet,
+                                                  EvaluationTrace* trace) {
+    //std::cout << "calculation" << std::endl; // для тестирования
+    FormulaInterface::Value result = formula.Evaluate(sheet, trace);
+    if (std::holds_alternative<double>(result))
+    {
+        return std::get<double>(result);
+    }
+    if (std::holds_alternative<bool>(result))
+    {
+        return std::get<bool>(result);
+    }
+    return std::get<FormulaError>(result);
 }
 
 CellInterface::Value Cell::FormulaImpl::GetValue() {
-    
+    if (cache_state_.load(std::memory_order_acquire) == Valid) {
+        return cache_value_;
+    }
 
-    if (!cache_value_) {
-        //std::cout << "calculation" << std::endl; // для тестирования
-        FormulaInterface::Value result = formula_->Evaluate(*sheet_);
-        if (std::holds_alternative<double>(result))
-        {
-            cache_value_ = std::get<double>(result);
-        }
-        else if (std::holds_alternative<FormulaError>(result)) {
-            cache_value_ = FormulaError(FormulaError::Category::Div0);
+    std::uint8_t expected = Invalid;
+    if (!cache_state_.compare_exchange_strong(expected, Computing, std::memory_order_acquire)) {
+        if (expected == Valid) {
+            return cache_value_;
         }
-        else {
-            cache_value_ = std::get<FormulaError>(result);
+        // значение вычисляет другой поток: не ждём его, а считаем сами,
+        // не трогая кэш (вычисление формулы не меняет таблицу)
+        return Calculate(*formula_, *sheet_);
+    }
+
+    try {
+        // след вычисления нужен только формулам, которые читают не всё,
+        // на что ссылаются
+        if (formula_->IsConditional()) {
+            EvaluationTrace trace;
+            cache_value_ = Calculate(*formula_, *sheet_, &trace);
+            trace_ = std::move(trace);
+        } else {
+            cache_value_ = Calculate(*formula_, *sheet_);
         }
+    } catch (...) {
+        cache_state_.store(Invalid, std::memory_order_release);
+        throw;
     }
-    return *cache_value_;
+    cache_state_.store(Valid, std::memory_order_release);
+    return cache_value_;
 }
 
 std::string Cell::FormulaImpl::GetText() const 
@@ -118,12 +169,73 @@ Cell::Cell(SheetInterface& sheet, const Position& position) :
 
 void Cell::FormulaImpl::InvalidateCache()
 {
-    cache_value_.reset();
+    cache_state_.store(Invalid, std::memory_order_release);
 }
 
 bool Cell::FormulaImpl::IsCached() const
 {
-    return cache_value_.has_value();
+    return cache_state_.load(std::memory_order_acquire) == Valid;
+}
+
+std::unique_ptr<Cell::Impl> Cell::FormulaImpl::Clone(SheetInterface& sheet) const
+{
+    return std::make_unique<FormulaImpl>(formula_, sheet, GetCache());
+}
+
+const FormulaInterface* Cell::FormulaImpl::GetFormula() const
+{
+    return formula_.get();
+}
+
+bool Cell::FormulaImpl::MapReferences(const ReferenceMapping& mapping, bool local, std::string_view sheet)
+{
+    std::unique_ptr<FormulaInterface> mapped = formula_->MapReferences(mapping, local, sheet);
+    if (!mapped) {
+        return false;
+    }
+    formula_ = std::move(mapped);
+    InvalidateCache();
+    trace_.reset();
+    return true;
+}
+
+std::optional<CellInterface::Value> Cell::FormulaImpl::GetCache() const
+{
+    if (IsCached()) {
+        return cache_value_;
+    }
+    return std::nullopt;
+}
+
+const std::shared_ptr<const FormulaInterface>& Cell::FormulaImpl::ShareFormula() const
+{
+    return formula_;
+}
+
+const CellInterface::Value& Cell::FormulaImpl::GetLastValue() const
+{
+    return cache_value_;
+}
+
+void Cell::FormulaImpl::RestoreCache(CellInterface::Value value)
+{
+    // след относится к другому вычислению
+    cache_value_ = std::move(value);
+    trace_.reset();
+    cache_state_.store(Valid, std::memory_order_release);
+}
+
+CellInterface::Value Cell::FormulaImpl::Evaluate() const
+{
+    return Calculate(*formula_, *sheet_);
+}
+
+const EvaluationTrace* Cell::FormulaImpl::GetTrace() const
+{
+    if (IsCached() && trace_) {
+        return &*trace_;
+    }
+    return nullptr;
 }
 
 // класс-обёртку Cell -------------------------------------------------------------------
@@ -139,7 +251,7 @@ void Cell::Set(std::string text) {
         impl_ = std::make_unique<FormulaImpl>(text, *sheet_);
         UpdateGraphReference();
     } else if (text.size () > 0) {
-        impl_ = std::make_unique<TextImpl>(text);
+        impl_ = std::make_unique<TextImpl>(std::move(text));
     } else {
         impl_ = std::make_unique<EmptyImpl>();
     }
@@ -151,6 +263,10 @@ void Cell::Clear() {
 
 Cell::Value Cell::GetValue() const
 {
+    // значения цикла зависят друг от друга - лист вычисляет их вместе
+    if (in_cycle_ && !impl_->IsCached()) {
+        static_cast<const Sheet*>(sheet_)->SolveCycle(*this);
+    }
     return impl_->GetValue();
 }
 
@@ -164,6 +280,29 @@ Position Cell::GetPosition() const
     return position_;
 }
 
+SheetInterface& Cell::GetSheet() const
+{
+    return *sheet_;
+}
+
+std::vector<SheetCellRef> Cell::GetSheetReferencedCells() const
+{
+    const FormulaInterface* formula = GetFormula();
+    if (formula != nullptr) {
+        return formula->GetSheetReferencedCells();
+    }
+    return std::vector<SheetCellRef> { };
+}
+
+std::vector<Range> Cell::GetReferencedRanges() const
+{
+    const FormulaInterface* formula = GetFormula();
+    if (formula != nullptr) {
+        return formula->GetReferencedRanges();
+    }
+    return std::vector<Range> { };
+}
+
 std::vector<Position> Cell::GetReferencedCells() const
 {
     if (impl_ != nullptr) {
@@ -172,18 +311,34 @@ std::vector<Position> Cell::GetReferencedCells() const
     return std::vector<Position> { };
 }
 
+std::unique_ptr<Cell> Cell::Clone(SheetInterface& sheet) const
+{
+    auto copy = std::make_unique<Cell>(sheet, position_);
+    copy->impl_ = impl_ ? impl_->Clone(sheet) : nullptr;
+    copy->in_cycle_ = in_cycle_;
+    return copy;
+}
+
 Cell::GraphReference& Cell::GetGraphReference()
 {
     return graph_reference_;
 }
 
+const Cell::GraphReference& Cell::GetGraphReference() const
+{
+    return graph_reference_;
+}
+
 void Cell::UpdateGraphReference()
 {
     std::vector<Cell*> cells_referenced;
     if (sheet_->GetCell(this->position_)) {
         for (Position pos : GetReferencedCells()) {
             Cell* p_cell = static_cast<Cell*>(sheet_->GetCell(pos));
-            cells_referenced.push_back(p_cell);
+            // ссылка на себя (итеративный режим) в граф не заносится
+            if (p_cell != this) {
+                cells_referenced.push_back(p_cell);
+            }
         }
     }
     graph_reference_.UpdateReferences(cells_referenced);
@@ -199,6 +354,83 @@ bool Cell::IsCacheValid() const
     return impl_->IsCached();
 }
 
+bool Cell::ReadsCell(const SheetInterface& sheet, Position pos) const
+{
+    auto formula_impl = dynamic_cast<const FormulaImpl*>(impl_.get());
+    if (formula_impl == nullptr || &sheet != sheet_) {
+        return true;
+    }
+    const EvaluationTrace* trace = formula_impl->GetTrace();
+    return trace == nullptr || trace->Reads(pos);
+}
+
+const FormulaInterface* Cell::GetFormula() const
+{
+    auto formula_impl = dynamic_cast<const FormulaImpl*>(impl_.get());
+    return formula_impl ? formula_impl->GetFormula() : nullptr;
+}
+
+std::optional<Cell::Value> Cell::GetCachedValue() const
+{
+    auto formula_impl = dynamic_cast<const FormulaImpl*>(impl_.get());
+    return formula_impl ? formula_impl->GetCache() : std::nullopt;
+}
+
+void Cell::SetFormula(std::shared_ptr<const FormulaInterface> formula,
+                      std::optional<Value> cache_value)
+{
+    impl_ = std::make_unique<FormulaImpl>(std::move(formula), *sheet_, std::move(cache_value));
+}
+
+std::shared_ptr<const FormulaInterface> Cell::ShareFormula() const
+{
+    auto formula_impl = dynamic_cast<const FormulaImpl*>(impl_.get());
+    return formula_impl ? formula_impl->ShareFormula() : nullptr;
+}
+
+std::optional<Cell::Value> Cell::GetLastValue() const
+{
+    auto formula_impl = dynamic_cast<const FormulaImpl*>(impl_.get());
+    if (formula_impl == nullptr) {
+        return std::nullopt;
+    }
+    return formula_impl->GetLastValue();
+}
+
+void Cell::RestoreCachedValue(Value value)
+{
+    if (auto formula_impl = dynamic_cast<FormulaImpl*>(impl_.get())) {
+        formula_impl->RestoreCache(std::move(value));
+    }
+}
+
+bool Cell::InCycle() const
+{
+    return in_cycle_;
+}
+
+void Cell::SetInCycle(bool in_cycle)
+{
+    in_cycle_ = in_cycle;
+}
+
+Cell::Value Cell::Evaluate() const
+{
+    auto formula_impl = dynamic_cast<const FormulaImpl*>(impl_.get());
+    return formula_impl ? formula_impl->Evaluate() : impl_->GetValue();
+}
+
+void Cell::SetPosition(Position pos)
+{
+    position_ = pos;
+}
+
+bool Cell::MapReferences(const ReferenceMapping& mapping, bool local, std::string_view sheet)
+{
+    auto formula_impl = dynamic_cast<FormulaImpl*>(impl_.get());
+    return formula_impl != nullptr && formula_impl->MapReferences(mapping, local, sheet);
+}
+
 // GraphReference (граф связей) -------------------------------------------------
 
 void Cell::GraphReference::AddDependency(CellInterface* cell)
@@ -285,15 +517,24 @@ bool Cell::GraphReference::IsCyclicDependent(const Cell* start_cell,
     return false;
 }
 
-void Cell::GraphReference::InvalidateCacheDependent()
+void Cell::GraphReference::InvalidateCacheDependent(std::vector<Cell*>& invalidated,
+                                                     const Cell* source)
 {
     // Для всех зависимых ячеек рекурсивно инвалидируем кэш
     for (Cell* dependent_cell : GetDependent())
     {
         // если кэш невалиден у текущей ячейки, то дальше "раскручивать" связи не нужно
-        if (dependent_cell->IsCacheValid()) {
-            dependent_cell->InvalidateCache();
-            dependent_cell->GetGraphReference().InvalidateCacheDependent();
+        if (!dependent_cell->IsCacheValid()) {
+            continue;
+        }
+        // ячейка из невыбранной ветви условия значение не меняет
+        if (source != nullptr &&
+            !dependent_cell->ReadsCell(source->GetSheet(), source->GetPosition())) {
+            continue;
         }
+        dependent_cell->InvalidateCache();
+        invalidated.push_back(dependent_cell);
+        dependent_cell->GetGraphReference().InvalidateCacheDependent(
+            invalidated, source ? dependent_cell : nullptr);
     }
 }
\ No newline at end of file
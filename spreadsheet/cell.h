@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <optional>
 
 #include "common.h"
@@ -18,12 +20,52 @@ public:
     Value GetValue() const override;
     std::string GetText() const override;
     Position GetPosition() const;
+    // Таблица (лист книги), которой принадлежит ячейка
+    SheetInterface& GetSheet() const;
     std::vector<Position> GetReferencedCells() const override;
+    // Ссылки формулы на ячейки других листов книги
+    std::vector<SheetCellRef> GetSheetReferencedCells() const;
+    // Диапазоны - аргументы функций формулы
+    std::vector<Range> GetReferencedRanges() const;
 
     // Метод проверяет кэшированы ли данные в ячейке
     bool IsCacheValid() const;
     // Метод сбрасывает содержимое кэша ячейки
     void InvalidateCache();
+    // Может ли значение ячейки зависеть от ячейки pos таблицы sheet. Ложь только
+    // для формулы с условными ветвями, чьё вычисленное значение pos не читало
+    bool ReadsCell(const SheetInterface& sheet, Position pos) const;
+
+    // Формула ячейки (nullptr, если ячейка не формульная)
+    const FormulaInterface* GetFormula() const;
+    // Значение из кэша формульной ячейки (если оно вычислено)
+    std::optional<Value> GetCachedValue() const;
+    // Задаёт ячейке готовую формулу и, возможно, её вычисленное значение
+    // (восстановление из снимка, без разбора текста)
+    void SetFormula(std::shared_ptr<const FormulaInterface> formula,
+                    std::optional<Value> cache_value = std::nullopt);
+
+    // Формула ячейки для хранения вне её (история правок, Sheet::Undo())
+    std::shared_ptr<const FormulaInterface> ShareFormula() const;
+    // Последнее вычисленное значение формулы, в том числе уже сброшенное;
+    // осмысленно, только если кэш был валиден до сброса
+    std::optional<Value> GetLastValue() const;
+    // Возвращает кэшу формулы значение, вычисленное ранее в том же состоянии
+    // таблицы (отмена правки)
+    void RestoreCachedValue(Value value);
+
+    // Ячейка входит в цикл (итеративный режим, Sheet::SetIterativeCalculation()):
+    // чтение со сброшенным кэшем вычисляет цикл целиком
+    bool InCycle() const;
+    void SetInCycle(bool in_cycle);
+    // Значение формулы по текущим значениям входов, без кэша (итерации цикла)
+    Value Evaluate() const;
+
+    // Ячейка переехала (вставка и удаление строк, перемещение блока)
+    void SetPosition(Position pos);
+    // Переносит ссылки формулы (FormulaInterface::MapReferences()) и
+    // сбрасывает её кэш. Возвращает false, если формула не изменилась.
+    bool MapReferences(const ReferenceMapping& mapping, bool local, std::string_view sheet);
 
 
     class GraphReference {
@@ -46,8 +88,12 @@ public:
         bool IsCyclicDependent(const Cell* start_cell,
                     std::vector<Cell*> cells_referenced) const;
 
-        // сбрасывает содержимое кэша зависящих ячеек
-        void InvalidateCacheDependent();
+        // сбрасывает содержимое кэша зависящих ячеек,
+        // ячейки со сброшенным кэшем добавляются в invalidated;
+        // если задана изменённая ячейка source, пропускаются зависящие,
+        // которые при последнем вычислении её не читали (Cell::ReadsCell)
+        void InvalidateCacheDependent(std::vector<Cell*>& invalidated,
+                                      const Cell* source = nullptr);
 
     private:
         // указатели на ячейки, на которые ссылается ячейка
@@ -56,8 +102,13 @@ public:
         std::unordered_set<CellInterface*> cells_dependent_ = {};
     };
 
+    // Копия ячейки для таблицы sheet: формула разделяется, вычисленное
+    // значение копируется, связи графа не копируются
+    std::unique_ptr<Cell> Clone(SheetInterface& sheet) const;
+
     // граф связей ячеек в таблице
     GraphReference& GetGraphReference();
+    const GraphReference& GetGraphReference() const;
     void UpdateGraphReference();
 
 private:  
@@ -68,6 +119,7 @@ private:
     SheetInterface* sheet_ = nullptr;
     Position position_ = Position::NONE;
     GraphReference graph_reference_;
+    bool in_cycle_ = false;
 
     // базовый класс Impl для ячеек разных типов
     class Impl {
@@ -79,6 +131,8 @@ private:
         virtual std::vector<Position> GetReferencedCells() const = 0;
         virtual void InvalidateCache() = 0;     // Инвалидация кэша
         virtual bool IsCached() const = 0;        // Проверка валидности кэша
+        // Копия содержимого для ячейки таблицы sheet
+        virtual std::unique_ptr<Impl> Clone(SheetInterface& sheet) const = 0;
 
     protected:
         Impl() = default;
@@ -93,17 +147,19 @@ private:
         std::vector<Position> GetReferencedCells() const override;
         void InvalidateCache() override;
         bool IsCached() const override;
+        std::unique_ptr<Impl> Clone(SheetInterface& sheet) const override;
     };
 
     // текстовая ячейка
     class TextImpl final : public Impl {
     public:
-        TextImpl(const std::string& text);
+        TextImpl(std::string text);
         CellInterface::Value GetValue() override;
         std::string GetText() const override;
         std::vector<Position> GetReferencedCells() const override;
         void InvalidateCache() override;
         bool IsCached() const override;
+        std::unique_ptr<Impl> Clone(SheetInterface& sheet) const override;
     private:
         std::string text_;
     };
@@ -112,6 +168,8 @@ private:
     class FormulaImpl final : public Impl {
     public:
         FormulaImpl(const std::string& text, SheetInterface& sheet);
+        FormulaImpl(std::shared_ptr<const FormulaInterface> formula, SheetInterface& sheet,
+                    std::optional<CellInterface::Value> cache_value);
         void Set(std::string text);
         CellInterface::Value GetValue() override;
         std::string GetText() const override;
@@ -119,10 +177,38 @@ private:
         std::vector<Position> GetReferencedCells() const override;
         void InvalidateCache() override;
         bool IsCached() const override;
+        std::unique_ptr<Impl> Clone(SheetInterface& sheet) const override;
+        const FormulaInterface* GetFormula() const;
+        bool MapReferences(const ReferenceMapping& mapping, bool local, std::string_view sheet);
+        std::optional<CellInterface::Value> GetCache() const;
+        const std::shared_ptr<const FormulaInterface>& ShareFormula() const;
+        const CellInterface::Value& GetLastValue() const;
+        void RestoreCache(CellInterface::Value value);
+        // значение по текущим значениям входов; кэш не меняется
+        CellInterface::Value Evaluate() const;
+        // Ячейки и диапазоны, прочитанные при вычислении кэша; только для
+        // формул с условными ветвями и только при валидном кэше
+        const EvaluationTrace* GetTrace() const;
     private:
-        std::unique_ptr<FormulaInterface> formula_;
-        std::optional<CellInterface::Value> cache_value_;
+        // Состояние кэша. Переход Invalid -> Computing захватывается CAS одним
+        // потоком, который и заполняет cache_value_; публикация - store(Valid)
+        // с release, поэтому чтение валидного кэша обходится без блокировок.
+        enum CacheState : std::uint8_t {
+            Invalid,
+            Computing,
+            Valid,
+        };
+
+        // формула неизменяема и разделяется между копиями листа (Sheet::Fork())
+        std::shared_ptr<const FormulaInterface> formula_;
+        CellInterface::Value cache_value_;
+        std::optional<EvaluationTrace> trace_;
+        std::atomic<std::uint8_t> cache_state_{ Invalid };
         SheetInterface* sheet_;
+
+        static CellInterface::Value Calculate(const FormulaInterface& formula,
+                                              const SheetInterface& sheet,
+                                              EvaluationTrace* trace = nullptr);
     };
 
 };  //class Cell 
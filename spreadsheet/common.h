@@ -1,7 +1,12 @@
 #pragma once
 
+#include <array>
 #include <iosfwd>
+#include <cstddef>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -28,6 +33,113 @@ struct Position {
     static const Position NONE;
 };
 
+// Прямоугольный диапазон ячеек (A1:B10), обе границы включительно
+struct Range {
+    Position from;  // левый верхний угол
+    Position to;    // правый нижний угол
+
+    bool operator==(const Range& rhs) const {
+        return from == rhs.from && to == rhs.to;
+    }
+
+    bool Contains(Position pos) const {
+        return pos.row >= from.row && pos.row <= to.row &&
+               pos.col >= from.col && pos.col <= to.col;
+    }
+
+    bool Contains(const Range& range) const {
+        return Contains(range.from) && Contains(range.to);
+    }
+
+    bool Intersects(const Range& rhs) const {
+        return from.row <= rhs.to.row && rhs.from.row <= to.row &&
+               from.col <= rhs.to.col && rhs.from.col <= to.col;
+    }
+
+    // Диапазон удалён вместе со строками или столбцами (#REF!)
+    bool IsValid() const {
+        return from.IsValid() && to.IsValid();
+    }
+
+    // Диапазон по двум любым противоположным углам
+    static Range FromCorners(Position lhs, Position rhs);
+    std::string ToString() const;
+};
+
+// Ссылка на ячейку другого листа книги (Sheet2!A1)
+struct SheetCellRef {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const SheetCellRef& rhs) const {
+        return sheet == rhs.sheet && pos == rhs.pos;
+    }
+};
+
+// Перенос ссылок формул при изменении расположения ячеек листа: новая позиция
+// ячейки и новый диапазон, на которые должна ссылаться формула.
+// Position::NONE и {NONE, NONE} - ссылка потеряна (#REF!)
+class ReferenceMapping {
+public:
+    virtual ~ReferenceMapping() = default;
+
+    virtual Position Apply(Position pos) const = 0;
+    virtual Range Apply(const Range& range) const = 0;
+};
+
+// Вставка или удаление строк (столбцов) листа
+struct ReferenceShift final : ReferenceMapping {
+    bool rows = true;   // сдвигаются строки (иначе столбцы)
+    int index = 0;      // первая вставляемая или удаляемая строка (столбец)
+    int count = 0;      // > 0 - вставка count строк перед index, < 0 - удаление -count
+
+    ReferenceShift(bool rows, int index, int count)
+        : rows(rows), index(index), count(count) {
+    }
+
+    // Позиция или диапазон после сдвига меняется
+    bool Affects(Position pos) const;
+    bool Affects(const Range& range) const;
+
+    // Ячейка удалённой строки или вышедшая за пределы листа - NONE
+    Position Apply(Position pos) const override;
+    // Удалённые строки вырезаются из диапазона, вставка внутри диапазона его
+    // расширяет
+    Range Apply(const Range& range) const override;
+};
+
+// Перемещение блока source на новое место с левым верхним углом target
+// (вырезать и вставить): ссылки на ячейки блока и диапазоны внутри него
+// переезжают вместе с ним, ссылки на замещённые ячейки нового места теряются
+struct ReferenceMove final : ReferenceMapping {
+    Range source;
+    Position target;
+
+    ReferenceMove(const Range& source, Position target)
+        : source(source), target(target) {
+    }
+
+    // Блок на новом месте
+    Range Target() const;
+
+    Position Apply(Position pos) const override;
+    Range Apply(const Range& range) const override;
+};
+
+// Сдвиг всех ссылок на rows строк и cols столбцов (относительные ссылки при
+// копировании формулы); ссылки, ушедшие за пределы листа, теряются
+struct ReferenceOffset final : ReferenceMapping {
+    int rows = 0;
+    int cols = 0;
+
+    ReferenceOffset(int rows, int cols)
+        : rows(rows), cols(cols) {
+    }
+
+    Position Apply(Position pos) const override;
+    Range Apply(const Range& range) const override;
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -42,6 +154,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Div0,   // в результате вычисления возникло деление на ноль
+        NA,     // искомое значение не найдено (MATCH, VLOOKUP)
     };
 
     FormulaError(Category category) :
@@ -64,6 +177,8 @@ public:
             return "#VALUE!"sv;
         case Category::Div0:
             return "#DIV/0!"sv;
+        case Category::NA:
+            return "#N/A"sv;
         default:
             return "#DIV/0!"sv;
         }
@@ -76,6 +191,53 @@ private:
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe);
 
+// Текст логического значения: TRUE или FALSE
+inline std::string_view LogicalToString(bool value) {
+    return value ? "TRUE"sv : "FALSE"sv;
+}
+
+// Ячейки и диапазоны листа, прочитанные при вычислении формулы. У формулы с
+// условными функциями (IF, AND, OR, CHOOSE) это может быть лишь часть её
+// ссылок: невыбранные ветви и пропущенные аргументы не вычисляются.
+struct EvaluationTrace {
+    std::vector<Position> cells;
+    std::vector<Range> ranges;
+
+    // Значение ячейки pos было прочитано (напрямую или в диапазоне)
+    bool Reads(Position pos) const;
+};
+
+// Числовое значение текста ячейки по правилам формул: только цифры и не более
+// одной точки. Для прочего (и для пустого) текста возвращает std::nullopt.
+std::optional<double> TextToNumber(std::string_view text);
+
+// Итоги по числовым значениям ячеек диапазона (для функций SUM, COUNT, AVERAGE)
+struct RangeTotals {
+    double sum = 0.;
+    std::size_t count = 0;  // число ячеек с числовым значением
+};
+
+// Наименьшее и наибольшее числовое значение диапазона (для MIN и MAX)
+struct RangeExtrema {
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    std::size_t count = 0;  // число ячеек с числовым значением
+
+    void Merge(const RangeExtrema& other) {
+        min = other.min < min ? other.min : min;
+        max = other.max > max ? other.max : max;
+        count += other.count;
+    }
+};
+
+// Способ сравнения при поиске значения в строке или столбце (MATCH, VLOOKUP)
+enum class LookupMode {
+    Exact,          // первое значение, равное искомому
+    LessOrEqual,    // наибольшее значение, не превосходящее искомое (из равных -
+                    // последнее); для упорядоченных по возрастанию данных
+                    // совпадает с приближённым поиском
+};
+
 // Исключение, выбрасываемое при попытке передать в метод некорректную позицию
 class InvalidPositionException : public std::out_of_range {
 public:
@@ -98,9 +260,9 @@ public:
 
 class CellInterface {
 public:
-    // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
-    // формулы
-    using Value = std::variant<std::string, double, FormulaError>;
+    // Либо текст ячейки, либо значение формулы (число или логическое
+    // значение), либо сообщение об ошибке из формулы
+    using Value = std::variant<std::string, double, FormulaError, bool>;
 
     virtual ~CellInterface() = default;
 
@@ -163,6 +325,63 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает лист с именем name из той же книги, что и таблица, для
+    // вычисления ссылок вида Sheet2!A1. Отдельная таблица (не в книге) других
+    // листов не видит: возвращается nullptr и ссылка даёт ошибку #REF!.
+    virtual const SheetInterface* FindSheet(std::string_view name) const {
+        return nullptr;
+    }
+
+    // Итоги по диапазону для функций формул. Учитываются числа и текст,
+    // представляющий число; пустые ячейки, логические значения и прочий текст
+    // пропускаются, ошибка формулы в диапазоне бросается как FormulaError.
+    // Реализация по умолчанию обходит диапазон через GetCell(), таблица может
+    // отвечать быстрее.
+    virtual RangeTotals GetRangeTotals(Range range) const;
+
+    // Наименьшее и наибольшее значение диапазона по тем же правилам
+    virtual RangeExtrema GetRangeExtrema(Range range) const;
+
+    // Сумма попарных произведений значений диапазонов одного размера
+    // (SUMPRODUCT): пустые ячейки и текст, не являющийся числом, дают ноль,
+    // ошибка формулы бросается как FormulaError
+    virtual double GetRangeProduct(Range lhs, Range rhs) const;
+
+    // Поиск числа value в строке или столбце range: смещение найденной ячейки
+    // от начала диапазона или std::nullopt. Сравниваются числа и текст,
+    // представляющий число; пустые ячейки, прочий текст и ошибки формул
+    // пропускаются. Реализация по умолчанию обходит диапазон через GetCell().
+    virtual std::optional<int> LookupValue(Range range, double value, LookupMode mode) const;
+};
+
+// Числовое значение ячейки для функций над диапазонами (std::nullopt - ячейки
+// нет, её значение логическое или текст не является числом); ошибка формулы
+// бросается как FormulaError
+std::optional<double> GetRangeNumber(const SheetInterface& sheet, Position pos);
+
+// Число с производными по нескольким входам сразу для прямого
+// автоматического дифференцирования (Sheet::GetDerivatives()). Производные по
+// DUAL_LANES входам лежат подряд и обновляются одинаковыми поэлементными
+// циклами, которые компилятор переводит в векторные инструкции.
+constexpr std::size_t DUAL_LANES = 4;
+
+struct Dual {
+    double value = 0.;
+    alignas(32) std::array<double, DUAL_LANES> tangent{};
+};
+
+// Значения с производными ячеек, зависящих от входов дифференцирования;
+// остальные ячейки формулы читают как константы
+class DualValues {
+public:
+    virtual ~DualValues() = default;
+
+    // nullptr - значение ячейки pos листа sheet от входов не зависит
+    virtual const Dual* Find(const SheetInterface& sheet, Position pos) const = 0;
+    // обходит зависящие от входов ячейки диапазона range листа sheet
+    virtual void ForEachInRange(const SheetInterface& sheet, const Range& range,
+                                const std::function<void(Position, const Dual&)>& visitor) const = 0;
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -0,0 +1,293 @@
+#include "sheet.h"
+
+#include "cell.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+// Производные значений ячеек ---------------------------------------------------
+
+namespace {
+
+// Числовое значение ячейки по правилам формул (пустая ячейка - ноль,
+// логическое значение - единица или ноль); std::nullopt - ошибка или текст
+std::optional<double> GetNumber(const Cell& cell)
+{
+    const CellInterface::Value value = cell.GetValue();
+    if (const double* number = std::get_if<double>(&value))
+    {
+        return *number;
+    }
+    if (const bool* logical = std::get_if<bool>(&value))
+    {
+        return *logical ? 1. : 0.;
+    }
+    if (const std::string* text = std::get_if<std::string>(&value))
+    {
+        return text->empty() ? 0. : TextToNumber(*text);
+    }
+    return std::nullopt;
+}
+
+// Текст ячейки с числом value: неотрицательное - число без показателя степени
+// (его понимает TextToNumber()), отрицательное - формула
+std::string NumberToCellText(double value)
+{
+    char buffer[512];
+    if (value >= 0.)
+    {
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed);
+        return std::string(buffer, result.ptr);
+    }
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    return "=" + std::string(buffer, result.ptr);
+}
+
+// Значения с производными формул конуса и входов
+class ConeDuals final : public DualValues {
+public:
+    std::unordered_map<const Cell*, Dual> duals;
+
+    const Dual* Find(const SheetInterface& sheet, Position pos) const override
+    {
+        auto it = duals.find(static_cast<const Cell*>(sheet.GetCell(pos)));
+        return it != duals.end() ? &it->second : nullptr;
+    }
+
+    void ForEachInRange(const SheetInterface& sheet, const Range& range,
+                        const std::function<void(Position, const Dual&)>& visitor) const override
+    {
+        for (const auto& [cell, dual] : duals)
+        {
+            if (&cell->GetSheet() == &sheet && range.Contains(cell->GetPosition()))
+            {
+                visitor(cell->GetPosition(), dual);
+            }
+        }
+    }
+};
+
+// наибольшее изменение значения или производной
+double DualDistance(const Dual& lhs, const Dual& rhs)
+{
+    double distance = std::abs(lhs.value - rhs.value);
+    for (std::size_t lane = 0; lane < DUAL_LANES; ++lane)
+    {
+        distance = std::max(distance, std::abs(lhs.tangent[lane] - rhs.tangent[lane]));
+    }
+    return distance;
+}
+
+}  // namespace
+
+std::vector<std::optional<Dual>> Sheet::EvaluateDuals(const std::vector<Position>& outputs,
+                                                      const std::vector<Position>& inputs) const
+{
+    // входы - независимые переменные: у входа lane единичная производная по lane
+    ConeDuals cone;
+    std::vector<const Cell*> stack;
+    for (std::size_t lane = 0; lane < inputs.size(); ++lane)
+    {
+        if (const Cell* cell = PositionToCell(inputs[lane]))
+        {
+            Dual& seed = cone.duals[cell];
+            seed.value = GetNumber(*cell).value_or(std::numeric_limits<double>::quiet_NaN());
+            seed.tangent[lane] = 1.;
+            stack.push_back(cell);
+        }
+    }
+
+    // формулы, зависящие от входов: напрямую, через другие листы и диапазоны
+    std::unordered_set<const Cell*> affected;
+    while (!stack.empty())
+    {
+        const Cell* cell = stack.back();
+        stack.pop_back();
+        std::vector<CellInterface*> dependents;
+        static_cast<const Sheet&>(cell->GetSheet()).range_index_.CollectDependents(cell->GetPosition(), dependents);
+        for (Cell* dependent : cell->GetGraphReference().GetDependent())
+        {
+            dependents.push_back(dependent);
+        }
+        for (CellInterface* dependent : dependents)
+        {
+            const Cell* formula_cell = static_cast<const Cell*>(dependent);
+            if (!cone.duals.count(formula_cell) && affected.insert(formula_cell).second)
+            {
+                stack.push_back(formula_cell);
+            }
+        }
+    }
+
+    // из них - влияющие на выходы, входы раньше формул, которые их читают
+    std::vector<Cell*> roots;
+    for (Position pos : outputs)
+    {
+        Cell* cell = PositionToCell(pos);
+        if (cell && affected.count(cell))
+        {
+            roots.push_back(cell);
+        }
+    }
+    auto in_cone = [&affected](const Cell* cell)
+    {
+        return affected.count(cell) > 0;
+    };
+    for (const std::vector<Cell*>& component : FindComponents(roots, in_cone))
+    {
+        if (!IsCycle(component))
+        {
+            const Cell* cell = component.front();
+            if (std::optional<Dual> dual = cell->GetFormula()->EvaluateDual(cell->GetSheet(), cone))
+            {
+                cone.duals[cell] = *dual;
+            }
+            continue;
+        }
+
+        // производные цикла сходятся теми же итерациями, что и значения
+        std::vector<Cell*> members = component;
+        std::stable_sort(members.begin(), members.end(), [](const Cell* lhs, const Cell* rhs)
+        {
+            return PositionLess{}(lhs->GetPosition(), rhs->GetPosition());
+        });
+        for (const Cell* member : members)
+        {
+            cone.duals[member] = Dual{ GetNumber(*member).value_or(0.) };
+        }
+        for (int iteration = 0; iteration < iteration_.max_iterations; ++iteration)
+        {
+            double change = 0;
+            for (const Cell* member : members)
+            {
+                std::optional<Dual> dual = member->GetFormula()->EvaluateDual(member->GetSheet(), cone);
+                if (!dual)
+                {
+                    for (const Cell* failed : members)
+                    {
+                        cone.duals.erase(failed);
+                    }
+                    iteration = iteration_.max_iterations;
+                    break;
+                }
+                Dual& current = cone.duals[member];
+                change = std::max(change, DualDistance(current, *dual));
+                current = *dual;
+            }
+            if (change <= iteration_.tolerance)
+            {
+                break;
+            }
+        }
+    }
+
+    // выход вне конуса от входов не зависит
+    std::vector<std::optional<Dual>> result;
+    for (Position pos : outputs)
+    {
+        const Cell* cell = PositionToCell(pos);
+        if (const Dual* dual = cell ? cone.Find(*this, pos) : nullptr)
+        {
+            result.push_back(*dual);
+        }
+        else if (std::optional<double> number = cell ? GetNumber(*cell) : 0.)
+        {
+            result.push_back(Dual{ *number });
+        }
+        else
+        {
+            result.push_back(std::nullopt);
+        }
+    }
+    return result;
+}
+
+std::vector<std::vector<double>> Sheet::GetDerivatives(const std::vector<Position>& outputs,
+                                                       const std::vector<Position>& inputs) const
+{
+    for (const std::vector<Position>* positions : { &outputs, &inputs })
+    {
+        for (Position pos : *positions)
+        {
+            if (!pos.IsValid())
+            {
+                throw InvalidPositionException("Invalid position for GetDerivatives()");
+            }
+        }
+    }
+
+    std::vector<std::vector<double>> result(outputs.size(), std::vector<double>(inputs.size()));
+    for (std::size_t first = 0; first < inputs.size(); first += DUAL_LANES)
+    {
+        const std::vector<Position> batch(inputs.begin() + first,
+                                          inputs.begin() + std::min(first + DUAL_LANES, inputs.size()));
+        const std::vector<std::optional<Dual>> duals = EvaluateDuals(outputs, batch);
+        for (std::size_t i = 0; i < outputs.size(); ++i)
+        {
+            for (std::size_t lane = 0; lane < batch.size(); ++lane)
+            {
+                result[i][first + lane] = duals[i] ? duals[i]->tangent[lane]
+                                                   : std::numeric_limits<double>::quiet_NaN();
+            }
+        }
+    }
+    return result;
+}
+
+GoalSeekResult Sheet::GoalSeek(Position target, double goal, Position input, int max_iterations, double tolerance)
+{
+    if (!target.IsValid() || !input.IsValid())
+    {
+        throw InvalidPositionException("Invalid position for GoalSeek()");
+    }
+    if (batch_depth_ > 0 || in_transaction_)
+    {
+        throw std::logic_error("Goal seek is not available in a batch update or a transaction");
+    }
+    const Cell* cell = PositionToCell(input);
+    if (cell && (!cell->GetReferencedCells().empty() || !cell->GetSheetReferencedCells().empty() ||
+                 !cell->GetReferencedRanges().empty()))
+    {
+        throw std::invalid_argument("Goal seek input must not depend on other cells");
+    }
+    std::optional<double> start = cell ? GetNumber(*cell) : 0.;
+    if (!start)
+    {
+        throw std::invalid_argument("Goal seek input must be a number");
+    }
+
+    // подписчики получают только итог подбора
+    OperationScope operation(*this);
+    GoalSeekResult result;
+    result.input = *start;
+    while (true)
+    {
+        const std::optional<Dual> dual = EvaluateDuals({ target }, { input }).front();
+        ++result.evaluations;
+        if (!dual)
+        {
+            break;
+        }
+        result.value = dual->value;
+        const double residual = dual->value - goal;
+        if (std::abs(residual) <= tolerance)
+        {
+            result.converged = true;
+            break;
+        }
+        const double slope = dual->tangent[0];
+        if (result.evaluations > max_iterations || slope == 0. || !std::isfinite(slope))
+        {
+            break;
+        }
+        result.input -= residual / slope;
+        SetCell(input, NumberToCellText(result.input));
+    }
+    operation.Finish();
+    return result;
+}
@@ -18,25 +18,45 @@ namespace {
 class Formula : public FormulaInterface {
 public:
 // Реализуйте следующие методы: 
-    explicit Formula(std::string expression) try : ast_( ParseFormulaAST(expression) ) {
+    explicit Formula(std::string expression) try : ast_( ParseFormulaAST(expression) ),
+        expression_( PrintExpression(ast_) ) {
      }
     catch (std::exception& exc) {
         std::throw_with_nested(FormulaException(exc.what()));
     }
 
-    Value Evaluate(const SheetInterface& sheet) const override {
+    explicit Formula(FormulaAST ast) : ast_(std::move(ast)),
+        expression_( PrintExpression(ast_) ) {
+    }
+
+    Value Evaluate(const SheetInterface& sheet, EvaluationTrace* trace) const override {
         try {
-            return ast_.Execute(sheet);
+            double value = ast_.Execute(sheet, trace);
+            if (ast_.IsLogical()) {
+                return value != 0.;
+            }
+            return value;
         }
         catch (FormulaError& err) {
             return err;
         }
     }
 
+    std::optional<Dual> EvaluateDual(const SheetInterface& sheet, const DualValues& values) const override {
+        try {
+            return ast_.ExecuteDual(sheet, values);
+        }
+        catch (FormulaError&) {
+            return std::nullopt;
+        }
+    }
+
+    bool IsConditional() const override {
+        return ast_.IsConditional();
+    }
+
     std::string GetExpression() const override {
-        std::ostringstream out;
-        ast_.PrintFormula(out);
-        return out.str();
+        return expression_;
     }
 
     std::vector<Position> GetReferencedCells() const override {
@@ -49,16 +69,79 @@ public:
         unique_ref_cells.unique();
         for (const Position& cell : unique_ref_cells)
         {
-            result.push_back(cell);
+            if (cell.IsValid())
+            {
+                result.push_back(cell);
+            }
         }
         return result;
     }
 
+    std::vector<SheetCellRef> GetSheetReferencedCells() const override {
+        std::vector<SheetCellRef> result;
+        for (const SheetCellRef& ref : ast_.GetSheetCells())
+        {
+            if (ref.pos.IsValid() && std::find(result.begin(), result.end(), ref) == result.end())
+            {
+                result.push_back(ref);
+            }
+        }
+        return result;
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        std::vector<Range> result;
+        for (const Range& range : ast_.GetRanges())
+        {
+            if (range.IsValid() && std::find(result.begin(), result.end(), range) == result.end())
+            {
+                result.push_back(range);
+            }
+        }
+        return result;
+    }
+
+    std::string Serialize() const override {
+        std::string result;
+        ast_.Serialize(result);
+        return result;
+    }
+
+    std::unique_ptr<FormulaInterface> MapReferences(const ReferenceMapping& mapping, bool local,
+                                                    std::string_view sheet) const override {
+        if (!ast_.IsAffectedBy(mapping, local, sheet)) {
+            return nullptr;
+        }
+        // копия дерева из байт-кода, без разбора текста
+        std::string bytecode;
+        ast_.Serialize(bytecode);
+        FormulaAST ast = DeserializeFormulaAST(bytecode);
+        ast.MapReferences(mapping, local, sheet);
+        return std::make_unique<Formula>(std::move(ast));
+    }
+
 private:
     FormulaAST ast_;
+    // Каноничный текст формулы печатается один раз при создании, а не при
+    // каждом GetText()/PrintTexts()
+    std::string expression_;
+
+    static std::string PrintExpression(const FormulaAST& ast) {
+        std::ostringstream out;
+        ast.PrintFormula(out);
+        return out.str();
+    }
 };
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
+}
+
+std::unique_ptr<FormulaInterface> DeserializeFormula(std::string_view bytecode) {
+    try {
+        return std::make_unique<Formula>(DeserializeFormulaAST(bytecode));
+    } catch (const std::exception& exc) {
+        std::throw_with_nested(FormulaException(exc.what()));
+    }
 }
\ No newline at end of file
@@ -9,12 +9,20 @@
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Значения ячеек других листов книги: Sheet2!A1*2
+// * Функции SUM, COUNT, AVERAGE, MIN, MAX от чисел и диапазонов: SUM(A1:A100,B1),
+//   SUMPRODUCT от диапазонов одного размера: SUMPRODUCT(A1:A10,B1:B10)
+// * Поиск: MATCH(5,A1:A100,0), VLOOKUP(B1,A1:C100,3,0), INDEX(A1:C100,2,3)
+// * Сравнения = <> < <= > >= и логические константы TRUE, FALSE; условные
+//   функции IF(A1>0,B1,C1), AND, OR, CHOOSE(2,A1,B1,C1). Невыбранные ветви IF
+//   и CHOOSE не вычисляются, AND и OR останавливаются на первом аргументе,
+//   определяющем результат. В арифметике TRUE - единица, FALSE - ноль.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
 class FormulaInterface {
 public:
-    using Value = std::variant<double, FormulaError>;
+    using Value = std::variant<double, FormulaError, bool>;
 
     virtual ~FormulaInterface() = default;
 
@@ -23,8 +31,21 @@ public:
     // Возвращает вычисленное значение формулы для переданного листа либо ошибку.
     // Если вычисление какой-то из указанных в формуле ячеек приводит к ошибке, то
     // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
-    // любая.
-    virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+    // любая. Формула сравнения или логической функции даёт bool.
+    // В trace (если передан) записываются ячейки и диапазоны листа, которые
+    // вычисление действительно прочитало; ссылки на другие листы не записываются.
+    virtual Value Evaluate(const SheetInterface& sheet, EvaluationTrace* trace = nullptr) const = 0;
+
+    // Значение формулы с производными по входам: ячейки из values дают свои
+    // производные, остальные - константы. Арифметика дифференцируется по
+    // обычным правилам, IF, CHOOSE, INDEX, VLOOKUP, MIN и MAX - по выбранному
+    // аргументу, сравнения, COUNT, MATCH, AND и OR кусочно-постоянны.
+    // std::nullopt - вычисление даёт ошибку.
+    virtual std::optional<Dual> EvaluateDual(const SheetInterface& sheet, const DualValues& values) const = 0;
+
+    // В формуле есть условные функции: вычисление может прочитать лишь часть
+    // ячеек из GetReferencedCells() и GetReferencedRanges()
+    virtual bool IsConditional() const = 0;
 
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
@@ -32,10 +53,34 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // ячеек. Ссылки #REF! (на удалённые ячейки) в список не входят, как и в
+    // списки ниже.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает ссылки на ячейки других листов книги (Sheet2!A1) без
+    // повторений.
+    virtual std::vector<SheetCellRef> GetSheetReferencedCells() const = 0;
+
+    // Возвращает диапазоны - аргументы функций (без повторений).
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+    // Возвращает формулу в компактном бинарном виде (постфиксная запись AST),
+    // из которого её можно восстановить без разбора текста.
+    virtual std::string Serialize() const = 0;
+
+    // Формула после переноса ссылок mapping (вставка и удаление строк,
+    // перемещение и копирование ячеек): ссылки на свой лист (local) и на лист
+    // с именем sheet перенесены, потерянные ссылки стали #REF!. Формула
+    // неизменяема и может разделяться копиями листа, поэтому переносятся
+    // ссылки копии. nullptr - перенос ссылок формулы не меняет.
+    virtual std::unique_ptr<FormulaInterface> MapReferences(const ReferenceMapping& mapping, bool local,
+                                                            std::string_view sheet) const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Восстанавливает формулу из вида, полученного FormulaInterface::Serialize().
+// Бросает FormulaException в случае некорректных данных.
+std::unique_ptr<FormulaInterface> DeserializeFormula(std::string_view bytecode);
\ No newline at end of file
@@ -0,0 +1,415 @@
+#include "history.h"
+
+#include "journal.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// EditHistory ------------------------------------------------------------------
+
+EditHistory::EditHistory(std::size_t limit) :
+    limit_(limit) {
+}
+
+void EditHistory::SetLimit(std::size_t limit) {
+    limit_ = limit;
+    Trim();
+}
+
+std::size_t EditHistory::GetMemoryUsage() const {
+    return bytes_;
+}
+
+void EditHistory::Begin(bool exact) {
+    if (depth_++ == 0) {
+        current_ = Action{};
+        current_.exact = exact;
+    }
+}
+
+void EditHistory::End() {
+    if (depth_ == 0 || --depth_ > 0) {
+        return;
+    }
+    Replay replay = replay_;
+    replay_ = Replay::None;
+    if (current_.entries.empty()) {
+        return;
+    }
+
+    bytes_ += current_.bytes;
+    if (replay == Replay::Undo) {
+        redo_.push_back(std::move(current_));
+    } else {
+        if (replay == Replay::None) {
+            for (const Action& action : redo_) {
+                bytes_ -= action.bytes;
+            }
+            redo_.clear();
+        }
+        undo_.push_back(std::move(current_));
+    }
+    current_ = Action{};
+    Trim();
+}
+
+bool EditHistory::IsRecording() const {
+    return depth_ > 0;
+}
+
+bool EditHistory::IsExact() const {
+    return current_.exact;
+}
+
+void EditHistory::MarkInexact() {
+    current_.exact = false;
+    // значения формул без возврата кэшей не нужны
+    std::vector<Entry>& entries = current_.entries;
+    auto cached = std::stable_partition(entries.begin(), entries.end(), [](const Entry& entry) {
+        return !std::holds_alternative<CachedValue>(entry);
+    });
+    for (auto it = cached; it != entries.end(); ++it) {
+        current_.bytes -= EstimateSize(*it);
+    }
+    entries.erase(cached, entries.end());
+}
+
+void EditHistory::Record(Entry entry) {
+    current_.bytes += EstimateSize(entry);
+    current_.entries.push_back(std::move(entry));
+}
+
+bool EditHistory::CanUndo() const {
+    return !undo_.empty();
+}
+
+bool EditHistory::CanRedo() const {
+    return !redo_.empty();
+}
+
+EditHistory::Action EditHistory::TakeUndo() {
+    Action action = std::move(undo_.back());
+    undo_.pop_back();
+    bytes_ -= action.bytes;
+    replay_ = Replay::Undo;
+    return action;
+}
+
+EditHistory::Action EditHistory::TakeRedo() {
+    Action action = std::move(redo_.back());
+    redo_.pop_back();
+    bytes_ -= action.bytes;
+    replay_ = Replay::Redo;
+    return action;
+}
+
+std::size_t EditHistory::EstimateSize(const Entry& entry) {
+    std::size_t size = sizeof(Entry);
+    if (const CellState* state = std::get_if<CellState>(&entry)) {
+        size += state->text.capacity();
+        // дерево формулы, которую держит только история, - порядка её текста
+        if (state->formula) {
+            size += state->formula->GetExpression().size();
+        }
+    } else if (const CachedValue* cached = std::get_if<CachedValue>(&entry)) {
+        if (const std::string* text = std::get_if<std::string>(&cached->value)) {
+            size += text->capacity();
+        }
+    }
+    return size;
+}
+
+void EditHistory::Trim() {
+    // сначала вытесняются самые старые шаги отмены, затем дальние шаги повтора
+    while (bytes_ > limit_ && !undo_.empty()) {
+        bytes_ -= undo_.front().bytes;
+        undo_.pop_front();
+    }
+    while (bytes_ > limit_ && !redo_.empty()) {
+        bytes_ -= redo_.front().bytes;
+        redo_.pop_front();
+    }
+}
+
+// История правок листа ---------------------------------------------------------
+
+void Sheet::SetHistoryLimit(std::size_t bytes)
+{
+    if (batch_depth_ > 0 || in_transaction_)
+    {
+        throw std::logic_error("History limit cannot be changed in a batch update or a transaction");
+    }
+    if (bytes == 0)
+    {
+        history_.reset();
+    }
+    else if (history_)
+    {
+        history_->SetLimit(bytes);
+    }
+    else
+    {
+        history_ = std::make_unique<EditHistory>(bytes);
+    }
+}
+
+std::size_t Sheet::GetHistoryMemoryUsage() const
+{
+    return history_ ? history_->GetMemoryUsage() : 0;
+}
+
+bool Sheet::Undo()
+{
+    return ReplayHistory(true);
+}
+
+bool Sheet::Redo()
+{
+    return ReplayHistory(false);
+}
+
+bool Sheet::ReplayHistory(bool undo)
+{
+    if (batch_depth_ > 0 || in_transaction_)
+    {
+        throw std::logic_error("Undo and redo are not available in a batch update or a transaction");
+    }
+    if (!history_ || !(undo ? history_->CanUndo() : history_->CanRedo()))
+    {
+        return false;
+    }
+    EditHistory::Action action = undo ? history_->TakeUndo() : history_->TakeRedo();
+
+    // обратные операции записываются как шаг противоположного стека;
+    // подписчики получают изменения после возврата значений
+    OperationScope operation(*this);
+    BeginBatchUpdate();
+    try
+    {
+        for (auto it = action.entries.rbegin(); it != action.entries.rend(); ++it)
+        {
+            std::visit([this](const auto& entry)
+            {
+                using Entry = std::decay_t<decltype(entry)>;
+                if constexpr (std::is_same_v<Entry, EditHistory::CellState>)
+                {
+                    entry.sheet->RestoreCell(entry);
+                }
+                else if constexpr (std::is_same_v<Entry, ReferenceShift>)
+                {
+                    ShiftCells(ReferenceShift(entry.rows, entry.index, -entry.count));
+                }
+                else if constexpr (std::is_same_v<Entry, ReferenceMove>)
+                {
+                    MoveRange(entry.Target(), entry.source.from);
+                }
+            }, *it);
+        }
+    }
+    catch (...)
+    {
+        EndBatchUpdate();
+        throw;
+    }
+    EndBatchUpdate();
+
+    // Таблица вернулась в состояние, в котором были вычислены сохранённые
+    // значения, - они снова валидны. Значения листа книги могли зависеть от
+    // других листов, изменившихся с тех пор, поэтому пересчитываются.
+    if (action.exact && workbook_ == nullptr)
+    {
+        RestoreCachedValues(action);
+    }
+    operation.Finish();
+    return true;
+}
+
+void Sheet::RestoreCachedValues(const EditHistory::Action& action)
+{
+    // значение ячейки - самое раннее из записанных в шаге
+    std::map<Position, std::pair<const CellInterface::Value*, const FormulaInterface*>, PositionLess> values;
+    for (auto it = action.entries.rbegin(); it != action.entries.rend(); ++it)
+    {
+        if (const auto* state = std::get_if<EditHistory::CellState>(&*it))
+        {
+            if (state->sheet == this && state->formula && state->cache)
+            {
+                values[state->pos] = { &*state->cache, state->formula.get() };
+            }
+        }
+        else if (const auto* cached = std::get_if<EditHistory::CachedValue>(&*it))
+        {
+            values[cached->pos] = { &cached->value, nullptr };
+        }
+    }
+    // Валидный кэш не может зависеть от сброшенного: инвалидация останавливается
+    // на ячейках со сброшенным кэшем. Поэтому значения возвращаются начиная с
+    // формул, все входы которых уже валидны.
+    auto is_ready = [this](const Cell& cell)
+    {
+        auto is_valid = [this](Position pos)
+        {
+            const Cell* input = PositionToCell(pos);
+            return input == nullptr || input->GetFormula() == nullptr || input->IsCacheValid();
+        };
+        for (Position pos : cell.GetReferencedCells())
+        {
+            if (!is_valid(pos))
+            {
+                return false;
+            }
+        }
+        for (const Range& range : cell.GetReferencedRanges())
+        {
+            for (Position pos : range_index_.GetFormulaCells(range))
+            {
+                if (!is_valid(pos))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    bool restored = true;
+    while (restored && !values.empty())
+    {
+        restored = false;
+        for (auto it = values.begin(); it != values.end();)
+        {
+            Cell* cell = PositionToCell(it->first);
+            const auto [value, formula] = it->second;
+            if (cell == nullptr || cell->GetFormula() == nullptr || cell->IsCacheValid() ||
+                (formula != nullptr && cell->GetFormula() != formula))
+            {
+                it = values.erase(it);
+                continue;
+            }
+            if (!is_ready(*cell))
+            {
+                ++it;
+                continue;
+            }
+            cell->RestoreCachedValue(*value);
+            restored = true;
+            it = values.erase(it);
+        }
+    }
+}
+
+void Sheet::RestoreCell(const EditHistory::CellState& state)
+{
+    const Cell* current = PositionToCell(state.pos);
+    if (!state.exists && current && current->GetGraphReference().GetDependent().empty())
+    {
+        ClearCell(state.pos);
+        return;
+    }
+    // ячейка, на которую ссылаются формулы, остаётся пустой
+    if (current == nullptr ? !state.exists
+                           : state.formula ? current->GetFormula() == state.formula.get()
+                                           : !current->GetFormula() && current->GetText() == state.text)
+    {
+        return;
+    }
+
+    auto cell = std::make_unique<Cell>(*this, state.pos);
+    if (state.formula)
+    {
+        cell->SetFormula(state.formula);
+    }
+    else
+    {
+        cell->Set(state.text);
+    }
+    ResizeSheet(state.pos);
+    cell->UpdateGraphReference();
+    // восстанавливается согласованное прежнее состояние, промежуточное может
+    // содержать цикл (как при фиксации транзакции)
+    InstallCell(state.pos, std::move(cell), false);
+    // формула журналируется в разобранном виде: текст с #REF! не разбирается
+    // заново, а числа в тексте формулы округлены
+    if (journal_ && state.formula)
+    {
+        journal_->LogFormula(state.pos, *state.formula);
+    }
+    else if (journal_)
+    {
+        journal_->LogSet(state.pos, state.text);
+    }
+}
+
+void Sheet::BeginHistoryAction(bool exact)
+{
+    if (history_)
+    {
+        history_->Begin(exact);
+    }
+}
+
+void Sheet::EndHistoryAction()
+{
+    if (history_)
+    {
+        history_->End();
+    }
+}
+
+bool Sheet::IsRecordingHistory() const
+{
+    return history_ && history_->IsRecording();
+}
+
+void Sheet::RecordCell(const Cell* cell, Position pos)
+{
+    if (!IsRecordingHistory())
+    {
+        return;
+    }
+    EditHistory::CellState state;
+    state.sheet = cell ? static_cast<Sheet*>(&cell->GetSheet()) : this;
+    state.pos = pos;
+    state.exists = cell != nullptr;
+    if (cell)
+    {
+        state.formula = cell->ShareFormula();
+        if (!state.formula)
+        {
+            state.text = cell->GetText();
+        }
+        state.cache = cell->GetCachedValue();
+    }
+    history_->Record(std::move(state));
+}
+
+void Sheet::RecordStructure(EditHistory::Entry entry)
+{
+    if (IsRecordingHistory())
+    {
+        // ячейки сдвигаются - позиции записанных значений устаревают
+        history_->MarkInexact();
+        history_->Record(std::move(entry));
+    }
+}
+
+void Sheet::RecordInvalidated(const std::vector<Cell*>& invalidated)
+{
+    if (!IsRecordingHistory() || !history_->IsExact())
+    {
+        return;
+    }
+    for (const Cell* cell : invalidated)
+    {
+        if (&cell->GetSheet() == this)
+        {
+            if (std::optional<CellInterface::Value> value = cell->GetLastValue())
+            {
+                history_->Record(EditHistory::CachedValue{ cell->GetPosition(), std::move(*value) });
+            }
+        }
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+class Sheet;
+
+// История правок листа (Sheet::Undo() и Sheet::Redo()). Хранит не копии
+// таблицы, а обратные операции: прежнее содержимое изменённых ячеек (формула -
+// разделяемое с ячейкой дерево, без текста и повторного разбора), вставки,
+// удаления и перемещения ячеек для обратного сдвига и значения формул, кэш
+// которых сбросила правка. Шаг истории - одна операция листа, фиксация
+// транзакции или пакет изменений целиком.
+class EditHistory {
+public:
+    // Содержимое ячейки до правки
+    struct CellState {
+        Sheet* sheet = nullptr;     // лист ячейки (сдвиг переписывает и формулы других листов)
+        Position pos;
+        bool exists = false;        // ячейка была в таблице
+        std::string text;           // текст не формульной ячейки
+        std::shared_ptr<const FormulaInterface> formula;
+        std::optional<CellInterface::Value> cache;
+    };
+    // Значение формулы листа, кэш которой сбросила правка
+    struct CachedValue {
+        Position pos;
+        CellInterface::Value value;
+    };
+    using Entry = std::variant<CellState, CachedValue, ReferenceShift, ReferenceMove>;
+
+    // Записи отменяются в обратном порядке
+    struct Action {
+        std::vector<Entry> entries;
+        // кэши можно вернуть: ячейки не сдвигались, значения не читались
+        // посреди шага (пакет изменений)
+        bool exact = true;
+        std::size_t bytes = 0;
+    };
+
+    // limit - бюджет памяти в байтах (оценка): старые шаги вытесняются
+    explicit EditHistory(std::size_t limit);
+
+    void SetLimit(std::size_t limit);
+    std::size_t GetMemoryUsage() const;
+
+    // Границы шага; вложенные шаги входят во внешний. Новый шаг очищает стек
+    // повтора, если это не воспроизведение TakeUndo() или TakeRedo().
+    void Begin(bool exact);
+    void End();
+    bool IsRecording() const;
+    bool IsExact() const;
+    void MarkInexact();
+    void Record(Entry entry);
+
+    bool CanUndo() const;
+    bool CanRedo() const;
+    // Снимает шаг для воспроизведения; следующий записанный шаг (обратный
+    // снятому) попадает в противоположный стек
+    Action TakeUndo();
+    Action TakeRedo();
+
+private:
+    enum class Replay {
+        None,
+        Undo,
+        Redo,
+    };
+
+    std::deque<Action> undo_;
+    std::deque<Action> redo_;
+    std::size_t limit_ = 0;
+    std::size_t bytes_ = 0;
+
+    int depth_ = 0;
+    Action current_;
+    Replay replay_ = Replay::None;
+
+    static std::size_t EstimateSize(const Entry& entry);
+    void Trim();
+};
@@ -0,0 +1,348 @@
+#include "importer.h"
+
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+// Тип поля определяется прямо в буфере чтения
+enum class FieldKind {
+    Empty,
+    Number,
+    Text,
+    Formula,
+};
+
+FieldKind ClassifyField(std::string_view field) {
+    if (field.empty()) {
+        return FieldKind::Empty;
+    }
+    if (field.size() > 1 && field.front() == FORMULA_SIGN) {
+        return FieldKind::Formula;
+    }
+    // число по правилам TextToNumber(): только цифры и не более одной точки;
+    // поле с ведущими нулями ("007") - код, а не число
+    std::size_t digits = 0;
+    std::size_t dots = 0;
+    for (char ch : field) {
+        if (std::isdigit(static_cast<unsigned char>(ch))) {
+            ++digits;
+        } else if (ch == '.') {
+            ++dots;
+        } else {
+            return FieldKind::Text;
+        }
+    }
+    if (digits == 0 || dots > 1 || (field.size() > 1 && field[0] == '0' && field[1] != '.')) {
+        return FieldKind::Text;
+    }
+    return FieldKind::Number;
+}
+
+// Читает поток блоками и отдаёт записи (строки файла) в виде std::string_view,
+// указывающих в собственный буфер. Запись действительна до следующего вызова.
+class RecordReader {
+public:
+    RecordReader(std::istream& input, const ImportOptions& options) :
+        input_(input), delimiter_(options.delimiter), quoted_(options.quoted),
+        buffer_(options.chunk_size > 0 ? options.chunk_size : 1) {
+    }
+
+    bool NextRecord(std::string_view& record) {
+        while (true) {
+            const char* newline = FindRecordEnd();
+            if (newline != nullptr) {
+                std::size_t end = newline - buffer_.data();
+                record = MakeRecord(begin_, end);
+                begin_ = end + 1;
+                return true;
+            }
+            if (eof_) {
+                if (begin_ == end_) {
+                    return false;
+                }
+                // последняя запись без перевода строки
+                record = MakeRecord(begin_, end_);
+                begin_ = end_;
+                scan_ = end_;
+                in_quotes_ = false;
+                quote_pending_ = false;
+                at_field_start_ = true;
+                return true;
+            }
+            Refill();
+        }
+    }
+
+    std::size_t GetBytesRead() const {
+        return bytes_read_;
+    }
+
+private:
+    std::istream& input_;
+    char delimiter_;
+    bool quoted_;
+    std::vector<char> buffer_;
+    std::size_t begin_ = 0;     // начало необработанных данных
+    std::size_t end_ = 0;       // конец прочитанных данных
+    std::size_t scan_ = 0;      // до сюда текущая запись уже просмотрена
+    bool in_quotes_ = false;    // просмотренная часть записи кончается внутри кавычек
+    bool quote_pending_ = false;    // ...и последний символ - кавычка, смысл
+                                    // которой решит следующий символ
+    bool at_field_start_ = true;    // следующий символ начинает поле
+    std::size_t bytes_read_ = 0;
+    bool eof_ = false;
+
+    // Ищет перевод строки, завершающий текущую запись, продолжая просмотр с
+    // места, где он остановился. Кавычки разбираются как в FieldSplitter:
+    // открывающая - только в начале поля, закрывающая - кавычка, за которой
+    // не идёт вторая. Перевод строки внутри кавычек запись не завершает.
+    // Каждый байт просматривается один раз, даже если поле в кавычках
+    // содержит много переводов строки.
+    const char* FindRecordEnd() {
+        const char* data = buffer_.data();
+        if (!quoted_) {
+            auto newline = static_cast<const char*>(
+                std::memchr(data + scan_, '\n', end_ - scan_));
+            scan_ = newline != nullptr ? newline - data + 1 : end_;
+            return newline;
+        }
+        while (scan_ < end_) {
+            if (in_quotes_) {
+                ScanQuoted();
+                continue;
+            }
+            const char ch = data[scan_++];
+            if (ch == '\n') {
+                at_field_start_ = true;
+                return data + scan_ - 1;
+            }
+            if (ch == '"' && at_field_start_) {
+                in_quotes_ = true;
+            }
+            at_field_start_ = ch == delimiter_;
+        }
+        return nullptr;
+    }
+
+    // Просматривает поле в кавычках до закрывающей кавычки или до конца
+    // прочитанных данных
+    void ScanQuoted() {
+        const char* data = buffer_.data();
+        while (scan_ < end_) {
+            if (quote_pending_) {
+                quote_pending_ = false;
+                if (data[scan_] != '"') {
+                    in_quotes_ = false;
+                    return;
+                }
+                // удвоенная кавычка внутри поля
+                ++scan_;
+                continue;
+            }
+            auto quote = static_cast<const char*>(
+                std::memchr(data + scan_, '"', end_ - scan_));
+            if (quote == nullptr) {
+                scan_ = end_;
+                return;
+            }
+            scan_ = quote - data + 1;
+            quote_pending_ = true;
+        }
+    }
+
+    std::string_view MakeRecord(std::size_t begin, std::size_t end) const {
+        // поддержка окончаний строк CRLF
+        if (end > begin && buffer_[end - 1] == '\r') {
+            --end;
+        }
+        return std::string_view(buffer_.data() + begin, end - begin);
+    }
+
+    // Сдвигает необработанный хвост в начало буфера и дочитывает следующий блок.
+    // Буфер растёт, только если одна запись не помещается в него целиком.
+    void Refill() {
+        std::size_t tail = end_ - begin_;
+        if (begin_ > 0) {
+            std::memmove(buffer_.data(), buffer_.data() + begin_, tail);
+        }
+        scan_ -= begin_;
+        begin_ = 0;
+        end_ = tail;
+        if (end_ == buffer_.size()) {
+            buffer_.resize(buffer_.size() * 2);
+        }
+        input_.read(buffer_.data() + end_, buffer_.size() - end_);
+        std::size_t count = static_cast<std::size_t>(input_.gcount());
+        end_ += count;
+        bytes_read_ += count;
+        if (count == 0 || !input_) {
+            eof_ = true;
+        }
+    }
+};
+
+// Разбивает запись на поля и передаёт их обработчику handler(col, field)
+class FieldSplitter {
+public:
+    explicit FieldSplitter(const ImportOptions& options) :
+        delimiter_(options.delimiter), quoted_(options.quoted) {
+    }
+
+    template <typename Handler>
+    void Split(std::string_view record, Handler&& handler) {
+        int col = 0;
+        const char* pos = record.data();
+        const char* last = record.data() + record.size();
+        while (true) {
+            std::string_view field;
+            if (quoted_ && pos < last && *pos == '"') {
+                pos = ParseQuoted(pos + 1, last, field);
+            } else {
+                auto delimiter = static_cast<const char*>(
+                    std::memchr(pos, delimiter_, last - pos));
+                const char* field_end = delimiter ? delimiter : last;
+                field = std::string_view(pos, field_end - pos);
+                pos = field_end;
+            }
+            handler(col, field);
+            // pos указывает на разделитель либо на конец записи
+            if (pos >= last) {
+                break;
+            }
+            ++pos;
+            ++col;
+        }
+    }
+
+private:
+    char delimiter_;
+    bool quoted_;
+    std::string unescaped_;     // переиспользуемый буфер для полей с ""
+
+    // Разбирает поле в кавычках, first указывает на символ после открывающей кавычки.
+    // Возвращает позицию после поля (разделитель или конец записи).
+    const char* ParseQuoted(const char* first, const char* last, std::string_view& field) {
+        const char* pos = first;
+        bool has_escapes = false;
+        while (true) {
+            auto quote = static_cast<const char*>(std::memchr(pos, '"', last - pos));
+            if (quote == nullptr) {
+                // незакрытая кавычка - поле до конца записи
+                field = std::string_view(first, last - first);
+                return last;
+            }
+            if (quote + 1 < last && quote[1] == '"') {
+                has_escapes = true;
+                pos = quote + 2;
+                continue;
+            }
+            field = std::string_view(first, quote - first);
+            pos = quote + 1;
+            break;
+        }
+        if (has_escapes) {
+            unescaped_.clear();
+            for (std::size_t i = 0; i < field.size(); ++i) {
+                unescaped_.push_back(field[i]);
+                if (field[i] == '"') {
+                    ++i;
+                }
+            }
+            field = unescaped_;
+        }
+        // символы между закрывающей кавычкой и разделителем отбрасываются
+        auto delimiter = static_cast<const char*>(std::memchr(pos, delimiter_, last - pos));
+        return delimiter ? delimiter : last;
+    }
+};
+
+}  // namespace
+
+ImportStats ImportDelimited(std::istream& input, Sheet& sheet, const ImportOptions& options) {
+    if (!options.origin.IsValid()) {
+        throw InvalidPositionException("Invalid origin for ImportDelimited()");
+    }
+
+    ImportStats stats;
+    RecordReader reader(input, options);
+    FieldSplitter splitter(options);
+
+    // Поля в пустых позициях загружаются сразу и при ошибке импорта удаляются.
+    // Формулы и поля поверх существующих ячеек откладываются до конца загрузки
+    // и применяются одной транзакцией: к этому моменту все ячейки, на которые
+    // ссылаются формулы, уже на месте, а ошибка формулы или цикл отменяют
+    // транзакцию целиком. Внутри транзакции вызывающего правки попадают в неё.
+    const bool own_transaction = !sheet.InTransaction();
+    std::vector<Position> created;
+    std::vector<std::pair<Position, std::string>> deferred;
+
+    sheet.BeginBatchUpdate();
+    try {
+        std::string_view record;
+        int row = options.origin.row;
+        while (reader.NextRecord(record)) {
+            if (row >= Position::MAX_ROWS) {
+                throw InvalidPositionException("Too many rows for ImportDelimited()");
+            }
+            splitter.Split(record, [&](int col, std::string_view field) {
+                FieldKind kind = ClassifyField(field);
+                if (kind == FieldKind::Empty) {
+                    return;
+                }
+                Position pos{ row, options.origin.col + col };
+                if (!pos.IsValid()) {
+                    throw InvalidPositionException("Too many columns for ImportDelimited()");
+                }
+                ++stats.cells;
+                if (kind == FieldKind::Formula) {
+                    ++stats.formulas;
+                    deferred.emplace_back(pos, std::string(field));
+                    return;
+                }
+                if (kind == FieldKind::Number) {
+                    ++stats.numbers;
+                }
+                if (!own_transaction) {
+                    sheet.LoadTextCell(pos, field);
+                } else if (sheet.GetCell(pos) == nullptr) {
+                    sheet.LoadTextCell(pos, field);
+                    created.push_back(pos);
+                } else {
+                    deferred.emplace_back(pos, std::string(field));
+                }
+            });
+            ++stats.rows;
+            ++row;
+        }
+
+        if (own_transaction) {
+            sheet.BeginTransaction();
+        }
+        for (auto& [pos, text] : deferred) {
+            sheet.SetCell(pos, std::move(text));
+        }
+        if (own_transaction) {
+            sheet.Commit();
+        }
+    } catch (...) {
+        if (own_transaction && sheet.InTransaction()) {
+            sheet.Rollback();
+        }
+        for (Position pos : created) {
+            sheet.ClearCell(pos);
+        }
+        sheet.EndBatchUpdate();
+        throw;
+    }
+    sheet.EndBatchUpdate();
+
+    stats.bytes = reader.GetBytesRead();
+    return stats;
+}
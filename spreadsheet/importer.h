@@ -0,0 +1,44 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstddef>
+#include <istream>
+
+// Параметры потокового импорта файлов с разделителями (CSV/TSV)
+struct ImportOptions {
+    char delimiter = '\t';              // '\t' для TSV, ',' для CSV
+    bool quoted = true;                 // поддержка полей в кавычках (RFC 4180)
+    Position origin = { 0, 0 };         // позиция, куда попадёт первое поле файла
+    std::size_t chunk_size = 1 << 20;   // размер блока чтения, байт
+};
+
+// Статистика импорта
+struct ImportStats {
+    std::size_t bytes = 0;      // прочитано байт
+    std::size_t rows = 0;       // прочитано строк (записей)
+    std::size_t cells = 0;      // создано непустых ячеек
+    std::size_t numbers = 0;    // из них числовых
+    std::size_t formulas = 0;   // из них формульных
+};
+
+// Загружает в таблицу данные из потока с разделителями.
+// Поток читается блоками по chunk_size байт, поэтому буфер чтения ограничен
+// размером блока и длиной самой длинной записи, а не размером файла. Кроме
+// него до конца импорта хранятся позиции созданных ячеек (для удаления при
+// ошибке) и тексты формул и полей поверх существующих ячеек: эта память
+// растёт линейно с числом таких ячеек, O(ячеек) на файл.
+// Поля разбираются прямо в буфере чтения (std::string_view), без временных строк;
+// копия делается только для полей в кавычках с удвоенными кавычками внутри.
+// Пустое поле ячейку не создаёт. Поле вида "=..." - формула, она проходит через
+// обычный Sheet::SetCell() (с разбором и проверкой циклов), остальные поля
+// загружаются напрямую через Sheet::LoadTextCell().
+// Импорт - один пакет изменений и применяется целиком или не применяется:
+// формулы и поля поверх существующих ячеек фиксируются одной транзакцией в
+// конце, а при ошибке созданные импортом ячейки удаляются. Внутри транзакции
+// вызывающего правки накапливаются в ней, и при ошибке её откатывает он сам.
+// Бросает InvalidPositionException, если данные выходят за границы таблицы,
+// FormulaException при ошибке в формуле и CircularDependencyException.
+ImportStats ImportDelimited(std::istream& input, Sheet& sheet,
+                            const ImportOptions& options = {});
@@ -0,0 +1,158 @@
+#include "ingest.h"
+
+#include <limits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+IngestQueue::IngestQueue(std::size_t capacity) {
+    std::size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    slots_ = std::make_unique<Slot[]>(size);
+    mask_ = size - 1;
+    for (std::size_t i = 0; i < size; ++i) {
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+IngestQueue::~IngestQueue() = default;
+
+bool IngestQueue::TryPush(Position pos, std::string text) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position for TryPush()");
+    }
+    return Push(Edit{ pos, std::move(text), false, Clock::now() });
+}
+
+bool IngestQueue::TryPushClear(Position pos) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position for TryPushClear()");
+    }
+    return Push(Edit{ pos, {}, true, Clock::now() });
+}
+
+bool IngestQueue::Push(Edit edit) {
+    std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Slot* slot = nullptr;
+    while (true) {
+        slot = &slots_[pos & mask_];
+        std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+        if (diff == 0) {
+            // слот свободен - занимаем позицию
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // слот ещё не освобождён потребителем - очередь заполнена
+            rejected_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+    slot->edit = std::move(edit);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    pushed_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool IngestQueue::Pop(Edit& edit) {
+    // потребитель один, поэтому позиция извлечения захватывается без CAS
+    std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[pos & mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+        return false;   // пусто или производитель ещё пишет правку
+    }
+    edit = std::move(slot.edit);
+    dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+    slot.sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+}
+
+std::size_t IngestQueue::Drain(Sheet& sheet, std::size_t max_edits) {
+    std::vector<Edit> edits;
+    Edit edit;
+    while (edits.size() < max_edits && Pop(edit)) {
+        edits.push_back(std::move(edit));
+    }
+    if (edits.empty()) {
+        return 0;
+    }
+
+    // для каждой ячейки применяется последняя правка на её месте в очереди,
+    // как при последовательных SetCell(); previous - прежняя правка той же
+    // ячейки, она применяется, если последняя не прошла (ошибка формулы, цикл)
+    constexpr std::size_t NONE = std::numeric_limits<std::size_t>::max();
+    std::unordered_map<std::uint64_t, std::size_t> last_edit;
+    std::vector<std::size_t> previous(edits.size(), NONE);
+    std::vector<bool> superseded(edits.size(), false);
+    last_edit.reserve(edits.size());
+    for (std::size_t i = 0; i < edits.size(); ++i) {
+        std::uint64_t key = static_cast<std::uint64_t>(edits[i].pos.row) * Position::MAX_COLS +
+                            edits[i].pos.col;
+        auto [it, inserted] = last_edit.emplace(key, i);
+        if (!inserted) {
+            previous[i] = it->second;
+            superseded[it->second] = true;
+            it->second = i;
+        }
+    }
+
+    std::uint64_t applied = 0;
+    std::uint64_t failed = 0;
+    Sheet::BatchUpdateScope batch(sheet);
+    for (std::size_t last = 0; last < edits.size(); ++last) {
+        if (superseded[last]) {
+            continue;
+        }
+        for (std::size_t i = last; i != NONE; i = previous[i]) {
+            ++applied;
+            try {
+                if (edits[i].clear) {
+                    sheet.ClearCell(edits[i].pos);
+                } else {
+                    sheet.SetCell(edits[i].pos, std::move(edits[i].text));
+                }
+                break;
+            } catch (const FormulaException&) {
+                ++failed;
+            } catch (const CircularDependencyException&) {
+                ++failed;
+            }
+        }
+    }
+    batch.Finish();
+
+    // задержка считается до момента, когда новые значения видны читателям
+    auto lag = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - edits.front().enqueued).count();
+    last_lag_ns_.store(lag, std::memory_order_relaxed);
+    std::int64_t max_lag = max_lag_ns_.load(std::memory_order_relaxed);
+    while (lag > max_lag &&
+           !max_lag_ns_.compare_exchange_weak(max_lag, lag, std::memory_order_relaxed)) {
+    }
+
+    drained_.fetch_add(edits.size(), std::memory_order_relaxed);
+    coalesced_.fetch_add(edits.size() - applied, std::memory_order_relaxed);
+    failed_.fetch_add(failed, std::memory_order_relaxed);
+    return edits.size();
+}
+
+IngestMetrics IngestQueue::GetMetrics() const {
+    IngestMetrics metrics;
+    metrics.pushed = pushed_.load(std::memory_order_relaxed);
+    metrics.rejected = rejected_.load(std::memory_order_relaxed);
+    metrics.drained = drained_.load(std::memory_order_relaxed);
+    metrics.coalesced = coalesced_.load(std::memory_order_relaxed);
+    metrics.failed = failed_.load(std::memory_order_relaxed);
+    std::size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+    std::size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+    metrics.depth = enqueued > dequeued ? enqueued - dequeued : 0;
+    metrics.capacity = mask_ + 1;
+    metrics.last_lag = std::chrono::nanoseconds(last_lag_ns_.load(std::memory_order_relaxed));
+    metrics.max_lag = std::chrono::nanoseconds(max_lag_ns_.load(std::memory_order_relaxed));
+    return metrics;
+}
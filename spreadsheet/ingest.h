@@ -0,0 +1,95 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+
+// Счётчики очереди приёма правок. Читаются из любого потока.
+struct IngestMetrics {
+    std::uint64_t pushed = 0;       // принято правок
+    std::uint64_t rejected = 0;     // отклонено из-за переполнения (backpressure)
+    std::uint64_t drained = 0;      // извлечено потоком вычислений
+    std::uint64_t coalesced = 0;    // из них перекрыто более поздней правкой той же ячейки
+                                    // и не применялось
+    std::uint64_t failed = 0;       // из них не применено (ошибка формулы, цикл)
+    std::size_t depth = 0;          // правок в очереди (приблизительно)
+    std::size_t capacity = 0;
+    std::chrono::nanoseconds last_lag{ 0 };  // задержка самой старой правки последнего пакета
+    std::chrono::nanoseconds max_lag{ 0 };   // наибольшая такая задержка
+};
+
+// Очередь приёма правок от внешних источников: много потоков-производителей
+// кладут правки без блокировок, единственный поток-владелец таблицы забирает
+// их пакетами. Ограниченное кольцо (алгоритм Д. Вьюкова): у каждого слота есть
+// атомарный номер, по которому производитель и потребитель узнают, свободен
+// ли слот, поэтому ни добавление, ни извлечение не ждут друг друга.
+//
+// Переполнение не блокирует производителя: TryPush() возвращает false, и
+// источник сам решает, ждать ли, прореживать или отбрасывать данные.
+class IngestQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // capacity округляется вверх до степени двойки
+    explicit IngestQueue(std::size_t capacity = 1 << 16);
+    ~IngestQueue();
+
+    IngestQueue(const IngestQueue&) = delete;
+    IngestQueue& operator=(const IngestQueue&) = delete;
+
+    // Производители (любые потоки). false - очередь заполнена.
+    bool TryPush(Position pos, std::string text);
+    bool TryPushClear(Position pos);
+
+    // Потребитель (поток, владеющий таблицей): извлекает до max_edits правок,
+    // оставляет для каждой ячейки только последнюю и применяет их одним пакетом
+    // (Sheet::BeginBatchUpdate()) в порядке очереди: последняя правка ячейки
+    // стоит на своём месте, как при последовательных SetCell(). Правки с
+    // ошибкой пропускаются и учитываются в метриках; если не прошла последняя
+    // правка ячейки, на её месте применяется предыдущая. Отличие от
+    // последовательного применения одно: перекрытая правка не применяется
+    // раньше, поэтому правки других ячеек между ними проверяются на циклы без
+    // неё. Возвращает число извлечённых правок.
+    std::size_t Drain(Sheet& sheet,
+                      std::size_t max_edits = std::numeric_limits<std::size_t>::max());
+
+    IngestMetrics GetMetrics() const;
+
+private:
+    struct Edit {
+        Position pos;
+        std::string text;
+        bool clear = false;
+        Clock::time_point enqueued;
+    };
+
+    struct Slot {
+        std::atomic<std::size_t> sequence;
+        Edit edit;
+    };
+
+    bool Push(Edit edit);
+    bool Pop(Edit& edit);
+
+    std::unique_ptr<Slot[]> slots_;
+    std::size_t mask_;
+
+    // позиции производителей и потребителя - в разных строках кэша
+    alignas(64) std::atomic<std::size_t> enqueue_pos_{ 0 };
+    alignas(64) std::atomic<std::size_t> dequeue_pos_{ 0 };
+
+    alignas(64) std::atomic<std::uint64_t> pushed_{ 0 };
+    std::atomic<std::uint64_t> rejected_{ 0 };
+    alignas(64) std::atomic<std::uint64_t> drained_{ 0 };
+    std::atomic<std::uint64_t> coalesced_{ 0 };
+    std::atomic<std::uint64_t> failed_{ 0 };
+    std::atomic<std::int64_t> last_lag_ns_{ 0 };
+    std::atomic<std::int64_t> max_lag_ns_{ 0 };
+};
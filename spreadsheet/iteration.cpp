@@ -0,0 +1,310 @@
+#include "sheet.h"
+
+#include "cell.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// Итеративное вычисление циклических ссылок ------------------------------------
+
+void Sheet::SetIterativeCalculation(const IterationSettings& settings)
+{
+    if (settings.max_iterations < 1 || !(settings.tolerance >= 0))
+    {
+        throw std::invalid_argument("Iterations must be positive and tolerance non-negative");
+    }
+    iteration_ = settings;
+}
+
+std::vector<Cell*> Sheet::GetFormulaInputs(const Cell& cell)
+{
+    std::vector<Cell*> inputs = cell.GetGraphReference().GetReferences();
+    const Sheet& owner = static_cast<const Sheet&>(cell.GetSheet());
+    for (const Range& range : cell.GetReferencedRanges())
+    {
+        for (Position pos : owner.range_index_.GetFormulaCells(range))
+        {
+            inputs.push_back(owner.PositionToCell(pos));
+        }
+    }
+    bool reads_itself = false;
+    for (Position pos : cell.GetReferencedCells())
+    {
+        reads_itself = reads_itself || pos == cell.GetPosition();
+    }
+    for (const SheetCellRef& ref : cell.GetSheetReferencedCells())
+    {
+        reads_itself = reads_itself || (ref.pos == cell.GetPosition() && owner.FindWorkbookSheet(ref.sheet) == &owner);
+    }
+    if (reads_itself)
+    {
+        inputs.push_back(owner.PositionToCell(cell.GetPosition()));
+    }
+    return inputs;
+}
+
+namespace {
+
+// формула, кэш которой сброшен
+bool IsPendingFormula(const Cell* cell)
+{
+    return cell->GetFormula() != nullptr && !cell->IsCacheValid();
+}
+
+}  // namespace
+
+std::vector<std::vector<Cell*>> Sheet::FindComponents(const std::vector<Cell*>& roots,
+                                                      const std::function<bool(const Cell*)>& include)
+{
+    // алгоритм Тарьяна с явным стеком: компонента выдаётся, когда обойдены все
+    // её входы, поэтому компоненты входов оказываются раньше
+    struct Frame {
+        Cell* cell;
+        std::vector<Cell*> inputs;
+        std::size_t next = 0;
+    };
+    struct Order {
+        std::size_t index;
+        std::size_t low;
+    };
+    std::unordered_map<const Cell*, Order> order;
+    std::unordered_set<const Cell*> on_path;
+    std::vector<Cell*> path;
+    std::vector<Frame> stack;
+    std::vector<std::vector<Cell*>> components;
+
+    auto visit = [&](Cell* cell)
+    {
+        const std::size_t index = order.size();
+        order[cell] = Order{ index, index };
+        path.push_back(cell);
+        on_path.insert(cell);
+        stack.push_back(Frame{ cell, GetFormulaInputs(*cell) });
+    };
+
+    for (Cell* root : roots)
+    {
+        if (!include(root) || order.count(root))
+        {
+            continue;
+        }
+        visit(root);
+        while (!stack.empty())
+        {
+            Frame& frame = stack.back();
+            if (frame.next < frame.inputs.size())
+            {
+                Cell* input = frame.inputs[frame.next++];
+                if (!include(input))
+                {
+                    continue;
+                }
+                auto it = order.find(input);
+                if (it == order.end())
+                {
+                    visit(input);
+                }
+                else if (on_path.count(input))
+                {
+                    Order& current = order[frame.cell];
+                    current.low = std::min(current.low, it->second.index);
+                }
+                continue;
+            }
+
+            Cell* cell = frame.cell;
+            stack.pop_back();
+            const Order done = order[cell];
+            if (done.low == done.index)
+            {
+                std::vector<Cell*> component;
+                Cell* member = nullptr;
+                do
+                {
+                    member = path.back();
+                    path.pop_back();
+                    on_path.erase(member);
+                    component.push_back(member);
+                } while (member != cell);
+                components.push_back(std::move(component));
+            }
+            if (!stack.empty())
+            {
+                Order& parent = order[stack.back().cell];
+                parent.low = std::min(parent.low, done.low);
+            }
+        }
+    }
+    return components;
+}
+
+bool Sheet::IsCycle(const std::vector<Cell*>& component)
+{
+    if (component.size() > 1)
+    {
+        return true;
+    }
+    const std::vector<Cell*> inputs = GetFormulaInputs(*component.front());
+    return std::find(inputs.begin(), inputs.end(), component.front()) != inputs.end();
+}
+
+void Sheet::MarkCycle(Cell* cell)
+{
+    // компонента корня обхода выдаётся последней
+    std::vector<std::vector<Cell*>> components = FindComponents({ cell }, [](const Cell* input)
+    {
+        return input->GetFormula() != nullptr;
+    });
+    if (components.empty() || !IsCycle(components.back()))
+    {
+        return;
+    }
+    for (Cell* member : components.back())
+    {
+        member->SetInCycle(true);
+    }
+}
+
+void Sheet::SolveCycle(const Cell& cell) const
+{
+    for (const std::vector<Cell*>& component : FindComponents({ const_cast<Cell*>(&cell) }, IsPendingFormula))
+    {
+        SolveComponent(component);
+    }
+}
+
+void Sheet::SolveComponent(const std::vector<Cell*>& component) const
+{
+    // цикл мог разомкнуться правкой - формула вычисляется как обычно
+    if (!IsCycle(component))
+    {
+        Cell* cell = component.front();
+        if (cell->InCycle())
+        {
+            cell->SetInCycle(false);
+        }
+        cell->GetValue();
+        return;
+    }
+
+    // Гаусс-Зейдель: формулы пересчитываются в порядке позиций, каждая по уже
+    // обновлённым значениям остальных; начальные значения - прежние (при
+    // небольшой правке входов цикл сходится за несколько проходов) или ноль
+    std::vector<Cell*> members = component;
+    std::stable_sort(members.begin(), members.end(), [](const Cell* lhs, const Cell* rhs)
+    {
+        return PositionLess{}(lhs->GetPosition(), rhs->GetPosition());
+    });
+    for (Cell* member : members)
+    {
+        member->SetInCycle(true);
+        const std::optional<CellInterface::Value> last = member->GetLastValue();
+        const double* number = last ? std::get_if<double>(&*last) : nullptr;
+        member->RestoreCachedValue(number ? *number : 0.0);
+    }
+
+    auto distance = [](const CellInterface::Value& lhs, const CellInterface::Value& rhs)
+    {
+        const double* lhs_number = std::get_if<double>(&lhs);
+        const double* rhs_number = std::get_if<double>(&rhs);
+        if (lhs_number && rhs_number)
+        {
+            return std::abs(*lhs_number - *rhs_number);
+        }
+        return lhs == rhs ? 0.0 : std::numeric_limits<double>::infinity();
+    };
+    for (int iteration = 0; iteration < iteration_.max_iterations; ++iteration)
+    {
+        double change = 0;
+        for (Cell* member : members)
+        {
+            CellInterface::Value value = member->Evaluate();
+            change = std::max(change, distance(*member->GetLastValue(), value));
+            member->RestoreCachedValue(std::move(value));
+        }
+        if (change <= iteration_.tolerance)
+        {
+            break;
+        }
+    }
+}
+
+void Sheet::SolveCycles(unsigned threads)
+{
+    std::vector<Cell*> roots;
+    for (const auto& row : sheet_)
+    {
+        for (const auto& cell : row)
+        {
+            if (cell && cell->InCycle() && !cell->IsCacheValid())
+            {
+                roots.push_back(cell.get());
+            }
+        }
+    }
+    std::vector<std::vector<Cell*>> components = FindComponents(roots, IsPendingFormula);
+
+    // уровень компоненты - длина самой длинной цепочки компонент её входов;
+    // компоненты одного уровня не зависят друг от друга
+    std::unordered_map<const Cell*, std::size_t> component_of;
+    std::vector<std::vector<std::size_t>> levels;
+    std::vector<std::size_t> level_of(components.size(), 0);
+    for (std::size_t i = 0; i < components.size(); ++i)
+    {
+        for (const Cell* member : components[i])
+        {
+            component_of[member] = i;
+        }
+        for (const Cell* member : components[i])
+        {
+            for (const Cell* input : GetFormulaInputs(*member))
+            {
+                auto it = component_of.find(input);
+                if (it != component_of.end() && it->second != i)
+                {
+                    level_of[i] = std::max(level_of[i], level_of[it->second] + 1);
+                }
+            }
+        }
+        if (levels.size() <= level_of[i])
+        {
+            levels.resize(level_of[i] + 1);
+        }
+        levels[level_of[i]].push_back(i);
+    }
+
+    for (const std::vector<std::size_t>& level : levels)
+    {
+        if (threads < 2 || level.size() < 2)
+        {
+            for (std::size_t i : level)
+            {
+                SolveComponent(components[i]);
+            }
+            continue;
+        }
+        // компоненты уровня не имеют общих ячеек, а их входы уже вычислены
+        std::atomic<std::size_t> next{ 0 };
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < std::min<std::size_t>(threads, level.size()); ++i)
+        {
+            workers.emplace_back([this, &components, &level, &next]
+            {
+                for (std::size_t item = next++; item < level.size(); item = next++)
+                {
+                    SolveComponent(components[level[item]]);
+                }
+            });
+        }
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+}
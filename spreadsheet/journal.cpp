@@ -0,0 +1,430 @@
+#include "journal.h"
+
+#include "formula.h"
+#include "snapshot.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+
+constexpr std::string_view JOURNAL_MAGIC = "SJNL"sv;
+constexpr std::uint32_t JOURNAL_VERSION = 4;     // версия 1 - без записей 'H',
+                                                 // версия 2 - без 'M' и 'P',
+                                                 // версия 3 - без 'F'
+constexpr std::size_t HEADER_SIZE = JOURNAL_MAGIC.size() + sizeof(std::uint32_t) + sizeof(std::uint64_t);
+constexpr std::size_t GROUP_HEADER_SIZE = 2 * sizeof(std::uint32_t);
+
+constexpr char OP_SET = 'S';
+constexpr char OP_CLEAR = 'C';
+constexpr char OP_SHIFT = 'H';
+constexpr char OP_MOVE = 'M';
+constexpr char OP_COPY = 'P';
+constexpr char OP_FORMULA = 'F';
+
+template <typename T>
+void WriteRaw(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool ReadRaw(std::string_view& in, T& value) {
+    if (in.size() < sizeof(T)) {
+        return false;
+    }
+    std::memcpy(&value, in.data(), sizeof(T));
+    in.remove_prefix(sizeof(T));
+    return true;
+}
+
+std::uint64_t Fnv1a64(std::string_view data) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (char ch : data) {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::uint32_t Fnv1a32(std::string_view data) {
+    std::uint32_t hash = 2166136261u;
+    for (char ch : data) {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool ReadFile(const std::string& path, std::string& data) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// Обрезает открытый файл до size байт
+bool TruncateFile(std::FILE* file, std::size_t size) {
+    std::fflush(file);
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), static_cast<long long>(size)) == 0;
+#else
+    return ::ftruncate(fileno(file), static_cast<off_t>(size)) == 0;
+#endif
+}
+
+void SyncFile(std::FILE* file) {
+    std::fflush(file);
+#ifdef _WIN32
+    _commit(_fileno(file));
+#else
+    ::fsync(fileno(file));
+#endif
+}
+
+// Записывает файл целиком через временный файл и переименование, чтобы на
+// диске всегда оставалась либо старая, либо новая версия
+void WriteFileAtomically(const std::string& path, std::string_view data) {
+    std::string tmp_path = path + ".tmp";
+    std::FILE* file = std::fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) {
+        throw JournalException("Cannot create " + tmp_path);
+    }
+    bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    SyncFile(file);
+    std::fclose(file);
+    if (!written) {
+        throw JournalException("Cannot write " + tmp_path);
+    }
+#ifdef _WIN32
+    std::remove(path.c_str());  // rename() в Windows не заменяет существующий файл
+#endif
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        throw JournalException("Cannot replace " + path);
+    }
+}
+
+std::string MakeHeader(std::uint64_t base_hash) {
+    std::string header(JOURNAL_MAGIC);
+    WriteRaw(header, JOURNAL_VERSION);
+    WriteRaw(header, base_hash);
+    return header;
+}
+
+// Проверяет заголовок журнала и возвращает хэш снимка, поверх которого он ведётся
+std::uint64_t ReadHeader(std::string_view& data) {
+    std::uint32_t version = 0;
+    std::uint64_t base_hash = 0;
+    if (data.substr(0, JOURNAL_MAGIC.size()) != JOURNAL_MAGIC) {
+        throw JournalException("Not a spreadsheet journal");
+    }
+    data.remove_prefix(JOURNAL_MAGIC.size());
+    if (!ReadRaw(data, version) || version == 0 || version > JOURNAL_VERSION ||
+        !ReadRaw(data, base_hash)) {
+        throw JournalException("Unsupported journal version");
+    }
+    return base_hash;
+}
+
+// Отделяет от rest очередную целую группу с верной контрольной суммой.
+// false - группы кончились либо дальше оборванная или повреждённая группа
+bool NextGroup(std::string_view& rest, std::string_view& group) {
+    std::string_view tail(rest);
+    std::uint32_t size = 0;
+    std::uint32_t checksum = 0;
+    if (!ReadRaw(tail, size) || !ReadRaw(tail, checksum) || size > tail.size() ||
+        Fnv1a32(tail.substr(0, size)) != checksum) {
+        return false;
+    }
+    group = tail.substr(0, size);
+    rest = tail.substr(size);
+    return true;
+}
+
+// Длина корректного начала журнала: заголовок и целые группы до первой
+// оборванной или повреждённой
+std::size_t ValidJournalSize(std::string_view data) {
+    std::string_view rest(data);
+    ReadHeader(rest);
+    std::string_view group;
+    while (NextGroup(rest, group)) {
+    }
+    return data.size() - rest.size();
+}
+
+}  // namespace
+
+Journal::Journal(std::string path, JournalOptions options) :
+    path_(std::move(path)), options_(options) {
+    Open(0, false);
+}
+
+Journal::~Journal() {
+    try {
+        Commit();
+    } catch (const JournalException&) {
+    }
+    if (file_) {
+        std::fclose(file_);
+    }
+}
+
+void Journal::LogSet(Position pos, std::string_view text) {
+    group_.push_back(OP_SET);
+    WriteRaw<std::int32_t>(group_, pos.row);
+    WriteRaw<std::int32_t>(group_, pos.col);
+    WriteRaw<std::uint32_t>(group_, static_cast<std::uint32_t>(text.size()));
+    group_ += text;
+    LogOperation();
+}
+
+void Journal::LogFormula(Position pos, const FormulaInterface& formula) {
+    const std::string bytecode = formula.Serialize();
+    group_.push_back(OP_FORMULA);
+    WriteRaw<std::int32_t>(group_, pos.row);
+    WriteRaw<std::int32_t>(group_, pos.col);
+    WriteRaw<std::uint32_t>(group_, static_cast<std::uint32_t>(bytecode.size()));
+    group_ += bytecode;
+    LogOperation();
+}
+
+void Journal::LogClear(Position pos) {
+    group_.push_back(OP_CLEAR);
+    WriteRaw<std::int32_t>(group_, pos.row);
+    WriteRaw<std::int32_t>(group_, pos.col);
+    LogOperation();
+}
+
+void Journal::LogShift(const ReferenceShift& shift) {
+    group_.push_back(OP_SHIFT);
+    WriteRaw<std::int32_t>(group_, shift.index);
+    WriteRaw<std::int32_t>(group_, shift.count);
+    WriteRaw<std::uint8_t>(group_, shift.rows ? 1 : 0);
+    LogOperation();
+}
+
+void Journal::LogMove(const Range& source, Position target) {
+    LogBlock(OP_MOVE, source, target);
+}
+
+void Journal::LogCopy(const Range& source, Position target) {
+    LogBlock(OP_COPY, source, target);
+}
+
+void Journal::LogBlock(char op, const Range& source, Position target) {
+    group_.push_back(op);
+    WriteRaw<std::int32_t>(group_, source.from.row);
+    WriteRaw<std::int32_t>(group_, source.from.col);
+    WriteRaw<std::int32_t>(group_, source.to.row);
+    WriteRaw<std::int32_t>(group_, source.to.col);
+    WriteRaw<std::int32_t>(group_, target.row);
+    WriteRaw<std::int32_t>(group_, target.col);
+    LogOperation();
+}
+
+void Journal::LogOperation() {
+    ++group_operations_;
+    if (options_.sync == SyncPolicy::EveryOperation ||
+        group_operations_ >= options_.group_size) {
+        Commit();
+    }
+}
+
+void Journal::Commit() {
+    if (group_.empty()) {
+        return;
+    }
+    std::string frame;
+    frame.reserve(GROUP_HEADER_SIZE + group_.size());
+    WriteRaw<std::uint32_t>(frame, static_cast<std::uint32_t>(group_.size()));
+    WriteRaw<std::uint32_t>(frame, Fnv1a32(group_));
+    frame += group_;
+    group_.clear();
+    group_operations_ = 0;
+
+    if (std::fwrite(frame.data(), 1, frame.size(), file_) != frame.size()) {
+        throw JournalException("Cannot write journal " + path_);
+    }
+    Sync();
+}
+
+void Journal::Compact(const Sheet& sheet, const std::string& snapshot_path) {
+    Commit();
+
+    std::ostringstream snapshot;
+    SaveSnapshot(sheet, snapshot);
+    std::string data = snapshot.str();
+    WriteFileAtomically(snapshot_path, data);
+
+    // если процесс упадёт здесь, старый журнал останется привязан к старому
+    // снимку и Recover() его проигнорирует: все его операции уже в новом снимке
+    std::fclose(file_);
+    file_ = nullptr;
+    Open(Fnv1a64(data), true);
+}
+
+std::size_t Journal::ReplayData(std::string_view data, Sheet& sheet) {
+    std::string_view rest(data);
+    ReadHeader(rest);
+
+    std::size_t operations = 0;
+    sheet.BeginBatchUpdate();
+    try {
+        std::string_view group;
+        while (NextGroup(rest, group)) {
+            char op = 0;
+            Position pos;
+            while (ReadRaw(group, op) && ReadRaw(group, pos.row) && ReadRaw(group, pos.col)) {
+                if (op == OP_CLEAR) {
+                    sheet.ClearCell(pos);
+                } else if (op == OP_SHIFT) {
+                    // вместо строки и столбца - индекс и число строк (столбцов)
+                    std::uint8_t rows = 0;
+                    if (!ReadRaw(group, rows) || pos.col == 0) {
+                        throw JournalException("Corrupted journal record");
+                    }
+                    int index = pos.row;
+                    int count = pos.col;
+                    if (rows != 0 && count > 0) {
+                        sheet.InsertRows(index, count);
+                    } else if (rows != 0) {
+                        sheet.DeleteRows(index, -count);
+                    } else if (count > 0) {
+                        sheet.InsertCols(index, count);
+                    } else {
+                        sheet.DeleteCols(index, -count);
+                    }
+                } else if (op == OP_MOVE || op == OP_COPY) {
+                    // строка и столбец - левый верхний угол блока
+                    Range source{ pos, Position{} };
+                    Position target;
+                    if (!ReadRaw(group, source.to.row) || !ReadRaw(group, source.to.col) ||
+                        !ReadRaw(group, target.row) || !ReadRaw(group, target.col)) {
+                        throw JournalException("Corrupted journal record");
+                    }
+                    if (op == OP_MOVE) {
+                        sheet.MoveRange(source, target);
+                    } else {
+                        sheet.CopyRange(source, target);
+                    }
+                } else {
+                    std::uint32_t length = 0;
+                    if ((op != OP_SET && op != OP_FORMULA) || !ReadRaw(group, length) ||
+                        length > group.size()) {
+                        throw JournalException("Corrupted journal record");
+                    }
+                    std::string_view content = group.substr(0, length);
+                    group.remove_prefix(length);
+                    if (op == OP_SET) {
+                        sheet.SetCell(pos, std::string(content));
+                    } else {
+                        // формула в разобранном виде ставится так же, как при отмене
+                        EditHistory::CellState state;
+                        state.sheet = &sheet;
+                        state.pos = pos;
+                        state.exists = true;
+                        try {
+                            state.formula = DeserializeFormula(content);
+                        } catch (const FormulaException&) {
+                            throw JournalException("Corrupted journal record");
+                        }
+                        if (!pos.IsValid()) {
+                            throw JournalException("Corrupted journal record");
+                        }
+                        sheet.RestoreCell(state);
+                    }
+                }
+                ++operations;
+            }
+        }
+    } catch (...) {
+        sheet.EndBatchUpdate();
+        throw;
+    }
+    sheet.EndBatchUpdate();
+    return operations;
+}
+
+std::size_t Journal::Replay(const std::string& path, Sheet& sheet) {
+    std::string data;
+    if (!ReadFile(path, data) || data.empty()) {
+        return 0;
+    }
+    return ReplayData(data, sheet);
+}
+
+std::unique_ptr<Sheet> Journal::Recover(const std::string& snapshot_path,
+                                        const std::string& journal_path) {
+    std::unique_ptr<Sheet> sheet;
+    std::uint64_t snapshot_hash = 0;
+    std::string data;
+    if (ReadFile(snapshot_path, data) && !data.empty()) {
+        snapshot_hash = Fnv1a64(data);
+        sheet = LoadSnapshot(data);
+    } else {
+        sheet = std::make_unique<Sheet>();
+    }
+
+    // журнал без полного заголовка, отсутствующий или ведущийся поверх другого
+    // снимка (его операции уже в снимке) начинается заново поверх этого снимка,
+    // иначе новые правки допишутся в журнал, который Recover() не применит
+    std::string journal;
+    bool replayed = false;
+    if (ReadFile(journal_path, journal) && journal.size() >= HEADER_SIZE) {
+        std::string_view header(journal);
+        if (ReadHeader(header) == snapshot_hash) {
+            ReplayData(journal, *sheet);
+            replayed = true;
+        }
+    }
+    if (!replayed) {
+        WriteFileAtomically(journal_path, MakeHeader(snapshot_hash));
+    }
+    return sheet;
+}
+
+void Journal::Open(std::uint64_t base_hash, bool truncate) {
+    std::string data;
+    if (truncate || (ReadFile(path_, data) && !data.empty() && data.size() < HEADER_SIZE)) {
+        // новый журнал или журнал с оборванным заголовком
+        WriteFileAtomically(path_, MakeHeader(base_hash));
+        data.clear();
+    }
+    // оборванная или повреждённая группа в конце отрезается: иначе новые группы
+    // оказались бы за ней и воспроизведение, остановившись на ней, их потеряло бы
+    const std::size_t valid_size = data.empty() ? 0 : ValidJournalSize(data);
+    file_ = std::fopen(path_.c_str(), "ab");
+    if (file_ == nullptr) {
+        throw JournalException("Cannot open journal " + path_);
+    }
+    if (valid_size < data.size() && !TruncateFile(file_, valid_size)) {
+        std::fclose(file_);
+        file_ = nullptr;
+        throw JournalException("Cannot truncate journal " + path_);
+    }
+    std::fseek(file_, 0, SEEK_END);
+    if (std::ftell(file_) == 0) {
+        std::string header = MakeHeader(base_hash);
+        std::fwrite(header.data(), 1, header.size(), file_);
+        Sync();
+    }
+}
+
+void Journal::Sync() {
+    if (options_.sync == SyncPolicy::None) {
+        std::fflush(file_);
+    } else {
+        SyncFile(file_);
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Когда журнал сбрасывается на диск (fsync)
+enum class SyncPolicy {
+    None,           // группа передаётся ОС без fsync: переживает падение процесса,
+                    // но не системы
+    GroupCommit,    // fsync после каждой записанной группы операций
+    EveryOperation, // каждая операция - отдельная группа с fsync
+};
+
+struct JournalOptions {
+    SyncPolicy sync = SyncPolicy::GroupCommit;
+    std::size_t group_size = 256;   // операций в группе до автоматического Commit()
+};
+
+// Исключение, выбрасываемое при ошибках ввода-вывода журнала
+class JournalException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Журнал упреждающей записи операций SetCell()/ClearCell(), вставки и
+// удаления строк и столбцов, перемещения и копирования блоков.
+// Операции копятся в памяти и записываются группами (group commit): одна запись
+// в файл и, в зависимости от политики, один fsync на группу. Каждая группа
+// снабжена длиной и контрольной суммой, поэтому оборванная при падении
+// последняя группа при воспроизведении отбрасывается целиком, а при открытии
+// журнала отрезается, чтобы новые группы не оказались за ней.
+//
+// Формат: заголовок "SJNL", uint32 версия, uint64 хэш снимка, поверх которого
+// ведётся журнал (0 - пустая таблица); далее группы: uint32 длина, uint32
+// контрольная сумма, записи вида uint8 операция ('S' или 'C'), int32 строка,
+// int32 столбец и для 'S' uint32 длина и текст ячейки. Вставка и удаление
+// строк и столбцов - запись 'H': int32 индекс, int32 число (меньше нуля -
+// удаление) и uint8 1 для строк или 0 для столбцов (версия 2). Перемещение и
+// копирование блока - записи 'M' и 'P': int32 строка и столбец левого верхнего
+// и правого нижнего угла блока, затем места назначения (версия 3). Формула,
+// возвращённая отменой, - запись 'F': int32 строка, int32 столбец, uint32
+// длина и код формулы (FormulaInterface::Serialize(), версия 4).
+//
+// Типичное использование:
+//     auto sheet = Journal::Recover(snapshot_path, journal_path);
+//     Journal journal(journal_path);
+//     sheet->AttachJournal(&journal);
+//     ... правки ...
+//     journal.Compact(*sheet, snapshot_path);  // время от времени
+class Journal {
+public:
+    explicit Journal(std::string path, JournalOptions options = {});
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    void LogSet(Position pos, std::string_view text);
+    // Формула в разобранном виде: её текст может не разбираться заново (#REF!)
+    void LogFormula(Position pos, const FormulaInterface& formula);
+    void LogClear(Position pos);
+    void LogShift(const ReferenceShift& shift);
+    void LogMove(const Range& source, Position target);
+    void LogCopy(const Range& source, Position target);
+
+    // Записывает накопленную группу операций (и выполняет fsync по политике)
+    void Commit();
+
+    // Сворачивает журнал в снимок: атомарно заменяет snapshot_path снимком
+    // таблицы и начинает журнал заново поверх этого снимка
+    void Compact(const Sheet& sheet, const std::string& snapshot_path);
+
+    // Воспроизводит журнал на таблице одним пакетом изменений (инвалидация кэша
+    // откладывается до конца). Возвращает число применённых операций.
+    // Журнал к таблице на время воспроизведения подключать не нужно, иначе
+    // операции будут записаны в него повторно.
+    static std::size_t Replay(const std::string& path, Sheet& sheet);
+
+    // Восстанавливает таблицу: загружает снимок (если он есть) и воспроизводит
+    // журнал, если тот ведётся поверх именно этого снимка. Отсутствующий журнал
+    // или журнал поверх другого снимка начинается заново поверх загруженного,
+    // чтобы открытый после этого Journal дописывал операции к нужному снимку
+    static std::unique_ptr<Sheet> Recover(const std::string& snapshot_path,
+                                          const std::string& journal_path);
+
+private:
+    std::string path_;
+    JournalOptions options_;
+    std::FILE* file_ = nullptr;
+    std::string group_;                 // записи текущей группы
+    std::size_t group_operations_ = 0;
+
+    static std::size_t ReplayData(std::string_view data, Sheet& sheet);
+    void LogBlock(char op, const Range& source, Position target);
+    void LogOperation();
+    void Open(std::uint64_t base_hash, bool truncate);
+    void Sync();
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#define PROFILE_CONCAT_INTERNAL(X, Y) X##Y
+#define PROFILE_CONCAT(X, Y) PROFILE_CONCAT_INTERNAL(X, Y)
+#define UNIQUE_VAR_NAME_PROFILE PROFILE_CONCAT(profile_guard_, __LINE__)
+// Замер времени до конца текущей области видимости: LOG_DURATION("SUM"s);
+#define LOG_DURATION(x) LogDuration UNIQUE_VAR_NAME_PROFILE(x)
+
+// Выводит в std::cerr время жизни объекта
+class LogDuration {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit LogDuration(std::string id) :
+        id_(std::move(id)) {
+    }
+
+    ~LogDuration() {
+        using namespace std::chrono;
+        const auto dur = Clock::now() - start_time_;
+        std::cerr << id_ << ": " << duration_cast<milliseconds>(dur).count() << " ms" << std::endl;
+    }
+
+private:
+    const std::string id_;
+    const Clock::time_point start_time_ = Clock::now();
+};
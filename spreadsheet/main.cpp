@@ -3,6 +3,19 @@
 
 #include "FormulaAST.h"
 #include "formula.h"
+#include "importer.h"
+#include "ingest.h"
+#include "journal.h"
+#include "log_duration.h"
+#include "reduction.h"
+#include "sheet.h"
+#include "snapshot.h"
+#include "workbook.h"
+
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <thread>
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -19,7 +32,11 @@ inline std::ostream& operator<<(std::ostream& output, Size size) {
 inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
     std::visit(
         [&](const auto& x) {
-            output << x;
+            if constexpr (std::is_same_v<std::decay_t<decltype(x)>, bool>) {
+                output << LogicalToString(x);
+            } else {
+                output << x;
+            }
         },
         value);
     return output;
@@ -272,6 +289,1773 @@ void TestCache() {
     B1_value = sheet->GetCell("B1"_pos)->GetValue();
 }
 
+void TestImportDelimited() {
+    {
+        Sheet sheet;
+        std::istringstream in("1\tmeow\t=A1+C2\r\n\t2.5\n\t\t=A1*2");
+        ImportOptions options;
+        options.chunk_size = 4;     // запись длиннее блока - буфер должен вырасти
+        ImportStats stats = ImportDelimited(in, sheet, options);
+        ASSERT_EQUAL(stats.rows, 3u);
+        ASSERT_EQUAL(stats.cells, 5u);
+        ASSERT_EQUAL(stats.numbers, 2u);
+        ASSERT_EQUAL(stats.formulas, 2u);
+
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), "1\tmeow\t=A1+C2\n\t2.5\t\n\t\t=A1*2\n");
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(values.str(), "1\tmeow\t1\n\t2.5\t\n\t\t2\n");
+    }
+    {
+        Sheet sheet;
+        std::istringstream in("a,\"b,\"\"c\"\"\",\"multi\nline\"\n'=x,=");
+        ImportOptions options;
+        options.delimiter = ',';
+        options.origin = "B2"_pos;
+        ImportDelimited(in, sheet, options);
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "b,\"c\"");
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "multi\nline");
+        ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("B3"_pos)->GetValue()), "=x");
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=");
+    }
+    {
+        // поле с переводами строк длиннее блока чтения
+        Sheet sheet;
+        std::istringstream in("\"a\nb\"\"\nc\"\tx\n\"\n\"\ty");
+        ImportOptions options;
+        options.chunk_size = 3;
+        ImportStats stats = ImportDelimited(in, sheet, options);
+        ASSERT_EQUAL(stats.rows, 2u);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "a\nb\"\nc");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "x");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "\n");
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "y");
+    }
+    {
+        // ошибка в формуле или цикл не оставляют таблицу импортированной наполовину
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "old");
+        for (const char* data : { "new\t1\n=B2\t=A2", "new\t1\n=1+\t2" }) {
+            std::istringstream in(data);
+            try {
+                ImportDelimited(in, sheet);
+                ASSERT(false);
+            } catch (const CircularDependencyException&) {
+            } catch (const FormulaException&) {
+            }
+            ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "old");
+            ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+            ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+            ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+            ASSERT(!sheet.InTransaction());
+        }
+    }
+    {
+        // кавычка не в начале поля - обычный символ и не склеивает записи
+        Sheet sheet;
+        std::istringstream in("12\" pipe\tx\nA\tB\nC\tD\n");
+        ImportOptions options;
+        options.chunk_size = 5;
+        ImportStats stats = ImportDelimited(in, sheet, options);
+        ASSERT_EQUAL(stats.rows, 3u);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "12\" pipe");
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "D");
+    }
+    {
+        // числа - по правилам TextToNumber()
+        Sheet sheet;
+        std::istringstream in("-5\t1e3\t007\t0.5\t12.\t1.2.3\t0");
+        ImportStats stats = ImportDelimited(in, sheet);
+        ASSERT_EQUAL(stats.cells, 7u);
+        ASSERT_EQUAL(stats.numbers, 3u);
+    }
+}
+
+void TestSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "=A1*(3+A1)/-B5");
+    sheet.SetCell("B1"_pos, "'=text");
+    sheet.SetCell("B2"_pos, "=A2+1");
+    sheet.SetCell("C1"_pos, "=1/0");
+    sheet.SetCell("B5"_pos, "4");
+    sheet.GetCell("B2"_pos)->GetValue();
+
+    std::ostringstream out;
+    SaveSnapshot(sheet, out);
+    std::string data = out.str();
+
+    std::unique_ptr<Sheet> restored = LoadSnapshot(data);
+    ASSERT_EQUAL(restored->GetPrintableSize(), sheet.GetPrintableSize());
+    // значения восстановлены из снимка, пересчёт не нужен
+    ASSERT(static_cast<Cell*>(restored->GetCell("B2"_pos))->IsCacheValid());
+    ASSERT(!static_cast<Cell*>(restored->GetCell("C1"_pos))->IsCacheValid());
+
+    std::ostringstream texts, restored_texts, values, restored_values;
+    sheet.PrintTexts(texts);
+    restored->PrintTexts(restored_texts);
+    ASSERT_EQUAL(restored_texts.str(), texts.str());
+    sheet.PrintValues(values);
+    restored->PrintValues(restored_values);
+    ASSERT_EQUAL(restored_values.str(), values.str());
+
+    // граф зависимостей восстановлен: изменение входа сбрасывает кэш
+    restored->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(std::get<double>(restored->GetCell("B2"_pos)->GetValue()), 0.);
+
+    // если содержимое не соответствует штампу, значения отбрасываются
+    std::string stale = data;
+    stale[stale.find("'=text") + 2] = 'T';
+    restored = LoadSnapshot(stale);
+    ASSERT(!static_cast<Cell*>(restored->GetCell("B2"_pos))->IsCacheValid());
+
+    try {
+        LoadSnapshot(std::string_view(data).substr(0, data.size() / 2));
+        ASSERT(false);
+    } catch (const SnapshotException&) {
+    }
+
+    // штамп покрывает и сами значения
+    Sheet errors;
+    errors.SetCell("A1"_pos, "x");
+    errors.SetCell("B1"_pos, "=1/0");
+    errors.GetCell("B1"_pos)->GetValue();
+    std::ostringstream errors_out;
+    SaveSnapshot(errors, errors_out);
+    const std::string errors_data = errors_out.str();
+    stale = errors_data;
+    stale.back() = static_cast<char>(FormulaError::Category::Value);
+    restored = LoadSnapshot(stale);
+    ASSERT(!static_cast<Cell*>(restored->GetCell("B1"_pos))->IsCacheValid());
+    ASSERT(std::get<FormulaError>(restored->GetCell("B1"_pos)->GetValue()) ==
+           FormulaError(FormulaError::Category::Div0));
+
+    // неизвестная категория ошибки и повтор позиции ячейки - повреждение
+    std::string corrupted = errors_data;
+    corrupted.back() = 42;
+    try {
+        LoadSnapshot(corrupted);
+        ASSERT(false);
+    } catch (const SnapshotException&) {
+    }
+    // заголовок 24 байта, затем A1: строка, столбец, вид, длина и "x"; у второй
+    // ячейки столбец заменяется на столбец первой
+    corrupted = errors_data;
+    const std::size_t second_cell = 24 + 4 + 4 + 1 + 4 + 1;
+    corrupted.replace(second_cell + 4, 4, 4, '\0');
+    try {
+        LoadSnapshot(corrupted);
+        ASSERT(false);
+    } catch (const SnapshotException&) {
+    }
+
+    // печатная область (смещение 8 после "SSNP" и версии) - в пределах листа
+    // и не меньше области ячеек
+    for (std::int32_t rows : { -1, 0, Position::MAX_ROWS + 1 }) {
+        corrupted = errors_data;
+        corrupted.replace(8, sizeof(rows), reinterpret_cast<const char*>(&rows), sizeof(rows));
+        try {
+            LoadSnapshot(corrupted);
+            ASSERT(false);
+        } catch (const SnapshotException&) {
+        }
+    }
+
+    // рёбра должны совпадать со ссылками формул: ребро C1 -> A1 идёт перед
+    // штампом (8 байт) и значением невычисленной формулы (1 байт)
+    Sheet linked;
+    linked.SetCell("A1"_pos, "1");
+    linked.SetCell("B1"_pos, "2");
+    linked.SetCell("C1"_pos, "=A1");
+    std::ostringstream linked_out;
+    SaveSnapshot(linked, linked_out);
+    const std::string linked_data = linked_out.str();
+    const std::size_t edge = linked_data.size() - 1 - 8 - 16;
+    corrupted = linked_data;
+    corrupted[edge + 12] = 1;                      // C1 -> B1
+    try {
+        LoadSnapshot(corrupted);
+        ASSERT(false);
+    } catch (const SnapshotException&) {
+    }
+    corrupted = linked_data;
+    corrupted.erase(edge, 16);
+    corrupted.replace(20, 4, 4, '\0');            // число рёбер в заголовке
+    try {
+        LoadSnapshot(corrupted);
+        ASSERT(false);
+    } catch (const SnapshotException&) {
+    }
+    restored = LoadSnapshot(linked_data);
+    restored->SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(std::get<double>(restored->GetCell("C1"_pos)->GetValue()), 5.);
+}
+
+void TestPrintLarge() {
+    Sheet sheet;
+    const int size = 300;  // больше порога параллельного вывода
+    for (int row = 0; row < size; row += 3) {
+        for (int col = row % 7; col < size - 1; col += 2) {
+            Position pos{ row, col };
+            switch ((row + col) % 5) {
+            case 0: sheet.SetCell(pos, std::to_string(row * 1000.5 + col)); break;
+            case 1: sheet.SetCell(pos, "=" + std::to_string(row + 1) + "/" + std::to_string(col + 3)); break;
+            case 2: sheet.SetCell(pos, "=1e7*" + std::to_string(col) + "-0.000012345"); break;
+            case 3: sheet.SetCell(pos, "=1/0"); break;
+            default: sheet.SetCell(pos, "text"); break;
+            }
+        }
+    }
+    sheet.SetCell(Position{ size - 1, size - 1 }, "=-0*1");
+
+    std::ostringstream expected_values;
+    std::ostringstream expected_texts;
+    for (int row = 0; row < size; ++row) {
+        for (int col = 0; col < size; ++col) {
+            if (col > 0) {
+                expected_values << '\t';
+                expected_texts << '\t';
+            }
+            if (const CellInterface* cell = sheet.GetCell(Position{ row, col })) {
+                expected_values << cell->GetValue();
+                expected_texts << cell->GetText();
+            }
+        }
+        expected_values << '\n';
+        expected_texts << '\n';
+    }
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT(values.str() == expected_values.str());
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT(texts.str() == expected_texts.str());
+
+    // нестандартный формат потока учитывается
+    std::ostringstream precise;
+    precise.precision(10);
+    sheet.SetCell("A1"_pos, "=1/3");
+    sheet.PrintValues(precise);
+    ASSERT_EQUAL(precise.str().substr(0, 12), "0.3333333333");
+}
+
+void TestBatchUpdate() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "=B1*A1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2.);
+
+    sheet.BeginBatchUpdate();
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A1"_pos, "3");
+    sheet.EndBatchUpdate();
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 12.);
+
+    // заменённая формула больше не числится среди зависимых ячейки A1
+    sheet.SetCell("B1"_pos, "=7");
+    ASSERT_EQUAL(static_cast<Cell*>(sheet.GetCell("A1"_pos))->GetGraphReference().GetDependent().size(), 1u);
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 28.);
+}
+
+void TestPrintValuesSince() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "2");
+    sheet.SetCell("A2"_pos, "text");
+    sheet.SetCell("A3"_pos, "=A1*10");
+
+    std::ostringstream full;
+    std::uint64_t token = sheet.PrintValuesSince(0, full);
+    ASSERT_EQUAL(token, sheet.GetVersion());
+    ASSERT_EQUAL(full.str(), "@0\t" + std::to_string(token) + "\t3\t2\n1\t1\t2\n2\ttext\t\n3\t10\t\n");
+
+    // в патч попадает изменённая строка и строка зависимой формулы
+    sheet.SetCell("A1"_pos, "5");
+    std::ostringstream patch;
+    std::uint64_t next = sheet.PrintValuesSince(token, patch);
+    ASSERT_EQUAL(patch.str(), "@" + std::to_string(token) + "\t" + std::to_string(next) +
+                              "\t3\t2\n1\t5\t2\n3\t50\t\n");
+
+    std::ostringstream empty;
+    ASSERT_EQUAL(sheet.PrintValuesSince(next, empty), next);
+    ASSERT_EQUAL(empty.str(), "@" + std::to_string(next) + "\t" + std::to_string(next) + "\t3\t2\n");
+
+    // изменение печатной области выводит все строки
+    sheet.ClearCell("B1"_pos);
+    std::ostringstream resized;
+    sheet.PrintValuesSince(next, resized);
+    ASSERT_EQUAL(resized.str().substr(resized.str().find('\n') + 1), "1\t5\n2\ttext\n3\t50\n");
+}
+
+void TestConcurrentReads() {
+    // цепочка формул с общими входами: потоки одновременно заполняют кэш
+    Sheet sheet;
+    const int rows = 200;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1");
+    for (int row = 1; row < rows; ++row) {
+        sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+1");
+        sheet.SetCell(Position{ row, 1 }, "=B" + std::to_string(row) + "+A" + std::to_string(row + 1));
+    }
+    std::ostringstream expected;
+    for (int round = 0; round < 20; ++round) {
+        sheet.InvalidateCell("A1"_pos);
+
+        std::vector<std::string> printed(4);
+        std::vector<double> totals(4);
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 4; ++i) {
+            readers.emplace_back([&sheet, &printed, &totals, i] {
+                const Sheet& reader = sheet;
+                totals[i] = std::get<double>(reader.GetCell(Position{ rows - 1 - i, 1 })->GetValue());
+                std::ostringstream values;
+                reader.PrintValues(values);
+                printed[i] = values.str();
+            });
+        }
+        for (std::thread& reader : readers) {
+            reader.join();
+        }
+
+        if (round == 0) {
+            expected.str(printed[0]);
+        }
+        for (int i = 0; i < 4; ++i) {
+            double n = rows - i;
+            ASSERT_EQUAL(totals[i], n * (n + 1) / 2);
+            ASSERT_EQUAL(printed[i], expected.str());
+        }
+    }
+}
+
+void TestSheetSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("A3"_pos, "'=text");
+
+    auto first = sheet.Snapshot();
+    ASSERT_EQUAL(first->GetVersion(), sheet.GetVersion());
+
+    // изменения таблицы не видны в уже взятом снимке
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("C2"_pos, "x");
+    auto second = sheet.Snapshot();
+
+    ASSERT_EQUAL(std::get<double>(first->GetCell("B1"_pos)->value), 2.);
+    ASSERT(first->GetCell("C2"_pos) == nullptr);
+    ASSERT(first->GetPrintableSize() == (Size{ 3, 2 }));
+    std::ostringstream old_values;
+    first->PrintValues(old_values);
+    ASSERT_EQUAL(old_values.str(), "1\t2\n\t\n=text\t\n");
+
+    ASSERT_EQUAL(std::get<double>(second->GetCell("B1"_pos)->value), 10.);
+    ASSERT_EQUAL(second->GetCell("B1"_pos)->text, "=A1*2");
+    std::ostringstream texts;
+    second->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "5\t=A1*2\t\n\t\tx\n'=text\t\t\n");
+
+    // неизменённая строка разделяется между снимками
+    ASSERT_EQUAL(first->GetCell("A3"_pos), second->GetCell("A3"_pos));
+
+    // снимок читается в другом потоке, пока таблица меняется
+    std::string printed;
+    std::thread reader([second, &printed] {
+        std::ostringstream values;
+        second->PrintValues(values);
+        printed = values.str();
+    });
+    for (int i = 0; i < 100; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+    }
+    reader.join();
+    ASSERT_EQUAL(printed, "5\t10\t\n\t\tx\n=text\t\t\n");
+}
+
+void TestWorkbook() {
+    Workbook book;
+    Sheet& first = book.AddSheet("First");
+    Sheet& second = book.AddSheet("Second");
+
+    first.SetCell("A1"_pos, "2");
+    second.SetCell("B2"_pos, "=First!A1*10+Missing!A1");
+    ASSERT_EQUAL(second.GetCell("B2"_pos)->GetText(), "=First!A1*10+Missing!A1");
+    ASSERT(std::holds_alternative<FormulaError>(second.GetCell("B2"_pos)->GetValue()));
+
+    // ссылка на лист, добавленный позже, связывается с ним
+    Sheet& missing = book.AddSheet("Missing");
+    missing.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(std::get<double>(second.GetCell("B2"_pos)->GetValue()), 21.);
+
+    // изменение на одном листе сбрасывает кэш формул на другом
+    first.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(std::get<double>(second.GetCell("B2"_pos)->GetValue()), 31.);
+
+    // циклы через листы запрещены
+    try {
+        first.SetCell("A1"_pos, "=Second!B2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        first.SetCell("C1"_pos, "=First!C1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // отдельная таблица других листов не видит
+    Sheet alone;
+    alone.SetCell("A1"_pos, "=First!A1");
+    ASSERT(std::holds_alternative<FormulaError>(alone.GetCell("A1"_pos)->GetValue()));
+
+    try {
+        book.AddSheet("First");
+        ASSERT(false);
+    } catch (const WorkbookException&) {
+    }
+
+    // независимые листы пересчитываются параллельно
+    Sheet& island = book.AddSheet("Island");
+    island.SetCell("A1"_pos, "5");
+    island.SetCell("A2"_pos, "=A1*A1");
+    ASSERT_EQUAL(book.GetSheetGroups().size(), 2u);
+    book.Recalculate(4);
+    ASSERT(static_cast<Cell*>(island.GetCell("A2"_pos))->IsCacheValid());
+    ASSERT_EQUAL(std::get<double>(island.GetCell("A2"_pos)->GetValue()), 25.);
+
+    // после замены формулы листы снова независимы
+    second.SetCell("B2"_pos, "=1");
+    ASSERT_EQUAL(book.GetSheetGroups().size(), 4u);
+}
+
+void TestTransaction() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1");
+    sheet.SetCell("C1"_pos, "=A1+B1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2.);
+
+    // правки не видны до Commit() и пропадают при Rollback()
+    sheet.BeginTransaction();
+    sheet.SetCell("A1"_pos, "5");
+    sheet.ClearCell("C1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    sheet.Rollback();
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2.);
+
+    // циклы проверяются с учётом накопленных правок
+    sheet.BeginTransaction();
+    sheet.SetCell("D1"_pos, "=E1");
+    try {
+        sheet.SetCell("E1"_pos, "=D1+1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCell("A1"_pos, "=C1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCell("A2"_pos, "=1+");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    // цикл, который разрывает другая правка той же транзакции, допустим
+    sheet.SetCell("B1"_pos, "7");
+    sheet.SetCell("A1"_pos, "=B1*2");
+    sheet.SetCell("E1"_pos, "3");
+    sheet.Commit();
+
+    ASSERT(!sheet.InTransaction());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 14.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 21.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 3.);
+
+    // изменение входа после фиксации сбрасывает кэш
+    sheet.SetCell("B1"_pos, "1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 3.);
+}
+
+void TestIngestQueue() {
+    Sheet sheet;
+    {
+        // переполнение не блокирует, а отклоняет правку
+        IngestQueue queue(4);
+        for (int i = 0; i < 4; ++i) {
+            ASSERT(queue.TryPush("A1"_pos, std::to_string(i)));
+        }
+        ASSERT(!queue.TryPush("A1"_pos, "4"));
+        ASSERT(!queue.TryPushClear("B1"_pos));
+        ASSERT_EQUAL(queue.Drain(sheet), 4u);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "3");
+
+        IngestMetrics metrics = queue.GetMetrics();
+        ASSERT_EQUAL(metrics.pushed, 4u);
+        ASSERT_EQUAL(metrics.rejected, 2u);
+        ASSERT_EQUAL(metrics.coalesced, 3u);
+        ASSERT_EQUAL(metrics.depth, 0u);
+    }
+    {
+        // результат тот же, что у последовательных SetCell(): последняя правка
+        // A1 идёт после правки B1 и образует цикл, поэтому остаётся прежняя
+        Sheet ordered;
+        IngestQueue queue(8);
+        queue.TryPush("A1"_pos, "1");
+        queue.TryPush("B1"_pos, "=A1");
+        queue.TryPush("A1"_pos, "=B1");
+        ASSERT_EQUAL(queue.Drain(ordered), 3u);
+        ASSERT_EQUAL(ordered.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(ordered.GetCell("B1"_pos)->GetText(), "=A1");
+        IngestMetrics metrics = queue.GetMetrics();
+        ASSERT_EQUAL(metrics.failed, 1u);
+        ASSERT_EQUAL(metrics.coalesced, 0u);
+    }
+
+    // несколько производителей и поток вычислений, владеющий таблицей
+    IngestQueue queue(1024);
+    const int producers = 4;
+    const int updates = 5000;
+    sheet.SetCell("A2"_pos, "=A1+B1+C1+D1");
+    std::atomic<int> running{ producers };
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&queue, &running, p] {
+            for (int i = 1; i <= updates; ++i) {
+                while (!queue.TryPush(Position{ 0, p }, std::to_string(i))) {
+                    std::this_thread::yield();
+                }
+            }
+            --running;
+        });
+    }
+    while (running > 0 || queue.GetMetrics().depth > 0) {
+        if (queue.Drain(sheet) == 0) {
+            std::this_thread::yield();
+        }
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    queue.Drain(sheet);
+
+    // порядок правок одного производителя сохраняется
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 4. * updates);
+    IngestMetrics metrics = queue.GetMetrics();
+    ASSERT_EQUAL(metrics.pushed, static_cast<std::uint64_t>(producers * updates));
+    ASSERT_EQUAL(metrics.drained, metrics.pushed);
+    ASSERT_EQUAL(metrics.failed, 0u);
+    ASSERT(metrics.max_lag >= metrics.last_lag);
+}
+
+void TestFork() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "text");
+    for (int row = 1; row < 50; ++row) {
+        sheet.SetCell(Position{ row, 1 }, "=B" + std::to_string(row) + "+A1");
+    }
+    sheet.SetCell("B1"_pos, "=A1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B50"_pos)->GetValue()), 50.);
+
+    // копии получают вычисленные значения и общие формулы
+    auto fork = sheet.Fork();
+    ASSERT(static_cast<Cell*>(fork->GetCell("B50"_pos))->IsCacheValid());
+    ASSERT_EQUAL(static_cast<Cell*>(fork->GetCell("B50"_pos))->GetFormula(),
+                 static_cast<Cell*>(sheet.GetCell("B50"_pos))->GetFormula());
+    std::ostringstream parent_texts, fork_texts;
+    sheet.PrintTexts(parent_texts);
+    fork->PrintTexts(fork_texts);
+    ASSERT_EQUAL(fork_texts.str(), parent_texts.str());
+
+    // сценарии считаются параллельно и не влияют на исходную таблицу
+    std::vector<std::unique_ptr<Sheet>> scenarios;
+    for (int i = 0; i < 4; ++i) {
+        scenarios.push_back(sheet.Fork());
+    }
+    std::vector<double> results(scenarios.size());
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < scenarios.size(); ++i) {
+        threads.emplace_back([&scenarios, &results, i] {
+            scenarios[i]->SetCell("A1"_pos, std::to_string(i + 2));
+            results[i] = std::get<double>(scenarios[i]->GetCell("B50"_pos)->GetValue());
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (std::size_t i = 0; i < scenarios.size(); ++i) {
+        ASSERT_EQUAL(results[i], 50. * (i + 2));
+    }
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B50"_pos)->GetValue()), 50.);
+
+    // копия продолжает проверять циклы
+    try {
+        fork->SetCell("A1"_pos, "=B10");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // лист книги не копируется: копия не получала бы изменения других листов
+    Workbook book;
+    Sheet& first = book.AddSheet("First");
+    book.AddSheet("Second").SetCell("A1"_pos, "=First!A1");
+    try {
+        first.Fork();
+        ASSERT(false);
+    } catch (const std::logic_error&) {
+    }
+}
+
+void TestRangeSum() {
+    Sheet sheet;
+    for (int row = 0; row < 10; ++row) {
+        sheet.SetCell(Position{ row, 0 }, std::to_string(row + 1));
+    }
+    sheet.SetCell("B1"_pos, "=SUM(A1:A10)");
+    sheet.SetCell("B2"_pos, "=AVERAGE(A1:A10)");
+    sheet.SetCell("B3"_pos, "=COUNT(A1:B2, 7)");
+    sheet.SetCell("B4"_pos, "=SUM(A10:A1)/2+1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 55.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 5.5);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 5.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B4"_pos)->GetValue()), 28.5);
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), "=SUM(A1:A10)/2+1");
+
+    // изменение, очистка и текст в диапазоне сбрасывают кэш формул
+    sheet.SetCell("A5"_pos, "=A4*10");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 90.);
+    sheet.SetCell("A4"_pos, "text");
+    ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("B1"_pos)->GetValue()));
+    sheet.ClearCell("A5"_pos);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 46.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 46. / 8);
+    sheet.SetCell("A20"_pos, "100");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 46.);
+    sheet.SetCell("C1"_pos, "=SUM(A1:A20)");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 146.);
+    sheet.SetCell("D1"_pos, "=AVERAGE(E1:E3)");
+    ASSERT(std::get<FormulaError>(sheet.GetCell("D1"_pos)->GetValue()) ==
+           FormulaError(FormulaError::Category::Div0));
+
+    // циклы через диапазоны
+    try {
+        sheet.SetCell("A7"_pos, "=B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCell("A30"_pos, "=SUM(A29:A31)");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCell("A9"_pos, "=B4");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        ParseFormula("FOO(A1)");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+
+    // разобранная формула переживает снимок, индекс - загрузку и копирование
+    std::ostringstream snapshot;
+    SaveSnapshot(sheet, snapshot);
+    auto restored = LoadSnapshot(snapshot.str());
+    auto fork = sheet.Fork();
+    for (SheetInterface* copy : { static_cast<SheetInterface*>(restored.get()),
+                                  static_cast<SheetInterface*>(fork.get()) }) {
+        ASSERT_EQUAL(copy->GetCell("B1"_pos)->GetText(), "=SUM(A1:A10)");
+        copy->SetCell("A1"_pos, "11");
+        ASSERT_EQUAL(std::get<double>(copy->GetCell("B1"_pos)->GetValue()), 56.);
+    }
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 46.);
+
+    // отрезок не получает ошибку округления остальных значений столбца
+    Sheet precise;
+    const std::string huge = "100000000000000000000";     // 1e20
+    precise.SetCell("A1"_pos, "0.1");
+    precise.SetCell("A2"_pos, "0.2");
+    precise.SetCell("B1"_pos, "=SUM(A2:A2)=0.2");
+    ASSERT(std::get<bool>(precise.GetCell("B1"_pos)->GetValue()));
+    precise.SetCell("C1"_pos, huge);
+    precise.SetCell("C1"_pos, "1");
+    precise.SetCell("B2"_pos, "=SUM(C1:C1)");
+    ASSERT_EQUAL(std::get<double>(precise.GetCell("B2"_pos)->GetValue()), 1.);
+    precise.SetCell("D1"_pos, huge);
+    precise.SetCell("D3"_pos, "1");
+    precise.SetCell("D1000"_pos, "0");
+    precise.SetCell("B3"_pos, "=SUM(D2:D5)");
+    precise.SetCell("B4"_pos, "=SUM(D2:D999)");
+    ASSERT_EQUAL(std::get<double>(precise.GetCell("B3"_pos)->GetValue()), 1.);
+    ASSERT_EQUAL(std::get<double>(precise.GetCell("B4"_pos)->GetValue()), 1.);
+}
+
+void TestAggregateDelta() {
+    Sheet sheet;
+    const int rows = 1000;
+    double expected = 0.;
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+        expected += row;
+    }
+    sheet.SetCell("B1"_pos, "=SUM(A1:A1000)");
+    sheet.SetCell("B2"_pos, "=AVERAGE(A1:A1000)");
+    sheet.SetCell("B3"_pos, "=B1*2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), expected);
+
+    // поправки константами, в том числе сверх предела до полного пересчёта
+    for (int i = 0; i < 3 * RangeIndex::MAX_DELTA_UPDATES; ++i) {
+        int row = (i * 7) % rows;
+        double old_value = std::stod(sheet.GetCell(Position{ row, 0 })->GetText());
+        sheet.SetCell(Position{ row, 0 }, std::to_string(i % 10));
+        expected += (i % 10) - old_value;
+        if (i % 97 == 0) {
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), expected);
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), expected * 2);
+        }
+    }
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), expected);
+
+    // текст и очистка меняют число значений, формула в диапазоне - пересчёт
+    double old_value = std::stod(sheet.GetCell("A10"_pos)->GetText());
+    sheet.SetCell("A10"_pos, "text");
+    sheet.ClearCell("A11"_pos);
+    expected -= old_value;
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), expected / (rows - 2));
+    sheet.SetCell("A10"_pos, "=C1+1");
+    sheet.SetCell("C1"_pos, "41");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), expected + 42);
+    sheet.SetCell("C1"_pos, "1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), expected + 2);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), (expected + 2) / (rows - 1));
+
+    // накопленная поправками ошибка сбрасывается полным пересчётом по значениям:
+    // итог совпадает с суммой, посчитанной обходом
+    Sheet drift;
+    const int drift_rows = 100;
+    for (int row = 0; row < drift_rows; ++row) {
+        drift.SetCell(Position{ row, 0 }, "0.1");
+    }
+    drift.SetCell("B1"_pos, "=SUM(A1:A100)");
+    drift.GetCell("B1"_pos)->GetValue();
+    drift.SetCell("A1"_pos, "10000000000000000");           // 1e16 поглощает дробные части
+    for (int i = 1; i < RangeIndex::MAX_DELTA_UPDATES; ++i) {
+        // каждый проход по строкам меняет значение: каждая правка - поправка
+        const bool odd_pass = i / (drift_rows - 1) % 2 != 0;
+        drift.SetCell(Position{ 1 + i % (drift_rows - 1), 0 }, odd_pass ? "0.7" : "0.3");
+    }
+    drift.SetCell("A1"_pos, "0.1");                         // поправка сверх предела
+    double naive = 0.;
+    for (int row = 0; row < drift_rows; ++row) {
+        naive += std::stod(drift.GetCell(Position{ row, 0 })->GetText());
+    }
+    ASSERT_EQUAL(std::get<double>(drift.GetCell("B1"_pos)->GetValue()), naive);
+}
+
+void TestReductions() {
+    Sheet sheet;
+    for (int row = 0; row < 8; ++row) {
+        sheet.SetCell(Position{ row, 0 }, std::to_string(row + 1));
+        sheet.SetCell(Position{ row, 1 }, std::to_string(10 - row));
+    }
+    sheet.SetCell("A3"_pos, "text");        // не число: пропускается, в SUMPRODUCT - ноль
+    sheet.SetCell("B5"_pos, "=A5*3");       // формула в диапазоне
+    sheet.SetCell("C1"_pos, "=MIN(A1:B8)");
+    sheet.SetCell("C2"_pos, "=MAX(A1:B8, 20)");
+    sheet.SetCell("C3"_pos, "=SUMPRODUCT(A1:A8,B1:B8)");
+    sheet.SetCell("C4"_pos, "=SUMPRODUCT(A1:A8)");
+    sheet.SetCell("C5"_pos, "=SUMPRODUCT(A1:A2,B1:B2,A1:A2)");
+    sheet.SetCell("C6"_pos, "=MIN(D1:D5)");
+    sheet.SetCell("C7"_pos, "=SUMPRODUCT(A1:A8,B1:B7)");
+
+    double expected_product = 0.;
+    for (int row = 0; row < 8; ++row) {
+        double a = row == 2 ? 0. : row + 1;
+        double b = row == 4 ? 15. : 10 - row;
+        expected_product += a * b;
+    }
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 1.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C2"_pos)->GetValue()), 20.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C3"_pos)->GetValue()), expected_product);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C4"_pos)->GetValue()), 33.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C5"_pos)->GetValue()), 1. * 10 * 1 + 2. * 9 * 2);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C6"_pos)->GetValue()), 0.);
+    ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("C7"_pos)->GetValue()));
+
+    // значение формулы в диапазоне участвует в MIN/MAX и пересчитывается
+    sheet.SetCell("A5"_pos, "=-1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), -3.);
+    sheet.SetCell("A6"_pos, "=1/0");
+    ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("C2"_pos)->GetValue()));
+
+    // ядра совпадают с поэлементным расчётом, в том числе при делении на потоки
+    const std::size_t size = REDUCTION_PARALLEL_MIN_VALUES * 2 + 13;
+    std::vector<double> lhs(size), rhs(size);
+    double min = 1e9, max = -1e9, product = 0.;
+    for (std::size_t i = 0; i < size; ++i) {
+        // каждое пятое значение - пропуск
+        lhs[i] = i % 5 == 0 ? std::numeric_limits<double>::quiet_NaN()
+                            : static_cast<double>((i * 7919) % 1000) - 500.;
+        rhs[i] = static_cast<double>(i % 3);
+        if (i % 5 != 0) {
+            min = std::min(min, lhs[i]);
+            max = std::max(max, lhs[i]);
+            product += lhs[i] * rhs[i];
+        }
+    }
+    std::vector<ReductionSegment> segments = {
+        ReductionSegment{ lhs.data(), rhs.data(), 100 },
+        ReductionSegment{ lhs.data() + 100, rhs.data() + 100, size - 100 },
+    };
+    RangeExtrema extrema = ReduceExtrema(segments);
+    ASSERT_EQUAL(extrema.min, min);
+    ASSERT_EQUAL(extrema.max, max);
+    ASSERT_EQUAL(extrema.count, size - (size + 4) / 5);
+    ASSERT_EQUAL(ReduceProduct(segments), product);
+}
+
+void TestLookups() {
+    Sheet sheet;
+    for (int row = 0; row < 6; ++row) {
+        sheet.SetCell(Position{ row, 0 }, std::to_string((row + 1) * 10));
+        sheet.SetCell(Position{ row, 1 }, std::to_string(row + 1));
+    }
+    sheet.SetCell("A7"_pos, "=A1+5");       // формула в столбце ключей: 15
+    sheet.SetCell("D1"_pos, "=MATCH(30,A1:A7,0)");
+    sheet.SetCell("D2"_pos, "=MATCH(35,A1:A7)");
+    sheet.SetCell("D3"_pos, "=VLOOKUP(40,A1:B7,2,0)");
+    sheet.SetCell("D4"_pos, "=VLOOKUP(15,A1:B7,1,0)");
+    sheet.SetCell("D5"_pos, "=MATCH(5,A1:A7)");
+    sheet.SetCell("D6"_pos, "=INDEX(A1:B7,2,2)");
+    sheet.SetCell("D7"_pos, "=INDEX(A1:A7,4)+INDEX(A1:B1,2)");
+    sheet.SetCell("D8"_pos, "=VLOOKUP(40,A1:B7,3,0)");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 3.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D2"_pos)->GetValue()), 3.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D3"_pos)->GetValue()), 4.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D4"_pos)->GetValue()), 15.);
+    ASSERT(std::get<FormulaError>(sheet.GetCell("D5"_pos)->GetValue()) ==
+           FormulaError(FormulaError::Category::NA));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D6"_pos)->GetValue()), 2.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D7"_pos)->GetValue()), 41.);
+    ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("D8"_pos)->GetValue()));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=MATCH(30,A1:A7,0)"s);
+
+    try {
+        sheet.SetCell("E1"_pos, "=MATCH(1)");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+
+    // индексы поиска уже построены и поддерживаются при изменении ячеек
+    sheet.SetCell("A3"_pos, "33");
+    ASSERT(std::get<FormulaError>(sheet.GetCell("D1"_pos)->GetValue()) ==
+           FormulaError(FormulaError::Category::NA));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D2"_pos)->GetValue()), 3.);
+    sheet.SetCell("A5"_pos, "30");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 5.);
+    sheet.SetCell("A2"_pos, "30");          // из равных точный поиск берёт первое
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 2.);
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 5.);
+    sheet.SetCell("A1"_pos, "20");          // формула A7 становится 25
+    ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("D4"_pos)->GetValue()));
+    sheet.SetCell("A1"_pos, "10");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D4"_pos)->GetValue()), 15.);
+
+    // индексы совпадают с обходом ячеек после произвольных правок
+    for (int step = 0; step < 300; ++step) {
+        Position pos{ (step * 5) % 6, 0 };    // A7 остаётся формулой
+        if (step % 11 == 0) {
+            sheet.ClearCell(pos);
+        } else if (step % 13 == 0) {
+            sheet.SetCell(pos, "text");
+        } else {
+            sheet.SetCell(pos, std::to_string((step * 37) % 60));
+        }
+        const Range keys{ "A1"_pos, "A7"_pos };
+        for (double value : { 0., 15., 30., 45., 59. }) {
+            for (LookupMode mode : { LookupMode::Exact, LookupMode::LessOrEqual }) {
+                ASSERT(sheet.LookupValue(keys, value, mode) ==
+                       sheet.SheetInterface::LookupValue(keys, value, mode));
+            }
+        }
+    }
+}
+
+void TestConditionals() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("A2"_pos, "=A1>3");
+    sheet.SetCell("A3"_pos, "=IF(A1<>5,1/0,A1*2)");     // ошибка в невыбранной ветви
+    sheet.SetCell("A4"_pos, "=AND(A1>=5,TRUE)+OR(FALSE,A1=4)");
+    sheet.SetCell("A5"_pos, "=CHOOSE(2,1/0,A1+1,1/0)");
+    sheet.SetCell("A6"_pos, "=CHOOSE(4,1,2)");
+    sheet.SetCell("A7"_pos, "=OR(A1<10,A6)");            // A6 не вычисляется
+    sheet.SetCell("A8"_pos, "=1+2<4-1");
+    ASSERT(std::get<bool>(sheet.GetCell("A2"_pos)->GetValue()));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 10.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A4"_pos)->GetValue()), 1.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A5"_pos)->GetValue()), 6.);
+    ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("A6"_pos)->GetValue()));
+    ASSERT(std::get<bool>(sheet.GetCell("A7"_pos)->GetValue()));
+    ASSERT(!std::get<bool>(sheet.GetCell("A8"_pos)->GetValue()));
+    ASSERT_EQUAL(sheet.GetCell("A8"_pos)->GetText(), "=1+2<4-1"s);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=AND(A1>=5,TRUE)+OR(FALSE,A1=4)"s);
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT(values.str().find("TRUE") != std::string::npos);
+
+    // логическое значение сохраняется в байт-коде формулы
+    auto formula = ParseFormula("IF(A1<=2,TRUE,FALSE)");
+    auto restored = DeserializeFormula(formula->Serialize());
+    ASSERT_EQUAL(restored->GetExpression(), "IF(A1<=2,TRUE,FALSE)"s);
+    ASSERT(!std::get<bool>(restored->Evaluate(sheet)));
+
+    // динамические зависимости: невыбранная ветвь не сбрасывает кэш
+    sheet.SetDynamicDependencies(true);
+    sheet.SetCell("B1"_pos, "1");
+    sheet.SetCell("B2"_pos, "100");
+    sheet.SetCell("B3"_pos, "200");
+    sheet.SetCell("C1"_pos, "=IF(B1,B2,B3+1)");
+    sheet.SetCell("C2"_pos, "=C1*2");
+    sheet.SetCell("C3"_pos, "=IF(B1,SUM(B2:B2),SUM(B3:B3))");
+    const Cell* c1 = static_cast<const Cell*>(sheet.GetCell("C1"_pos));
+    const Cell* c2 = static_cast<const Cell*>(sheet.GetCell("C2"_pos));
+    const Cell* c3 = static_cast<const Cell*>(sheet.GetCell("C3"_pos));
+    ASSERT_EQUAL(std::get<double>(c2->GetValue()), 200.);
+    ASSERT_EQUAL(std::get<double>(c3->GetValue()), 100.);
+    sheet.SetCell("B3"_pos, "300");
+    ASSERT(c1->IsCacheValid() && c2->IsCacheValid() && c3->IsCacheValid());
+    sheet.SetCell("B2"_pos, "150");
+    ASSERT(!c1->IsCacheValid() && !c2->IsCacheValid() && !c3->IsCacheValid());
+    ASSERT_EQUAL(std::get<double>(c2->GetValue()), 300.);
+    ASSERT_EQUAL(std::get<double>(c3->GetValue()), 150.);
+    sheet.SetCell("B1"_pos, "=0");
+    ASSERT_EQUAL(std::get<double>(c2->GetValue()), 602.);
+    ASSERT_EQUAL(std::get<double>(c3->GetValue()), 300.);
+    sheet.SetCell("B2"_pos, "1");
+    ASSERT(c1->IsCacheValid() && c3->IsCacheValid());
+    sheet.SetCell("B3"_pos, "1");
+    ASSERT_EQUAL(std::get<double>(c2->GetValue()), 4.);
+    ASSERT_EQUAL(std::get<double>(c3->GetValue()), 1.);
+}
+
+void TestInsertDelete() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.SetCell("B1"_pos, "=A1+A3");
+    sheet.SetCell("B2"_pos, "=SUM(A1:A3)");
+    sheet.SetCell("C5"_pos, "=A2*10");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 6.);
+
+    // вставка внутрь диапазона его расширяет
+    sheet.InsertRows(1);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+A4"s);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=SUM(A1:A4)"s);
+    ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetText(), "=A3*10"s);
+    ASSERT(sheet.GetCell("C5"_pos) == nullptr);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C6"_pos)->GetValue()), 20.);
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("C6"_pos))->GetPosition() == "C6"_pos);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 6, 3 }));
+    sheet.SetCell("A2"_pos, "5");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 11.);
+    sheet.SetCell("A3"_pos, "7");       // граф переехал вместе с ячейками
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C6"_pos)->GetValue()), 70.);
+
+    // ссылки на удалённые ячейки становятся #REF!, диапазоны сжимаются
+    sheet.SetCell("D10"_pos, "=A1*2");
+    sheet.DeleteRows(0);
+    ASSERT_EQUAL(sheet.GetCell("D9"_pos)->GetText(), "=#REF!*2"s);
+    ASSERT(std::get<FormulaError>(sheet.GetCell("D9"_pos)->GetValue()) ==
+           FormulaError(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=SUM(A1:A3)"s);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 15.);
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=A2*10"s);
+    sheet.SetCell("A2"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C5"_pos)->GetValue()), 40.);
+
+    // столбцы; диапазон, удалённый целиком, тоже #REF!
+    sheet.InsertCols(0, 2);
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "=SUM(C1:C3)"s);
+    ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetText(), "=C2*10"s);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D2"_pos)->GetValue()), 12.);
+    sheet.DeleteCols(0, 3);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=SUM(#REF!)"s);
+    ASSERT(std::get<FormulaError>(sheet.GetCell("A2"_pos)->GetValue()) ==
+           FormulaError(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=#REF!*10"s);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 9, 3 }));
+
+    // формула с #REF! сохраняется в снимке
+    std::ostringstream snapshot;
+    SaveSnapshot(sheet, snapshot);
+    auto restored = LoadSnapshot(snapshot.str());
+    ASSERT_EQUAL(restored->GetCell("A2"_pos)->GetText(), "=SUM(#REF!)"s);
+    ASSERT_EQUAL(restored->GetCell("C9"_pos)->GetText(), "=#REF!*2"s);
+
+    // вставка не вытесняет ячейки за пределы листа
+    sheet.SetCell(Position{ Position::MAX_ROWS - 1, 0 }, "last");
+    try {
+        sheet.InsertRows(0);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+
+    // ссылки других листов книги
+    Workbook book;
+    Sheet& first = book.AddSheet("First");
+    Sheet& second = book.AddSheet("Second");
+    first.SetCell("B2"_pos, "4");
+    second.SetCell("A1"_pos, "=First!B2+1");
+    ASSERT_EQUAL(std::get<double>(second.GetCell("A1"_pos)->GetValue()), 5.);
+    first.InsertRows(0);
+    ASSERT_EQUAL(second.GetCell("A1"_pos)->GetText(), "=First!B3+1"s);
+    first.SetCell("B3"_pos, "6");
+    ASSERT_EQUAL(std::get<double>(second.GetCell("A1"_pos)->GetValue()), 7.);
+    first.DeleteRows(2);
+    ASSERT_EQUAL(second.GetCell("A1"_pos)->GetText(), "=First!#REF!+1"s);
+    ASSERT(std::holds_alternative<FormulaError>(second.GetCell("A1"_pos)->GetValue()));
+    ASSERT_EQUAL(book.GetSheetGroups().size(), 2u);
+}
+
+void TestMoveCopy() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.SetCell("B2"_pos, "10");
+    sheet.SetCell("C1"_pos, "=SUM(A1:A2)");
+    sheet.SetCell("D1"_pos, "=B1*2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 6.);
+
+    // ссылки на ячейки блока и диапазоны внутри него переезжают вместе с ним
+    sheet.MoveRange(Range{ "A1"_pos, "B2"_pos }, "D4"_pos);
+    ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("E4"_pos)->GetText(), "=D4+D5"s);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(D4:D5)"s);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=E4*2"s);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 5 }));
+    sheet.SetCell("D4"_pos, "5");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 14.);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 7.);
+
+    // блок перекрывает своё старое место; ссылка на замещённую ячейку - #REF!
+    sheet.SetCell("E6"_pos, "3");
+    sheet.SetCell("G6"_pos, "=E6+1");
+    sheet.MoveRange(Range{ "D4"_pos, "E5"_pos }, "D5"_pos);
+    ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetText(), "=D5+D6"s);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(D5:D6)"s);
+    ASSERT_EQUAL(sheet.GetCell("G6"_pos)->GetText(), "=#REF!+1"s);
+    ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("G6"_pos)->GetValue()));
+    ASSERT_EQUAL(sheet.GetCell("E6"_pos)->GetText(), "10"s);
+    sheet.SetCell("D6"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 18.);
+
+    // копия формулы получает сдвинутые относительные ссылки
+    sheet.SetCell("A10"_pos, "3");
+    sheet.SetCell("A11"_pos, "4");
+    sheet.SetCell("B10"_pos, "=A10*2");
+    sheet.CopyRange(Range{ "A10"_pos, "B10"_pos }, "A12"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B12"_pos)->GetText(), "=A12*2"s);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B12"_pos)->GetValue()), 6.);
+    sheet.CopyRange(Range{ "B10"_pos, "B10"_pos }, "B11"_pos);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B11"_pos)->GetValue()), 8.);
+    sheet.SetCell("A11"_pos, "6");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B11"_pos)->GetValue()), 12.);
+    sheet.CopyRange(Range{ "B10"_pos, "B10"_pos }, "A13"_pos);
+    ASSERT_EQUAL(sheet.GetCell("A13"_pos)->GetText(), "=#REF!*2"s);
+    // пустая ячейка блока очищает место назначения
+    sheet.CopyRange(Range{ "C10"_pos, "C10"_pos }, "B11"_pos);
+    ASSERT(sheet.GetCell("B11"_pos) == nullptr);
+    {
+        // как при ClearCell(): ячейка удаляется, печатная область сжимается,
+        // а ячейка, на которую ссылается формула, остаётся пустой заглушкой
+        Sheet cleared;
+        cleared.SetCell("A1"_pos, "x");
+        cleared.SetCell("B3"_pos, "y");
+        cleared.CopyRange(Range{ "Z9"_pos, "Z9"_pos }, "B3"_pos);
+        ASSERT(cleared.GetCell("B3"_pos) == nullptr);
+        ASSERT_EQUAL(cleared.GetPrintableSize(), (Size{ 1, 1 }));
+        cleared.SetCell("B3"_pos, "y");
+        cleared.SetCell("C1"_pos, "=B3");
+        cleared.CopyRange(Range{ "Z9"_pos, "Z9"_pos }, "B3"_pos);
+        ASSERT_EQUAL(cleared.GetCell("B3"_pos)->GetText(), ""s);
+        ASSERT_EQUAL(std::get<double>(cleared.GetCell("C1"_pos)->GetValue()), 0.);
+        Sheet twin;
+        twin.SetCell("A1"_pos, "x");
+        twin.SetCell("B3"_pos, "y");
+        twin.SetCell("C1"_pos, "=B3");
+        twin.ClearCell("B3"_pos);
+        ASSERT_EQUAL(cleared.GetPrintableSize(), twin.GetPrintableSize());
+    }
+
+    // копия, замыкающая цикл, не заносится
+    sheet.SetCell("A20"_pos, "=B21");
+    sheet.SetCell("B22"_pos, "=A21");
+    try {
+        sheet.CopyRange(Range{ "A20"_pos, "A20"_pos }, "A21"_pos);
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A21"_pos)->GetText(), ""s);
+
+    // ссылки других листов книги
+    Workbook book;
+    Sheet& first = book.AddSheet("First");
+    Sheet& second = book.AddSheet("Second");
+    first.SetCell("A1"_pos, "7");
+    second.SetCell("A1"_pos, "=First!A1+1");
+    first.MoveRange(Range{ "A1"_pos, "A1"_pos }, "C3"_pos);
+    ASSERT_EQUAL(second.GetCell("A1"_pos)->GetText(), "=First!C3+1"s);
+    first.SetCell("C3"_pos, "9");
+    ASSERT_EQUAL(std::get<double>(second.GetCell("A1"_pos)->GetValue()), 10.);
+
+    // журнал воспроизводит перемещение и копирование
+    const std::string journal_path = "test_move_journal.bin";
+    std::remove(journal_path.c_str());
+    {
+        Sheet logged;
+        Journal journal(journal_path);
+        logged.AttachJournal(&journal);
+        logged.SetCell("A1"_pos, "2");
+        logged.SetCell("B1"_pos, "=A1*3");
+        logged.MoveRange(Range{ "A1"_pos, "B1"_pos }, "B2"_pos);
+        logged.CopyRange(Range{ "B2"_pos, "C2"_pos }, "B3"_pos);
+        logged.AttachJournal(nullptr);
+    }
+    Sheet replayed;
+    ASSERT_EQUAL(Journal::Replay(journal_path, replayed), 4u);
+    ASSERT_EQUAL(replayed.GetCell("C3"_pos)->GetText(), "=B3*3"s);
+    ASSERT_EQUAL(std::get<double>(replayed.GetCell("C2"_pos)->GetValue()), 6.);
+    std::remove(journal_path.c_str());
+}
+
+void TestUndoRedo() {
+    Sheet sheet;
+    ASSERT(!sheet.Undo());
+    sheet.SetHistoryLimit(1 << 20);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 3.);
+
+    // отмена возвращает прежние значения формул без пересчёта
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 11.);
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1"s);
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("C1"_pos))->IsCacheValid());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 3.);
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 11.);
+    ASSERT(!sheet.Redo());
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 10.);
+
+    // новая правка очищает стек повтора
+    sheet.SetCell("D1"_pos, "x");
+    ASSERT(!sheet.Redo());
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+
+    // пакет и транзакция - один шаг
+    sheet.BeginBatchUpdate();
+    sheet.SetCell("A2"_pos, "7");
+    sheet.SetCell("A3"_pos, "=A2+A1");
+    sheet.EndBatchUpdate();
+    sheet.BeginTransaction();
+    sheet.SetCell("A1"_pos, "3");
+    sheet.ClearCell("A2"_pos);
+    sheet.Commit();
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 3.);
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 12.);
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT(sheet.GetCell("A3"_pos) == nullptr);
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 12.);
+    ASSERT(sheet.Undo());
+
+    // удаление строки: ячейки и ссылки на них возвращаются
+    sheet.SetCell("D5"_pos, "=B1+1");
+    sheet.DeleteRows(0);
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetText(), "=#REF!+1"s);
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetText(), "=B1+1"s);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D5"_pos)->GetValue()), 11.);
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D5"_pos)->GetValue()), 9.);
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D5"_pos)->GetValue()), 9.);
+
+    // вставка, перемещение и копирование
+    sheet.InsertCols(0);
+    ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetText(), "=C1+1"s);
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetText(), "=B1+1"s);
+    sheet.MoveRange(Range{ "A1"_pos, "B1"_pos }, "A10"_pos);
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetText(), "=B10+1"s);
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("A10"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*2"s);
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetText(), "=B1+1"s);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D5"_pos)->GetValue()), 9.);
+    sheet.CopyRange(Range{ "B1"_pos, "B1"_pos }, "B2"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A2*2"s);
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+
+    // бюджет памяти вытесняет старые шаги
+    Sheet bounded;
+    bounded.SetHistoryLimit(4096);
+    for (int i = 0; i < 1000; ++i) {
+        bounded.SetCell(Position{ i, 0 }, std::to_string(i));
+    }
+    ASSERT(bounded.GetHistoryMemoryUsage() <= 4096u);
+    int undone = 0;
+    while (bounded.Undo()) {
+        ++undone;
+    }
+    ASSERT(undone > 0 && undone < 1000);
+    ASSERT_EQUAL(bounded.GetCell(Position{ 999 - undone, 0 })->GetText(), std::to_string(999 - undone));
+}
+
+void TestSubscriptions() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    std::vector<std::vector<CellChange>> received;
+    int id = sheet.Subscribe(Range{ "A1"_pos, "C3"_pos }, [&received](const std::vector<CellChange>& changes) {
+        received.push_back(changes);
+    });
+
+    // правка и пересчитанная формула - одна рассылка в порядке позиций
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(received.size(), 1u);
+    ASSERT_EQUAL(received[0].size(), 2u);
+    ASSERT(received[0][0].pos == "A1"_pos && received[0][1].pos == "B1"_pos);
+    ASSERT_EQUAL(std::get<double>(received[0][1].old_value), 2.);
+    ASSERT_EQUAL(std::get<double>(received[0][1].new_value), 6.);
+    ASSERT(sheet.HasChanges(Range{ "B1"_pos, "B1"_pos }));
+    ASSERT(!sheet.HasChanges(Range{ "A2"_pos, "Z100"_pos }));
+
+    // правки, не изменившие значения, и вернувшие прежнее значение в пакете
+    sheet.SetCell("B1"_pos, "=A1+A1");
+    ASSERT_EQUAL(received.size(), 1u);
+    sheet.BeginBatchUpdate();
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("A1"_pos, "3");
+    sheet.EndBatchUpdate();
+    ASSERT_EQUAL(received.size(), 1u);
+
+    // изменения за пределами подписки не рассылаются, но отмечаются
+    sheet.SetCell("D4"_pos, "x");
+    ASSERT_EQUAL(received.size(), 1u);
+    ASSERT(sheet.HasChanges(Range{ "D4"_pos, "D4"_pos }));
+
+    // очистка и сдвиг строк
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(received.size(), 2u);
+    ASSERT_EQUAL(std::get<std::string>(received[1][0].new_value), ""s);
+    ASSERT_EQUAL(std::get<double>(received[1][1].new_value), 0.);
+    sheet.SetCell("C2"_pos, "7");
+    sheet.InsertRows(0);
+    ASSERT_EQUAL(received.size(), 4u);
+    ASSERT_EQUAL(received[3].size(), 4u);
+    ASSERT(received[3][0].pos == "B1"_pos && received[3][1].pos == "B2"_pos &&
+           received[3][2].pos == "C2"_pos && received[3][3].pos == "C3"_pos);
+    ASSERT_EQUAL(std::get<std::string>(received[3][2].old_value), "7"s);
+    ASSERT_EQUAL(std::get<std::string>(received[3][3].new_value), "7"s);
+
+    // подписка на ячейку другого листа книги
+    Workbook book;
+    Sheet& first = book.AddSheet("First");
+    Sheet& second = book.AddSheet("Second");
+    second.SetCell("A1"_pos, "=First!A1+1");
+    std::vector<CellChange> remote;
+    second.Subscribe("A1"_pos, [&remote](const std::vector<CellChange>& changes) {
+        remote.insert(remote.end(), changes.begin(), changes.end());
+    });
+    first.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(remote.size(), 1u);
+    ASSERT_EQUAL(std::get<double>(remote[0].old_value), 1.);
+    ASSERT_EQUAL(std::get<double>(remote[0].new_value), 5.);
+
+    ASSERT(sheet.Unsubscribe(id));
+    ASSERT(!sheet.Unsubscribe(id));
+    sheet.SetCell("A1"_pos, "9");
+    ASSERT_EQUAL(received.size(), 4u);
+    ASSERT(!sheet.HasChanges(Range{ "A1"_pos, "A1"_pos }));
+
+    // исключение подписчика выходит из операции уже после её завершения, и
+    // остальные подписки свои изменения получают
+    int failing = sheet.Subscribe("A1"_pos, [](const std::vector<CellChange>&) {
+        throw std::runtime_error("subscriber failed");
+    });
+    int delivered = 0;
+    sheet.Subscribe("A1"_pos, [&delivered](const std::vector<CellChange>&) {
+        ++delivered;
+    });
+    try {
+        sheet.SetCell("A1"_pos, "10");
+        ASSERT(false);
+    } catch (const std::runtime_error&) {
+    }
+    ASSERT_EQUAL(delivered, 1);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "10"s);
+    ASSERT(sheet.Unsubscribe(failing));
+    sheet.SetCell("A1"_pos, "11");
+    ASSERT_EQUAL(delivered, 2);
+
+    // подписки на ячейки одной плитки получают только свои изменения, в том
+    // числе на границах плитки
+    Sheet tiled;
+    const int size = ChangeSubscriptions::TILE_SIZE;
+    std::vector<std::vector<Position>> seen(size);
+    for (int i = 0; i < size; ++i) {
+        tiled.Subscribe(Position{ i, size - 1 - i }, [&seen, i](const std::vector<CellChange>& changes) {
+            for (const CellChange& change : changes) {
+                seen[i].push_back(change.pos);
+            }
+        });
+    }
+    tiled.BeginBatchUpdate();
+    for (int i = 0; i < size; i += 3) {
+        tiled.SetCell(Position{ i, size - 1 - i }, "1");
+        tiled.SetCell(Position{ i, i }, "2");
+    }
+    tiled.EndBatchUpdate();
+    for (int i = 0; i < size; ++i) {
+        ASSERT_EQUAL(seen[i].size(), i % 3 == 0 ? 1u : 0u);
+        if (!seen[i].empty()) {
+            ASSERT_EQUAL(seen[i][0], (Position{ i, size - 1 - i }));
+        }
+    }
+}
+
+void TestRecalculate() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < 200; ++row) {
+        sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+1");
+        sheet.SetCell(Position{ row, 1 }, "=A1*" + std::to_string(row));
+    }
+    auto is_valid = [&sheet](Position pos) {
+        return static_cast<const Cell*>(sheet.GetCell(pos))->IsCacheValid();
+    };
+
+    // сначала входы области, затем остальные формулы в пределах бюджета
+    RecalcBudget budget;
+    budget.max_formulas = 50;
+    RecalcProgress progress = sheet.Recalculate(Range{ "B10"_pos, "B10"_pos }, budget);
+    ASSERT(progress.region_ready && !progress.complete);
+    ASSERT_EQUAL(progress.evaluated, 50u);
+    ASSERT(is_valid("B10"_pos));
+    ASSERT(!is_valid("B200"_pos));
+
+    // цепочка длиннее бюджета готовится за несколько шагов
+    int steps = 1;
+    for (progress = sheet.Recalculate(Range{ "A200"_pos, "A200"_pos }, budget); !progress.region_ready;
+         progress = sheet.Recalculate(Range{ "A200"_pos, "A200"_pos }, budget)) {
+        ++steps;
+    }
+    ASSERT(steps > 1);
+    ASSERT(is_valid("A200"_pos));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A200"_pos)->GetValue()), 200.);
+
+    // отмена прерывает шаг до вычислений, следующий шаг продолжает обход
+    std::atomic<bool> cancel{ true };
+    budget.cancel = &cancel;
+    progress = sheet.Recalculate(budget);
+    ASSERT(!progress.complete);
+    ASSERT_EQUAL(progress.evaluated, 0u);
+    cancel = false;
+    budget.max_formulas = 10;
+    do {
+        progress = sheet.Recalculate(budget);
+        ASSERT(progress.evaluated <= 10u);
+    } while (!progress.complete);
+    ASSERT(is_valid("B200"_pos));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B200"_pos)->GetValue()), 199.);
+
+    // правка сбрасывает кэш - обход начинается сначала
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT(!is_valid("B2"_pos));
+    progress = sheet.Recalculate();
+    ASSERT(progress.complete);
+    ASSERT_EQUAL(progress.evaluated, 398u);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A200"_pos)->GetValue()), 201.);
+    try {
+        sheet.Recalculate(Range{ "B2"_pos, "A1"_pos });
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestBulkRead() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("B2"_pos, "=1/0");
+    sheet.SetCell("C2"_pos, "=A1<2");
+    sheet.SetCell("B3"_pos, "2.5");
+    sheet.SetCell("Z100"_pos, "far");
+
+    std::vector<Position> visited;
+    sheet.ForEachCell(Range{ "A1"_pos, "C4"_pos }, [&visited](Position pos, const Cell& cell) {
+        ASSERT(cell.GetPosition() == pos);
+        visited.push_back(pos);
+    });
+    ASSERT_EQUAL(visited.size(), 6u);
+    ASSERT(visited.front() == "A1"_pos && visited.back() == "B3"_pos);
+
+    // область шире хранимых ячеек: за их пределами - нули
+    double out[12];
+    std::uint8_t mask[12];
+    std::fill(std::begin(out), std::end(out), -1.);
+    ASSERT_EQUAL(sheet.ReadNumbers(Range{ "A1"_pos, "C4"_pos }, out, mask), 3u);
+    const double expected[12] = { 1., 0., 0., 2., 0., 0., 0., 2.5, 0., 0., 0., 0. };
+    const std::uint8_t expected_mask[12] = { 1, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0 };
+    for (int i = 0; i < 12; ++i) {
+        ASSERT_EQUAL(out[i], expected[i]);
+        ASSERT_EQUAL(int{ mask[i] }, int{ expected_mask[i] });
+    }
+
+    // константы обновляются вместе с индексом
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.ReadNumbers(Range{ "A1"_pos, "A2"_pos }, out), 2u);
+    ASSERT_EQUAL(out[0], 5.);
+    ASSERT_EQUAL(out[1], 6.);
+    try {
+        sheet.ReadNumbers(Range{ "B1"_pos, "A1"_pos }, out);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestPlaceholderLifetime() {
+    auto count_cells = [](const Sheet& sheet) {
+        std::size_t count = 0;
+        sheet.ForEachCell(Range{ "A1"_pos, Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } },
+                          [&count](Position, const Cell&) {
+                              ++count;
+                          });
+        return count;
+    };
+
+    // заглушка живёт, пока на неё ссылается формула
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B5");
+    ASSERT(sheet.GetCell("B5"_pos) != nullptr);
+    sheet.SetCell("A2"_pos, "=B5+1");
+    sheet.SetCell("A1"_pos, "=C5");
+    ASSERT(sheet.GetCell("B5"_pos) != nullptr);
+    sheet.ClearCell("A2"_pos);
+    ASSERT(sheet.GetCell("B5"_pos) == nullptr);
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetCell("C5"_pos) == nullptr);
+    ASSERT(sheet.GetPrintableSize() == (Size{ 0, 0 }));
+
+    // очищенная ячейка, на которую ссылаются, - заглушка до последней ссылки
+    sheet.SetCell("B1"_pos, "5");
+    sheet.SetCell("A1"_pos, "=B1");
+    sheet.ClearCell("B1"_pos);
+    ASSERT(sheet.GetCell("B1"_pos) != nullptr);
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+
+    // удаление строки с формулой освобождает её заглушки
+    sheet.SetCell("A1"_pos, "=C10");
+    sheet.DeleteRows(0);
+    ASSERT(sheet.GetCell("C9"_pos) == nullptr);
+    ASSERT_EQUAL(count_cells(sheet), 0u);
+
+    // ссылки на другой лист книги
+    Workbook book;
+    Sheet& first = book.AddSheet("First");
+    Sheet& second = book.AddSheet("Second");
+    first.SetCell("A1"_pos, "=Second!C3");
+    ASSERT(second.GetCell("C3"_pos) != nullptr);
+    first.ClearCell("A1"_pos);
+    ASSERT(second.GetCell("C3"_pos) == nullptr);
+
+    // правки и очистки с меняющимися ссылками не накапливают ячейки
+    std::size_t steady = 0;
+    for (int i = 0; i < 20000; ++i) {
+        sheet.SetCell(Position{ i % 7, 0 }, "=B" + std::to_string(i % 500 + 1) + "+C" + std::to_string(i % 311 + 1));
+        if (i % 3 == 0) {
+            sheet.ClearCell(Position{ (i + 4) % 7, 0 });
+        }
+        if (i == 5000) {
+            steady = count_cells(sheet);
+        }
+    }
+    ASSERT(count_cells(sheet) <= steady);
+    ASSERT(count_cells(sheet) <= 7u * 3u);
+}
+
+void TestIterativeCalculation() {
+    auto number = [](const Sheet& sheet, Position pos) {
+        return std::get<double>(sheet.GetCell(pos)->GetValue());
+    };
+
+    // по умолчанию цикл - ошибка
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "=C1");
+    try {
+        sheet.SetCell("C1"_pos, "=B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCell("D1"_pos, "=D1+1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    IterationSettings settings;
+    settings.enabled = true;
+    settings.max_iterations = 100;
+    settings.tolerance = 1e-9;
+    sheet.SetIterativeCalculation(settings);
+
+    // проценты на средний остаток: C = (A + A + C) / 2 * 0.1 => C = A / 9.5
+    sheet.SetCell("A1"_pos, "100");
+    sheet.SetCell("B1"_pos, "=A1+C1");
+    sheet.SetCell("C1"_pos, "=(A1+B1)/2*0.1");
+    sheet.SetCell("E1"_pos, "=B1*2");
+    ASSERT(std::abs(number(sheet, "C1"_pos) - 100 / 9.5) < 1e-6);
+    ASSERT(std::abs(number(sheet, "B1"_pos) - (100 + 100 / 9.5)) < 1e-6);
+    ASSERT(std::abs(number(sheet, "E1"_pos) - 2 * (100 + 100 / 9.5)) < 1e-6);
+    sheet.SetCell("A1"_pos, "200");
+    ASSERT(std::abs(number(sheet, "E1"_pos) - 2 * (200 + 200 / 9.5)) < 1e-6);
+
+    // неподвижная точка ссылки на себя
+    sheet.SetCell("D1"_pos, "=D1*0.5+1");
+    ASSERT(std::abs(number(sheet, "D1"_pos) - 2) < 1e-6);
+    sheet.SetCell("D1"_pos, "=A1");
+    ASSERT_EQUAL(number(sheet, "D1"_pos), 200.0);
+
+    // расходящийся цикл останавливается на max_iterations
+    settings.max_iterations = 10;
+    sheet.SetIterativeCalculation(settings);
+    sheet.SetCell("F1"_pos, "=G1+1");
+    sheet.SetCell("G1"_pos, "=F1");
+    ASSERT_EQUAL(number(sheet, "F1"_pos), 10.0);
+
+    // разомкнутый цикл вычисляется как обычно
+    sheet.SetCell("G1"_pos, "5");
+    ASSERT_EQUAL(number(sheet, "F1"_pos), 6.0);
+
+    // независимые циклы вычисляются параллельно, цепочка циклов - по уровням
+    settings.max_iterations = 200;
+    sheet.SetIterativeCalculation(settings);
+    for (int row = 2; row < 40; ++row) {
+        const std::string a = "A" + std::to_string(row + 1);
+        const std::string b = "B" + std::to_string(row + 1);
+        sheet.SetCell(Position{ row, 0 }, "=" + b + "*0.5+" + std::to_string(row));
+        sheet.SetCell(Position{ row, 1 }, "=" + a + "*0.5" + (row % 2 ? "+A" + std::to_string(row) : ""));
+    }
+    sheet.SolveCycles(4);
+    for (int row = 2; row < 40; ++row) {
+        const double a = number(sheet, Position{ row, 0 });
+        const double b = number(sheet, Position{ row, 1 });
+        const double input = row % 2 ? number(sheet, Position{ row - 1, 0 }) : 0.0;
+        ASSERT(std::abs(a - (b * 0.5 + row)) < 1e-6);
+        ASSERT(std::abs(b - (a * 0.5 + input)) < 1e-6);
+    }
+
+    // выключение режима запрещает новые циклы
+    settings.enabled = false;
+    sheet.SetIterativeCalculation(settings);
+    try {
+        sheet.SetCell("H1"_pos, "=H1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet.SetCell("A1"_pos, "300");
+    ASSERT(std::abs(number(sheet, "C1"_pos) - 300 / 9.5) < 1e-6);
+
+    try {
+        settings.max_iterations = 0;
+        sheet.SetIterativeCalculation(settings);
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+}
+
+void TestDerivatives() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("A2"_pos, "4");
+    sheet.SetCell("B1"_pos, "=A1*A1+A2/2");
+    sheet.SetCell("C1"_pos, "=SUM(A1:A2)*B1");
+    sheet.SetCell("G1"_pos, "=IF(A1>2,A1*10,A1)");
+    sheet.SetCell("G2"_pos, "=MIN(A1,A2)-A2");
+    sheet.SetCell("H1"_pos, "=1/(A1-3)");
+    sheet.SetCell("H2"_pos, "=2*5");
+
+    auto derivatives = sheet.GetDerivatives({ "B1"_pos, "C1"_pos, "G1"_pos, "G2"_pos, "H2"_pos, "A1"_pos },
+                                            { "A1"_pos, "A2"_pos });
+    ASSERT_EQUAL(derivatives[0][0], 6.0);
+    ASSERT_EQUAL(derivatives[0][1], 0.5);
+    // C1 = (A1 + A2) * B1: 1 * 11 + 7 * dB1
+    ASSERT_EQUAL(derivatives[1][0], 11.0 + 7.0 * 6.0);
+    ASSERT_EQUAL(derivatives[1][1], 11.0 + 7.0 * 0.5);
+    ASSERT_EQUAL(derivatives[2][0], 10.0);
+    ASSERT_EQUAL(derivatives[3][0], 1.0);
+    ASSERT_EQUAL(derivatives[3][1], -1.0);
+    ASSERT_EQUAL(derivatives[4][0], 0.0);
+    ASSERT_EQUAL(derivatives[5][0], 1.0);
+    ASSERT_EQUAL(derivatives[5][1], 0.0);
+    ASSERT(std::isnan(sheet.GetDerivatives({ "H1"_pos }, { "A1"_pos })[0][0]));
+
+    // входов больше, чем направлений одного прохода
+    std::vector<Position> inputs;
+    for (int row = 0; row < 6; ++row) {
+        sheet.SetCell(Position{ row, 4 }, std::to_string(row + 1));
+        sheet.SetCell(Position{ row, 5 }, std::to_string((row + 1) * 10));
+        inputs.push_back(Position{ row, 4 });
+        inputs.push_back(Position{ row, 5 });
+    }
+    sheet.SetCell("D1"_pos, "=SUMPRODUCT(E1:E6,F1:F6)+AVERAGE(E1:E6)");
+    derivatives = sheet.GetDerivatives({ "D1"_pos }, inputs);
+    for (int row = 0; row < 6; ++row) {
+        ASSERT(std::abs(derivatives[0][2 * row] - ((row + 1) * 10 + 1.0 / 6)) < 1e-12);
+        ASSERT_EQUAL(derivatives[0][2 * row + 1], row + 1.0);
+    }
+
+    // подбор параметра: B1 = A1 * A1 + 2 = 50
+    sheet.SetHistoryLimit(1 << 20);
+    GoalSeekResult seek = sheet.GoalSeek("B1"_pos, 50, "A1"_pos);
+    ASSERT(seek.converged);
+    ASSERT(seek.evaluations <= 8);
+    ASSERT(std::abs(seek.input - std::sqrt(48.0)) < 1e-9);
+    ASSERT(std::abs(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()) - 50) < 1e-9);
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "3");
+
+    // отрицательный ответ записывается формулой
+    sheet.SetCell("I1"_pos, "=A2*2+10");
+    seek = sheet.GoalSeek("I1"_pos, 0, "A2"_pos);
+    ASSERT(seek.converged);
+    ASSERT_EQUAL(seek.evaluations, 2);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=-5");
+    seek = sheet.GoalSeek("I1"_pos, 4, "A2"_pos);
+    ASSERT(seek.converged);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=-3");
+
+    // цель не зависит от входа
+    seek = sheet.GoalSeek("H2"_pos, 3, "A1"_pos);
+    ASSERT(!seek.converged);
+    try {
+        sheet.GoalSeek("A1"_pos, 3, "B1"_pos);
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+}
+
+void TestJournal() {
+    const std::string journal_path = "test_journal.bin";
+    const std::string snapshot_path = "test_snapshot.bin";
+    std::remove(journal_path.c_str());
+    std::remove(snapshot_path.c_str());
+
+    Sheet sheet;
+    {
+        Journal journal(journal_path, JournalOptions{ SyncPolicy::None, 2 });
+        sheet.AttachJournal(&journal);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("C1"_pos, "text");
+        sheet.ClearCell("C1"_pos);
+        sheet.SetCell("A1"_pos, "5");
+
+        journal.Compact(sheet, snapshot_path);
+        sheet.SetCell("A2"_pos, "=B1*2");
+        journal.Commit();
+        sheet.SetCell("A3"_pos, "tail");  // неполная группа - запишется в деструкторе
+        sheet.AttachJournal(nullptr);
+    }
+
+    // оборванная при записи группа отбрасывается
+    {
+        static const char garbage[] = "\x10\x00\x00\x00garbage";
+        std::ofstream torn(journal_path, std::ios::binary | std::ios::app);
+        torn.write(garbage, sizeof(garbage) - 1);
+    }
+
+    auto restored = Journal::Recover(snapshot_path, journal_path);
+    ASSERT_EQUAL(std::get<double>(restored->GetCell("A2"_pos)->GetValue()), 12.);
+    ASSERT(restored->GetCell("C1"_pos) == nullptr);
+    ASSERT_EQUAL(restored->GetCell("A3"_pos)->GetText(), "tail");
+
+    // после оборванной группы журнал продолжается: она отрезается при открытии
+    {
+        Journal journal(journal_path, JournalOptions{ SyncPolicy::None, 1 });
+        restored->AttachJournal(&journal);
+        restored->SetCell("A4"_pos, "after");
+        restored->AttachJournal(nullptr);
+    }
+    restored = Journal::Recover(snapshot_path, journal_path);
+    ASSERT_EQUAL(restored->GetCell("A3"_pos)->GetText(), "tail");
+    ASSERT_EQUAL(restored->GetCell("A4"_pos)->GetText(), "after");
+
+    // журнал, пропавший рядом со снимком, начинается заново поверх снимка
+    std::remove(journal_path.c_str());
+    restored = Journal::Recover(snapshot_path, journal_path);
+    ASSERT(restored->GetCell("A2"_pos) == nullptr);
+    {
+        Journal journal(journal_path);
+        restored->AttachJournal(&journal);
+        restored->SetCell("B2"_pos, "kept");
+        restored->AttachJournal(nullptr);
+    }
+    restored = Journal::Recover(snapshot_path, journal_path);
+    ASSERT_EQUAL(restored->GetCell("B2"_pos)->GetText(), "kept");
+    ASSERT_EQUAL(std::get<double>(restored->GetCell("B1"_pos)->GetValue()), 6.);
+
+    // отмена журналирует формулу в разобранном виде: #REF! и точные числа
+    std::remove(journal_path.c_str());
+    std::remove(snapshot_path.c_str());
+    {
+        Sheet edited;
+        edited.SetHistoryLimit(1 << 20);
+        Journal journal(journal_path, JournalOptions{ SyncPolicy::None, 1 });
+        edited.AttachJournal(&journal);
+        edited.SetCell("A1"_pos, "=B5+1");
+        edited.SetCell("A2"_pos, "=0.1234567*2");
+        edited.DeleteRows(4);
+        edited.SetCell("A1"_pos, "1");
+        edited.SetCell("A2"_pos, "2");
+        ASSERT(edited.Undo());
+        ASSERT(edited.Undo());
+        edited.AttachJournal(nullptr);
+    }
+    restored = Journal::Recover(snapshot_path, journal_path);
+    ASSERT_EQUAL(restored->GetCell("A1"_pos)->GetText(), "=#REF!+1");
+    ASSERT_EQUAL(std::get<double>(restored->GetCell("A2"_pos)->GetValue()), 0.2469134);
+
+    std::remove(journal_path.c_str());
+    std::remove(snapshot_path.c_str());
+}
+
 void Test() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "=A2 + A3 + A4");
@@ -293,6 +2077,289 @@ void Test() {
     
 }
 
+#ifdef SPREADSHEET_BENCHMARKS
+// Сравнение SUM по индексу с поячеечным суммированием по длинному столбцу
+// (сборка с -DSPREADSHEET_BENCHMARKS=ON)
+void BenchmarkRangeSum() {
+    using namespace std::literals;
+    const int rows = Position::MAX_ROWS;
+    const int queries = 200;
+
+    Sheet sheet;
+    auto fill = [&sheet, rows] {
+        sheet.BeginBatchUpdate();
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row % 100));
+        }
+        sheet.EndBatchUpdate();
+    };
+    fill();
+    sheet.SetCell("B1"_pos, "=SUM(A1:A" + std::to_string(rows) + ")");
+
+    const Range column{ Position{ 0, 0 }, Position{ rows - 1, 0 } };
+    double naive_total = 0.;
+    {
+        // обход ячеек реализацией SheetInterface по умолчанию
+        LOG_DURATION("naive sum"s);
+        for (int i = 0; i < queries; ++i) {
+            sheet.SetCell(Position{ i, 0 }, std::to_string(i));
+            naive_total += sheet.SheetInterface::GetRangeTotals(column).sum;
+        }
+    }
+    fill();
+    double index_total = 0.;
+    {
+        LOG_DURATION("SUM with prefix sums"s);
+        for (int i = 0; i < queries; ++i) {
+            sheet.SetCell(Position{ i, 0 }, std::to_string(i));
+            index_total += std::get<double>(sheet.GetCell("B1"_pos)->GetValue());
+        }
+    }
+    std::cerr << "totals: " << naive_total << " " << index_total << std::endl;
+}
+
+// Ядра свёрток (reduction.h) против поэлементного цикла с ветвлениями и
+// MIN/SUMPRODUCT таблицы против обхода ячеек через SheetInterface
+void BenchmarkReductions() {
+    using namespace std::literals;
+    for (std::size_t size : { std::size_t{ 1000 }, std::size_t{ 100000 }, std::size_t{ 10000000 } }) {
+        std::vector<double> lhs(size), rhs(size);
+        for (std::size_t i = 0; i < size; ++i) {
+            lhs[i] = i % 5 == 0 ? std::numeric_limits<double>::quiet_NaN()
+                                : static_cast<double>((i * 7919) % 1000);
+            rhs[i] = static_cast<double>(i % 3);
+        }
+        const std::size_t repeats = std::max<std::size_t>(1, 100000000 / size);
+        const std::string suffix = " x"s + std::to_string(repeats) + " (" + std::to_string(size) + " values)";
+
+        const std::vector<ReductionSegment> segments = {
+            ReductionSegment{ lhs.data(), rhs.data(), size },
+        };
+
+        double scalar = 0.;
+        {
+            LOG_DURATION("scalar MIN/MAX/COUNT"s + suffix);
+            for (std::size_t r = 0; r < repeats; ++r) {
+                double min = std::numeric_limits<double>::infinity();
+                double max = -std::numeric_limits<double>::infinity();
+                std::size_t count = 0;
+                for (std::size_t i = 0; i < size; ++i) {
+                    if (std::isnan(lhs[i])) {
+                        continue;
+                    }
+                    if (lhs[i] < min) {
+                        min = lhs[i];
+                    }
+                    if (lhs[i] > max) {
+                        max = lhs[i];
+                    }
+                    ++count;
+                }
+                scalar += min + max + static_cast<double>(count);
+            }
+        }
+        double kernel = 0.;
+        {
+            LOG_DURATION("kernel MIN/MAX/COUNT"s + suffix);
+            for (std::size_t r = 0; r < repeats; ++r) {
+                RangeExtrema extrema = ReduceExtrema(segments);
+                kernel += extrema.min + extrema.max + static_cast<double>(extrema.count);
+            }
+        }
+        {
+            LOG_DURATION("scalar SUMPRODUCT"s + suffix);
+            for (std::size_t r = 0; r < repeats; ++r) {
+                double product = 0.;
+                for (std::size_t i = 0; i < size; ++i) {
+                    if (!std::isnan(lhs[i]) && !std::isnan(rhs[i])) {
+                        product += lhs[i] * rhs[i];
+                    }
+                }
+                scalar += product;
+            }
+        }
+        {
+            LOG_DURATION("kernel SUMPRODUCT"s + suffix);
+            for (std::size_t r = 0; r < repeats; ++r) {
+                kernel += ReduceProduct(segments);
+            }
+        }
+        std::cerr << "results: " << scalar << " " << kernel << std::endl;
+    }
+
+    for (int cols : { 1, 7 }) {
+        const int rows = cols == 1 ? 1000 : Position::MAX_ROWS;
+        Sheet sheet;
+        sheet.BeginBatchUpdate();
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < 2 * cols; ++col) {
+                sheet.SetCell(Position{ row, col }, std::to_string((row * 31 + col) % 1000));
+            }
+        }
+        sheet.EndBatchUpdate();
+        const Range lhs{ Position{ 0, 0 }, Position{ rows - 1, cols - 1 } };
+        const Range rhs{ Position{ 0, cols }, Position{ rows - 1, 2 * cols - 1 } };
+        const int repeats = cols == 1 ? 1000 : 10;
+        const std::string suffix = " x"s + std::to_string(repeats) + " (" + std::to_string(rows * cols) + " cells)";
+
+        double scalar = 0.;
+        {
+            LOG_DURATION("cell-by-cell MIN+SUMPRODUCT"s + suffix);
+            for (int r = 0; r < repeats; ++r) {
+                scalar += sheet.SheetInterface::GetRangeExtrema(lhs).min +
+                          sheet.SheetInterface::GetRangeProduct(lhs, rhs);
+            }
+        }
+        double indexed = 0.;
+        {
+            LOG_DURATION("indexed MIN+SUMPRODUCT"s + suffix);
+            for (int r = 0; r < repeats; ++r) {
+                indexed += sheet.GetRangeExtrema(lhs).min + sheet.GetRangeProduct(lhs, rhs);
+            }
+        }
+        std::cerr << "results: " << scalar << " " << indexed << std::endl;
+    }
+}
+
+// Поиск по столбцу из MAX_ROWS ключей: индексы поиска против обхода ячеек
+void BenchmarkLookups() {
+    using namespace std::literals;
+    const int rows = Position::MAX_ROWS;
+    const int queries = 2000;
+    Sheet sheet;
+    sheet.BeginBatchUpdate();
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell(Position{ row, 0 }, std::to_string(row * 2));
+        sheet.SetCell(Position{ row, 1 }, std::to_string(row));
+    }
+    // на таблицу ссылается формула - для неё строятся индексы поиска
+    sheet.SetCell(Position{ 0, 2 }, "=VLOOKUP(10,A1:B" + std::to_string(rows) + ",2,0)");
+    sheet.EndBatchUpdate();
+    const Range keys{ Position{ 0, 0 }, Position{ rows - 1, 0 } };
+
+    for (LookupMode mode : { LookupMode::Exact, LookupMode::LessOrEqual }) {
+        const std::string suffix = (mode == LookupMode::Exact ? " exact x"s : " approximate x"s) +
+                                   std::to_string(queries);
+        long long scan_total = 0;
+        {
+            LOG_DURATION("cell-by-cell lookup"s + suffix);
+            for (int i = 0; i < queries; ++i) {
+                scan_total += sheet.SheetInterface::LookupValue(keys, (i * 7919) % (2 * rows), mode).value_or(-1);
+            }
+        }
+        long long index_total = 0;
+        {
+            LOG_DURATION("indexed lookup"s + suffix);
+            for (int i = 0; i < queries; ++i) {
+                index_total += sheet.LookupValue(keys, (i * 7919) % (2 * rows), mode).value_or(-1);
+            }
+        }
+        std::cerr << "totals: " << scan_total << " " << index_total << std::endl;
+    }
+}
+
+// Чтение столбца чисел поячеечно через SheetInterface и в буфер ReadNumbers()
+void BenchmarkBulkRead() {
+    using namespace std::literals;
+    const int rows = Position::MAX_ROWS;
+    const int cols = 16;
+    const int repeats = 20;
+    Sheet sheet;
+    sheet.BeginBatchUpdate();
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            sheet.SetCell(Position{ row, col }, std::to_string((row + col) % 100));
+        }
+    }
+    sheet.EndBatchUpdate();
+    const Range area{ Position{ 0, 0 }, Position{ rows - 1, cols - 1 } };
+
+    double cell_total = 0.;
+    {
+        LOG_DURATION("GetCell loop x"s + std::to_string(repeats));
+        const SheetInterface& base = sheet;
+        for (int i = 0; i < repeats; ++i) {
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    if (auto number = GetRangeNumber(base, Position{ row, col })) {
+                        cell_total += *number;
+                    }
+                }
+            }
+        }
+    }
+    double bulk_total = 0.;
+    {
+        LOG_DURATION("ReadNumbers x"s + std::to_string(repeats));
+        std::vector<double> out(static_cast<std::size_t>(rows) * cols);
+        for (int i = 0; i < repeats; ++i) {
+            sheet.ReadNumbers(area, out.data());
+            for (double value : out) {
+                bulk_total += value;
+            }
+        }
+    }
+    std::cerr << "totals: " << cell_total << " " << bulk_total << std::endl;
+}
+
+// Долгая сессия правок и очисток формул с меняющимися ссылками: число ячеек
+// и печатная область не растут
+void BenchmarkPlaceholderSoak() {
+    using namespace std::literals;
+    const int cycles = 2000000;
+    Sheet sheet;
+    LOG_DURATION("placeholder soak x"s + std::to_string(cycles));
+    for (int i = 0; i < cycles; ++i) {
+        const Position pos{ i % 64, 0 };
+        sheet.SetCell(pos, "=B" + std::to_string(i % 5000 + 1) + "+C" + std::to_string(i % 3001 + 1));
+        sheet.ClearCell(pos);
+        if (i % 500000 == 0) {
+            std::size_t cells = 0;
+            sheet.ForEachCell(Range{ Position{ 0, 0 }, Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } },
+                              [&cells](Position, const Cell&) {
+                                  ++cells;
+                              });
+            std::cerr << "cycle " << i << ": " << cells << " cells" << std::endl;
+        }
+    }
+}
+
+void BenchmarkDerivatives() {
+    using namespace std::literals;
+    // модель: 8 входов, 5000 формул цепочкой от их суммы
+    const int inputs_count = 8;
+    const int chain = 5000;
+    Sheet sheet;
+    std::vector<Position> inputs;
+    for (int col = 0; col < inputs_count; ++col) {
+        sheet.SetCell(Position{ 0, col }, std::to_string(col + 1));
+        inputs.push_back(Position{ 0, col });
+    }
+    sheet.SetCell(Position{ 1, 0 }, "=SUM(A1:H1)");
+    for (int row = 2; row < chain; ++row) {
+        sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "*1.0001+B" + std::to_string(row % 8 + 1));
+    }
+    const Position output{ chain - 1, 0 };
+
+    std::vector<std::vector<double>> derivatives;
+    {
+        LOG_DURATION("derivatives, dual numbers"s);
+        derivatives = sheet.GetDerivatives({ output }, inputs);
+    }
+    double finite = 0.;
+    {
+        LOG_DURATION("derivatives, finite differences"s);
+        for (int col = 0; col < inputs_count; ++col) {
+            const double base = std::get<double>(sheet.GetCell(output)->GetValue());
+            sheet.SetCell(inputs[col], std::to_string(col + 1) + ".001");
+            finite = (std::get<double>(sheet.GetCell(output)->GetValue()) - base) / 0.001;
+            sheet.SetCell(inputs[col], std::to_string(col + 1));
+        }
+    }
+    std::cerr << "d/dH1: " << derivatives[0].back() << " vs " << finite << std::endl;
+}
+#endif
+
 int main() {
     TestRunner tr;
     RUN_TEST(tr, TestEmpty);
@@ -303,6 +2370,40 @@ int main() {
     RUN_TEST(tr, TestCellExpr);
     RUN_TEST(tr, TestRef);
     RUN_TEST(tr, TestCache);
+    RUN_TEST(tr, TestImportDelimited);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestPrintLarge);
+    RUN_TEST(tr, TestBatchUpdate);
+    RUN_TEST(tr, TestPrintValuesSince);
+    RUN_TEST(tr, TestConcurrentReads);
+    RUN_TEST(tr, TestSheetSnapshot);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestTransaction);
+    RUN_TEST(tr, TestIngestQueue);
+    RUN_TEST(tr, TestFork);
+    RUN_TEST(tr, TestRangeSum);
+    RUN_TEST(tr, TestAggregateDelta);
+    RUN_TEST(tr, TestReductions);
+    RUN_TEST(tr, TestLookups);
+    RUN_TEST(tr, TestConditionals);
+    RUN_TEST(tr, TestInsertDelete);
+    RUN_TEST(tr, TestMoveCopy);
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestSubscriptions);
+    RUN_TEST(tr, TestRecalculate);
+    RUN_TEST(tr, TestBulkRead);
+    RUN_TEST(tr, TestPlaceholderLifetime);
+    RUN_TEST(tr, TestIterativeCalculation);
+    RUN_TEST(tr, TestDerivatives);
+    RUN_TEST(tr, TestJournal);
     RUN_TEST(tr, Test);
+#ifdef SPREADSHEET_BENCHMARKS
+    BenchmarkRangeSum();
+    BenchmarkReductions();
+    BenchmarkLookups();
+    BenchmarkBulkRead();
+    BenchmarkPlaceholderSoak();
+    BenchmarkDerivatives();
+#endif
     return 0;
 }
@@ -0,0 +1,513 @@
+#include "range_index.h"
+
+#include "reduction.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+// наименьший размер столбца индекса, дальше - удвоение
+const std::size_t MIN_COLUMN_SIZE = 64;
+
+// значение строки без числовой константы
+const double BLANK = std::numeric_limits<double>::quiet_NaN();
+
+// дерево столбца перестраивается после стольких поправок на строку столбца
+// (но не реже чем через MIN_REBUILD_UPDATES)
+const std::size_t REBUILD_UPDATES_PER_ROW_DIVISOR = 8;
+const std::size_t MIN_REBUILD_UPDATES = 256;
+
+// сумма по деревьям принимается, если оценка её ошибки не больше этой доли
+// самой суммы
+const double MAX_RELATIVE_ERROR = 1e-10;
+
+// граница ошибки округления одного сложения с результатом sum
+double RoundingError(double sum) {
+    return std::numeric_limits<double>::epsilon() * std::abs(sum);
+}
+
+bool IsNumber(double value) {
+    return value == value;
+}
+
+// ячейка строки или столбца range на смещении offset от начала
+Position VectorPosition(Range range, int offset) {
+    if (range.from.row == range.to.row) {
+        return Position{ range.from.row, range.from.col + offset };
+    }
+    return Position{ range.from.row + offset, range.from.col };
+}
+
+// переносит смещение offset в индексе поиска со значения old_key на new_key
+template <typename Table>
+void MoveLookupKey(Table& table, int offset, double old_key, double new_key) {
+    if (IsNumber(old_key)) {
+        auto found = table.find(old_key);
+        if (found != table.end() && found->second.erase(offset) > 0 && found->second.empty()) {
+            table.erase(found);
+        }
+    }
+    if (IsNumber(new_key)) {
+        table[new_key].insert(offset);
+    }
+}
+
+}  // namespace
+
+void RangeIndex::SetCell(Position pos, std::optional<double> number, bool formula) {
+    if (pos.col >= static_cast<int>(columns_.size())) {
+        if (!number && !formula) {
+            return;
+        }
+        columns_.resize(pos.col + 1);
+    }
+    Column& column = columns_[pos.col];
+
+    bool was_formula = formula ? !column.formula_rows.insert(pos.row).second
+                               : column.formula_rows.erase(pos.row) > 0;
+
+    double old_value = 0.;
+    int old_count = 0;
+    if (pos.row < static_cast<int>(column.values.size())) {
+        if (IsNumber(column.values[pos.row])) {
+            old_value = column.values[pos.row];
+            old_count = 1;
+        }
+    } else if (number) {
+        Grow(column, pos.row);
+    }
+    double new_value = number ? *number : 0.;
+    int new_count = number ? 1 : 0;
+
+    if (old_count != new_count || old_value != new_value) {
+        UpdateLookups(pos, old_count ? old_value : BLANK, new_count ? new_value : BLANK);
+    }
+
+    // итоги с формулой в позиции пересчитываются, константы дают поправку
+    if (was_formula || formula) {
+        DropCachedTotals(pos);
+    } else if (old_count != new_count || old_value != new_value) {
+        AdjustCachedTotals(pos, new_value - old_value, new_count - old_count);
+    }
+
+    if (old_count == new_count && old_value == new_value) {
+        return;
+    }
+    column.values[pos.row] = number ? new_value : BLANK;
+    Add(column, pos.row, new_value - old_value, new_count - old_count);
+}
+
+RangeTotals RangeIndex::GetConstantTotals(Range range) const {
+    RangeTotals totals;
+    bool resum = false;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        auto cached = cached_.find(RangeKey(range));
+        resum = cached != cached_.end() && cached->second.resum;
+    }
+    int last_col = std::min(range.to.col, static_cast<int>(columns_.size()) - 1);
+    for (int col = range.from.col; col <= last_col; ++col) {
+        RangeTotals column = ColumnTotals(columns_[col], range.from.row, range.to.row + 1, resum);
+        totals.sum += column.sum;
+        totals.count += column.count;
+    }
+    return totals;
+}
+
+RangeExtrema RangeIndex::GetConstantExtrema(Range range) const {
+    std::vector<ReductionSegment> segments;
+    int last_col = std::min(range.to.col, static_cast<int>(columns_.size()) - 1);
+    for (int col = range.from.col; col <= last_col; ++col) {
+        const Column& column = columns_[col];
+        std::size_t begin = static_cast<std::size_t>(range.from.row);
+        std::size_t end = std::min(static_cast<std::size_t>(range.to.row) + 1, column.values.size());
+        if (begin < end) {
+            segments.push_back(ReductionSegment{ column.values.data() + begin, nullptr, end - begin });
+        }
+    }
+    return ReduceExtrema(segments);
+}
+
+double RangeIndex::GetConstantProduct(Range lhs, Range rhs) const {
+    std::vector<ReductionSegment> segments;
+    const std::size_t rows = static_cast<std::size_t>(lhs.to.row - lhs.from.row) + 1;
+    for (int offset = 0; offset <= lhs.to.col - lhs.from.col; ++offset) {
+        int lhs_col = lhs.from.col + offset;
+        int rhs_col = rhs.from.col + offset;
+        if (lhs_col >= static_cast<int>(columns_.size()) || rhs_col >= static_cast<int>(columns_.size())) {
+            continue;
+        }
+        // за пределами хранимых строк столбца чисел нет
+        const std::vector<double>& lhs_values = columns_[lhs_col].values;
+        const std::vector<double>& rhs_values = columns_[rhs_col].values;
+        std::size_t lhs_begin = static_cast<std::size_t>(lhs.from.row);
+        std::size_t rhs_begin = static_cast<std::size_t>(rhs.from.row);
+        if (lhs_begin >= lhs_values.size() || rhs_begin >= rhs_values.size()) {
+            continue;
+        }
+        std::size_t size = std::min({ rows, lhs_values.size() - lhs_begin, rhs_values.size() - rhs_begin });
+        segments.push_back(ReductionSegment{ lhs_values.data() + lhs_begin, rhs_values.data() + rhs_begin, size });
+    }
+    return ReduceProduct(segments);
+}
+
+std::optional<RangeIndex::LookupMatch> RangeIndex::LookupConstant(Range range, double value,
+                                                                  LookupMode mode) const {
+    const int size = (range.to.row - range.from.row) + (range.to.col - range.from.col) + 1;
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    ReferencedRange* owner = nullptr;
+    if (range.from.col < static_cast<int>(columns_.size())) {
+        for (std::uint64_t key : columns_[range.from.col].cached) {
+            ReferencedRange& referenced = cached_.at(key);
+            if (referenced.range.Contains(range.from) && referenced.range.Contains(range.to)) {
+                owner = &referenced;
+                break;
+            }
+        }
+    }
+
+    if (owner == nullptr) {
+        // на диапазон не ссылается ни одна формула - индекс не строится
+        std::optional<LookupMatch> result;
+        for (int offset = 0; offset < size; ++offset) {
+            double key = GetConstant(VectorPosition(range, offset));
+            if (mode == LookupMode::Exact && key == value) {
+                return LookupMatch{ offset, key };
+            }
+            if (mode == LookupMode::LessOrEqual && key <= value && (!result || key >= result->key)) {
+                result = LookupMatch{ offset, key };
+            }
+        }
+        return result;
+    }
+
+    auto build = [&](auto& table) {
+        for (int offset = 0; offset < size; ++offset) {
+            double key = GetConstant(VectorPosition(range, offset));
+            if (IsNumber(key)) {
+                table[key].insert(offset);
+            }
+        }
+    };
+    LookupTables& tables = GetLookupTables(*owner, range);
+    if (mode == LookupMode::Exact) {
+        if (!tables.exact) {
+            build(tables.exact.emplace());
+        }
+        auto found = tables.exact->find(value);
+        if (found == tables.exact->end()) {
+            return std::nullopt;
+        }
+        return LookupMatch{ *found->second.begin(), found->first };
+    }
+
+    if (!tables.sorted) {
+        build(tables.sorted.emplace());
+    }
+    auto found = tables.sorted->upper_bound(value);
+    if (found == tables.sorted->begin()) {
+        return std::nullopt;
+    }
+    --found;
+    return LookupMatch{ *found->second.rbegin(), found->first };
+}
+
+std::vector<Position> RangeIndex::GetFormulaCells(Range range) const {
+    std::vector<Position> result;
+    ForEachFormulaCell(range, [&result](Position pos) {
+        result.push_back(pos);
+    });
+    return result;
+}
+
+std::size_t RangeIndex::ReadConstants(Range range, double* out, std::uint8_t* mask) const {
+    const std::size_t width = static_cast<std::size_t>(range.to.col - range.from.col) + 1;
+    const std::size_t size = width * (static_cast<std::size_t>(range.to.row - range.from.row) + 1);
+    std::fill(out, out + size, 0.);
+    if (mask != nullptr) {
+        std::fill(mask, mask + size, std::uint8_t{ 0 });
+    }
+    std::size_t count = 0;
+    // за пределами хранимых столбцов и строк столбца констант нет
+    const int last_col = std::min(range.to.col, static_cast<int>(columns_.size()) - 1);
+    for (int col = range.from.col; col <= last_col; ++col) {
+        const std::vector<double>& values = columns_[col].values;
+        const int last_row = std::min(range.to.row, static_cast<int>(values.size()) - 1);
+        std::size_t offset = static_cast<std::size_t>(col - range.from.col);
+        for (int row = range.from.row; row <= last_row; ++row, offset += width) {
+            const double value = values[row];
+            if (!std::isnan(value)) {
+                out[offset] = value;
+                if (mask != nullptr) {
+                    mask[offset] = 1;
+                }
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+void RangeIndex::AddDependent(Range range, CellInterface* cell) {
+    if (range.to.col >= static_cast<int>(columns_.size())) {
+        columns_.resize(range.to.col + 1);
+    }
+    std::uint64_t key = RangeKey(range);
+    ReferencedRange& cached = cached_[key];
+    bool first_reference = cached.references++ == 0;
+    cached.range = range;
+    for (int col = range.from.col; col <= range.to.col; ++col) {
+        columns_[col].dependents.push_back(Dependent{ range.from.row, range.to.row, cell });
+        if (first_reference) {
+            columns_[col].cached.push_back(key);
+        }
+    }
+}
+
+void RangeIndex::RemoveDependent(Range range, CellInterface* cell) {
+    int last_col = std::min(range.to.col, static_cast<int>(columns_.size()) - 1);
+    for (int col = range.from.col; col <= last_col; ++col) {
+        std::vector<Dependent>& dependents = columns_[col].dependents;
+        auto it = std::find_if(dependents.begin(), dependents.end(), [&](const Dependent& dependent) {
+            return dependent.cell == cell && dependent.from_row == range.from.row &&
+                   dependent.to_row == range.to.row;
+        });
+        if (it != dependents.end()) {
+            *it = dependents.back();
+            dependents.pop_back();
+        }
+    }
+
+    // итоги диапазона больше не нужны ни одной формуле
+    std::uint64_t key = RangeKey(range);
+    auto cached = cached_.find(key);
+    if (cached == cached_.end() || --cached->second.references > 0) {
+        return;
+    }
+    cached_.erase(cached);
+    for (int col = range.from.col; col <= last_col; ++col) {
+        std::vector<std::uint64_t>& keys = columns_[col].cached;
+        keys.erase(std::remove(keys.begin(), keys.end(), key), keys.end());
+    }
+}
+
+void RangeIndex::CollectDependents(Position pos, std::vector<CellInterface*>& result) const {
+    if (pos.col >= static_cast<int>(columns_.size())) {
+        return;
+    }
+    for (const Dependent& dependent : columns_[pos.col].dependents) {
+        if (pos.row >= dependent.from_row && pos.row <= dependent.to_row) {
+            result.push_back(dependent.cell);
+        }
+    }
+}
+
+void RangeIndex::CollectDependents(const Range& area, std::vector<CellInterface*>& result) const {
+    const std::size_t end = std::min<std::size_t>(columns_.size(), area.to.col + 1);
+    for (std::size_t col = area.from.col; col < end; ++col) {
+        for (const Dependent& dependent : columns_[col].dependents) {
+            if (dependent.from_row <= area.to.row && dependent.to_row >= area.from.row) {
+                result.push_back(dependent.cell);
+            }
+        }
+    }
+}
+
+std::optional<RangeTotals> RangeIndex::GetCachedTotals(Range range) const {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto cached = cached_.find(RangeKey(range));
+    if (cached == cached_.end() || !cached->second.valid) {
+        return std::nullopt;
+    }
+    return cached->second.totals;
+}
+
+void RangeIndex::CacheTotals(Range range, RangeTotals totals) const {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto cached = cached_.find(RangeKey(range));
+    if (cached == cached_.end()) {
+        return;
+    }
+    cached->second.totals = totals;
+    cached->second.valid = true;
+    cached->second.resum = false;
+    cached->second.updates = 0;
+}
+
+void RangeIndex::DropCachedTotals(Position pos) {
+    if (pos.col >= static_cast<int>(columns_.size())) {
+        return;
+    }
+    for (std::uint64_t key : columns_[pos.col].cached) {
+        ReferencedRange& cached = cached_.at(key);
+        if (cached.range.Contains(pos)) {
+            cached.valid = false;
+        }
+    }
+}
+
+void RangeIndex::AdjustCachedTotals(Position pos, double value, int count) {
+    for (std::uint64_t key : columns_[pos.col].cached) {
+        ReferencedRange& cached = cached_.at(key);
+        if (!cached.valid || !cached.range.Contains(pos)) {
+            continue;
+        }
+        if (++cached.updates > MAX_DELTA_UPDATES) {
+            cached.valid = false;
+            cached.resum = true;
+            continue;
+        }
+        cached.totals.sum += value;
+        cached.totals.count += static_cast<std::size_t>(count);
+    }
+}
+
+void RangeIndex::UpdateLookups(Position pos, double old_key, double new_key) {
+    if (pos.col >= static_cast<int>(columns_.size())) {
+        return;
+    }
+    for (std::uint64_t key : columns_[pos.col].cached) {
+        ReferencedRange& referenced = cached_.at(key);
+        if (!referenced.range.Contains(pos)) {
+            continue;
+        }
+        for (LookupTables& tables : referenced.lookups) {
+            if (!tables.vector.Contains(pos)) {
+                continue;
+            }
+            int offset = (pos.row - tables.vector.from.row) + (pos.col - tables.vector.from.col);
+            if (tables.exact) {
+                MoveLookupKey(*tables.exact, offset, old_key, new_key);
+            }
+            if (tables.sorted) {
+                MoveLookupKey(*tables.sorted, offset, old_key, new_key);
+            }
+        }
+    }
+}
+
+double RangeIndex::GetConstant(Position pos) const {
+    if (pos.col >= static_cast<int>(columns_.size()) ||
+        pos.row >= static_cast<int>(columns_[pos.col].values.size())) {
+        return BLANK;
+    }
+    return columns_[pos.col].values[pos.row];
+}
+
+RangeIndex::LookupTables& RangeIndex::GetLookupTables(ReferencedRange& referenced, Range vector) {
+    for (LookupTables& tables : referenced.lookups) {
+        if (tables.vector == vector) {
+            return tables;
+        }
+    }
+    referenced.lookups.push_back(LookupTables{ vector, std::nullopt, std::nullopt });
+    return referenced.lookups.back();
+}
+
+void RangeIndex::Clear() {
+    columns_.clear();
+    cached_.clear();
+}
+
+std::uint64_t RangeIndex::RangeKey(Range range) {
+    // координаты меньше 2^16 (Position::MAX_ROWS, Position::MAX_COLS)
+    return (static_cast<std::uint64_t>(range.from.row) << 48) |
+           (static_cast<std::uint64_t>(range.from.col) << 32) |
+           (static_cast<std::uint64_t>(range.to.row) << 16) |
+           static_cast<std::uint64_t>(range.to.col);
+}
+
+void RangeIndex::Grow(Column& column, int row) {
+    std::size_t size = std::max({ static_cast<std::size_t>(row) + 1, column.values.size() * 2,
+                                  MIN_COLUMN_SIZE });
+    column.values.resize(size, BLANK);
+    Rebuild(column);
+}
+
+void RangeIndex::Rebuild(Column& column) {
+    // каждый узел передаёт накопленное родителю
+    const std::size_t size = column.values.size();
+    column.magnitude = 0.;
+    column.error = 0.;
+    column.updates = 0;
+    column.sum_tree.assign(size + 1, 0.);
+    column.count_tree.assign(size + 1, 0);
+    for (std::size_t i = 1; i <= size; ++i) {
+        if (IsNumber(column.values[i - 1])) {
+            column.sum_tree[i] += column.values[i - 1];
+            column.count_tree[i] += 1;
+            column.magnitude += std::abs(column.values[i - 1]);
+            column.error += RoundingError(column.sum_tree[i]);
+        }
+        std::size_t parent = i + (i & (~i + 1));
+        if (parent <= size) {
+            column.sum_tree[parent] += column.sum_tree[i];
+            column.error += RoundingError(column.sum_tree[parent]);
+            column.count_tree[parent] += column.count_tree[i];
+        }
+    }
+}
+
+void RangeIndex::Add(Column& column, int row, double value, int count) {
+    // поправки копят ошибку округления в узлах - время от времени дерево
+    // строится заново по точным значениям
+    if (++column.updates >= std::max(column.values.size() / REBUILD_UPDATES_PER_ROW_DIVISOR,
+                                     MIN_REBUILD_UPDATES)) {
+        Rebuild(column);
+        return;
+    }
+    column.magnitude += std::abs(value);
+    for (std::size_t i = static_cast<std::size_t>(row) + 1; i < column.sum_tree.size(); i += i & (~i + 1)) {
+        column.sum_tree[i] += value;
+        column.count_tree[i] += static_cast<std::size_t>(count);
+        column.error += RoundingError(column.sum_tree[i]);
+    }
+}
+
+RangeTotals RangeIndex::Prefix(const Column& column, int end) {
+    RangeTotals totals;
+    std::size_t i = std::min(static_cast<std::size_t>(end), column.values.size());
+    for (; i > 0; i -= i & (~i + 1)) {
+        totals.sum += column.sum_tree[i];
+        totals.count += column.count_tree[i];
+    }
+    return totals;
+}
+
+RangeTotals RangeIndex::ColumnTotals(const Column& column, int begin, int end, bool resum) {
+    RangeTotals totals;
+    const int stored_end = std::min(end, static_cast<int>(column.values.size()));
+    if (begin >= stored_end) {
+        return totals;
+    }
+    if (!resum && stored_end - begin > DIRECT_SUM_ROWS) {
+        RangeTotals to = Prefix(column, stored_end);
+        RangeTotals from = Prefix(column, begin);
+        totals.sum = to.sum - from.sum;
+        totals.count = to.count - from.count;
+
+        // ошибка узлов обоих префиксов и сложения не больше глубины узлов в
+        // каждом из них и вычитания
+        double depth = 1.;
+        for (std::size_t size = column.values.size(); size > 1; size >>= 1) {
+            ++depth;
+        }
+        const double error = 2. * column.error +
+                             std::numeric_limits<double>::epsilon() * (2. * depth + 1.) * column.magnitude;
+        if (error <= MAX_RELATIVE_ERROR * std::abs(totals.sum)) {
+            return totals;
+        }
+        totals = RangeTotals{};
+    }
+    // в порядке строк, как при обходе ячеек
+    for (int row = begin; row < stored_end; ++row) {
+        const double value = column.values[row];
+        if (IsNumber(value)) {
+            totals.sum += value;
+            ++totals.count;
+        }
+    }
+    return totals;
+}
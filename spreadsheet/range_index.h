@@ -0,0 +1,185 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+// Индекс таблицы для функций над диапазонами (SUM, COUNT, AVERAGE, MIN, MAX,
+// SUMPRODUCT, MATCH, VLOOKUP).
+// По каждому столбцу хранит:
+// * деревья Фенвика сумм и количеств числовых констант - итоги по отрезку
+//   строк за O(log n) вместо обхода ячеек;
+// * сами значения констант подряд по строкам - по ним MIN, MAX и SUMPRODUCT
+//   сворачиваются векторизуемыми циклами (reduction.h);
+// * строки формульных ячеек - их значения меняются без SetCell(), поэтому
+//   они вычисляются по одной;
+// * формулы, диапазоны которых захватывают столбец, - чтобы при изменении
+//   ячейки сбросить кэш ссылающихся на неё через диапазон формул.
+// Суммы обновляются приращениями, поэтому разность префиксов может потерять
+// точность (мелкие значения рядом с крупными или после крупных поправок).
+// Короткие отрезки (до DIRECT_SUM_ROWS строк) и отрезки, сумма которых мала
+// по сравнению с оценкой ошибки дерева, суммируются по самим значениям
+// столбца, как при обходе ячеек. Дерево столбца перестраивается по значениям
+// после числа поправок порядка размера столбца, что ограничивает накопление
+// ошибки при амортизированной стоимости O(1) на правку.
+//
+// Для диапазонов, на которые ссылаются формулы, индекс хранит и готовые итоги
+// (вместе со значениями формул диапазона). Изменение числовой константы
+// поправляет их на разность нового и старого значения за O(1), поэтому
+// пересчёт агрегата после такой правки не обходит диапазон. Изменение формулы
+// в диапазоне сбрасывает итоги, а после MAX_DELTA_UPDATES поправок они
+// пересчитываются заново суммированием самих значений констант, чтобы
+// ограничить накопление ошибки округления.
+//
+// Для поиска в строках и столбцах таких диапазонов индекс при первом
+// обращении строит хэш-таблицу значений констант (точное совпадение) или
+// упорядоченный словарь (ближайшее меньшее) и дальше поддерживает их при
+// каждом изменении ячейки, так что поиск не обходит диапазон.
+class RangeIndex {
+public:
+    static const int MAX_DELTA_UPDATES = 1024;
+    // отрезки столбца не длиннее суммируются без деревьев Фенвика
+    static const int DIRECT_SUM_ROWS = 64;
+
+    // Обновляет сведения о ячейке pos: number - значение числовой константы
+    // (std::nullopt - ячейки нет или она не число), formula - ячейка с формулой
+    void SetCell(Position pos, std::optional<double> number, bool formula);
+
+    // Итоги по числовым константам диапазона
+    RangeTotals GetConstantTotals(Range range) const;
+
+    // Наименьшая и наибольшая числовая константа диапазона
+    RangeExtrema GetConstantExtrema(Range range) const;
+
+    // Сумма попарных произведений констант диапазонов одного размера
+    // (формулы и нечисловые ячейки дают ноль)
+    double GetConstantProduct(Range lhs, Range rhs) const;
+
+    // Найденная константа: смещение от начала диапазона и её значение
+    struct LookupMatch {
+        int offset;
+        double key;
+    };
+    // Поиск числа value среди констант строки или столбца range (формульные
+    // ячейки не учитываются). Если range лежит в диапазоне, на который
+    // ссылается формула, используются индексы поиска, иначе строка или столбец
+    // обходится. Может вызываться из нескольких читающих потоков одновременно.
+    std::optional<LookupMatch> LookupConstant(Range range, double value, LookupMode mode) const;
+
+    // Позиции формульных ячеек диапазона
+    std::vector<Position> GetFormulaCells(Range range) const;
+    // Обход формульных ячеек диапазона по столбцам без выделения памяти
+    template <typename Visitor>
+    void ForEachFormulaCell(Range range, Visitor visitor) const {
+        const int last_col = std::min(range.to.col, static_cast<int>(columns_.size()) - 1);
+        for (int col = range.from.col; col <= last_col; ++col) {
+            const std::set<int>& rows = columns_[col].formula_rows;
+            for (auto it = rows.lower_bound(range.from.row); it != rows.end() && *it <= range.to.row; ++it) {
+                visitor(Position{ *it, col });
+            }
+        }
+    }
+
+    // Выписывает числовые константы диапазона по строкам в out (по элементу
+    // на ячейку), в mask (если задан) - 1 для числа; остальные ячейки
+    // получают 0. Возвращает число констант.
+    std::size_t ReadConstants(Range range, double* out, std::uint8_t* mask) const;
+
+    // Формула cell ссылается на диапазон range
+    void AddDependent(Range range, CellInterface* cell);
+    void RemoveDependent(Range range, CellInterface* cell);
+
+    // Добавляет в result формулы, диапазоны которых содержат pos
+    void CollectDependents(Position pos, std::vector<CellInterface*>& result) const;
+    // Добавляет в result формулы, диапазоны которых пересекаются с area
+    // (возможны повторы)
+    void CollectDependents(const Range& area, std::vector<CellInterface*>& result) const;
+
+    // Готовые итоги диапазона, если они актуальны
+    std::optional<RangeTotals> GetCachedTotals(Range range) const;
+    // Запоминает итоги диапазона, на который ссылается хотя бы одна формула.
+    // Может вызываться из нескольких читающих потоков одновременно.
+    void CacheTotals(Range range, RangeTotals totals) const;
+    // Значение формулы в позиции pos могло измениться - сбрасывает итоги
+    // содержащих её диапазонов
+    void DropCachedTotals(Position pos);
+
+    void Clear();
+
+private:
+    struct Dependent {
+        int from_row;
+        int to_row;
+        CellInterface* cell;
+    };
+
+    // Индексы поиска по строке или столбцу vector: смещения констант по
+    // значению; каждый строится при первом поиске своего вида
+    struct LookupTables {
+        Range vector;
+        std::optional<std::unordered_map<double, std::set<int>>> exact;
+        std::optional<std::map<double, std::set<int>>> sorted;
+    };
+
+    // Диапазон, на который ссылаются формулы
+    struct ReferencedRange {
+        Range range;
+        RangeTotals totals;
+        bool valid = false;
+        bool resum = false;     // итоги сброшены по числу поправок - следующий
+                                // расчёт суммирует значения, а не деревья
+        int updates = 0;        // поправок после полного расчёта
+        int references = 0;     // число формул, ссылающихся на диапазон
+        std::vector<LookupTables> lookups;  // по строкам и столбцам диапазона
+    };
+
+    struct Column {
+        std::vector<double> values;         // значения констант по строкам, NaN - не число
+        std::vector<double> sum_tree;       // деревья Фенвика, индексация с единицы
+        std::vector<std::size_t> count_tree;
+        double magnitude = 0.;              // сумма модулей значений при перестройке
+                                            // дерева и модулей поправок после неё
+        double error = 0.;                  // граница суммарной ошибки округления узлов
+        std::size_t updates = 0;            // поправок дерева после перестройки
+        std::set<int> formula_rows;
+        std::vector<Dependent> dependents;
+        std::vector<std::uint64_t> cached;  // ключи итогов диапазонов со столбцом
+    };
+
+    std::vector<Column> columns_;
+    // итоги и индексы поиска диапазонов по ключу RangeKey(); заполняются
+    // читателями под мьютексом
+    mutable std::unordered_map<std::uint64_t, ReferencedRange> cached_;
+    mutable std::mutex cache_mutex_;
+
+    static std::uint64_t RangeKey(Range range);
+    // поправляет итоги диапазонов, содержащих pos, на изменение константы
+    void AdjustCachedTotals(Position pos, double value, int count);
+    // переносит константу в позиции pos в индексах поиска со значения
+    // old_key на new_key (NaN - не число)
+    void UpdateLookups(Position pos, double old_key, double new_key);
+
+    // значение константы в позиции pos (NaN - не число)
+    double GetConstant(Position pos) const;
+    // индексы поиска по строке или столбцу vector диапазона referenced
+    static LookupTables& GetLookupTables(ReferencedRange& referenced, Range vector);
+
+    // расширяет столбец до строки row с перестройкой деревьев за O(n)
+    static void Grow(Column& column, int row);
+    // строит деревья столбца заново по значениям за O(n)
+    static void Rebuild(Column& column);
+    static void Add(Column& column, int row, double value, int count);
+    // итоги по строкам [0, end)
+    static RangeTotals Prefix(const Column& column, int end);
+    // итоги по строкам [begin, end): по деревьям или, если их ошибка может
+    // быть сравнима с результатом (или resum), - суммированием значений
+    static RangeTotals ColumnTotals(const Column& column, int begin, int end, bool resum);
+};
@@ -0,0 +1,158 @@
+#include "reduction.h"
+
+#include <algorithm>
+#include <limits>
+#include <thread>
+
+namespace {
+
+// Число независимых аккумуляторов. Они записаны отдельными переменными: так
+// компилятор держит их в регистрах и упаковывает соседние в один SIMD-регистр
+// (SLP-векторизация), а цепочки зависимостей сравнений и сложений не
+// выстраиваются в одну очередь.
+const std::size_t LANES = 4;
+
+// пропуск (NaN) в попарном произведении - ноль
+inline double Number(double value) {
+    return value == value ? value : 0.;
+}
+
+// Делит отрезки на части примерно по total / threads значений, сворачивает
+// части в отдельных потоках и объединяет результаты по порядку
+template <typename Result, typename Reduce, typename Merge>
+Result ReduceSegments(const std::vector<ReductionSegment>& segments, Result init,
+                      Reduce reduce, Merge merge) {
+    std::size_t total = 0;
+    for (const ReductionSegment& segment : segments) {
+        total += segment.size;
+    }
+    static const unsigned threads = std::thread::hardware_concurrency();
+    if (total < REDUCTION_PARALLEL_MIN_VALUES || threads < 2) {
+        Result result = init;
+        for (const ReductionSegment& segment : segments) {
+            merge(result, reduce(segment));
+        }
+        return result;
+    }
+
+    const std::size_t chunk = (total + threads - 1) / threads;
+    std::vector<std::vector<ReductionSegment>> parts(1);
+    std::size_t part_size = 0;
+    for (ReductionSegment segment : segments) {
+        while (segment.size > 0) {
+            if (part_size == chunk) {
+                parts.emplace_back();
+                part_size = 0;
+            }
+            ReductionSegment piece = segment;
+            piece.size = std::min(segment.size, chunk - part_size);
+            parts.back().push_back(piece);
+            part_size += piece.size;
+
+            segment.lhs += piece.size;
+            if (segment.rhs) {
+                segment.rhs += piece.size;
+            }
+            segment.size -= piece.size;
+        }
+    }
+
+    std::vector<Result> results(parts.size(), init);
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+        workers.emplace_back([&parts, &results, &reduce, &merge, i] {
+            for (const ReductionSegment& segment : parts[i]) {
+                merge(results[i], reduce(segment));
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    Result result = init;
+    for (const Result& part : results) {
+        merge(result, part);
+    }
+    return result;
+}
+
+}  // namespace
+
+RangeExtrema ReduceExtrema(const ReductionSegment& segment) {
+    const double inf = std::numeric_limits<double>::infinity();
+    double min0 = inf, min1 = inf, min2 = inf, min3 = inf;
+    double max0 = -inf, max1 = -inf, max2 = -inf, max3 = -inf;
+    double count0 = 0., count1 = 0., count2 = 0., count3 = 0.;
+
+    // сравнение с NaN ложно: пропуск не меняет аккумуляторы
+    const double* values = segment.lhs;
+    const std::size_t size = segment.size;
+    std::size_t i = 0;
+    for (; i + LANES <= size; i += LANES) {
+        double a = values[i], b = values[i + 1], c = values[i + 2], d = values[i + 3];
+        min0 = a < min0 ? a : min0;
+        min1 = b < min1 ? b : min1;
+        min2 = c < min2 ? c : min2;
+        min3 = d < min3 ? d : min3;
+        max0 = a > max0 ? a : max0;
+        max1 = b > max1 ? b : max1;
+        max2 = c > max2 ? c : max2;
+        max3 = d > max3 ? d : max3;
+        count0 += a == a ? 1. : 0.;
+        count1 += b == b ? 1. : 0.;
+        count2 += c == c ? 1. : 0.;
+        count3 += d == d ? 1. : 0.;
+    }
+    for (; i < size; ++i) {
+        double a = values[i];
+        min0 = a < min0 ? a : min0;
+        max0 = a > max0 ? a : max0;
+        count0 += a == a ? 1. : 0.;
+    }
+
+    RangeExtrema result{ min0, max0, 0 };
+    result.Merge(RangeExtrema{ min1, max1, 0 });
+    result.Merge(RangeExtrema{ min2, max2, 0 });
+    result.Merge(RangeExtrema{ min3, max3, 0 });
+    result.count = static_cast<std::size_t>(count0 + count1 + count2 + count3);
+    return result;
+}
+
+double ReduceProduct(const ReductionSegment& segment) {
+    double sum0 = 0., sum1 = 0., sum2 = 0., sum3 = 0.;
+    const double* lhs = segment.lhs;
+    const double* rhs = segment.rhs;
+    std::size_t i = 0;
+    for (; i + LANES <= segment.size; i += LANES) {
+        sum0 += Number(lhs[i]) * Number(rhs[i]);
+        sum1 += Number(lhs[i + 1]) * Number(rhs[i + 1]);
+        sum2 += Number(lhs[i + 2]) * Number(rhs[i + 2]);
+        sum3 += Number(lhs[i + 3]) * Number(rhs[i + 3]);
+    }
+    for (; i < segment.size; ++i) {
+        sum0 += Number(lhs[i]) * Number(rhs[i]);
+    }
+    return (sum0 + sum1) + (sum2 + sum3);
+}
+
+RangeExtrema ReduceExtrema(const std::vector<ReductionSegment>& segments) {
+    return ReduceSegments(
+        segments, RangeExtrema{},
+        [](const ReductionSegment& segment) {
+            return ReduceExtrema(segment);
+        },
+        [](RangeExtrema& result, const RangeExtrema& part) {
+            result.Merge(part);
+        });
+}
+
+double ReduceProduct(const std::vector<ReductionSegment>& segments) {
+    return ReduceSegments(
+        segments, 0.,
+        [](const ReductionSegment& segment) {
+            return ReduceProduct(segment);
+        },
+        [](double& result, double part) {
+            result += part;
+        });
+}
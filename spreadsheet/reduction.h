@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <vector>
+
+// Свёртки непрерывных массивов значений для функций над диапазонами.
+// Пропуски (пустые, текстовые и формульные ячейки) хранятся как NaN: сравнение
+// с NaN ложно, поэтому циклы обходятся без ветвлений и с несколькими
+// независимыми аккумуляторами векторизуются компилятором под доступный набор
+// SIMD-инструкций. Файл нельзя собирать с -ffast-math: он отменяет семантику
+// NaN. Большие объёмы делятся между потоками.
+
+// Отрезок данных: lhs (и rhs для попарных свёрток) - size значений подряд
+struct ReductionSegment {
+    const double* lhs = nullptr;
+    const double* rhs = nullptr;
+    std::size_t size = 0;
+};
+
+// Минимум, максимум и количество чисел отрезка (NaN пропускаются)
+RangeExtrema ReduceExtrema(const ReductionSegment& segment);
+// Сумма попарных произведений lhs и rhs (NaN считается нулём)
+double ReduceProduct(const ReductionSegment& segment);
+
+// Свёртки набора отрезков; при объёме от REDUCTION_PARALLEL_MIN_VALUES
+// значений отрезки делятся между потоками
+inline constexpr std::size_t REDUCTION_PARALLEL_MIN_VALUES = 1 << 18;
+RangeExtrema ReduceExtrema(const std::vector<ReductionSegment>& segments);
+double ReduceProduct(const std::vector<ReductionSegment>& segments);
@@ -2,11 +2,20 @@
 
 #include "cell.h"
 #include "common.h"
+#include "journal.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <charconv>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <locale>
 #include <optional>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
 
 using namespace std::literals;
 
@@ -18,244 +27,2186 @@ void Sheet::SetCell(Position pos, std::string text) {
         throw InvalidPositionException("Invalid position for SetCell()");
     }
 
+    if (in_transaction_)
+    {
+        std::unique_ptr<Cell> p_new_cell = PreCreateNewCell(pos, text);
+        if (RejectsCycle(pos, *p_new_cell))
+        {
+            throw CircularDependencyException("Circular dependency detected!");
+        }
+        staged_[pos] = StagedEdit{ std::move(p_new_cell), std::move(text) };
+        return;
+    }
+
+    OperationScope operation(*this);
     // проверяем размер sheet, если нужно увеличиваем
     ResizeSheet(pos);
 
     // создаём новую ячейку, разбираем связи (если они есть) из text,
     // но пока не заносим её в таблицу
     std::unique_ptr<Cell> p_new_cell = PreCreateNewCell(pos, text);
+    InstallCell(pos, std::move(p_new_cell));
+
+    if (journal_)
+    {
+        journal_->LogSet(pos, text);
+    }
+    operation.Finish();
+}
+
+void Sheet::InstallCell(Position pos, std::unique_ptr<Cell> p_new_cell, bool check_cycles) {
+    // проверяем на циклические зависимости новое содержимое cell (в том числе
+    // для новой позиции: она может входить в диапазон формулы, от которой зависит);
+    // в итеративном режиме цикл допустим, но его ячейки отмечаются
+    const bool cyclic = p_new_cell->GetFormula() != nullptr && (check_cycles || iteration_.enabled) &&
+                        IsCyclic(pos, *p_new_cell);
+    if (cyclic && !iteration_.enabled) {
+        throw CircularDependencyException("Circular dependency detected!");
+    }
+
+    RecordCell(PositionToCell(pos), pos);
+    ++version_;
+
+    // Инвалидируем кэш этой ячейки и всех зависимых, в том числе формул с
+    // диапазонами, в которые она входит (в пакете - в конце пакета)
+    if (batch_depth_ > 0) {
+        pending_invalidation_.push_back(pos);
+    } else {
+        InvalidateCell(pos);
+    }
+
+    // старая ячейка - (ячейка с pos в таблице)
+    Cell* old_cell = static_cast<Cell*>(GetCell(pos));
+    std::vector<Cell*> released;
+    // если ячейка существует  
+    if (old_cell) { 
+        Cell::GraphReference& graph_new_cell = (*p_new_cell.get()).GetGraphReference();
+
+        // переносим информацию зависимостях в новую ячейку
+        Cell::GraphReference graph_old_cell = (*old_cell).GetGraphReference();
+        for ( CellInterface* cell_dep : graph_old_cell.GetDependent()) {
+            // добавляем зависимость в новую ячейку
+            graph_new_cell.AddDependency(cell_dep);
+            // в зависимой ячейки удаляем ссылку на старую ячейку
+            static_cast<Cell*>(cell_dep)->GetGraphReference().DeleteReferences(old_cell);
+        }
+        // старая ячейка удаляется - убираем её из зависимых у ячеек, на которые она ссылалась
+        for (Cell* cell_ref : graph_old_cell.GetReferences()) {
+            cell_ref->GetGraphReference().DeleteDependency(old_cell);
+            UnlinkSheetReference(cell_ref);
+            released.push_back(cell_ref);
+        }
+        UnindexCell(*old_cell);
+    }
+
+    // заносим ячейку в таблицу
+    sheet_.at(pos.row).at(pos.col).swap(p_new_cell);
+    Cell* new_cell = static_cast<Cell*>(sheet_.at(pos.row).at(pos.col).get());
+
+    // обнавляем cсылки
+    UpdatesReferences(new_cell);
+    IndexCell(pos);
+    // заглушки, на которые новая формула не ссылается, больше не нужны
+    ReleasePlaceholders(std::move(released));
+   
+    if (cyclic) {
+        MarkCycle(new_cell);
+    }
+   
+    // изменяем, если нужно, минимальную печатную область
+    ExtendPrintableSize(pos);
+    MarkRowChanged(pos.row);
+}
+
+void Sheet::BeginBatchUpdate()
+{
+    // пакет - один шаг истории правок; значения, прочитанные внутри пакета,
+    // могли быть вычислены по частично изменённой таблице
+    BeginOperation(false);
+    ++batch_depth_;
+}
+
+void Sheet::EndBatchUpdate()
+{
+    EndBatch(true);
+}
+
+void Sheet::EndBatch(bool notify)
+{
+    if (batch_depth_ == 0)
+    {
+        return;
+    }
+    if (--batch_depth_ == 0)
+    {
+        // каждая изменённая ячейка инвалидируется один раз; уже сброшенный кэш
+        // останавливает обход, поэтому общие зависимые ячейки обходятся однократно
+        std::vector<Position> pending = std::move(pending_invalidation_);
+        pending_invalidation_.clear();
+        std::sort(pending.begin(), pending.end(), [](Position lhs, Position rhs) {
+            return std::make_pair(lhs.row, lhs.col) < std::make_pair(rhs.row, rhs.col);
+        });
+        pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+        if (!pending.empty())
+        {
+            ++version_;
+        }
+        for (Position pos : pending)
+        {
+            InvalidateCell(pos);
+        }
+    }
+    // шаг истории закрывается и изменения рассылаются после инвалидации
+    EndOperation(notify);
+}
+
+void Sheet::BeginOperation(bool exact)
+{
+    ++operation_depth_;
+    BeginHistoryAction(exact);
+}
+
+void Sheet::EndOperation(bool notify)
+{
+    EndHistoryAction();
+    if (--operation_depth_ > 0 || !notify)
+    {
+        return;
+    }
+    // операция могла изменить значения формул других листов книги
+    if (workbook_ == nullptr)
+    {
+        DeliverChanges();
+        return;
+    }
+    // исключение подписчика одного листа не лишает изменений другие листы
+    std::exception_ptr error;
+    const std::vector<std::string>& names = workbook_->GetSheetNames();
+    for (std::size_t i = 0; i < names.size(); ++i)
+    {
+        try
+        {
+            workbook_->GetSheet(names[i])->DeliverChanges();
+        }
+        catch (...)
+        {
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+void Sheet::BeginTransaction()
+{
+    if (in_transaction_)
+    {
+        throw std::logic_error("Transaction is already started");
+    }
+    in_transaction_ = true;
+}
+
+void Sheet::Commit()
+{
+    if (!in_transaction_)
+    {
+        throw std::logic_error("No transaction to commit");
+    }
+
+    // листы книги могли измениться после проверки правок - проверяем циклы
+    // заново, пока таблица ещё не тронута
+    for (const auto& [pos, edit] : staged_)
+    {
+        if (edit.cell && RejectsCycle(pos, *edit.cell))
+        {
+            throw CircularDependencyException("Circular dependency detected!");
+        }
+    }
+
+    in_transaction_ = false;
+    OperationScope operation(*this);
+    std::map<Position, StagedEdit, PositionLess> staged = std::move(staged_);
+    staged_.clear();
+
+    BeginBatchUpdate();
+    for (auto& [pos, edit] : staged)
+    {
+        if (!edit.cell)
+        {
+            ClearCell(pos);
+            continue;
+        }
+        ResizeSheet(pos);
+        // ссылки подготовленной ячейки могли устареть из-за других правок;
+        // промежуточный граф может содержать цикл, который снимет следующая
+        // правка, поэтому циклы (уже проверенные) не перепроверяются
+        edit.cell->UpdateGraphReference();
+        InstallCell(pos, std::move(edit.cell), false);
+        if (journal_)
+        {
+            journal_->LogSet(pos, edit.text);
+        }
+    }
+    EndBatchUpdate();
+    operation.Finish();
+}
+
+void Sheet::Rollback()
+{
+    if (!in_transaction_)
+    {
+        throw std::logic_error("No transaction to roll back");
+    }
+    in_transaction_ = false;
+    staged_.clear();
+}
+
+bool Sheet::InTransaction() const
+{
+    return in_transaction_;
+}
+
+bool Sheet::IsCyclic(Position pos, const Cell& cell) const
+{
+    // обход в глубину по ячейкам (лист, позиция): для позиций этого листа с
+    // накопленной правкой берутся ссылки правки, для остальных - формулы таблицы
+    struct Node {
+        const Sheet* sheet;
+        Position pos;
+
+        bool operator<(const Node& rhs) const {
+            return std::make_tuple(sheet, pos.row, pos.col) <
+                   std::make_tuple(rhs.sheet, rhs.pos.row, rhs.pos.col);
+        }
+    };
+
+    // на позицию не ссылается ни одна формула - цикл может замкнуть только
+    // ссылка формулы на себя: прямая (итеративный режим, иначе она отсекается
+    // при разборе) или через диапазон
+    if (staged_.empty())
+    {
+        const Cell* current = PositionToCell(pos);
+        std::vector<CellInterface*> range_dependents;
+        range_index_.CollectDependents(pos, range_dependents);
+        if (range_dependents.empty() &&
+            (current == nullptr || current->GetGraphReference().GetDependent().empty()))
+        {
+            const std::vector<Position> refs = cell.GetReferencedCells();
+            if (std::find(refs.begin(), refs.end(), pos) != refs.end())
+            {
+                return true;
+            }
+            for (const SheetCellRef& ref : cell.GetSheetReferencedCells())
+            {
+                if (ref.pos == pos && FindWorkbookSheet(ref.sheet) == this)
+                {
+                    return true;
+                }
+            }
+            for (const Range& range : cell.GetReferencedRanges())
+            {
+                if (range.Contains(pos))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+
+    std::vector<Node> stack;
+    auto push_formula_refs = [this, pos, &stack](const Sheet* owner, const Cell& formula_cell) {
+        for (Position ref : formula_cell.GetReferencedCells())
+        {
+            stack.push_back(Node{ owner, ref });
+        }
+        for (const SheetCellRef& ref : formula_cell.GetSheetReferencedCells())
+        {
+            if (const Sheet* target = owner->FindWorkbookSheet(ref.sheet))
+            {
+                stack.push_back(Node{ target, ref.pos });
+            }
+        }
+        // диапазон зависит от всех своих ячеек, но продолжить цикл могут только
+        // формулы в нём и сама проверяемая позиция
+        for (const Range& range : formula_cell.GetReferencedRanges())
+        {
+            for (Position ref : owner->range_index_.GetFormulaCells(range))
+            {
+                stack.push_back(Node{ owner, ref });
+            }
+            if (owner != this)
+            {
+                continue;
+            }
+            if (range.Contains(pos))
+            {
+                stack.push_back(Node{ this, pos });
+            }
+            for (const auto& [staged_pos, edit] : staged_)
+            {
+                if (edit.cell && range.Contains(staged_pos))
+                {
+                    stack.push_back(Node{ this, staged_pos });
+                }
+            }
+        }
+    };
+
+    push_formula_refs(this, cell);
+    std::set<Node> visited;
+    while (!stack.empty())
+    {
+        Node node = stack.back();
+        stack.pop_back();
+        if (node.sheet == this && node.pos == pos)
+        {
+            return true;
+        }
+        if (!visited.insert(node).second)
+        {
+            continue;
+        }
+
+        auto staged = node.sheet == this ? staged_.find(node.pos) : staged_.end();
+        if (staged != staged_.end())
+        {
+            if (staged->second.cell)
+            {
+                push_formula_refs(this, *staged->second.cell);
+            }
+            continue;
+        }
+        const Cell* committed = node.sheet->PositionToCell(node.pos);
+        if (committed && committed->GetFormula())
+        {
+            push_formula_refs(node.sheet, *committed);
+        }
+    }
+    return false;
+}
+
+bool Sheet::RejectsCycle(Position pos, const Cell& cell) const
+{
+    return !iteration_.enabled && IsCyclic(pos, cell);
+}
+
+void Sheet::SetDynamicDependencies(bool enabled)
+{
+    dynamic_dependencies_ = enabled;
+}
+
+void Sheet::AttachJournal(Journal* journal)
+{
+    journal_ = journal;
+}
+
+CellInterface* Sheet::GetCell(Position pos)
+{
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid position for GetCell()");
+    }
+
+    if (!CellExists(pos))
+    {
+        return nullptr;
+    }
+
+    if (sheet_.at(pos.row).at(pos.col).get() == nullptr) {
+        return nullptr;
+    }
+    return sheet_.at(pos.row).at(pos.col).get();
+}
+
+const CellInterface* Sheet::GetCell(const Position pos) const {  
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid position for GetCell()");
+    }
+
+    if (!CellExists(pos))
+    {
+        return nullptr;
+    }
+
+    if (sheet_.at(pos.row).at(pos.col).get() == nullptr) {
+        return nullptr;
+    }
+    return sheet_.at(pos.row).at(pos.col).get();
+}
+
+void Sheet::ClearCell(Position pos) {
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid position for ClearCell()");
+    }
+
+    if (in_transaction_)
+    {
+        staged_[pos] = StagedEdit{};
+        return;
+    }
+
+    OperationScope operation(*this);
+    RemoveCell(pos);
+
+    if (journal_)
+    {
+        journal_->LogClear(pos);
+    }
+
+    if ((pos.row + 1 == max_row_) || (pos.col + 1 == max_col_))
+    {
+        // Удаленная ячейка была на границе Printable Area. Нужен перерасчет
+        UpdatePrintableSize();
+    }
+    operation.Finish();
+}
+
+void Sheet::RemoveCell(Position pos)
+{
+    if (Cell* cell = PositionToCell(pos))
+    {
+        RecordCell(cell, pos);
+        // значение ячейки пропадает - сбрасываем кэш зависимых от неё формул
+        if (batch_depth_ > 0)
+        {
+            pending_invalidation_.push_back(pos);
+        }
+        else
+        {
+            InvalidateCell(pos);
+        }
+        // формула уходит из зависимых ячеек, на которые ссылалась
+        std::vector<Cell*> released = cell->GetGraphReference().GetReferences();
+        for (Cell* ref_cell : released)
+        {
+            ref_cell->GetGraphReference().DeleteDependency(cell);
+            UnlinkSheetReference(ref_cell);
+        }
+        UnindexCell(*cell);
+        if (cell->GetGraphReference().GetDependent().empty())
+        {
+            sheet_.at(pos.row).at(pos.col).reset();
+        }
+        else
+        {
+            // на ячейку ссылаются формулы - она остаётся в графе пустой
+            cell->Set(std::string());
+            cell->GetGraphReference().UpdateReferences({});
+        }
+        IndexCell(pos);
+        ++version_;
+        MarkRowChanged(pos.row);
+        ReleasePlaceholders(std::move(released));
+    }
+}
+
+void Sheet::LoadTextCell(Position pos, std::string_view text)
+{
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid position for LoadTextCell()");
+    }
+
+    if (in_transaction_ || PositionToCell(pos) != nullptr ||
+        (text.size() > 1 && text.front() == FORMULA_SIGN))
+    {
+        SetCell(pos, std::string(text));
+        return;
+    }
+
+    OperationScope operation(*this);
+    RecordCell(nullptr, pos);
+    ResizeSheet(pos);
+    std::unique_ptr<Cell> new_cell = std::make_unique<Cell>(*this, pos);
+    new_cell->Set(std::string(text));
+    sheet_.at(pos.row).at(pos.col) = std::move(new_cell);
+    IndexCell(pos);
+
+    ++version_;
+    ExtendPrintableSize(pos);
+    MarkRowChanged(pos.row);
+
+    // ячейка могла попасть в диапазон формулы
+    if (batch_depth_ > 0)
+    {
+        pending_invalidation_.push_back(pos);
+    }
+    else
+    {
+        InvalidateCell(pos);
+    }
+
+    if (journal_)
+    {
+        journal_->LogSet(pos, text);
+    }
+    operation.Finish();
+}
+
+namespace {
+
+// Вставляет count пустых элементов перед index или (count < 0) удаляет -count
+// элементов начиная с index; элементы за концом вектора не трогаются
+template <typename T>
+void ShiftItems(std::vector<T>& items, int index, int count)
+{
+    const int size = static_cast<int>(items.size());
+    if (index >= size)
+    {
+        return;
+    }
+    if (count < 0)
+    {
+        items.erase(items.begin() + index, items.begin() + std::min(size, index - count));
+        return;
+    }
+    items.resize(size + count);
+    std::move_backward(items.begin() + index, items.begin() + size, items.end());
+    for (int i = index; i < index + count; ++i)
+    {
+        items[i] = T{};
+    }
+}
+
+}  // namespace
+
+void Sheet::InsertRows(int index, int count)
+{
+    if (index < 0 || index >= Position::MAX_ROWS || count <= 0 || count > Position::MAX_ROWS)
+    {
+        throw InvalidPositionException("Invalid rows for InsertRows()");
+    }
+    ShiftCells(ReferenceShift{ true, index, count });
+}
+
+void Sheet::DeleteRows(int index, int count)
+{
+    if (index < 0 || index >= Position::MAX_ROWS || count <= 0)
+    {
+        throw InvalidPositionException("Invalid rows for DeleteRows()");
+    }
+    ShiftCells(ReferenceShift{ true, index, -std::min(count, Position::MAX_ROWS - index) });
+}
+
+void Sheet::InsertCols(int index, int count)
+{
+    if (index < 0 || index >= Position::MAX_COLS || count <= 0 || count > Position::MAX_COLS)
+    {
+        throw InvalidPositionException("Invalid columns for InsertCols()");
+    }
+    ShiftCells(ReferenceShift{ false, index, count });
+}
+
+void Sheet::DeleteCols(int index, int count)
+{
+    if (index < 0 || index >= Position::MAX_COLS || count <= 0)
+    {
+        throw InvalidPositionException("Invalid columns for DeleteCols()");
+    }
+    ShiftCells(ReferenceShift{ false, index, -std::min(count, Position::MAX_COLS - index) });
+}
+
+void Sheet::ShiftCells(const ReferenceShift& shift)
+{
+    if (in_transaction_)
+    {
+        throw std::logic_error("Rows and columns cannot be inserted or deleted in a transaction");
+    }
+    OperationScope operation(*this);
+    const int limit = shift.rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    const Size printable_before = GetPrintableSize();
+
+    // обход ячеек, которые сдвигаются или удаляются
+    auto for_each_shifted = [this, &shift](auto action)
+    {
+        for (int row = shift.rows ? shift.index : 0; row < static_cast<int>(sheet_.size()); ++row)
+        {
+            for (int col = shift.rows ? 0 : shift.index; col < static_cast<int>(sheet_[row].size()); ++col)
+            {
+                if (sheet_[row][col])
+                {
+                    action(sheet_[row][col].get(), Position{ row, col });
+                }
+            }
+        }
+    };
+
+    if (shift.count > 0)
+    {
+        for_each_shifted([&shift, limit](const Cell* /* cell */, Position pos)
+        {
+            if ((shift.rows ? pos.row : pos.col) + shift.count >= limit)
+            {
+                throw InvalidPositionException("Insertion would move cells out of the sheet");
+            }
+        });
+    }
+
+    // формулы, ссылки которых может задеть сдвиг: зависящие от сдвигаемых
+    // ячеек (на любом листе книги) и ссылающиеся на задетые диапазоны
+    std::unordered_set<Cell*> referencing;
+    std::vector<CellInterface*> range_dependents;
+    const int last_row = Position::MAX_ROWS - 1;
+    const int last_col = Position::MAX_COLS - 1;
+    range_index_.CollectDependents(
+        Range{ shift.rows ? Position{ shift.index, 0 } : Position{ 0, shift.index },
+               Position{ last_row, last_col } },
+        range_dependents);
+    for (CellInterface* dependent : range_dependents)
+    {
+        referencing.insert(static_cast<Cell*>(dependent));
+    }
+    std::vector<Cell*> deleted;
+    for_each_shifted([&](Cell* cell, Position pos)
+    {
+        for (Cell* dependent : cell->GetGraphReference().GetDependent())
+        {
+            referencing.insert(dependent);
+        }
+        if (shift.Apply(pos) == Position::NONE)
+        {
+            deleted.push_back(cell);
+        }
+    });
+
+    // отмена вставляет строки обратно и возвращает прежнее содержимое
+    // удалённых ячеек и формул со ссылками на сдвинутую часть листа
+    for (Cell* cell : deleted)
+    {
+        RecordCell(cell, cell->GetPosition());
+    }
+    for (Cell* cell : referencing)
+    {
+        RecordCell(cell, cell->GetPosition());
+    }
+    RecordStructure(shift);
+
+    // удаляемые ячейки выходят из графа
+    auto is_deleted = [this, &shift](const Cell* cell)
+    {
+        return &cell->GetSheet() == this && shift.Apply(cell->GetPosition()) == Position::NONE;
+    };
+    std::vector<Cell*> released;
+    for (Cell* cell : deleted)
+    {
+        referencing.erase(cell);
+        for (Cell* ref_cell : cell->GetGraphReference().GetReferences())
+        {
+            if (!is_deleted(ref_cell))
+            {
+                ref_cell->GetGraphReference().DeleteDependency(cell);
+                released.push_back(ref_cell);
+            }
+            UnlinkSheetReference(ref_cell);
+        }
+        for (Cell* dependent : cell->GetGraphReference().GetDependent())
+        {
+            if (!is_deleted(dependent))
+            {
+                dependent->GetGraphReference().DeleteReferences(cell);
+                static_cast<Sheet&>(dependent->GetSheet()).UnlinkSheetReference(cell);
+            }
+        }
+    }
+
+    // сдвиг хранилища: ячейки переезжают вместе со связями графа
+    ++version_;
+    std::vector<std::unique_ptr<Cell>> removed;
+    if (shift.rows)
+    {
+        if (shift.count < 0)
+        {
+            for (int row = shift.index; row < std::min<int>(sheet_.size(), shift.index - shift.count); ++row)
+            {
+                for (auto& cell : sheet_[row])
+                {
+                    removed.push_back(std::move(cell));
+                }
+            }
+        }
+        ShiftItems(sheet_, shift.index, shift.count);
+        ShiftItems(row_versions_, shift.index, shift.count);
+        ShiftItems(published_rows_, shift.index, shift.count);
+        ShiftItems(published_versions_, shift.index, shift.count);
+        sheet_.resize(std::min<std::size_t>(sheet_.size(), Position::MAX_ROWS));
+    }
+    else
+    {
+        for (int row = 0; row < static_cast<int>(sheet_.size()); ++row)
+        {
+            auto& cells = sheet_[row];
+            if (shift.index >= static_cast<int>(cells.size()))
+            {
+                continue;
+            }
+            for (int col = shift.index; shift.count < 0 &&
+                 col < std::min<int>(cells.size(), shift.index - shift.count); ++col)
+            {
+                removed.push_back(std::move(cells[col]));
+            }
+            ShiftItems(cells, shift.index, shift.count);
+            cells.resize(std::min<std::size_t>(cells.size(), Position::MAX_COLS));
+            MarkRowChanged(row);
+        }
+    }
+    for_each_shifted([](Cell* cell, Position pos)
+    {
+        cell->SetPosition(pos);
+    });
+
+    // переписываются только задетые ссылки
+    std::string_view name = workbook_ ? workbook_->GetSheetName(*this) : std::string_view{};
+    std::vector<Cell*> changed;
+    for (Cell* cell : referencing)
+    {
+        if (cell->MapReferences(shift, &cell->GetSheet() == this, name))
+        {
+            changed.push_back(cell);
+        }
+    }
+
+    for (Position& pos : pending_invalidation_)
+    {
+        pos = shift.Apply(pos);
+    }
+    pending_invalidation_.erase(
+        std::remove(pending_invalidation_.begin(), pending_invalidation_.end(), Position::NONE),
+        pending_invalidation_.end());
+
+    RebuildRangeIndex();
+    if (shift.count < 0)
+    {
+        UpdatePrintableSize();
+    }
+    else if (shift.rows ? shift.index < max_row_ : shift.index < max_col_)
+    {
+        int& max = shift.rows ? max_row_ : max_col_;
+        max = std::min(max + shift.count, limit);
+    }
+    // строки сдвинулись - инкрементальный вывод отдаёт таблицу целиком
+    size_version_ = version_;
+
+    // значения формул с изменёнными ссылками (и зависящих от них) пересчитываются
+    std::vector<Sheet*> touched_sheets;
+    for (Cell* cell : changed)
+    {
+        Sheet* owner = static_cast<Sheet*>(&cell->GetSheet());
+        if (owner != this &&
+            std::find(touched_sheets.begin(), touched_sheets.end(), owner) == touched_sheets.end())
+        {
+            ++owner->version_;
+            touched_sheets.push_back(owner);
+        }
+        owner->InvalidateCell(cell->GetPosition());
+    }
+
+    // значения сдвинутой части листа меняются целиком (до края печатной
+    // области до и после сдвига)
+    const Size printable_after = GetPrintableSize();
+    const int rows = std::max(printable_before.rows, printable_after.rows);
+    const int cols = std::max(printable_before.cols, printable_after.cols);
+    if (shift.index < (shift.rows ? rows : cols))
+    {
+        MarkValuesChanged(Range{ shift.rows ? Position{ shift.index, 0 } : Position{ 0, shift.index },
+                                 Position{ rows - 1, cols - 1 } });
+    }
+    ReleasePlaceholders(std::move(released));
+
+    if (journal_)
+    {
+        journal_->LogShift(shift);
+    }
+    operation.Finish();
+}
+
+void Sheet::CheckRange(const Range& range, const char* method) const
+{
+    if (!range.IsValid() || range.from.row > range.to.row || range.from.col > range.to.col)
+    {
+        throw InvalidPositionException(std::string("Invalid range for ") + method + "()");
+    }
+}
+
+void Sheet::CheckBlockTarget(const Range& source, Position target, const char* method) const
+{
+    if (!source.IsValid() || source.from.row > source.to.row || source.from.col > source.to.col ||
+        !target.IsValid() || !ReferenceMove(source, target).Target().to.IsValid())
+    {
+        throw InvalidPositionException(std::string("Invalid range for ") + method + "()");
+    }
+    if (in_transaction_)
+    {
+        throw std::logic_error("Cells cannot be moved or copied in a transaction");
+    }
+}
+
+void Sheet::MoveRange(Range source, Position target)
+{
+    CheckBlockTarget(source, target, "MoveRange");
+    if (source.from == target)
+    {
+        return;
+    }
+    OperationScope operation(*this);
+    const ReferenceMove move(source, target);
+    const Range destination = move.Target();
+
+    auto for_each_cell = [this](const Range& area, auto action)
+    {
+        const int last_row = std::min<int>(area.to.row, static_cast<int>(sheet_.size()) - 1);
+        for (int row = area.from.row; row <= last_row; ++row)
+        {
+            const int last_col = std::min<int>(area.to.col, static_cast<int>(sheet_[row].size()) - 1);
+            for (int col = area.from.col; col <= last_col; ++col)
+            {
+                if (sheet_[row][col])
+                {
+                    action(sheet_[row][col].get());
+                }
+            }
+        }
+    };
+
+    // ячейки блока и замещаемые ими ячейки нового места
+    std::vector<Cell*> moved;
+    std::vector<Cell*> overwritten;
+    for_each_cell(source, [&moved](Cell* cell)
+    {
+        moved.push_back(cell);
+    });
+    for_each_cell(destination, [&overwritten, &source](Cell* cell)
+    {
+        if (!source.Contains(cell->GetPosition()))
+        {
+            overwritten.push_back(cell);
+        }
+    });
+    const std::unordered_set<Cell*> removed_cells(overwritten.begin(), overwritten.end());
+
+    // формулы, ссылки которых может задеть перемещение: зависящие от ячеек
+    // обеих областей (на любом листе книги) и ссылающиеся на их диапазоны
+    std::unordered_set<Cell*> referencing;
+    std::vector<CellInterface*> range_dependents;
+    range_index_.CollectDependents(source, range_dependents);
+    range_index_.CollectDependents(destination, range_dependents);
+    for (CellInterface* dependent : range_dependents)
+    {
+        referencing.insert(static_cast<Cell*>(dependent));
+    }
+    for (const std::vector<Cell*>* cells : { &moved, &overwritten })
+    {
+        for (Cell* cell : *cells)
+        {
+            for (Cell* dependent : cell->GetGraphReference().GetDependent())
+            {
+                referencing.insert(dependent);
+            }
+        }
+    }
+    for (Cell* cell : overwritten)
+    {
+        referencing.erase(cell);
+    }
+    // отмена - обратное перемещение и прежнее содержимое замещённых ячеек и
+    // формул со ссылками на обе области
+    for (Cell* cell : overwritten)
+    {
+        RecordCell(cell, cell->GetPosition());
+    }
+    for (Cell* cell : referencing)
+    {
+        RecordCell(cell, cell->GetPosition());
+    }
+    RecordStructure(move);
+
+    // диапазоны формул обеих областей и ссылающихся на них формул листа
+    // возвращаются в индекс уже с новыми ссылками
+    std::unordered_set<Cell*> unindexed;
+    auto unindex = [this, &unindexed](Cell* cell)
+    {
+        if (&cell->GetSheet() == this && unindexed.insert(cell).second)
+        {
+            UnindexCell(*cell);
+        }
+    };
+    std::for_each(moved.begin(), moved.end(), unindex);
+    std::for_each(overwritten.begin(), overwritten.end(), unindex);
+    std::for_each(referencing.begin(), referencing.end(), unindex);
+
+    // замещаемые ячейки выходят из графа
+    std::vector<Cell*> released;
+    for (Cell* cell : overwritten)
+    {
+        for (Cell* ref_cell : cell->GetGraphReference().GetReferences())
+        {
+            if (removed_cells.count(ref_cell) == 0)
+            {
+                ref_cell->GetGraphReference().DeleteDependency(cell);
+                released.push_back(ref_cell);
+            }
+            UnlinkSheetReference(ref_cell);
+        }
+        for (Cell* dependent : cell->GetGraphReference().GetDependent())
+        {
+            if (removed_cells.count(dependent) == 0)
+            {
+                dependent->GetGraphReference().DeleteReferences(cell);
+                static_cast<Sheet&>(dependent->GetSheet()).UnlinkSheetReference(cell);
+            }
+        }
+    }
+
+    // ячейки блока переезжают вместе со связями графа
+    ++version_;
+    std::vector<Position> touched;
+    std::vector<std::unique_ptr<Cell>> removed;
+    for (Cell* cell : overwritten)
+    {
+        Position pos = cell->GetPosition();
+        touched.push_back(pos);
+        removed.push_back(std::move(sheet_[pos.row][pos.col]));
+    }
+    std::vector<std::unique_ptr<Cell>> moving;
+    for (Cell* cell : moved)
+    {
+        Position pos = cell->GetPosition();
+        touched.push_back(pos);
+        moving.push_back(std::move(sheet_[pos.row][pos.col]));
+    }
+    bool on_border = std::any_of(touched.begin(), touched.end(), [this](Position pos)
+    {
+        return pos.row + 1 == max_row_ || pos.col + 1 == max_col_;
+    });
+    for (std::unique_ptr<Cell>& cell : moving)
+    {
+        Position pos = move.Apply(cell->GetPosition());
+        ResizeSheet(pos);
+        cell->SetPosition(pos);
+        sheet_[pos.row][pos.col] = std::move(cell);
+        touched.push_back(pos);
+    }
+    for (Position pos : touched)
+    {
+        MarkRowChanged(pos.row);
+    }
+
+    // переписываются только задетые ссылки
+    std::string_view name = workbook_ ? workbook_->GetSheetName(*this) : std::string_view{};
+    std::vector<Cell*> changed;
+    for (Cell* cell : referencing)
+    {
+        if (cell->MapReferences(move, &cell->GetSheet() == this, name))
+        {
+            changed.push_back(cell);
+        }
+    }
+
+    for (Position& pos : pending_invalidation_)
+    {
+        pos = move.Apply(pos);
+    }
+    pending_invalidation_.erase(
+        std::remove(pending_invalidation_.begin(), pending_invalidation_.end(), Position::NONE),
+        pending_invalidation_.end());
+
+    std::vector<Position> reindexed = touched;
+    for (Cell* cell : unindexed)
+    {
+        if (removed_cells.count(cell) == 0)
+        {
+            reindexed.push_back(cell->GetPosition());
+        }
+    }
+    std::sort(reindexed.begin(), reindexed.end(), PositionLess{});
+    reindexed.erase(std::unique(reindexed.begin(), reindexed.end()), reindexed.end());
+    for (Position pos : reindexed)
+    {
+        IndexCell(pos);
+    }
+
+    if (on_border)
+    {
+        UpdatePrintableSize();
+    }
+    for (Position pos : touched)
+    {
+        if (PositionToCell(pos))
+        {
+            ExtendPrintableSize(pos);
+        }
+    }
+
+    // освободившиеся и занятые позиции и формулы с изменёнными ссылками
+    // инвалидируются одним пакетом
+    BeginBatchUpdate();
+    pending_invalidation_.insert(pending_invalidation_.end(), touched.begin(), touched.end());
+    std::vector<Sheet*> touched_sheets;
+    for (Cell* cell : changed)
+    {
+        Sheet* owner = static_cast<Sheet*>(&cell->GetSheet());
+        if (owner == this)
+        {
+            pending_invalidation_.push_back(cell->GetPosition());
+            continue;
+        }
+        if (std::find(touched_sheets.begin(), touched_sheets.end(), owner) == touched_sheets.end())
+        {
+            ++owner->version_;
+            touched_sheets.push_back(owner);
+        }
+        owner->InvalidateCell(cell->GetPosition());
+    }
+    EndBatchUpdate();
+    ReleasePlaceholders(std::move(released));
+
+    if (journal_)
+    {
+        journal_->LogMove(source, target);
+    }
+    operation.Finish();
+}
+
+void Sheet::CopyRange(Range source, Position target)
+{
+    CheckBlockTarget(source, target, "CopyRange");
+    if (source.from == target)
+    {
+        return;
+    }
+    OperationScope operation(*this);
+    const ReferenceOffset offset(target.row - source.from.row, target.col - source.from.col);
+
+    // копии готовятся по состоянию до копирования (блоки могут пересекаться) и
+    // проверяются на циклы как правки транзакции; nullptr - очистка
+    std::map<Position, StagedEdit, PositionLess> copies;
+    const int rows = source.to.row - source.from.row + 1;
+    const int cols = source.to.col - source.from.col + 1;
+    auto stored_cols = [this](int row, int first_col)
+    {
+        return row < static_cast<int>(sheet_.size())
+                   ? static_cast<int>(sheet_[row].size()) - first_col : 0;
+    };
+    for (int i = 0; i < rows; ++i)
+    {
+        const int source_row = source.from.row + i;
+        const int target_row = target.row + i;
+        const int count = std::min(cols, std::max(stored_cols(source_row, source.from.col),
+                                                  stored_cols(target_row, target.col)));
+        for (int j = 0; j < count; ++j)
+        {
+            Position from{ source_row, source.from.col + j };
+            Position to{ target_row, target.col + j };
+            const Cell* original = PositionToCell(from);
+            if (original == nullptr || original->GetText().empty())
+            {
+                const Cell* current = PositionToCell(to);
+                if (current != nullptr && !current->GetText().empty())
+                {
+                    copies[to] = StagedEdit{};
+                }
+                continue;
+            }
+            // разобранное дерево разделяется с источником, пока ссылки не сдвинуты
+            std::unique_ptr<Cell> copy = original->Clone(*this);
+            copy->SetPosition(to);
+            copy->MapReferences(offset, true, {});
+            std::vector<std::string> sheets;
+            for (const SheetCellRef& ref : copy->GetSheetReferencedCells())
+            {
+                if (std::find(sheets.begin(), sheets.end(), ref.sheet) == sheets.end())
+                {
+                    sheets.push_back(ref.sheet);
+                }
+            }
+            for (const std::string& sheet : sheets)
+            {
+                copy->MapReferences(offset, false, sheet);
+            }
+            copies[to] = StagedEdit{ std::move(copy), {} };
+        }
+    }
+
+    staged_ = std::move(copies);
+    bool cyclic = false;
+    for (const auto& [pos, edit] : staged_)
+    {
+        if (edit.cell && edit.cell->GetFormula() && RejectsCycle(pos, *edit.cell))
+        {
+            cyclic = true;
+            break;
+        }
+    }
+    copies = std::move(staged_);
+    staged_.clear();
+    if (cyclic)
+    {
+        throw CircularDependencyException("Circular dependency detected!");
+    }
+
+    bool cleared = false;
+    BeginBatchUpdate();
+    for (auto& [pos, edit] : copies)
+    {
+        if (!edit.cell)
+        {
+            RemoveCell(pos);
+            cleared = true;
+            continue;
+        }
+        ResizeSheet(pos);
+        edit.cell->UpdateGraphReference();
+        InstallCell(pos, std::move(edit.cell), false);
+    }
+    EndBatchUpdate();
+    if (cleared)
+    {
+        UpdatePrintableSize();
+    }
+
+    if (journal_)
+    {
+        journal_->LogCopy(source, target);
+    }
+    operation.Finish();
+}
+
+Size Sheet::GetPrintableSize() const {
+    return Size{ max_row_, max_col_ };
+}
+
+namespace {
+
+// Параметры вывода таблицы
+const int PRINT_BLOCK_ROWS = 256;                   // строк в блоке одного потока
+const std::size_t PRINT_PARALLEL_MIN_CELLS = 1 << 16; // меньше - в одном потоке
+const std::size_t PRINT_BUFFER_SIZE = 1 << 16;      // порог сброса буфера в поток
+
+// Формат чисел потока совпадает с форматом по умолчанию (%g, точность 6,
+// классическая локаль), и to_chars даёт тот же текст, что и operator<<
+bool HasDefaultNumberFormat(const std::ostream& output)
+{
+    const auto format_flags = std::ios_base::floatfield | std::ios_base::showpoint |
+                              std::ios_base::showpos | std::ios_base::uppercase;
+    return output.precision() == 6 && (output.flags() & format_flags) == 0 &&
+           output.getloc() == std::locale::classic();
+}
+
+void AppendNumber(std::string& out, double value)
+{
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value,
+                                std::chars_format::general, 6);
+    out.append(buffer, result.ptr);
+}
+
+struct StringSolutionPrinter {
+    std::string& out;
+
+    void operator()(const std::string& str) const {
+        out += str;
+    }
+    void operator()(double value) const {
+        AppendNumber(out, value);
+    }
+    void operator()(FormulaError er) const {
+        out += er.ToString();
+    }
+    void operator()(bool value) const {
+        out += LogicalToString(value);
+    }
+};
+
+}  // namespace
+
+void Sheet::PrintValues(std::ostream& output) const
+{
+    if (!HasDefaultNumberFormat(output))
+    {
+        // Нестандартный формат чисел - печатаем через operator<<
+        PrintValuesFormatted(output);
+        return;
+    }
+    PrintRows(output, true);
+}
+
+void Sheet::PrintTexts(std::ostream& output) const
+{
+    PrintRows(output, false);
+}
+
+void Sheet::PrintValuesFormatted(std::ostream& output) const
+{
+    for (int x = 0; x < max_row_; ++x)
+    {
+        bool need_separator = false;
+        // Проходим по всей ширине Printable area
+        for (int y = 0; y < max_col_; ++y)
+        {
+            // Проверка необходимости печати разделителя
+            if (need_separator)
+            {
+                output << '\t';
+            }
+            need_separator = true;
+
+            // Если мы не вышли за пределы вектора И ячейка не nullptr
+            if ((y < static_cast<int>(sheet_.at(x).size())) && sheet_.at(x).at(y))
+            {
+                // Ячейка существует
+				std::visit(OstreamSolutionPrinter { output },
+                        sheet_.at(x).at(y)->GetValue());
+            }
+        }
+        // Разделение строк
+        output << '\n';
+    }
+}
+
+void Sheet::PrintRows(std::ostream& output, bool values) const
+{
+    std::size_t cells = static_cast<std::size_t>(max_row_) * max_col_;
+    unsigned threads = std::thread::hardware_concurrency();
+
+    if (cells < PRINT_PARALLEL_MIN_CELLS || threads < 2)
+    {
+        std::string buffer;
+        buffer.reserve(PRINT_BUFFER_SIZE * 2);
+        for (int row = 0; row < max_row_; ++row)
+        {
+            FormatRows(row, row + 1, values, buffer);
+            if (buffer.size() >= PRINT_BUFFER_SIZE)
+            {
+                output.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+        output.write(buffer.data(), buffer.size());
+        return;
+    }
+
+    if (values)
+    {
+        // Вычисление формул меняет их кэш, поэтому выполняется заранее в
+        // одном потоке; параллельное форматирование только читает значения
+        for (int row = 0; row < max_row_ && row < static_cast<int>(sheet_.size()); ++row)
+        {
+            for (const auto& cell : sheet_[row])
+            {
+                if (cell && !cell->IsCacheValid())
+                {
+                    cell->GetValue();
+                }
+            }
+        }
+    }
+
+    // Блоки строк форматируются партиями по числу потоков и пишутся по порядку
+    std::vector<std::string> blocks(threads);
+    for (int first = 0; first < max_row_; first += PRINT_BLOCK_ROWS * threads)
+    {
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < threads; ++i)
+        {
+            int block_first = first + static_cast<int>(i) * PRINT_BLOCK_ROWS;
+            int block_last = std::min(block_first + PRINT_BLOCK_ROWS, max_row_);
+            blocks[i].clear();
+            if (block_first >= block_last)
+            {
+                continue;
+            }
+            workers.emplace_back([this, block_first, block_last, values, &block = blocks[i]] {
+                FormatRows(block_first, block_last, values, block);
+            });
+        }
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+        for (const std::string& block : blocks)
+        {
+            output.write(block.data(), block.size());
+        }
+    }
+}
+
+void Sheet::FormatRows(int first_row, int last_row, bool values, std::string& out) const
+{
+    const int separators = max_col_ > 0 ? max_col_ - 1 : 0;
+    for (int row = first_row; row < last_row; ++row)
+    {
+        // число уже выведенных разделителей в строке
+        int printed = 0;
+        if (row < static_cast<int>(sheet_.size()))
+        {
+            const auto& cells = sheet_[row];
+            const int width = std::min(static_cast<int>(cells.size()), max_col_);
+            for (int col = 0; col < width; ++col)
+            {
+                if (!cells[col])
+                {
+                    continue;
+                }
+                out.append(col - printed, '\t');
+                printed = col;
+                if (values)
+                {
+                    std::visit(StringSolutionPrinter{ out }, cells[col]->GetValue());
+                }
+                else
+                {
+                    out += cells[col]->GetText();
+                }
+            }
+        }
+        // пустой хвост строки (или вся пустая строка) - одни разделители
+        out.append(separators - printed, '\t');
+        out += '\n';
+    }
+}
+
+std::shared_ptr<const SheetSnapshot> Sheet::Snapshot()
+{
+    auto snapshot = std::make_shared<SheetSnapshot>();
+    snapshot->version_ = version_;
+    snapshot->size_ = GetPrintableSize();
+
+    const int rows = static_cast<int>(sheet_.size());
+    published_rows_.resize(rows);
+    published_versions_.resize(rows, 0);
+    for (int row = 0; row < rows; ++row)
+    {
+        std::uint64_t row_version = row < static_cast<int>(row_versions_.size()) ? row_versions_[row] : 0;
+        if (published_rows_[row] && published_versions_[row] == row_version)
+        {
+            continue;
+        }
+
+        // строка изменилась - собираем её заново, старую копию держат прежние снимки
+        const auto& cells = sheet_[row];
+        auto data = std::make_shared<SheetSnapshot::Row>(cells.size());
+        bool empty = true;
+        for (std::size_t col = 0; col < cells.size(); ++col)
+        {
+            if (cells[col])
+            {
+                (*data)[col] = SheetSnapshot::CellData{ cells[col]->GetText(), cells[col]->GetValue() };
+                empty = false;
+            }
+        }
+        published_rows_[row] = empty ? nullptr : std::move(data);
+        published_versions_[row] = row_version;
+    }
+    snapshot->rows_ = published_rows_;
+    return snapshot;
+}
+
+std::unique_ptr<Sheet> Sheet::Fork() const
+{
+    if (workbook_ != nullptr)
+    {
+        // значения формул копии, прочитанные с других листов, устаревали бы
+        // молча: копия не получает инвалидацию от графа книги
+        throw std::logic_error("Cannot fork a workbook sheet");
+    }
+    auto child = std::make_unique<Sheet>();
+    child->dynamic_dependencies_ = dynamic_dependencies_;
+    child->iteration_ = iteration_;
+    child->max_row_ = max_row_;
+    child->max_col_ = max_col_;
+    child->version_ = version_;
+    child->size_version_ = version_;
+
+    child->sheet_.resize(sheet_.size());
+    for (std::size_t row = 0; row < sheet_.size(); ++row)
+    {
+        child->sheet_[row].resize(sheet_[row].size());
+        for (std::size_t col = 0; col < sheet_[row].size(); ++col)
+        {
+            if (sheet_[row][col])
+            {
+                child->sheet_[row][col] = sheet_[row][col]->Clone(*child);
+            }
+        }
+    }
+
+    // граф переносится по позициям
+    for (const auto& row : sheet_)
+    {
+        for (const auto& cell : row)
+        {
+            if (!cell)
+            {
+                continue;
+            }
+            Cell* child_cell = child->PositionToCell(cell->GetPosition());
+            for (const Cell* ref : cell->GetGraphReference().GetReferences())
+            {
+                Cell* child_ref = child->PositionToCell(ref->GetPosition());
+                child_cell->GetGraphReference().AddReferences(child_ref);
+                child_ref->GetGraphReference().AddDependency(child_cell);
+            }
+        }
+    }
+    child->RebuildRangeIndex();
+    return child;
+}
+
+std::uint64_t SheetSnapshot::GetVersion() const
+{
+    return version_;
+}
+
+Size SheetSnapshot::GetPrintableSize() const
+{
+    return size_;
+}
+
+const SheetSnapshot::CellData* SheetSnapshot::GetCell(Position pos) const
+{
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid position for GetCell()");
+    }
+    if (pos.row >= static_cast<int>(rows_.size()) || !rows_[pos.row] ||
+        pos.col >= static_cast<int>(rows_[pos.row]->size()))
+    {
+        return nullptr;
+    }
+    const auto& cell = (*rows_[pos.row])[pos.col];
+    return cell ? &*cell : nullptr;
+}
+
+void SheetSnapshot::PrintValues(std::ostream& output) const
+{
+    PrintRows(output, true);
+}
+
+void SheetSnapshot::PrintTexts(std::ostream& output) const
+{
+    PrintRows(output, false);
+}
+
+void SheetSnapshot::PrintRows(std::ostream& output, bool values) const
+{
+    const bool default_format = HasDefaultNumberFormat(output);
+    const int separators = size_.cols > 0 ? size_.cols - 1 : 0;
+    std::string buffer;
+    for (int row = 0; row < size_.rows; ++row)
+    {
+        int printed = 0;
+        if (row < static_cast<int>(rows_.size()) && rows_[row])
+        {
+            const Row& cells = *rows_[row];
+            const int width = std::min(static_cast<int>(cells.size()), size_.cols);
+            for (int col = 0; col < width; ++col)
+            {
+                if (!cells[col])
+                {
+                    continue;
+                }
+                buffer.append(col - printed, '\t');
+                printed = col;
+                if (!values)
+                {
+                    buffer += cells[col]->text;
+                }
+                else if (default_format)
+                {
+                    std::visit(StringSolutionPrinter{ buffer }, cells[col]->value);
+                }
+                else
+                {
+                    // нестандартный формат чисел - печатаем через operator<<
+                    output.write(buffer.data(), buffer.size());
+                    buffer.clear();
+                    std::visit([&output](const auto& value) {
+                        if constexpr (std::is_same_v<std::decay_t<decltype(value)>, bool>) {
+                            output << LogicalToString(value);
+                        } else {
+                            output << value;
+                        }
+                    }, cells[col]->value);
+                }
+            }
+        }
+        buffer.append(separators - printed, '\t');
+        buffer += '\n';
+        if (buffer.size() >= PRINT_BUFFER_SIZE)
+        {
+            output.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    output.write(buffer.data(), buffer.size());
+}
+
+std::unique_ptr<SheetInterface> CreateSheet() {
+    return std::make_unique<Sheet>();
+}
+
+void Sheet::ResizeSheet(const Position pos)
+{
+    if (!pos.IsValid())
+    {
+        return;
+    }
+
+    // Если элементов в векторе строк меньше, чем номер строки в pos.row
+    if (static_cast<int>(sheet_.size()) < (pos.row + 1))
+    {
+        // резервируем и инициализируем nullptr элементы вплоть до строки pos.row
+        sheet_.reserve(pos.row + 1);
+        sheet_.resize(pos.row + 1);
+    }
+
+    // Если элементов в векторе столбцов меньше, чем номер столбца в pos.col
+    if (static_cast<int>(sheet_.at(pos.row).size()) < (pos.col + 1))
+    {
+        // резервируем и инициализируем nullptr элементы вплоть до столбца pos.col
+        sheet_.at(pos.row).reserve(pos.col + 1);
+        sheet_.at(pos.row).resize(pos.col + 1);
+    }
+}
+
+bool Sheet::CellExists(Position pos) const
+{
+    return (pos.row < static_cast<int>(sheet_.size())) &&
+           (pos.col < static_cast<int>(sheet_.at(pos.row).size()));
+}
+
+void Sheet::UpdatePrintableSize()
+{
+    Size old_size = GetPrintableSize();
+    max_row_ = 0;
+    max_col_ = 0;
+
+    // Сканируем ячейки, пропуская nullptr
+    for (int x = 0; x < static_cast<int>(sheet_.size()); ++x)
+    {
+        for (int y = 0; y < static_cast<int>(sheet_.at(x).size()); ++y)
+        {
+            if (sheet_.at(x).at(y))
+            {
+                max_row_ = (max_row_ < (x + 1) ? x + 1 : max_row_);
+                max_col_ = (max_col_ < (y + 1) ? y + 1 : max_col_);
+            }
+        }
+    }
+
+    if (!(GetPrintableSize() == old_size))
+    {
+        size_version_ = version_;
+    }
+}
+
+void Sheet::ExtendPrintableSize(Position pos)
+{
+    if (pos.row >= max_row_ || pos.col >= max_col_)
+    {
+        max_col_ = (max_col_ < (pos.col + 1) ? pos.col + 1 : max_col_);
+        max_row_ = (max_row_ < (pos.row + 1) ? pos.row + 1 : max_row_);
+        size_version_ = version_;
+    }
+}
+
+Cell* Sheet::PositionToCell(Position pos) const {
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid position for GetCell()");
+    }
+
+    if (!CellExists(pos))
+    {
+        return nullptr;
+    }
+
+    return sheet_.at(pos.row).at(pos.col).get();
+}
+
+Cell* Sheet::AddEmptyCell(const Position pos) {
+    ResizeSheet(pos);
+    // создаём умный указатель на cell
+    std::unique_ptr<Cell> new_cell = std::make_unique<Cell>(*this, pos);
+    sheet_.at(pos.row).at(pos.col).swap(new_cell);
+    return  sheet_.at(pos.row).at(pos.col).get();
+}
+
+void Sheet::ReleasePlaceholders(std::vector<Cell*> cells)
+{
+    // ячейка могла потерять несколько ссылок - удаляется один раз
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    for (Cell* cell : cells)
+    {
+        static_cast<Sheet&>(cell->GetSheet()).ReleasePlaceholder(cell);
+    }
+}
+
+void Sheet::ReleasePlaceholder(Cell* cell)
+{
+    if (cell->GetFormula() != nullptr || !cell->GetText().empty() ||
+        !cell->GetGraphReference().GetDependent().empty())
+    {
+        return;
+    }
+    const Position pos = cell->GetPosition();
+    if (PositionToCell(pos) != cell)
+    {
+        return;
+    }
+    sheet_[pos.row][pos.col].reset();
+    IndexCell(pos);
+    if (pos.row + 1 == max_row_ || pos.col + 1 == max_col_)
+    {
+        UpdatePrintableSize();
+    }
+}
+
+void Sheet::InvalidateCell(const Position& pos)
+{
+    std::vector<Cell*> invalidated;
+    if (Cell* cell = PositionToCell(pos))
+    {
+        cell->InvalidateCache();
+        cell->GetGraphReference().InvalidateCacheDependent(
+            invalidated, dynamic_dependencies_ ? cell : nullptr);
+        if (cell->GetFormula())
+        {
+            range_index_.DropCachedTotals(pos);
+        }
+    }
+
+    // формулы, диапазоны которых содержат изменённую ячейку или сброшенные
+    // формулы; их зависимые в свою очередь могут входить в диапазоны
+    std::vector<CellInterface*> range_dependents;
+    auto collect_range_dependents = [this, &range_dependents](const Sheet& owner, Position source)
+    {
+        std::size_t first = range_dependents.size();
+        owner.range_index_.CollectDependents(source, range_dependents);
+        if (dynamic_dependencies_)
+        {
+            range_dependents.erase(
+                std::remove_if(range_dependents.begin() + first, range_dependents.end(),
+                               [&owner, source](CellInterface* dependent) {
+                                   return !static_cast<Cell*>(dependent)->ReadsCell(owner, source);
+                               }),
+                range_dependents.end());
+        }
+    };
+    collect_range_dependents(*this, pos);
+    std::size_t next = 0;
+    do
+    {
+        for (CellInterface* dependent : range_dependents)
+        {
+            Cell* dependent_cell = static_cast<Cell*>(dependent);
+            if (dependent_cell->IsCacheValid())
+            {
+                dependent_cell->InvalidateCache();
+                invalidated.push_back(dependent_cell);
+                dependent_cell->GetGraphReference().InvalidateCacheDependent(
+                    invalidated, dynamic_dependencies_ ? dependent_cell : nullptr);
+            }
+        }
+        range_dependents.clear();
+        // итоги диапазонов со сброшенными формулами пересчитываются полностью
+        for (; next < invalidated.size(); ++next)
+        {
+            Sheet* owner = static_cast<Sheet*>(&invalidated[next]->GetSheet());
+            owner->range_index_.DropCachedTotals(invalidated[next]->GetPosition());
+            collect_range_dependents(*owner, invalidated[next]->GetPosition());
+        }
+    } while (!range_dependents.empty());
+
+    RecordInvalidated(invalidated);
+
+    // значения зависимых ячеек могли измениться - их строки попадут в
+    // инкрементальный вывод (своего листа или другого листа книги), а сами
+    // ячейки - в рассылку подписчикам
+    MarkRowChanged(pos.row);
+    MarkValueChanged(pos);
+    std::vector<Sheet*> touched_sheets;
+    for (Cell* dependent : invalidated)
+    {
+        Sheet* owner = static_cast<Sheet*>(&dependent->GetSheet());
+        if (owner != this &&
+            std::find(touched_sheets.begin(), touched_sheets.end(), owner) == touched_sheets.end())
+        {
+            ++owner->version_;
+            touched_sheets.push_back(owner);
+        }
+        owner->MarkRowChanged(dependent->GetPosition().row);
+        owner->MarkValueChanged(dependent->GetPosition());
+    }
+}
+
+std::size_t Sheet::ReadNumbers(Range range, double* out, std::uint8_t* mask) const
+{
+    CheckRange(range, "ReadNumbers");
+    std::size_t count = range_index_.ReadConstants(range, out, mask);
+    const std::size_t width = static_cast<std::size_t>(range.to.col - range.from.col) + 1;
+    range_index_.ForEachFormulaCell(range, [&](Position pos)
+    {
+        const CellInterface::Value value = PositionToCell(pos)->GetValue();
+        if (const double* number = std::get_if<double>(&value))
+        {
+            const std::size_t offset = static_cast<std::size_t>(pos.row - range.from.row) * width +
+                                       static_cast<std::size_t>(pos.col - range.from.col);
+            out[offset] = *number;
+            if (mask != nullptr)
+            {
+                mask[offset] = 1;
+            }
+            ++count;
+        }
+    });
+    return count;
+}
 
-    // старая ячейка - (ячейка с pos в таблице)
-    Cell* old_cell = static_cast<Cell*>(GetCell(pos));
-    // если ячейка существует  
-    if (old_cell) { 
-        // получаем список указателей на ячейки, на которые ссылается новая ячейка   
-        Cell::GraphReference& graph_new_cell = (*p_new_cell.get()).GetGraphReference();
-        std::vector<Cell*> cells_referenced = graph_new_cell.GetReferences();
+RangeTotals Sheet::GetRangeTotals(Range range) const
+{
+    if (std::optional<RangeTotals> cached = range_index_.GetCachedTotals(range))
+    {
+        return *cached;
+    }
 
-        // проверяем на циклические зависимости новое содержимое cell
-        if (graph_new_cell.IsCyclicDependent(old_cell, cells_referenced) ) {
-            throw CircularDependencyException("Circular dependency detected!");
+    RangeTotals totals = range_index_.GetConstantTotals(range);
+    for (Position pos : range_index_.GetFormulaCells(range))
+    {
+        CellInterface::Value value = PositionToCell(pos)->GetValue();
+        if (std::holds_alternative<FormulaError>(value))
+        {
+            throw std::get<FormulaError>(value);
+        }
+        if (std::holds_alternative<double>(value))
+        {
+            totals.sum += std::get<double>(value);
+            ++totals.count;
         }
+    }
+    range_index_.CacheTotals(range, totals);
+    return totals;
+}
 
-        // Инвалидируем кэш этой ячейки и всех зависимых
-        InvalidateCell(pos);
-        
-        // переносим информацию зависимостях в новую ячейку
-        Cell::GraphReference graph_old_cell = (*old_cell).GetGraphReference();
-        for ( CellInterface* cell_dep : graph_old_cell.GetDependent()) {
-            // добавляем зависимость в новую ячейку
-            graph_new_cell.AddDependency(cell_dep);
-            // в зависимой ячейки удаляем ссылку на старую ячейку
-            static_cast<Cell*>(cell_dep)->GetGraphReference().DeleteReferences(old_cell);
+RangeExtrema Sheet::GetRangeExtrema(Range range) const
+{
+    RangeExtrema extrema = range_index_.GetConstantExtrema(range);
+    for (Position pos : range_index_.GetFormulaCells(range))
+    {
+        if (std::optional<double> number = GetRangeNumber(*this, pos))
+        {
+            extrema.Merge(RangeExtrema{ *number, *number, 1 });
         }
     }
+    return extrema;
+}
 
-    // заносим ячейку в таблицу
-    sheet_.at(pos.row).at(pos.col).swap(p_new_cell);
-    Cell* new_cell = static_cast<Cell*>(sheet_.at(pos.row).at(pos.col).get());
+double Sheet::GetRangeProduct(Range lhs, Range rhs) const
+{
+    double result = range_index_.GetConstantProduct(lhs, rhs);
 
-    // обнавляем cсылки
-    UpdatesReferences(new_cell);
-   
-    // изменяем, если нужно, минимальную печатную область
-    max_col_ = (max_col_ < (pos.col + 1) ? pos.col + 1 : max_col_);
-    max_row_ = (max_row_ < (pos.row + 1) ? pos.row + 1 : max_row_);  
- 
+    // в индексе формулы дают ноль - пары, где формула хотя бы с одной
+    // стороны, досчитываются по значениям ячеек
+    std::set<std::pair<int, int>> formula_offsets;
+    for (Position pos : range_index_.GetFormulaCells(lhs))
+    {
+        formula_offsets.emplace(pos.row - lhs.from.row, pos.col - lhs.from.col);
+    }
+    for (Position pos : range_index_.GetFormulaCells(rhs))
+    {
+        formula_offsets.emplace(pos.row - rhs.from.row, pos.col - rhs.from.col);
+    }
+    for (const auto& [row, col] : formula_offsets)
+    {
+        std::optional<double> left = GetRangeNumber(*this, Position{ lhs.from.row + row, lhs.from.col + col });
+        std::optional<double> right = GetRangeNumber(*this, Position{ rhs.from.row + row, rhs.from.col + col });
+        result += left.value_or(0.) * right.value_or(0.);
+    }
+    return result;
 }
 
-CellInterface* Sheet::GetCell(Position pos)
+std::optional<int> Sheet::LookupValue(Range range, double value, LookupMode mode) const
 {
-    if (!pos.IsValid())
+    std::optional<RangeIndex::LookupMatch> match = range_index_.LookupConstant(range, value, mode);
+    for (Position pos : range_index_.GetFormulaCells(range))
     {
-        throw InvalidPositionException("Invalid position for GetCell()");
+        std::optional<double> number;
+        try
+        {
+            number = GetRangeNumber(*this, pos);
+        }
+        catch (const FormulaError&)
+        {
+            continue;
+        }
+        if (!number)
+        {
+            continue;
+        }
+        int offset = (pos.row - range.from.row) + (pos.col - range.from.col);
+        if (mode == LookupMode::Exact)
+        {
+            if (*number == value && (!match || offset < match->offset))
+            {
+                match = RangeIndex::LookupMatch{ offset, *number };
+            }
+        }
+        else if (*number <= value &&
+                 (!match || *number > match->key || (*number == match->key && offset > match->offset)))
+        {
+            match = RangeIndex::LookupMatch{ offset, *number };
+        }
     }
-
-    if (!CellExists(pos))
+    if (!match)
     {
-        return nullptr;
+        return std::nullopt;
     }
+    return match->offset;
+}
 
-    if (sheet_.at(pos.row).at(pos.col).get() == nullptr) {
-        return nullptr;
+void Sheet::IndexCell(Position pos)
+{
+    const Cell* cell = PositionToCell(pos);
+    if (cell == nullptr)
+    {
+        range_index_.SetCell(pos, std::nullopt, false);
+        return;
+    }
+    if (cell->GetFormula() == nullptr)
+    {
+        // текст ячейки без экранирующего символа - её значение
+        CellInterface::Value value = cell->GetValue();
+        range_index_.SetCell(pos, TextToNumber(std::get<std::string>(value)), false);
+        return;
+    }
+    range_index_.SetCell(pos, std::nullopt, true);
+    for (const Range& range : cell->GetReferencedRanges())
+    {
+        range_index_.AddDependent(range, const_cast<Cell*>(cell));
     }
-    return sheet_.at(pos.row).at(pos.col).get();
 }
 
-const CellInterface* Sheet::GetCell(const Position pos) const {  
-    if (!pos.IsValid())
+void Sheet::UnindexCell(Cell& cell)
+{
+    for (const Range& range : cell.GetReferencedRanges())
     {
-        throw InvalidPositionException("Invalid position for GetCell()");
+        range_index_.RemoveDependent(range, &cell);
     }
+}
 
-    if (!CellExists(pos))
+void Sheet::RebuildRangeIndex()
+{
+    range_index_.Clear();
+    for (const auto& row : sheet_)
     {
-        return nullptr;
+        for (const auto& cell : row)
+        {
+            if (cell)
+            {
+                IndexCell(cell->GetPosition());
+            }
+        }
     }
+}
 
-    if (sheet_.at(pos.row).at(pos.col).get() == nullptr) {
-        return nullptr;
-    }
-    return sheet_.at(pos.row).at(pos.col).get();
+const SheetInterface* Sheet::FindSheet(std::string_view name) const
+{
+    return FindWorkbookSheet(name);
 }
 
-void Sheet::ClearCell(Position pos) {
-    if (!pos.IsValid())
+Sheet* Sheet::FindWorkbookSheet(std::string_view name) const
+{
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+std::vector<Cell*> Sheet::ResolveSheetReferences(const Cell& cell, bool create,
+                                                 std::string_view only_sheet)
+{
+    std::vector<Cell*> result;
+    for (const SheetCellRef& ref : cell.GetSheetReferencedCells())
     {
-        throw InvalidPositionException("Invalid position for ClearCell()");
+        if (!only_sheet.empty() && ref.sheet != only_sheet)
+        {
+            continue;
+        }
+        Sheet* target = FindWorkbookSheet(ref.sheet);
+        if (target == nullptr)
+        {
+            continue;   // листа нет - формула даёт #REF!
+        }
+        Cell* ref_cell = target->PositionToCell(ref.pos);
+        if (ref_cell == nullptr && create)
+        {
+            ref_cell = target->AddEmptyCell(ref.pos);
+        }
+        if (ref_cell != nullptr)
+        {
+            result.push_back(ref_cell);
+        }
     }
+    return result;
+}
 
-    if (CellExists(pos))
-    {   
-        sheet_.at(pos.row).at(pos.col).reset();
+void Sheet::LinkSheetReference(Cell* cell, Cell* ref_cell)
+{
+    if (ref_cell == cell)
+    {
+        return;
     }
-
-    if ((pos.row + 1 == max_row_) || (pos.col + 1 == max_col_))
+    ref_cell->GetGraphReference().AddDependency(cell);
+    cell->GetGraphReference().AddReferences(ref_cell);
+    const Sheet* target = static_cast<const Sheet*>(&ref_cell->GetSheet());
+    if (target != this)
     {
-        // Удаленная ячейка была на границе Printable Area. Нужен перерасчет
-        UpdatePrintableSize();
+        ++sheet_links_[target];
     }
 }
 
-Size Sheet::GetPrintableSize() const {
-    return Size{ max_row_, max_col_ };
+void Sheet::UnlinkSheetReference(Cell* ref_cell)
+{
+    const Sheet* target = static_cast<const Sheet*>(&ref_cell->GetSheet());
+    auto it = sheet_links_.find(target);
+    if (target != this && it != sheet_links_.end() && --it->second == 0)
+    {
+        sheet_links_.erase(it);
+    }
 }
 
-void Sheet::PrintValues(std::ostream& output) const
+void Sheet::LinkSheet(std::string_view name)
 {
-    for (int x = 0; x < max_row_; ++x)
+    for (const auto& row : sheet_)
     {
-        bool need_separator = false;
-        // Проходим по всей ширине Printable area
-        for (int y = 0; y < max_col_; ++y)
+        for (const auto& cell : row)
         {
-            // Проверка необходимости печати разделителя
-            if (need_separator)
+            if (!cell)
             {
-                output << '\t';
+                continue;
             }
-            need_separator = true;
-
-            // Если мы не вышли за пределы вектора И ячейка не nullptr
-            if ((y < static_cast<int>(sheet_.at(x).size())) && sheet_.at(x).at(y))
+            std::vector<Cell*> ref_cells = ResolveSheetReferences(*cell, true, name);
+            for (Cell* ref_cell : ref_cells)
             {
-                // Ячейка существует
-				std::visit(OstreamSolutionPrinter { output },
-                        sheet_.at(x).at(y)->GetValue());
+                LinkSheetReference(cell.get(), ref_cell);
+            }
+            if (!ref_cells.empty())
+            {
+                // #REF! меняется на значение ячейки нового листа
+                ++version_;
+                InvalidateCell(cell->GetPosition());
             }
         }
-        // Разделение строк
-        output << '\n';
     }
 }
 
-void Sheet::PrintTexts(std::ostream& output) const
+void Sheet::CalculateAll()
 {
-    for (int x = 0; x < max_row_; ++x)
+    for (const auto& row : sheet_)
     {
-        bool need_separator = false;
-        // Проходим по всей ширине Printable area
-        for (int y = 0; y < max_col_; ++y)
+        for (const auto& cell : row)
         {
-            // Проверка необходимости печати разделителя
-            if (need_separator)
+            if (cell && !cell->IsCacheValid())
             {
-                output << '\t';
+                cell->GetValue();
             }
-            need_separator = true;
+        }
+    }
+}
 
-            // Если мы не вышли за пределы вектора И ячейка не nullptr
-            if ((y < static_cast<int>(sheet_.at(x).size())) && sheet_.at(x).at(y))
+namespace {
+
+bool IsBudgetExhausted(const RecalcBudget& budget, const RecalcProgress& progress)
+{
+    return progress.evaluated >= budget.max_formulas ||
+           (budget.cancel != nullptr && budget.cancel->load(std::memory_order_relaxed)) ||
+           (budget.deadline != std::chrono::steady_clock::time_point::max() &&
+            std::chrono::steady_clock::now() >= budget.deadline);
+}
+
+}  // namespace
+
+RecalcProgress Sheet::Recalculate(Range priority, const RecalcBudget& budget)
+{
+    CheckRange(priority, "Recalculate");
+    RecalcProgress progress;
+    const int last_row = std::min<int>(priority.to.row, static_cast<int>(sheet_.size()) - 1);
+    for (int row = priority.from.row; row <= last_row; ++row)
+    {
+        const int last_col = std::min<int>(priority.to.col, static_cast<int>(sheet_[row].size()) - 1);
+        for (int col = priority.from.col; col <= last_col; ++col)
+        {
+            if (Cell* cell = sheet_[row][col].get(); cell && !EvaluateCone(cell, budget, progress))
             {
-                // Ячейка существует
-                output << sheet_.at(x).at(y)->GetText();
+                return progress;
             }
         }
-        // Разделение строк
-        output << '\n';
     }
+    progress.region_ready = true;
+    return ContinueRecalculation(budget, progress);
 }
 
-std::unique_ptr<SheetInterface> CreateSheet() {
-    return std::make_unique<Sheet>();
+RecalcProgress Sheet::Recalculate(const RecalcBudget& budget)
+{
+    RecalcProgress progress;
+    progress.region_ready = true;
+    return ContinueRecalculation(budget, progress);
 }
 
-void Sheet::ResizeSheet(const Position pos)
+RecalcProgress Sheet::ContinueRecalculation(const RecalcBudget& budget, RecalcProgress progress)
 {
-    if (!pos.IsValid())
+    // правка могла сбросить кэш уже пройденных формул
+    if (recalc_version_ != version_)
     {
-        return;
+        recalc_cursor_ = Position{ 0, 0 };
+        recalc_version_ = version_;
     }
-
-    // Если элементов в векторе строк меньше, чем номер строки в pos.row
-    if (static_cast<int>(sheet_.size()) < (pos.row + 1))
+    Position& cursor = recalc_cursor_;
+    for (; cursor.row < static_cast<int>(sheet_.size()); ++cursor.row, cursor.col = 0)
     {
-        // резервируем и инициализируем nullptr элементы вплоть до строки pos.row
-        sheet_.reserve(pos.row + 1);
-        sheet_.resize(pos.row + 1);
+        for (; cursor.col < static_cast<int>(sheet_[cursor.row].size()); ++cursor.col)
+        {
+            Cell* cell = sheet_[cursor.row][cursor.col].get();
+            if (cell && !EvaluateCone(cell, budget, progress))
+            {
+                return progress;
+            }
+        }
     }
+    progress.complete = true;
+    return progress;
+}
 
-    // Если элементов в векторе столбцов меньше, чем номер столбца в pos.col
-    if (static_cast<int>(sheet_.at(pos.row).size()) < (pos.col + 1))
+bool Sheet::EvaluateCone(Cell* cell, const RecalcBudget& budget, RecalcProgress& progress)
+{
+    auto is_dirty = [](const Cell* input)
     {
-        // резервируем и инициализируем nullptr элементы вплоть до столбца pos.col
-        sheet_.at(pos.row).reserve(pos.col + 1);
-        sheet_.at(pos.row).resize(pos.col + 1);
+        return input->GetFormula() != nullptr && !input->IsCacheValid();
+    };
+    if (!is_dirty(cell))
+    {
+        return true;
+    }
+    // обход в глубину с явным стеком: формула вычисляется, когда готовы все её
+    // входы, поэтому GetValue() не уходит в рекурсию по цепочке зависимостей
+    struct Frame {
+        Cell* cell;
+        std::vector<Cell*> inputs;
+        std::size_t next = 0;
+    };
+    std::vector<Frame> stack;
+    std::unordered_set<const Cell*> visited{ cell };
+    stack.push_back(Frame{ cell, GetFormulaInputs(*cell) });
+    while (!stack.empty())
+    {
+        Frame& frame = stack.back();
+        if (frame.next < frame.inputs.size())
+        {
+            Cell* input = frame.inputs[frame.next++];
+            if (is_dirty(input) && visited.insert(input).second)
+            {
+                stack.push_back(Frame{ input, GetFormulaInputs(*input) });
+            }
+            continue;
+        }
+        if (IsBudgetExhausted(budget, progress))
+        {
+            return false;
+        }
+        if (!frame.cell->IsCacheValid())
+        {
+            frame.cell->GetValue();
+            ++progress.evaluated;
+        }
+        stack.pop_back();
     }
+    return true;
 }
 
-bool Sheet::CellExists(Position pos) const
+std::uint64_t Sheet::GetVersion() const
 {
-    return (pos.row < static_cast<int>(sheet_.size())) &&
-           (pos.col < static_cast<int>(sheet_.at(pos.row).size()));
+    return version_;
 }
 
-void Sheet::UpdatePrintableSize()
+std::uint64_t Sheet::PrintValuesSince(std::uint64_t token, std::ostream& output) const
 {
-    max_row_ = 0;
-    max_col_ = 0;
-
-    // Сканируем ячейки, пропуская nullptr
-    for (int x = 0; x < static_cast<int>(sheet_.size()); ++x)
+    std::vector<int> rows;
+    if (size_version_ > token)
     {
-        for (int y = 0; y < static_cast<int>(sheet_.at(x).size()); ++y)
+        // изменилась печатная область - строки меняют ширину, выводим всё
+        rows.reserve(max_row_);
+        for (int row = 0; row < max_row_; ++row)
         {
-            if (sheet_.at(x).at(y))
+            rows.push_back(row);
+        }
+    }
+    else
+    {
+        // журнал изменений упорядочен по версиям
+        auto first = std::upper_bound(change_log_.begin(), change_log_.end(), token,
+            [](std::uint64_t version, const std::pair<std::uint64_t, int>& entry) {
+                return version < entry.first;
+            });
+        for (auto it = first; it != change_log_.end(); ++it)
+        {
+            if (it->second < max_row_)
             {
-                max_row_ = (max_row_ < (x + 1) ? x + 1 : max_row_);
-                max_col_ = (max_col_ < (y + 1) ? y + 1 : max_col_);
+                rows.push_back(it->second);
             }
         }
+        std::sort(rows.begin(), rows.end());
+        rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
     }
-}
 
-Cell* Sheet::PositionToCell(Position pos) const {
-    if (!pos.IsValid())
+    std::string buffer = "@" + std::to_string(token) + '\t' + std::to_string(version_) + '\t' +
+                         std::to_string(max_row_) + '\t' + std::to_string(max_col_) + '\n';
+    for (int row : rows)
     {
-        throw InvalidPositionException("Invalid position for GetCell()");
+        buffer += std::to_string(row + 1);
+        buffer += '\t';
+        FormatRows(row, row + 1, true, buffer);
+        if (buffer.size() >= PRINT_BUFFER_SIZE)
+        {
+            output.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
     }
+    output.write(buffer.data(), buffer.size());
+    return version_;
+}
 
-    if (!CellExists(pos))
+void Sheet::MarkRowChanged(int row)
+{
+    if (row >= static_cast<int>(row_versions_.size()))
     {
-        return nullptr;
+        row_versions_.resize(row + 1, 0);
     }
+    if (row_versions_[row] == version_)
+    {
+        return;
+    }
+    row_versions_[row] = version_;
+    change_log_.emplace_back(version_, row);
 
-    return sheet_.at(pos.row).at(pos.col).get();
-}
-
-Cell* Sheet::AddEmptyCell(const Position pos) {
-    ResizeSheet(pos);
-    // создаём умный указатель на cell
-    std::unique_ptr<Cell> new_cell = std::make_unique<Cell>(*this, pos);
-    sheet_.at(pos.row).at(pos.col).swap(new_cell);
-    return  sheet_.at(pos.row).at(pos.col).get();
-}
-
-void Sheet::InvalidateCell(const Position& pos)
-{
-    Cell* cell = static_cast<Cell*>(GetCell(pos));
-    cell->InvalidateCache();
-    cell->GetGraphReference().InvalidateCacheDependent();
+    // журнал разрастается из-за повторных изменений одних и тех же строк -
+    // оставляем по одной (последней) записи на строку
+    if (change_log_.size() > 2 * row_versions_.size() + 1024)
+    {
+        change_log_.clear();
+        for (int r = 0; r < static_cast<int>(row_versions_.size()); ++r)
+        {
+            if (row_versions_[r] > 0)
+            {
+                change_log_.emplace_back(row_versions_[r], r);
+            }
+        }
+        std::sort(change_log_.begin(), change_log_.end());
+    }
 }
 
 std::unique_ptr<Cell> Sheet::PreCreateNewCell(const Position pos, const std::string text) {
@@ -267,6 +2218,10 @@ std::unique_ptr<Cell> Sheet::PreCreateNewCell(const Position pos, const std::str
     Cell* new_cell = static_cast<Cell*>(p_new_cell.get());
     // устанавливаем значение ячейки
     (*new_cell).Set(text);
+    // в итеративном режиме ссылка на себя - допустимый цикл
+    if (iteration_.enabled) {
+        return p_new_cell;
+    }
     // проверяем на циклические зависимости новое содержимое cell
     // (проверка на создание новой ячейки, которая напрямую ссылается сама на себя)
     std::vector<Position> ref_cells = (*new_cell).GetReferencedCells();
@@ -274,6 +2229,12 @@ std::unique_ptr<Cell> Sheet::PreCreateNewCell(const Position pos, const std::str
     if (it != ref_cells.end()) {
         throw CircularDependencyException("Circular dependency detected!");
     }
+    // то же для ссылки на свой лист по имени (Sheet1!A1 в ячейке A1 листа Sheet1)
+    for (const SheetCellRef& ref : new_cell->GetSheetReferencedCells()) {
+        if (ref.pos == pos && FindWorkbookSheet(ref.sheet) == this) {
+            throw CircularDependencyException("Circular dependency detected!");
+        }
+    }
     return p_new_cell;
 }
 
@@ -287,9 +2248,16 @@ void Sheet::UpdatesReferences(Cell* new_cell) {
             // добавляем в таблицу пустую ячейку
             ref_cell = AddEmptyCell(pos_ref);
         }
-        PositionToCell(pos_ref)->GetGraphReference().AddDependency(new_cell);
+        // ссылка на себя (итеративный режим) в граф не заносится
+        if (ref_cell != new_cell) {
+            ref_cell->GetGraphReference().AddDependency(new_cell);
+        }
         new_cell->UpdateGraphReference();
     }
+    // на ячейки других листов книги
+    for (Cell* ref_cell : ResolveSheetReferences(*new_cell, true)) {
+        LinkSheetReference(new_cell, ref_cell);
+    }
 
     // вверх
     for (CellInterface* cell_dep : new_cell->GetGraphReference().GetDependent()) {
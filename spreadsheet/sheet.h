@@ -2,10 +2,95 @@
 
 #include "cell.h"
 #include "common.h"
+#include "history.h"
+#include "range_index.h"
+#include "subscriptions.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <thread>
 
+class Journal;
+class Workbook;
+
+// Неизменяемое представление таблицы на момент одной версии (Sheet::Snapshot()):
+// тексты и вычисленные значения всех ячеек. Не связано с таблицей, поэтому его
+// можно читать из любых потоков, пока таблица продолжает изменяться.
+class SheetSnapshot {
+public:
+    struct CellData {
+        std::string text;
+        CellInterface::Value value;
+    };
+
+    std::uint64_t GetVersion() const;
+    Size GetPrintableSize() const;
+
+    // Содержимое ячейки (nullptr, если ячейки нет)
+    const CellData* GetCell(Position pos) const;
+
+    // Вывод в формате Sheet::PrintValues() и Sheet::PrintTexts()
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+private:
+    friend class Sheet;
+    using Row = std::vector<std::optional<CellData>>;
+
+    // строки разделяются между снимками, пока не изменятся (nullptr - пустая строка)
+    std::vector<std::shared_ptr<const Row>> rows_;
+    std::uint64_t version_ = 0;
+    Size size_;
+
+    void PrintRows(std::ostream& output, bool values) const;
+};
+
+// Ограничения шага пересчёта (Sheet::Recalculate())
+struct RecalcBudget {
+    std::size_t max_formulas = std::numeric_limits<std::size_t>::max();  // вычисляемых формул за шаг
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    const std::atomic<bool>* cancel = nullptr;  // отмена (например, из потока интерфейса)
+};
+
+// Итог шага пересчёта
+struct RecalcProgress {
+    bool region_ready = false;  // формулы приоритетной области и их входы вычислены
+    bool complete = false;      // вычислены все формулы листа
+    std::size_t evaluated = 0;  // вычислено формул за шаг
+};
+
+// Результат подбора параметра (Sheet::GoalSeek())
+struct GoalSeekResult {
+    bool converged = false;     // цель достигнута с заданной точностью
+    int evaluations = 0;        // вычислений цели с производной
+    double input = 0.;          // последнее значение входа (записано в ячейку)
+    double value = 0.;          // значение цели при нём
+};
+
+// Итеративное вычисление циклических ссылок (Sheet::SetIterativeCalculation())
+struct IterationSettings {
+    bool enabled = false;
+    int max_iterations = 100;   // наибольшее число проходов по циклу
+    double tolerance = 1e-3;    // проходы заканчиваются, когда значения меняются не больше
+};
+
+// Режим параллельного чтения: пока таблицу никто не изменяет, её можно читать
+// из нескольких потоков одновременно без внешней синхронизации - GetCell(),
+// GetValue() и GetText() ячеек, GetPrintableSize(), PrintValues(),
+// PrintTexts() и PrintValuesSince(). Кэш формулы заполняет поток, первым
+// захвативший её состояние (CAS), чтение готового значения блокировок не
+// требует. Изменяющие методы (SetCell(), ClearCell(), пакеты, загрузка) должны
+// выполняться в момент, когда читателей нет, - например, под эксклюзивной
+// блокировкой std::shared_mutex, которую читатели берут в разделяемом режиме.
 class Sheet : public SheetInterface {
 public:
     Sheet() = default;
@@ -23,18 +108,414 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Лист той же книги (nullptr, если таблица не входит в книгу)
+    const SheetInterface* FindSheet(std::string_view name) const override;
+
+    // Итоги по диапазону для SUM, COUNT и AVERAGE: числовые константы
+    // суммируются по индексу за O(log n) на столбец, формулы диапазона
+    // вычисляются по одной
+    RangeTotals GetRangeTotals(Range range) const override;
+    // MIN, MAX и SUMPRODUCT: константы сворачиваются векторизуемыми циклами
+    // (большие диапазоны - в нескольких потоках), формулы - по одной
+    RangeExtrema GetRangeExtrema(Range range) const override;
+    double GetRangeProduct(Range lhs, Range rhs) const override;
+    // MATCH и VLOOKUP: константы ищутся по индексам поиска за O(1) (точное
+    // совпадение) или O(log n) (ближайшее меньшее), формулы сверяются по одной
+    std::optional<int> LookupValue(Range range, double value, LookupMode mode) const override;
+
+    // Обход существующих ячеек диапазона по строкам без выделения памяти и
+    // виртуальных вызовов: строки и части строк за пределами хранимых ячеек
+    // пропускаются целиком. visitor(Position, const Cell&).
+    template <typename Visitor>
+    void ForEachCell(Range range, Visitor visitor) const;
+    // Чтение чисел диапазона в буферы вызывающего: out (и mask, если задан)
+    // по элементу на ячейку, по строкам. Числовые константы копируются из
+    // столбцов индекса, формулы вычисляются; для чисел mask получает 1,
+    // остальные ячейки (текст, логические значения, ошибки, пустые) - 0 и в
+    // out 0. Возвращает число чисел.
+    std::size_t ReadNumbers(Range range, double* out, std::uint8_t* mask = nullptr) const;
+
     // Производит сброс кэша для указанной ячейки и всех зависящих от нее
     void InvalidateCell(const Position& pos);
 
+    // Быстрая загрузка текстового (не формульного) значения, используется при
+    // импорте. В ещё не существующую позицию ячейка заносится напрямую, без
+    // разбора формулы, проверки циклов и инвалидации кэша. Для существующей
+    // ячейки и для формул выполняется обычный SetCell().
+    void LoadTextCell(Position pos, std::string_view text);
+
+    // Вставка count пустых строк (столбцов) перед index и удаление count строк
+    // (столбцов) начиная с index. Ячейки за ними сдвигаются, ссылки формул на
+    // сдвинутые ячейки (в том числе формул других листов книги) переносятся,
+    // ссылки на удалённые ячейки становятся #REF!, диапазоны сжимаются, а при
+    // вставке внутрь - расширяются. Граф зависимостей не перестраивается:
+    // ячейки переезжают вместе со связями, переписываются и пересчитываются
+    // только формулы, ссылающиеся на сдвинутую часть листа. Бросает
+    // InvalidPositionException, если вставка вытеснила бы непустые ячейки за
+    // пределы листа, и std::logic_error внутри транзакции.
+    void InsertRows(int index, int count = 1);
+    void DeleteRows(int index, int count = 1);
+    void InsertCols(int index, int count = 1);
+    void DeleteCols(int index, int count = 1);
+
+    // Перемещение блока source так, что его левый верхний угол попадает в
+    // target (вырезать и вставить). Ячейки переезжают вместе со связями графа,
+    // без разбора формул; ссылки на ячейки блока (в том числе с других листов
+    // книги) и диапазоны внутри него переносятся на новое место, ссылки на
+    // замещённые ячейки нового места становятся #REF!. Изменения графа и
+    // инвалидация зависимых ячеек выполняются одним пакетом.
+    void MoveRange(Range source, Position target);
+    // Копирование блока source в target: формулы копий получают разобранное
+    // дерево источника со сдвинутыми относительными ссылками (ссылки за
+    // пределы листа - #REF!), пустые ячейки блока очищают место назначения,
+    // как ClearCell().
+    // Копии проверяются на циклы все вместе до изменения таблицы
+    // (CircularDependencyException - таблица не меняется) и заносятся одним
+    // пакетом.
+    // Обе операции бросают InvalidPositionException, если блок не помещается
+    // на лист, и std::logic_error внутри транзакции.
+    void CopyRange(Range source, Position target);
+
+    // Пакетное изменение: между BeginBatchUpdate() и EndBatchUpdate() SetCell()
+    // не сбрасывает кэш зависимых ячеек сразу, а откладывает это до конца пакета,
+    // где каждая изменённая ячейка инвалидируется один раз. Значения, прочитанные
+    // внутри пакета, могут быть устаревшими. Пакеты могут быть вложенными.
+    void BeginBatchUpdate();
+    void EndBatchUpdate();
+
+    // Пакет изменений на время жизни объекта. Finish() завершает пакет, как
+    // EndBatchUpdate(); при выходе по исключению без Finish() пакет завершается
+    // в деструкторе (кэш сбрасывается), а рассылка подписчикам откладывается
+    // до следующей операции - исключение подписчика не выходит из деструктора.
+    class BatchUpdateScope {
+    public:
+        explicit BatchUpdateScope(Sheet& sheet) : sheet_(sheet) {
+            sheet_.BeginBatchUpdate();
+        }
+        ~BatchUpdateScope() {
+            if (!finished_) {
+                sheet_.EndBatch(false);
+            }
+        }
+        BatchUpdateScope(const BatchUpdateScope&) = delete;
+        BatchUpdateScope& operator=(const BatchUpdateScope&) = delete;
+
+        void Finish() {
+            finished_ = true;
+            sheet_.EndBatchUpdate();
+        }
+
+    private:
+        Sheet& sheet_;
+        bool finished_ = false;
+    };
+
+    // Транзакция: между BeginTransaction() и Commit() SetCell() и ClearCell()
+    // не меняют таблицу, а накапливают правки. Каждая правка проверяется сразу
+    // (синтаксис формулы и циклы с учётом других накопленных правок) и при
+    // ошибке бросает исключение, не попадая в транзакцию. Чтение до Commit()
+    // видит зафиксированное состояние. Commit() применяет правки одним пакетом
+    // (одна общая инвалидация зависимых ячеек), Rollback() просто отбрасывает
+    // их. Вложенные транзакции не поддерживаются (std::logic_error).
+    void BeginTransaction();
+    void Commit();
+    void Rollback();
+    bool InTransaction() const;
+
+    // Версия таблицы: растёт при каждом изменении содержимого
+    std::uint64_t GetVersion() const;
+
+    // Инкрементальный вывод значений: выводит только строки, значения в которых
+    // могли измениться после версии token (в том числе ячейки, пересчитанные из-за
+    // изменения их входов), и возвращает текущую версию для следующего вызова.
+    // Формат патча: строка-заголовок "@token<TAB>версия<TAB>строк<TAB>столбцов",
+    // затем для каждой изменённой строки её номер (с единицы), табуляция и
+    // содержимое строки в формате PrintValues(). Строки за пределами печатной
+    // области потребитель отбрасывает сам. Если печатная область изменилась,
+    // выводятся все строки. Стоимость пропорциональна числу изменённых строк.
+    std::uint64_t PrintValuesSince(std::uint64_t token, std::ostream& output) const;
+
+    // Снимок текущего состояния для читателей, которые не должны ждать писателя.
+    // Строки копируются при записи: снимок заново собирает только строки,
+    // изменённые после предыдущего снимка, остальные разделяются с ним. Память
+    // строки освобождается, когда её не держит ни таблица, ни один из снимков.
+    // Вызывается писателем (или под его блокировкой); внутри пакета изменений
+    // значения могут быть устаревшими, как и при обычном чтении.
+    std::shared_ptr<const SheetSnapshot> Snapshot();
+
+    // Независимая копия таблицы для расчёта сценариев "что если". Формулы
+    // (разобранные AST) разделяются с исходной таблицей, вычисленные значения
+    // копируются, поэтому копия не разбирает формулы и не пересчитывает
+    // неизменённые ячейки. Исходную таблицу и копии можно менять и вычислять
+    // независимо, в том числе в разных потоках. Журнал и незафиксированная
+    // транзакция не копируются. Лист книги не копируется (std::logic_error):
+    // формулы копии читали бы другие листы книги, не получая инвалидацию от
+    // их изменений, и их значения молча устаревали бы.
+    // Копирование стоит O(N) от числа ячеек и рёбер графа: каждая ячейка
+    // клонируется, граф и индекс диапазонов строятся заново. Строки не
+    // разделяются при записи, как в Snapshot(): ячейки и граф хранят прямые
+    // указатели на ячейки своего листа, и общая ячейка принадлежала бы сразу
+    // двум графам. Для тысяч сценариев выгоднее один Fork() на поток и
+    // откат входов между сценариями, чем Fork() на каждый сценарий.
+    std::unique_ptr<Sheet> Fork() const;
+
+    // Динамические зависимости: изменение ячейки не сбрасывает кэш формулы
+    // с условными ветвями (IF, AND, OR, CHOOSE), если при последнем
+    // вычислении формула эту ячейку не читала (ветвь не была выбрана).
+    // Выключено по умолчанию: каждая такая формула хранит список прочитанных
+    // ячеек и диапазонов. Ссылки на другие листы книги сбрасывают кэш всегда.
+    void SetDynamicDependencies(bool enabled);
+
+    // Итеративный режим для циклических ссылок (выключен по умолчанию):
+    // правки, замыкающие цикл (в том числе ссылку формулы на себя), не бросают
+    // CircularDependencyException. Формулы цикла - компоненты сильной
+    // связности графа - вычисляются методом Гаусса-Зейделя: начиная с прежних
+    // значений (или нуля), формулы компоненты пересчитываются по очереди, каждая
+    // по уже обновлённым значениям остальных, пока значения не перестанут
+    // меняться больше чем на tolerance или не кончатся max_iterations проходов.
+    // Ациклические части вычисляются как обычно, за один проход. Выключение
+    // режима запрещает новые циклы, уже замкнутые продолжают вычисляться
+    // итерациями. Цикл решается при первом чтении его ячейки, поэтому лист с
+    // циклами можно читать из нескольких потоков только после SolveCycles().
+    void SetIterativeCalculation(const IterationSettings& settings);
+    // Вычисляет все циклы листа вместе с их входами; независимые компоненты
+    // (без путей между ними) вычисляются параллельно в threads потоках
+    void SolveCycles(unsigned threads = std::thread::hardware_concurrency());
+
+    // История правок. Undo() отменяет последний шаг - SetCell(), ClearCell(),
+    // LoadTextCell(), вставку, удаление, перемещение или копирование ячеек,
+    // фиксацию транзакции или пакет изменений целиком, - Redo() повторяет
+    // отменённый; новая правка очищает стек повтора. Возвращают false, если
+    // отменять (повторять) нечего, и бросают std::logic_error внутри пакета или
+    // транзакции. Шаг хранит прежнее содержимое изменённых ячеек и обратные
+    // сдвиги, а не копию таблицы. Формулам, кэш которых сбросила правка,
+    // отмена возвращает прежние значения без пересчёта (кроме шагов со сдвигом
+    // ячеек, пакетов и листов книги - их значения пересчитываются).
+    // bytes - бюджет памяти истории (оценка): старые шаги вытесняются;
+    // 0 (по умолчанию) - история не ведётся.
+    void SetHistoryLimit(std::size_t bytes);
+    std::size_t GetHistoryMemoryUsage() const;
+    bool Undo();
+    bool Redo();
+
+    // Подписки на изменения значений ячейки или диапазона. Изменения
+    // рассылаются пакетом после каждой операции листа (SetCell(), ClearCell(),
+    // фиксации транзакции, конца внешнего пакета изменений, отмены и т.д.), в
+    // том числе операции другого листа книги, от которого зависят формулы
+    // листа: значения отмеченных ячеек вычисляются, и подписка получает только
+    // действительно изменившиеся, каждую один раз и в порядке позиций.
+    // Стоимость рассылки пропорциональна числу отмеченных ячеек и подписок на
+    // них, а не числу подписок. Очередь изменений подписчик ведёт сам,
+    // складывая их в callback. Если операция завершилась исключением, её
+    // изменения уходят вместе со следующей. Исключение callback выходит из
+    // операции после рассылки остальным подпискам (из нескольких - первое).
+    // Подписка вычисляет значения ячеек диапазона; отслеживание изменений
+    // включено, пока у листа есть подписки.
+    int Subscribe(Range range, ChangeSubscriptions::Callback callback);
+    int Subscribe(Position pos, ChangeSubscriptions::Callback callback);
+    bool Unsubscribe(int id);
+    // Могли ли измениться значения ячеек range в последней рассылке или после
+    // неё (внутри callback - в рассылаемых операциях). Проверка по битовым
+    // картам плиток ячеек, без вычисления значений; false, если подписок нет.
+    bool HasChanges(Range range) const;
+
+    // Пошаговый пересчёт с приоритетной областью (видимой частью листа).
+    // Сначала вычисляются формулы priority и все их непосчитанные входы (в том
+    // числе на других листах книги) - обходом графа в порядке зависимостей,
+    // без рекурсии, - затем остальные формулы листа со сброшенным кэшем. Шаг
+    // прерывается по исчерпании budget или флагу отмены и продолжается
+    // следующим вызовом с места остановки; после правки листа обход остальных
+    // формул начинается сначала. Вычисленные значения остаются в кэше и при
+    // прерывании. Без priority сразу продолжается обход всего листа.
+    RecalcProgress Recalculate(Range priority, const RecalcBudget& budget = {});
+    RecalcProgress Recalculate(const RecalcBudget& budget = {});
+
+    // Производные значений ячеек outputs по значениям ячеек inputs при текущем
+    // состоянии листа (прямое автоматическое дифференцирование):
+    // result[i][j] = d outputs[i] / d inputs[j]. Формулы, которые зависят от
+    // входов и влияют на выходы, вычисляются двойственными числами - один
+    // проход по ним на каждые DUAL_LANES входов, без конечных разностей и
+    // пересчёта листа. Вход - значение ячейки (формула входа не
+    // дифференцируется); производная выхода с ошибкой - NaN. Циклы
+    // итеративного режима дифференцируются теми же итерациями.
+    std::vector<std::vector<double>> GetDerivatives(const std::vector<Position>& outputs,
+                                                    const std::vector<Position>& inputs) const;
+    // Подбор параметра: записывает в ячейку input значение, при котором target
+    // равна goal, методом Ньютона с точной производной (GetDerivatives()).
+    // Вход - число или формула без ссылок; отрицательное значение
+    // записывается формулой (текст ячейки не может быть отрицательным
+    // числом). Шаги подбора - один шаг истории правок.
+    GoalSeekResult GoalSeek(Position target, double goal, Position input,
+                            int max_iterations = 20, double tolerance = 1e-9);
+
+    // Журнал, в который записываются успешные SetCell() и ClearCell()
+    // (nullptr - журнал не ведётся). Таблица журналом не владеет.
+    void AttachJournal(Journal* journal);
+
 private:
+    friend class Workbook;
+    friend class Cell;      // решение цикла при чтении ячейки (Cell::GetValue())
+    friend class Journal;   // воспроизведение формул, возвращённых отменой
+
+    // сохранение и восстановление бинарного снимка (snapshot.cpp)
+    friend void SaveSnapshot(const Sheet& sheet, std::ostream& output);
+    friend std::unique_ptr<Sheet> LoadSnapshot(std::string_view data);
+
     std::vector<std::vector<std::unique_ptr<Cell>>> sheet_;
 
     // Единый для всй таблицы словарь зависимых ячеек (ячейка - список зависимых от нее)
     std::unordered_map<CellInterface*, std::unordered_set<CellInterface*>> cells_dependent_;
 
+    Journal* journal_ = nullptr;
+
+    Workbook* workbook_ = nullptr;      // книга, в которую входит лист
+    bool dynamic_dependencies_ = false; // SetDynamicDependencies()
+    IterationSettings iteration_;       // SetIterativeCalculation()
+    // число ссылок формул этого листа на ячейки других листов книги
+    std::unordered_map<const Sheet*, int> sheet_links_;
+
+    // накопленная правка транзакции (cell == nullptr - очистка ячейки)
+    struct StagedEdit {
+        std::unique_ptr<Cell> cell;
+        std::string text;
+    };
+    struct PositionLess {
+        bool operator()(Position lhs, Position rhs) const {
+            return std::make_pair(lhs.row, lhs.col) < std::make_pair(rhs.row, rhs.col);
+        }
+    };
+    bool in_transaction_ = false;
+    std::map<Position, StagedEdit, PositionLess> staged_;
+
+    // проверяет, замыкает ли формула cell в позиции pos цикл (в том числе через
+    // диапазоны) с учётом накопленных правок транзакции
+    bool IsCyclic(Position pos, const Cell& cell) const;
+    // цикл, который нельзя замкнуть (итеративный режим выключен)
+    bool RejectsCycle(Position pos, const Cell& cell) const;
+
+    // Циклические ссылки (iteration.cpp)
+    // входы формулы cell: ячейки, на которые она ссылается (в том числе сама
+    // ячейка - ссылка на себя в граф не заносится), и формулы её диапазонов
+    static std::vector<Cell*> GetFormulaInputs(const Cell& cell);
+    // компоненты сильной связности графа входов, достижимые из roots по
+    // ячейкам include, в порядке вычисления: компоненты входов раньше
+    static std::vector<std::vector<Cell*>> FindComponents(const std::vector<Cell*>& roots,
+                                                          const std::function<bool(const Cell*)>& include);
+    // компонента - цикл, а не одиночная формула без ссылки на себя
+    static bool IsCycle(const std::vector<Cell*>& component);
+    // отмечает ячейки цикла, который замкнула формула cell
+    static void MarkCycle(Cell* cell);
+    // вычисляет цикл ячейки cell вместе с его входами (чтение ячейки цикла)
+    void SolveCycle(const Cell& cell) const;
+    // вычисляет компоненту: цикл - итерациями, одиночную формулу - один раз
+    void SolveComponent(const std::vector<Cell*>& component) const;
+
+    // Производные (derivatives.cpp): значения выходов с производными по не
+    // более чем DUAL_LANES входам; std::nullopt - значение выхода не число
+    std::vector<std::optional<Dual>> EvaluateDuals(const std::vector<Position>& outputs,
+                                                   const std::vector<Position>& inputs) const;
+
+    // вставка или удаление строк (столбцов), общая часть InsertRows() и прочих
+    void ShiftCells(const ReferenceShift& shift);
+    // проверка диапазона - аргумента метода method
+    void CheckRange(const Range& range, const char* method) const;
+    // проверка аргументов MoveRange() и CopyRange()
+    void CheckBlockTarget(const Range& source, Position target, const char* method) const;
+
+    // индекс числовых констант, формул и ссылок на диапазоны (range_index.h)
+    RangeIndex range_index_;
+
+    // заносит в индекс ячейку pos (или её отсутствие) и диапазоны её формулы
+    void IndexCell(Position pos);
+    // убирает из индекса диапазоны формулы ячейки, покидающей таблицу
+    void UnindexCell(Cell& cell);
+    // строит индекс заново по всем ячейкам (загрузка снимка, Fork())
+    void RebuildRangeIndex();
+
+    // Операция листа: шаг истории правок, по окончании внешней операции -
+    // рассылка изменений подписчикам. Finish() завершает операцию с рассылкой,
+    // исключение подписчика выходит из него; при выходе по исключению без
+    // Finish() деструктор закрывает шаг, а рассылка откладывается.
+    class OperationScope {
+    public:
+        explicit OperationScope(Sheet& sheet) : sheet_(sheet) {
+            sheet_.BeginOperation(true);
+        }
+        ~OperationScope() {
+            if (!finished_) {
+                sheet_.EndOperation(false);
+            }
+        }
+        OperationScope(const OperationScope&) = delete;
+        OperationScope& operator=(const OperationScope&) = delete;
+
+        void Finish() {
+            finished_ = true;
+            sheet_.EndOperation(true);
+        }
+
+    private:
+        Sheet& sheet_;
+        bool finished_ = false;
+    };
+    int operation_depth_ = 0;
+    void BeginOperation(bool exact);
+    void EndOperation(bool notify);
+    // EndBatchUpdate(); notify - разослать изменения подписчикам
+    void EndBatch(bool notify);
+
+    // подписки на изменения (nullptr - подписок нет)
+    std::unique_ptr<ChangeSubscriptions> subscriptions_;
+    // отмечают ячейки, значения которых могли измениться
+    void MarkValueChanged(Position pos);
+    void MarkValuesChanged(const Range& range);
+    // вычисляет отмеченные ячейки и вызывает подписчиков
+    void DeliverChanges();
+
+    // история правок (nullptr - не ведётся)
+    std::unique_ptr<EditHistory> history_;
+    void BeginHistoryAction(bool exact);
+    void EndHistoryAction();
+    bool IsRecordingHistory() const;
+    // записывают прежнее содержимое ячейки (nullptr - ячейки нет), сдвиг
+    // ячеек и значения формул со сброшенным кэшем
+    void RecordCell(const Cell* cell, Position pos);
+    void RecordStructure(EditHistory::Entry entry);
+    void RecordInvalidated(const std::vector<Cell*>& invalidated);
+    // возвращает ячейке записанное содержимое
+    void RestoreCell(const EditHistory::CellState& state);
+    bool ReplayHistory(bool undo);
+    // возвращает формулам значения, записанные в шаге истории
+    void RestoreCachedValues(const EditHistory::Action& action);
+
+    int batch_depth_ = 0;                           // вложенность пакетов изменений
+    std::vector<Position> pending_invalidation_;    // ячейки, ждущие конца пакета
+
     int max_row_ = 0;    // Число строк в Printable Area
     int max_col_ = 0;    // Число столбцов в Printable Area
 
+    std::uint64_t version_ = 0;         // версия таблицы
+    std::uint64_t size_version_ = 0;    // версия последнего изменения Printable Area
+    std::vector<std::uint64_t> row_versions_;   // версия последнего изменения строки
+    // журнал изменений строк (версия, строка) в порядке возрастания версий
+    std::vector<std::pair<std::uint64_t, int>> change_log_;
+
+    // строки последнего снимка и версии, на которые они собраны
+    std::vector<std::shared_ptr<const SheetSnapshot::Row>> published_rows_;
+    std::vector<std::uint64_t> published_versions_;
+
+    // отмечает строку как изменённую в текущей версии
+    void MarkRowChanged(int row);
+    // расширяет Printable Area до позиции pos
+    void ExtendPrintableSize(Position pos);
+
+    // Вывод таблицы: строки форматируются в буфер (при большом объёме - блоками
+    // в нескольких потоках) и записываются в поток по порядку
+    void PrintRows(std::ostream& output, bool values) const;
+    void FormatRows(int first_row, int last_row, bool values, std::string& out) const;
+    // Вывод значений через operator<< с учётом формата потока
+    void PrintValuesFormatted(std::ostream& output) const;
+
     void ResizeSheet(const Position pos);
     bool CellExists(Position pos) const;
     void UpdatePrintableSize();
@@ -52,10 +533,61 @@ private:
 		void operator()(FormulaError er) const {
 			out << er;
 		}
+		void operator()(bool value) const {
+			out << LogicalToString(value);
+		}
 	};
 
     Cell* PositionToCell(Position pos) const;
     std::unique_ptr<Cell> PreCreateNewCell(const Position pos, const std::string text);
+    // заносит в таблицу подготовленную ячейку вместо старой, переносит связи;
+    // check_cycles == false - циклы уже проверены (фиксация транзакции)
+    void InstallCell(Position pos, std::unique_ptr<Cell> p_new_cell, bool check_cycles = true);
+    // удаляет ячейку pos, как ClearCell(), но без журнала и пересчёта
+    // печатной области: ячейка, на которую ссылаются формулы, остаётся пустой
+    // заглушкой
+    void RemoveCell(Position pos);
     Cell* AddEmptyCell(const Position pos);
+    // Пустая ячейка-заглушка для ссылок формул живёт, пока на неё ссылается
+    // хотя бы одна формула (зависимые в графе - счётчик ссылок): ячейки cells,
+    // потерявшие ссылку, удаляются, если стали пустыми и ненужными
+    void ReleasePlaceholders(std::vector<Cell*> cells);
+    void ReleasePlaceholder(Cell* cell);
+
+    // Межлистовые ссылки (workbook.h)
+    Sheet* FindWorkbookSheet(std::string_view name) const;
+    // ячейки других листов, на которые ссылается формула cell; с create
+    // отсутствующие ячейки создаются пустыми (как и для ссылок внутри листа)
+    std::vector<Cell*> ResolveSheetReferences(const Cell& cell, bool create,
+                                              std::string_view only_sheet = {});
+    void LinkSheetReference(Cell* cell, Cell* ref_cell);
+    void UnlinkSheetReference(Cell* ref_cell);
+    // связывает формулы листа с только что добавленным в книгу листом name
+    void LinkSheet(std::string_view name);
+    // вычисляет все формулы листа, кэш которых невалиден
+    void CalculateAll();
+
+    // место, с которого Recalculate() продолжает обход формул листа, и версия
+    // таблицы, для которой оно действительно
+    Position recalc_cursor_{ 0, 0 };
+    std::uint64_t recalc_version_ = 0;
+    // вычисляет формулу cell после её непосчитанных входов; false - шаг прерван
+    bool EvaluateCone(Cell* cell, const RecalcBudget& budget, RecalcProgress& progress);
+    RecalcProgress ContinueRecalculation(const RecalcBudget& budget, RecalcProgress progress);
     void UpdatesReferences(Cell* new_cell);
 };
+
+template <typename Visitor>
+void Sheet::ForEachCell(Range range, Visitor visitor) const {
+    CheckRange(range, "ForEachCell");
+    const int last_row = std::min<int>(range.to.row, static_cast<int>(sheet_.size()) - 1);
+    for (int row = range.from.row; row <= last_row; ++row) {
+        const std::vector<std::unique_ptr<Cell>>& cells = sheet_[row];
+        const int last_col = std::min<int>(range.to.col, static_cast<int>(cells.size()) - 1);
+        for (int col = range.from.col; col <= last_col; ++col) {
+            if (const Cell* cell = cells[col].get()) {
+                visitor(Position{ row, col }, *cell);
+            }
+        }
+    }
+}
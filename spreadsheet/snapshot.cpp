@@ -0,0 +1,365 @@
+#include "snapshot.h"
+
+#include "cell.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SPREADSHEET_HAS_MMAP 1
+#endif
+
+using namespace std::literals;
+
+namespace {
+
+constexpr std::string_view SNAPSHOT_MAGIC = "SSNP"sv;
+
+enum class CellKind : std::uint8_t {
+    Empty = 0,
+    Text = 1,
+    Formula = 2,
+};
+
+enum class ValueKind : std::uint8_t {
+    None = 0,
+    Number = 1,
+    Error = 2,
+    Logical = 3,
+};
+
+template <typename T>
+void WriteRaw(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+constexpr std::uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+
+// hash - продолжение хэша предыдущих частей
+std::uint64_t Fnv1a(std::string_view data, std::uint64_t hash = FNV_OFFSET_BASIS) {
+    for (char ch : data) {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Последовательное чтение снимка с проверкой границ
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::string_view data) : data_(data) {
+    }
+
+    template <typename T>
+    T Read() {
+        T value;
+        std::memcpy(&value, Take(sizeof(T)).data(), sizeof(T));
+        return value;
+    }
+
+    std::string_view Take(std::size_t size) {
+        if (data_.size() < size) {
+            throw SnapshotException("Unexpected end of snapshot");
+        }
+        std::string_view result = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return result;
+    }
+
+    Position ReadPosition() {
+        Position pos;
+        pos.row = Read<std::int32_t>();
+        pos.col = Read<std::int32_t>();
+        if (!pos.IsValid()) {
+            throw SnapshotException("Invalid cell position in snapshot");
+        }
+        return pos;
+    }
+
+    const char* Current() const {
+        return data_.data();
+    }
+
+private:
+    std::string_view data_;
+};
+
+}  // namespace
+
+void SaveSnapshot(const Sheet& sheet, std::ostream& output) {
+    std::string cells;
+    std::string edges;
+    std::string values;
+    std::uint32_t cell_count = 0;
+    std::uint32_t edge_count = 0;
+
+    for (int row = 0; row < static_cast<int>(sheet.sheet_.size()); ++row) {
+        for (int col = 0; col < static_cast<int>(sheet.sheet_[row].size()); ++col) {
+            const Cell* cell = sheet.sheet_[row][col].get();
+            if (cell == nullptr) {
+                continue;
+            }
+            ++cell_count;
+            WriteRaw<std::int32_t>(cells, row);
+            WriteRaw<std::int32_t>(cells, col);
+
+            const FormulaInterface* formula = cell->GetFormula();
+            std::string data = formula ? formula->Serialize() : cell->GetText();
+            CellKind kind = formula ? CellKind::Formula
+                            : data.empty() ? CellKind::Empty : CellKind::Text;
+            WriteRaw(cells, kind);
+            WriteRaw<std::uint32_t>(cells, static_cast<std::uint32_t>(data.size()));
+            cells += data;
+
+            if (formula == nullptr) {
+                continue;
+            }
+            std::optional<CellInterface::Value> cache = cell->GetCachedValue();
+            if (cache && std::holds_alternative<double>(*cache)) {
+                WriteRaw(values, ValueKind::Number);
+                WriteRaw(values, std::get<double>(*cache));
+            } else if (cache && std::holds_alternative<FormulaError>(*cache)) {
+                WriteRaw(values, ValueKind::Error);
+                WriteRaw(values, static_cast<std::uint8_t>(
+                    std::get<FormulaError>(*cache).GetCategory()));
+            } else if (cache && std::holds_alternative<bool>(*cache)) {
+                WriteRaw(values, ValueKind::Logical);
+                WriteRaw(values, static_cast<std::uint8_t>(std::get<bool>(*cache)));
+            } else {
+                WriteRaw(values, ValueKind::None);
+            }
+
+            for (const Cell* referenced : cell->GetGraphReference().GetReferences()) {
+                if (&referenced->GetSheet() != &sheet) {
+                    continue;   // снимок хранит один лист, связи с другими листами в него не входят
+                }
+                Position to = referenced->GetPosition();
+                ++edge_count;
+                WriteRaw<std::int32_t>(edges, row);
+                WriteRaw<std::int32_t>(edges, col);
+                WriteRaw<std::int32_t>(edges, to.row);
+                WriteRaw<std::int32_t>(edges, to.col);
+            }
+        }
+    }
+
+    std::string printable_size;
+    WriteRaw<std::int32_t>(printable_size, sheet.max_row_);
+    WriteRaw<std::int32_t>(printable_size, sheet.max_col_);
+
+    std::string header(SNAPSHOT_MAGIC);
+    WriteRaw(header, SNAPSHOT_VERSION);
+    header += printable_size;
+    WriteRaw(header, cell_count);
+    WriteRaw(header, edge_count);
+
+    std::string stamp;
+    WriteRaw(stamp, Fnv1a(values, Fnv1a(cells, Fnv1a(printable_size))));
+
+    output.write(header.data(), header.size());
+    output.write(cells.data(), cells.size());
+    output.write(edges.data(), edges.size());
+    output.write(stamp.data(), stamp.size());
+    output.write(values.data(), values.size());
+}
+
+std::unique_ptr<Sheet> LoadSnapshot(std::string_view data) {
+    SnapshotReader reader(data);
+    if (reader.Take(SNAPSHOT_MAGIC.size()) != SNAPSHOT_MAGIC) {
+        throw SnapshotException("Not a spreadsheet snapshot");
+    }
+    const std::uint32_t version = reader.Read<std::uint32_t>();
+    if (version == 0 || version > SNAPSHOT_VERSION) {
+        throw SnapshotException("Unsupported snapshot version");
+    }
+
+    auto sheet = std::make_unique<Sheet>();
+    std::string_view printable_size = reader.Take(2 * sizeof(std::int32_t));
+    int max_row = 0;
+    int max_col = 0;
+    std::memcpy(&max_row, printable_size.data(), sizeof(max_row));
+    std::memcpy(&max_col, printable_size.data() + sizeof(max_row), sizeof(max_col));
+    if (max_row < 0 || max_row > Position::MAX_ROWS || max_col < 0 || max_col > Position::MAX_COLS) {
+        throw SnapshotException("Invalid printable size in snapshot");
+    }
+    std::uint32_t cell_count = reader.Read<std::uint32_t>();
+    std::uint32_t edge_count = reader.Read<std::uint32_t>();
+
+    // формулы получают ячейку только после чтения значений
+    std::vector<std::pair<Cell*, std::unique_ptr<FormulaInterface>>> formulas;
+
+    const char* cells_begin = reader.Current();
+    std::optional<Position> last;
+    int last_col = -1;
+    for (std::uint32_t i = 0; i < cell_count; ++i) {
+        Position pos = reader.ReadPosition();
+        // ячейки записываются по строкам в порядке возрастания позиций; повтор
+        // позиции заменил бы ячейку, на которую уже указывают формулы и рёбра
+        if (last && (pos.row < last->row || (pos.row == last->row && pos.col <= last->col))) {
+            throw SnapshotException("Duplicate or unordered cell position in snapshot");
+        }
+        last = pos;
+        last_col = std::max(last_col, pos.col);
+        auto kind = static_cast<CellKind>(reader.Read<std::uint8_t>());
+        std::string_view content = reader.Take(reader.Read<std::uint32_t>());
+
+        Cell* cell = sheet->AddEmptyCell(pos);
+        switch (kind) {
+        case CellKind::Empty:
+            break;
+        case CellKind::Text:
+            cell->Set(std::string(content));
+            break;
+        case CellKind::Formula:
+            try {
+                formulas.emplace_back(cell, DeserializeFormula(content));
+            } catch (const FormulaException& exc) {
+                throw SnapshotException("Invalid formula in snapshot: "s + exc.what());
+            }
+            break;
+        default:
+            throw SnapshotException("Invalid cell kind in snapshot");
+        }
+    }
+    std::string_view cells_section(cells_begin, reader.Current() - cells_begin);
+    // печатная область охватывает все ячейки
+    if (last && (max_row <= last->row || max_col <= last_col)) {
+        throw SnapshotException("Printable size in snapshot does not cover its cells");
+    }
+
+    // ребро - ссылка формулы from на ячейку to, и каждая ссылка формулы (кроме
+    // ссылки на себя) записана ровно одним ребром: иначе граф разошёлся бы с
+    // формулами и правки не сбрасывали бы кэш зависимых ячеек
+    std::unordered_map<const Cell*, std::size_t> formula_index;
+    for (std::size_t i = 0; i < formulas.size(); ++i) {
+        formula_index.emplace(formulas[i].first, i);
+    }
+    std::vector<std::vector<Position>> references(formulas.size());
+    std::vector<std::size_t> edges(formulas.size());
+    for (std::size_t i = 0; i < formulas.size(); ++i) {
+        references[i] = formulas[i].second->GetReferencedCells();
+    }
+    for (std::uint32_t i = 0; i < edge_count; ++i) {
+        Cell* from = sheet->PositionToCell(reader.ReadPosition());
+        Cell* to = sheet->PositionToCell(reader.ReadPosition());
+        if (from == nullptr || to == nullptr) {
+            throw SnapshotException("Dangling dependency in snapshot");
+        }
+        auto formula = formula_index.find(from);
+        if (formula == formula_index.end() || from == to ||
+            !std::binary_search(references[formula->second].begin(), references[formula->second].end(),
+                                to->GetPosition())) {
+            throw SnapshotException("Dependency does not match a formula reference in snapshot");
+        }
+        const std::vector<Cell*> known = from->GetGraphReference().GetReferences();
+        if (std::find(known.begin(), known.end(), to) != known.end()) {
+            throw SnapshotException("Duplicate dependency in snapshot");
+        }
+        ++edges[formula->second];
+        from->GetGraphReference().AddReferences(to);
+        to->GetGraphReference().AddDependency(from);
+    }
+    for (std::size_t i = 0; i < formulas.size(); ++i) {
+        const Position pos = formulas[i].first->GetPosition();
+        const std::size_t self = std::binary_search(references[i].begin(), references[i].end(), pos) ? 1 : 0;
+        if (edges[i] + self != references[i].size()) {
+            throw SnapshotException("Missing dependency in snapshot");
+        }
+    }
+
+    const std::uint64_t stamp = reader.Read<std::uint64_t>();
+    const char* values_begin = reader.Current();
+    std::vector<std::optional<CellInterface::Value>> caches;
+    caches.reserve(formulas.size());
+    for (std::size_t i = 0; i < formulas.size(); ++i) {
+        std::optional<CellInterface::Value>& cache = caches.emplace_back();
+        switch (static_cast<ValueKind>(reader.Read<std::uint8_t>())) {
+        case ValueKind::None:
+            break;
+        case ValueKind::Number:
+            cache = reader.Read<double>();
+            break;
+        case ValueKind::Error: {
+            const std::uint8_t category = reader.Read<std::uint8_t>();
+            if (category > static_cast<std::uint8_t>(FormulaError::Category::NA)) {
+                throw SnapshotException("Invalid error category in snapshot");
+            }
+            cache = FormulaError(static_cast<FormulaError::Category>(category));
+            break;
+        }
+        case ValueKind::Logical:
+            cache = reader.Read<std::uint8_t>() != 0;
+            break;
+        default:
+            throw SnapshotException("Invalid value kind in snapshot");
+        }
+    }
+    std::string_view values_section(values_begin, reader.Current() - values_begin);
+
+    // версия 1 - штамп только от секции ячеек
+    const bool values_valid = version == 1
+        ? stamp == Fnv1a(cells_section)
+        : stamp == Fnv1a(values_section, Fnv1a(cells_section, Fnv1a(printable_size)));
+    for (std::size_t i = 0; i < formulas.size(); ++i) {
+        formulas[i].first->SetFormula(std::move(formulas[i].second),
+                                      values_valid ? std::move(caches[i]) : std::nullopt);
+    }
+
+    sheet->RebuildRangeIndex();
+    sheet->max_row_ = max_row;
+    sheet->max_col_ = max_col;
+    sheet->size_version_ = ++sheet->version_;
+    return sheet;
+}
+
+std::unique_ptr<Sheet> LoadSnapshotFile(const std::string& path) {
+#ifdef SPREADSHEET_HAS_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw SnapshotException("Cannot open snapshot file " + path);
+    }
+    struct stat info {};
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw SnapshotException("Cannot read snapshot file " + path);
+    }
+    std::size_t size = static_cast<std::size_t>(info.st_size);
+    if (size == 0) {
+        ::close(fd);
+        throw SnapshotException("Not a spreadsheet snapshot");
+    }
+    void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        throw SnapshotException("Cannot map snapshot file " + path);
+    }
+    try {
+        auto sheet = LoadSnapshot(std::string_view(static_cast<const char*>(mapped), size));
+        ::munmap(mapped, size);
+        return sheet;
+    } catch (...) {
+        ::munmap(mapped, size);
+        throw;
+    }
+#else
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        throw SnapshotException("Cannot open snapshot file " + path);
+    }
+    std::string data{ std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>() };
+    return LoadSnapshot(data);
+#endif
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Бинарный снимок таблицы (версия формата SNAPSHOT_VERSION).
+// Снимок хранит содержимое ячеек, формулы в уже разобранном (постфиксном) виде,
+// граф зависимостей в виде списка рёбер и вычисленные значения формул.
+// Восстановленная таблица сразу отдаёт значения: формулы не разбираются заново,
+// граф не перестраивается, а кэш не пересчитывается.
+//
+// Формат (числа в порядке байт платформы, без выравнивания):
+//   заголовок: "SSNP", uint32 версия, int32 строк и int32 столбцов печатной
+//              области, uint32 число ячеек, uint32 число рёбер;
+//   ячейки:    int32 строка, int32 столбец, uint8 вид (0 - пустая, 1 - текст,
+//              2 - формула), uint32 длина, данные (текст или код формулы);
+//   рёбра:     int32 строка и столбец ячейки с формулой, int32 строка и столбец
+//              ячейки, на которую она ссылается;
+//   значения:  uint64 штамп (FNV-1a от печатной области из заголовка, секции
+//              ячеек и секции значений; в версии 1 - только от секции ячеек),
+//              затем для каждой формулы в порядке секции ячеек uint8 вид
+//              (0 - нет, 1 - число, 2 - ошибка, 3 - логическое) и double,
+//              uint8 категория ошибки или uint8 логическое значение.
+// Ячейки идут по строкам в порядке возрастания позиций, повтор позиции -
+// повреждение снимка, как и печатная область за пределами листа или меньше
+// области ячеек. Рёбра проверяются по ссылкам формул (GetReferencedCells()):
+// каждой ссылке, кроме ссылки на себя, соответствует ровно одно ребро. Если штамп не совпадает с содержимым, значения считаются
+// устаревшими и отбрасываются - формулы будут вычислены заново при первом
+// обращении.
+
+inline constexpr std::uint32_t SNAPSHOT_VERSION = 2;
+
+// Исключение, выбрасываемое при чтении повреждённого или несовместимого снимка
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Записывает снимок таблицы в поток (поток должен быть открыт в бинарном режиме)
+void SaveSnapshot(const Sheet& sheet, std::ostream& output);
+
+// Восстанавливает таблицу из снимка, лежащего в памяти целиком (например,
+// отображённого в память файла). Бросает SnapshotException.
+std::unique_ptr<Sheet> LoadSnapshot(std::string_view data);
+
+// Восстанавливает таблицу из файла снимка. Где это возможно, файл отображается
+// в память (mmap) вместо чтения в промежуточный буфер.
+std::unique_ptr<Sheet> LoadSnapshotFile(const std::string& path);
@@ -20,6 +20,232 @@ bool Position::operator<(const Position rhs) const {
     return (col < rhs.col || row < rhs.row);
 }
 
+Range Range::FromCorners(Position lhs, Position rhs) {
+    return Range{ Position{ std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col) },
+                  Position{ std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col) } };
+}
+
+std::string Range::ToString() const {
+    return from.ToString() + ':' + to.ToString();
+}
+
+namespace {
+
+// Координата по оси сдвига
+int& Coordinate(Position& pos, bool rows) {
+    return rows ? pos.row : pos.col;
+}
+
+int Coordinate(const Position& pos, bool rows) {
+    return rows ? pos.row : pos.col;
+}
+
+}  // namespace
+
+bool ReferenceShift::Affects(Position pos) const {
+    return pos.IsValid() && Coordinate(pos, rows) >= index;
+}
+
+bool ReferenceShift::Affects(const Range& range) const {
+    // вставка сразу за диапазоном его не расширяет
+    return range.IsValid() && Coordinate(range.to, rows) >= index;
+}
+
+Position ReferenceShift::Apply(Position pos) const {
+    if (!Affects(pos)) {
+        return pos;
+    }
+    int& coordinate = Coordinate(pos, rows);
+    if (count < 0 && coordinate < index - count) {
+        return Position::NONE;
+    }
+    coordinate += count;
+    return pos.IsValid() ? pos : Position::NONE;
+}
+
+Range ReferenceShift::Apply(const Range& range) const {
+    if (!Affects(range)) {
+        return range;
+    }
+    Range result = range;
+    int& from = Coordinate(result.from, rows);
+    int& to = Coordinate(result.to, rows);
+    const int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (count > 0) {
+        if (from >= index) {
+            from += count;
+        }
+        to = std::min(to + count, limit - 1);
+    } else {
+        const int end = index - count;  // за последней удаляемой
+        from = from < index ? from : std::max(from + count, index);
+        to = to >= end ? to + count : index - 1;
+    }
+    if (from >= limit || from > to) {
+        return Range{ Position::NONE, Position::NONE };
+    }
+    return result;
+}
+
+namespace {
+
+Position Offset(Position pos, int rows, int cols) {
+    Position result{ pos.row + rows, pos.col + cols };
+    return result.IsValid() ? result : Position::NONE;
+}
+
+}  // namespace
+
+Range ReferenceMove::Target() const {
+    const int rows = source.to.row - source.from.row;
+    const int cols = source.to.col - source.from.col;
+    return Range{ target, Position{ target.row + rows, target.col + cols } };
+}
+
+Position ReferenceMove::Apply(Position pos) const {
+    if (source.Contains(pos)) {
+        return Offset(pos, target.row - source.from.row, target.col - source.from.col);
+    }
+    // прежнее содержимое нового места блока удалено
+    return Target().Contains(pos) ? Position::NONE : pos;
+}
+
+Range ReferenceMove::Apply(const Range& range) const {
+    if (!range.IsValid()) {
+        return range;
+    }
+    if (source.Contains(range)) {
+        return Range{ Apply(range.from), Apply(range.to) };
+    }
+    // диапазон частично внутри блока не меняется
+    if (Target().Contains(range) && !source.Intersects(range)) {
+        return Range{ Position::NONE, Position::NONE };
+    }
+    return range;
+}
+
+Position ReferenceOffset::Apply(Position pos) const {
+    return pos.IsValid() ? Offset(pos, rows, cols) : pos;
+}
+
+Range ReferenceOffset::Apply(const Range& range) const {
+    if (!range.IsValid()) {
+        return range;
+    }
+    Range result{ Apply(range.from), Apply(range.to) };
+    return result.IsValid() ? result : Range{ Position::NONE, Position::NONE };
+}
+
+std::optional<double> TextToNumber(std::string_view text) {
+    if (text.empty()) {
+        return std::nullopt;
+    }
+    for (char ch : text) {
+        // если не цифра и не точка
+        if (!(std::isdigit(static_cast<unsigned char>(ch)) || ch == '.')) {
+            return std::nullopt;
+        }
+    }
+    // если несколько точек
+    if (std::count(text.begin(), text.end(), '.') > 1) {
+        return std::nullopt;
+    }
+    try {
+        return std::stod(std::string(text));
+    } catch (const std::exception& /*ext*/) {
+        return std::nullopt;
+    }
+}
+
+std::optional<double> GetRangeNumber(const SheetInterface& sheet, Position pos) {
+    const CellInterface* cell = sheet.GetCell(pos);
+    if (cell == nullptr) {
+        return std::nullopt;
+    }
+    CellInterface::Value value = cell->GetValue();
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<FormulaError>(value)) {
+        throw std::get<FormulaError>(value);
+    }
+    if (std::holds_alternative<bool>(value)) {
+        return std::nullopt;
+    }
+    return TextToNumber(std::get<std::string>(value));
+}
+
+RangeTotals SheetInterface::GetRangeTotals(Range range) const {
+    RangeTotals totals;
+    for (int row = range.from.row; row <= range.to.row; ++row) {
+        for (int col = range.from.col; col <= range.to.col; ++col) {
+            if (auto number = GetRangeNumber(*this, Position{ row, col })) {
+                totals.sum += *number;
+                ++totals.count;
+            }
+        }
+    }
+    return totals;
+}
+
+RangeExtrema SheetInterface::GetRangeExtrema(Range range) const {
+    RangeExtrema extrema;
+    for (int row = range.from.row; row <= range.to.row; ++row) {
+        for (int col = range.from.col; col <= range.to.col; ++col) {
+            if (auto number = GetRangeNumber(*this, Position{ row, col })) {
+                extrema.Merge(RangeExtrema{ *number, *number, 1 });
+            }
+        }
+    }
+    return extrema;
+}
+
+double SheetInterface::GetRangeProduct(Range lhs, Range rhs) const {
+    double result = 0.;
+    for (int row = 0; row <= lhs.to.row - lhs.from.row; ++row) {
+        for (int col = 0; col <= lhs.to.col - lhs.from.col; ++col) {
+            auto left = GetRangeNumber(*this, Position{ lhs.from.row + row, lhs.from.col + col });
+            auto right = GetRangeNumber(*this, Position{ rhs.from.row + row, rhs.from.col + col });
+            result += left.value_or(0.) * right.value_or(0.);
+        }
+    }
+    return result;
+}
+
+std::optional<int> SheetInterface::LookupValue(Range range, double value, LookupMode mode) const {
+    std::optional<int> result;
+    double best = 0.;
+    int offset = 0;
+    for (int row = range.from.row; row <= range.to.row; ++row) {
+        for (int col = range.from.col; col <= range.to.col; ++col, ++offset) {
+            std::optional<double> number;
+            try {
+                number = GetRangeNumber(*this, Position{ row, col });
+            } catch (const FormulaError&) {
+                continue;
+            }
+            if (!number) {
+                continue;
+            }
+            if (mode == LookupMode::Exact && *number == value) {
+                return offset;
+            }
+            if (mode == LookupMode::LessOrEqual && *number <= value && (!result || *number >= best)) {
+                result = offset;
+                best = *number;
+            }
+        }
+    }
+    return result;
+}
+
+bool EvaluationTrace::Reads(Position pos) const {
+    return std::find(cells.begin(), cells.end(), pos) != cells.end() ||
+           std::any_of(ranges.begin(), ranges.end(), [pos](const Range& range) {
+               return range.Contains(pos);
+           });
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
@@ -0,0 +1,316 @@
+#include "subscriptions.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+// ChangeSubscriptions ----------------------------------------------------------
+
+std::uint64_t ChangeSubscriptions::TileKey(int tile_row, int tile_col) {
+    return (static_cast<std::uint64_t>(tile_row) << 32) | static_cast<std::uint32_t>(tile_col);
+}
+
+std::uint64_t ChangeSubscriptions::PositionKey(Position pos) {
+    return (static_cast<std::uint64_t>(pos.row) << 32) | static_cast<std::uint32_t>(pos.col);
+}
+
+std::uint64_t ChangeSubscriptions::TileMask(int tile, int from, int to) {
+    const int first = std::max(from - tile * TILE_SIZE, 0);
+    const int last = std::min(to - tile * TILE_SIZE, TILE_SIZE - 1);
+    const std::uint64_t upper = last == TILE_SIZE - 1 ? ~std::uint64_t{ 0 }
+                                                      : (std::uint64_t{ 1 } << (last + 1)) - 1;
+    return upper & ~((std::uint64_t{ 1 } << first) - 1);
+}
+
+int ChangeSubscriptions::LowestBit(std::uint64_t mask) {
+    int bit = 0;
+    while (!(mask & (std::uint64_t{ 1 } << bit))) {
+        ++bit;
+    }
+    return bit;
+}
+
+template <typename Action>
+void ChangeSubscriptions::ForEachTile(const Range& range, Action action) {
+    for (int tile_row = range.from.row / TILE_SIZE; tile_row <= range.to.row / TILE_SIZE; ++tile_row) {
+        for (int tile_col = range.from.col / TILE_SIZE; tile_col <= range.to.col / TILE_SIZE; ++tile_col) {
+            action(tile_row, tile_col);
+        }
+    }
+}
+
+int ChangeSubscriptions::Subscribe(Range range, Callback callback,
+                                   std::vector<std::pair<Position, CellInterface::Value>> values) {
+    const int id = next_id_++;
+    Subscription& subscription = subscriptions_[id];
+    subscription.range = range;
+    subscription.callback = std::move(callback);
+    for (auto& [pos, value] : values) {
+        subscription.values.emplace(PositionKey(pos), std::move(value));
+    }
+    ForEachTile(range, [this, id, &range](int tile_row, int tile_col) {
+        watchers_[TileKey(tile_row, tile_col)].push_back(
+            Watcher{ id, TileMask(tile_row, range.from.row, range.to.row),
+                     TileMask(tile_col, range.from.col, range.to.col) });
+    });
+    return id;
+}
+
+bool ChangeSubscriptions::Unsubscribe(int id) {
+    auto it = subscriptions_.find(id);
+    if (it == subscriptions_.end()) {
+        return false;
+    }
+    ForEachTile(it->second.range, [this, id](int tile_row, int tile_col) {
+        auto tile = watchers_.find(TileKey(tile_row, tile_col));
+        std::vector<Watcher>& watchers = tile->second;
+        watchers.erase(std::find_if(watchers.begin(), watchers.end(),
+                                    [id](const Watcher& watcher) { return watcher.id == id; }));
+        if (watchers.empty()) {
+            watchers_.erase(tile);
+        }
+    });
+    subscriptions_.erase(it);
+    return true;
+}
+
+bool ChangeSubscriptions::IsEmpty() const {
+    return subscriptions_.empty();
+}
+
+void ChangeSubscriptions::MarkChanged(Position pos) {
+    dirty_[TileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE)][pos.row % TILE_SIZE] |=
+        std::uint64_t{ 1 } << (pos.col % TILE_SIZE);
+}
+
+void ChangeSubscriptions::MarkChanged(const Range& range) {
+    ForEachTile(range, [this, &range](int tile_row, int tile_col) {
+        TileBits& bits = dirty_[TileKey(tile_row, tile_col)];
+        const std::uint64_t mask = TileMask(tile_col, range.from.col, range.to.col);
+        const int first = std::max(range.from.row, tile_row * TILE_SIZE);
+        const int last = std::min(range.to.row, tile_row * TILE_SIZE + TILE_SIZE - 1);
+        for (int row = first; row <= last; ++row) {
+            bits[row % TILE_SIZE] |= mask;
+        }
+    });
+}
+
+bool ChangeSubscriptions::HasChanges(const Range& range) const {
+    return HasChanges(dirty_, range) || HasChanges(delivered_, range);
+}
+
+bool ChangeSubscriptions::HasChanges(const TileMap& tiles_bits, const Range& range) {
+    auto check = [&range](int tile_row, int tile_col, const TileBits& bits) {
+        const std::uint64_t mask = TileMask(tile_col, range.from.col, range.to.col);
+        const int first = std::max(range.from.row, tile_row * TILE_SIZE);
+        const int last = std::min(range.to.row, tile_row * TILE_SIZE + TILE_SIZE - 1);
+        for (int row = first; row <= last; ++row) {
+            if (bits[row % TILE_SIZE] & mask) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // обходится меньшее из плиток области и отмеченных плиток
+    const std::uint64_t tiles = static_cast<std::uint64_t>(range.to.row / TILE_SIZE - range.from.row / TILE_SIZE + 1) *
+                                (range.to.col / TILE_SIZE - range.from.col / TILE_SIZE + 1);
+    if (tiles <= tiles_bits.size()) {
+        bool found = false;
+        ForEachTile(range, [&tiles_bits, &check, &found](int tile_row, int tile_col) {
+            if (!found) {
+                auto it = tiles_bits.find(TileKey(tile_row, tile_col));
+                found = it != tiles_bits.end() && check(tile_row, tile_col, it->second);
+            }
+        });
+        return found;
+    }
+    for (const auto& [key, bits] : tiles_bits) {
+        const int tile_row = static_cast<int>(key >> 32);
+        const int tile_col = static_cast<int>(key & 0xFFFFFFFFu);
+        if (tile_row >= range.from.row / TILE_SIZE && tile_row <= range.to.row / TILE_SIZE &&
+            tile_col >= range.from.col / TILE_SIZE && tile_col <= range.to.col / TILE_SIZE &&
+            check(tile_row, tile_col, bits)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ChangeSubscriptions::HasPending() const {
+    return !dirty_.empty();
+}
+
+std::vector<ChangeSubscriptions::Delivery> ChangeSubscriptions::Collect(const ValueReader& read) {
+    // отметки рассылки остаются для HasChanges() до следующей рассылки
+    delivered_ = std::move(dirty_);
+    dirty_.clear();
+
+    // значение ячейки вычисляется один раз для всех подписок на неё
+    std::unordered_map<std::uint64_t, CellInterface::Value> current_values;
+    auto current = [&current_values, &read](Position pos) -> const CellInterface::Value& {
+        auto [it, inserted] = current_values.try_emplace(PositionKey(pos));
+        if (inserted) {
+            it->second = read(pos);
+        }
+        return it->second;
+    };
+
+    std::map<int, std::vector<CellChange>> changes;
+    for (const auto& [key, bits] : delivered_) {
+        auto watchers = watchers_.find(key);
+        if (watchers == watchers_.end()) {
+            continue;
+        }
+        const int tile_row = static_cast<int>(key >> 32);
+        const int tile_col = static_cast<int>(key & 0xFFFFFFFFu);
+        std::uint64_t dirty_rows = 0;
+        for (int row = 0; row < TILE_SIZE; ++row) {
+            if (bits[row] != 0) {
+                dirty_rows |= std::uint64_t{ 1 } << row;
+            }
+        }
+        for (const Watcher& watcher : watchers->second) {
+            Subscription* subscription = nullptr;
+            for (std::uint64_t rows = dirty_rows & watcher.rows; rows != 0; rows &= rows - 1) {
+                const int row = LowestBit(rows);
+                for (std::uint64_t mask = bits[row] & watcher.cols; mask != 0; mask &= mask - 1) {
+                    const Position pos{ tile_row * TILE_SIZE + row, tile_col * TILE_SIZE + LowestBit(mask) };
+                    if (subscription == nullptr) {
+                        subscription = &subscriptions_.at(watcher.id);
+                    }
+                    const CellInterface::Value& value = current(pos);
+                    auto known = subscription->values.find(PositionKey(pos));
+                    CellInterface::Value old_value =
+                        known != subscription->values.end() ? known->second : CellInterface::Value{ std::string() };
+                    if (old_value == value) {
+                        continue;
+                    }
+                    const std::string* text = std::get_if<std::string>(&value);
+                    if (text && text->empty()) {
+                        subscription->values.erase(PositionKey(pos));
+                    } else {
+                        subscription->values[PositionKey(pos)] = value;
+                    }
+                    changes[watcher.id].push_back(CellChange{ pos, std::move(old_value), value });
+                }
+            }
+        }
+    }
+
+    std::vector<Delivery> deliveries;
+    for (auto& [id, cell_changes] : changes) {
+        std::sort(cell_changes.begin(), cell_changes.end(), [](const CellChange& lhs, const CellChange& rhs) {
+            return std::make_pair(lhs.pos.row, lhs.pos.col) < std::make_pair(rhs.pos.row, rhs.pos.col);
+        });
+        deliveries.emplace_back(subscriptions_.at(id).callback, std::move(cell_changes));
+    }
+    return deliveries;
+}
+
+// Подписки листа ---------------------------------------------------------------
+
+int Sheet::Subscribe(Range range, ChangeSubscriptions::Callback callback)
+{
+    CheckRange(range, "Subscribe");
+    // значения на момент подписки - точка отсчёта первых изменений
+    std::vector<std::pair<Position, CellInterface::Value>> values;
+    const int last_row = std::min<int>(range.to.row, static_cast<int>(sheet_.size()) - 1);
+    for (int row = range.from.row; row <= last_row; ++row)
+    {
+        const int last_col = std::min<int>(range.to.col, static_cast<int>(sheet_[row].size()) - 1);
+        for (int col = range.from.col; col <= last_col; ++col)
+        {
+            if (const Cell* cell = sheet_[row][col].get())
+            {
+                CellInterface::Value value = cell->GetValue();
+                const std::string* text = std::get_if<std::string>(&value);
+                if (!text || !text->empty())
+                {
+                    values.emplace_back(Position{ row, col }, std::move(value));
+                }
+            }
+        }
+    }
+    if (!subscriptions_)
+    {
+        subscriptions_ = std::make_unique<ChangeSubscriptions>();
+    }
+    return subscriptions_->Subscribe(range, std::move(callback), std::move(values));
+}
+
+int Sheet::Subscribe(Position pos, ChangeSubscriptions::Callback callback)
+{
+    return Subscribe(Range{ pos, pos }, std::move(callback));
+}
+
+bool Sheet::Unsubscribe(int id)
+{
+    if (!subscriptions_ || !subscriptions_->Unsubscribe(id))
+    {
+        return false;
+    }
+    // без подписок изменения не отслеживаются
+    if (subscriptions_->IsEmpty())
+    {
+        subscriptions_.reset();
+    }
+    return true;
+}
+
+bool Sheet::HasChanges(Range range) const
+{
+    return subscriptions_ && subscriptions_->HasChanges(range);
+}
+
+void Sheet::MarkValueChanged(Position pos)
+{
+    if (subscriptions_)
+    {
+        subscriptions_->MarkChanged(pos);
+    }
+}
+
+void Sheet::MarkValuesChanged(const Range& range)
+{
+    if (subscriptions_)
+    {
+        subscriptions_->MarkChanged(range);
+    }
+}
+
+void Sheet::DeliverChanges()
+{
+    if (!subscriptions_ || !subscriptions_->HasPending())
+    {
+        return;
+    }
+    std::vector<ChangeSubscriptions::Delivery> deliveries = subscriptions_->Collect([this](Position pos)
+    {
+        const Cell* cell = PositionToCell(pos);
+        return cell ? cell->GetValue() : CellInterface::Value{ std::string() };
+    });
+    // подписчик может менять лист и подписки - вызывается копия; исключение
+    // подписчика не лишает изменений остальных и выходит после рассылки
+    std::exception_ptr error;
+    for (auto& [callback, changes] : deliveries)
+    {
+        try
+        {
+            callback(changes);
+        }
+        catch (...)
+        {
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
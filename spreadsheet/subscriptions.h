@@ -0,0 +1,91 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Изменение значения ячейки, о котором сообщает подписка (Sheet::Subscribe()).
+// Значение отсутствующей ячейки - пустая строка.
+struct CellChange {
+    Position pos;
+    CellInterface::Value old_value;
+    CellInterface::Value new_value;
+};
+
+// Подписки листа на изменения значений и отметки ячеек, значения которых могли
+// измениться после последней рассылки. Отметки хранятся битовыми картами
+// плиток TILE_SIZE x TILE_SIZE ячеек: отметка - одна операция OR, проверка
+// области - маски по строкам её плиток. Плитки знают подписки, диапазоны
+// которых их задевают, вместе с масками строк и столбцов диапазона в плитке:
+// рассылка пересекает их с отметками плитки и обходит только отмеченные
+// ячейки каждой подписки, а не все подписки для каждой отмеченной ячейки
+// плитки. Подписка хранит значения своих ячеек на
+// момент последней рассылки: правки, вернувшие значение, не попадают в
+// изменения, а несколько правок одной ячейки сливаются в одно изменение.
+class ChangeSubscriptions {
+public:
+    static const int TILE_SIZE = 64;
+
+    using Callback = std::function<void(const std::vector<CellChange>&)>;
+    // текущее значение ячейки листа
+    using ValueReader = std::function<CellInterface::Value(Position)>;
+
+    // values - значения непустых ячеек диапазона на момент подписки
+    int Subscribe(Range range, Callback callback, std::vector<std::pair<Position, CellInterface::Value>> values);
+    bool Unsubscribe(int id);
+    bool IsEmpty() const;
+
+    // отмечают ячейки, значения которых могли измениться
+    void MarkChanged(Position pos);
+    void MarkChanged(const Range& range);
+
+    // отметки в range после последней рассылки или в ней самой
+    bool HasChanges(const Range& range) const;
+    bool HasPending() const;
+
+    // Изменения отмеченных ячеек для каждой задетой подписки (в порядке
+    // возрастания позиций); отметки снимаются
+    using Delivery = std::pair<Callback, std::vector<CellChange>>;
+    std::vector<Delivery> Collect(const ValueReader& read);
+
+private:
+    using TileBits = std::array<std::uint64_t, TILE_SIZE>;  // строка плитки - маска столбцов
+
+    struct Subscription {
+        Range range;
+        Callback callback;
+        std::unordered_map<std::uint64_t, CellInterface::Value> values;  // непустые значения
+    };
+
+    int next_id_ = 0;
+    // упорядочены по номеру, чтобы рассылка шла в порядке подписки
+    std::map<int, Subscription> subscriptions_;
+    // подписка на часть плитки: строки и столбцы её диапазона в плитке
+    struct Watcher {
+        int id;
+        std::uint64_t rows;
+        std::uint64_t cols;
+    };
+    std::unordered_map<std::uint64_t, std::vector<Watcher>> watchers_;  // плитка - подписки
+
+    using TileMap = std::unordered_map<std::uint64_t, TileBits>;
+    TileMap dirty_;         // отметки после последней рассылки
+    TileMap delivered_;     // отметки последней рассылки
+
+    static std::uint64_t TileKey(int tile_row, int tile_col);
+    static std::uint64_t PositionKey(Position pos);
+    // маска строк (столбцов) плитки с номером tile по строкам (столбцам),
+    // попадающих в [from, to]
+    static std::uint64_t TileMask(int tile, int from, int to);
+    // номер младшего установленного бита непустой маски
+    static int LowestBit(std::uint64_t mask);
+    static bool HasChanges(const TileMap& tiles_bits, const Range& range);
+    template <typename Action>
+    static void ForEachTile(const Range& range, Action action);
+};
@@ -0,0 +1,133 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <numeric>
+
+namespace {
+
+bool IsValidSheetName(std::string_view name) {
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name.front()))) {
+        return false;
+    }
+    return std::all_of(name.begin(), name.end(), [](char ch) {
+        return std::isalnum(static_cast<unsigned char>(ch)) || ch == '_';
+    });
+}
+
+}  // namespace
+
+Sheet& Workbook::AddSheet(const std::string& name) {
+    if (!IsValidSheetName(name)) {
+        throw WorkbookException("Invalid sheet name: " + name);
+    }
+    if (sheets_.count(name) > 0) {
+        throw WorkbookException("Duplicate sheet name: " + name);
+    }
+
+    auto sheet = std::make_unique<Sheet>();
+    sheet->workbook_ = this;
+    Sheet& result = *sheet;
+    sheets_.emplace(name, std::move(sheet));
+    names_.push_back(name);
+
+    // формулы, ссылавшиеся на ещё не существовавший лист, давали #REF!
+    for (auto& [other_name, other] : sheets_) {
+        if (other.get() != &result) {
+            other->LinkSheet(name);
+        }
+    }
+    return result;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    auto it = sheets_.find(name);
+    return it != sheets_.end() ? it->second.get() : nullptr;
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    auto it = sheets_.find(name);
+    return it != sheets_.end() ? it->second.get() : nullptr;
+}
+
+const std::vector<std::string>& Workbook::GetSheetNames() const {
+    return names_;
+}
+
+std::string_view Workbook::GetSheetName(const Sheet& sheet) const {
+    for (const auto& [name, other] : sheets_) {
+        if (other.get() == &sheet) {
+            return name;
+        }
+    }
+    return {};
+}
+
+std::vector<std::vector<Sheet*>> Workbook::GetSheetGroups() const {
+    // система непересекающихся множеств над листами, связанными ссылками
+    std::vector<Sheet*> sheets;
+    for (const std::string& name : names_) {
+        sheets.push_back(sheets_.find(name)->second.get());
+    }
+    std::vector<std::size_t> parent(sheets.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&parent](std::size_t i) {
+        while (parent[i] != i) {
+            i = parent[i] = parent[parent[i]];
+        }
+        return i;
+    };
+    auto index_of = [&sheets](const Sheet* sheet) {
+        return static_cast<std::size_t>(std::find(sheets.begin(), sheets.end(), sheet) - sheets.begin());
+    };
+
+    for (std::size_t i = 0; i < sheets.size(); ++i) {
+        for (const auto& [target, count] : sheets[i]->sheet_links_) {
+            parent[find(i)] = find(index_of(target));
+        }
+    }
+
+    std::vector<std::vector<Sheet*>> groups;
+    std::vector<std::size_t> group_of_root(sheets.size(), sheets.size());
+    for (std::size_t i = 0; i < sheets.size(); ++i) {
+        std::size_t root = find(i);
+        if (group_of_root[root] == sheets.size()) {
+            group_of_root[root] = groups.size();
+            groups.emplace_back();
+        }
+        groups[group_of_root[root]].push_back(sheets[i]);
+    }
+    return groups;
+}
+
+void Workbook::Recalculate(unsigned threads) {
+    std::vector<std::vector<Sheet*>> groups = GetSheetGroups();
+    auto calculate = [](const std::vector<Sheet*>& group) {
+        for (Sheet* sheet : group) {
+            sheet->CalculateAll();
+        }
+    };
+
+    if (threads < 2 || groups.size() < 2) {
+        for (const auto& group : groups) {
+            calculate(group);
+        }
+        return;
+    }
+
+    // группы не имеют общих ячеек, поэтому вычисляются без синхронизации;
+    // потоки разбирают группы по очереди, чтобы крупные не тормозили остальные
+    std::atomic<std::size_t> next{ 0 };
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::min<std::size_t>(threads, groups.size()); ++i) {
+        workers.emplace_back([&groups, &next, &calculate] {
+            for (std::size_t group = next++; group < groups.size(); group = next++) {
+                calculate(groups[group]);
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
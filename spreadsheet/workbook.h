@@ -0,0 +1,58 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Исключение, выбрасываемое при ошибках работы с листами книги
+class WorkbookException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Книга: набор именованных листов, формулы которых могут ссылаться на ячейки
+// других листов (Sheet2!A1). Межлистовые ссылки входят в общий граф
+// зависимостей ячеек: изменение ячейки сбрасывает кэш зависимых формул на всех
+// листах, а проверка циклов учитывает ссылки через листы. Лист знает, на какие
+// листы ссылаются его формулы, - по этим связям книга делит листы на
+// независимые группы и пересчитывает их параллельно.
+class Workbook {
+public:
+    Workbook() = default;
+
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+
+    // Добавляет пустой лист. Имя: латинские буквы, цифры и '_', не начинается
+    // с цифры и не повторяется. Формулы, уже ссылающиеся на лист с этим именем,
+    // связываются с ним. Бросает WorkbookException.
+    Sheet& AddSheet(const std::string& name);
+
+    // Лист по имени (nullptr, если его нет)
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+
+    // Имена листов в порядке добавления
+    const std::vector<std::string>& GetSheetNames() const;
+    // Имя листа книги (пустое, если лист в книгу не входит)
+    std::string_view GetSheetName(const Sheet& sheet) const;
+
+    // Группы листов, связанных ссылками напрямую или через другие листы
+    std::vector<std::vector<Sheet*>> GetSheetGroups() const;
+
+    // Вычисляет все формулы книги. Независимые группы листов вычисляются
+    // параллельно в threads потоках, листы одной группы - последовательно.
+    void Recalculate(unsigned threads = std::thread::hardware_concurrency());
+
+private:
+    std::vector<std::string> names_;
+    std::map<std::string, std::unique_ptr<Sheet>, std::less<>> sheets_;
+};